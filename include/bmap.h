@@ -0,0 +1,42 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sha256.h"
+
+// Block map as created by bmaptool (https://github.com/yoctoproject/bmaptool)
+
+typedef struct {
+  uint64_t first;         // first block of the range
+  uint64_t last;          // last block of the range, inclusive
+  bool has_checksum;
+  uint8_t sha256[SHA256_DIGEST_SIZE];
+} bmap_range_t;
+
+typedef struct {
+  uint64_t image_size;
+  uint32_t block_size;
+  uint64_t blocks_count;
+  uint64_t mapped_blocks;
+  bmap_range_t *ranges;
+  size_t nranges;
+} bmap_t;
+
+extern bmap_t *bmap_free(bmap_t *bmap);
+static inline void bmap_freep(bmap_t **bmap) {
+  if (*bmap)
+    *bmap = bmap_free(*bmap);
+}
+#define _cleanup_bmap_ __attribute__((__cleanup__(bmap_freep)))
+
+/* Reads and validates a bmap file.
+   Returns 0 on success, -errno on failure. On failure error contains
+   a description of the problem if not NULL. */
+extern int bmap_load(const char *path, bmap_t **ret, char **error);
+
+// Start and end (exclusive) of a range in bytes
+extern uint64_t bmap_range_start(const bmap_t *bmap, size_t i);
+extern uint64_t bmap_range_end(const bmap_t *bmap, size_t i);
@@ -0,0 +1,80 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sha256.h"
+
+/* Chunk index of an image, published as <image>.chunks next to it:
+
+     rdii-chunks 1
+     size <size of the uncompressed image>
+     chunk-size <bytes>
+     image-sha256 <sha256 of the image file>
+     <sha256 of the uncompressed chunk> <offset> <length>
+     ...
+
+   One line per chunk of chunk-size bytes of the uncompressed image, only
+   the last chunk is shorter. Offset and length locate the chunk in the
+   image file: for uncompressed images the chunk itself, for compressed
+   images a complete frame (zstd, lz4) or stream (xz, gzip, bzip2), which
+   can be decompressed on its own. Lines starting with # are comments.
+
+   The installer compares the chunks with the data already on the
+   device and fetches only the differing ones with range requests.
+
+   A casync index (.caibx) describes an image split into chunks of
+   varying size at content defined boundaries. The chunks are stored
+   zstd compressed in a chunk store under their sha256,
+   <store>/<first 4 hex digits>/<sha256>.cacnk, and fetched from there.
+   Only indexes with sha256 chunk ids (casync --digest=sha256, desync
+   --digest sha256) are supported. */
+
+#define CHUNK_INDEX_VERSION 1
+// the chunks get written with O_DIRECT from the pipeline buffers
+#define CHUNK_INDEX_ALIGN 4096
+#define CHUNK_INDEX_MAX_CHUNK_SIZE (64 * 1024 * 1024)
+
+typedef struct {
+  uint8_t sha256[SHA256_DIGEST_SIZE]; // of the uncompressed chunk
+  uint64_t start;         // in the uncompressed image
+  uint32_t size;          // uncompressed
+  uint64_t offset;        // in the image file, unused with a chunk store
+  uint64_t length;
+} chunk_t;
+
+typedef struct {
+  uint64_t image_size;    // uncompressed
+  uint32_t chunk_size;    // largest chunk
+  // of the image file resp. of the casync index itself
+  uint8_t image_sha256[SHA256_DIGEST_SIZE];
+  bool store;             // the chunks are in a casync chunk store
+  chunk_t *chunks;
+  size_t nchunks;
+} chunk_index_t;
+
+extern chunk_index_t *chunk_index_free(chunk_index_t *idx);
+static inline void chunk_index_freep(chunk_index_t **idx) {
+  if (*idx)
+    *idx = chunk_index_free(*idx);
+}
+#define _cleanup_chunk_index_ __attribute__((__cleanup__(chunk_index_freep)))
+
+/* Reads and validates a chunk index.
+   Returns 0 on success, -errno on failure. On failure error contains
+   a description of the problem if not NULL. */
+extern int chunk_index_load(const char *path, chunk_index_t **ret,
+			    char **error);
+/* Reads a casync index, same return values as chunk_index_load.
+   image_sha256 is the digest of the index file. */
+extern int chunk_index_load_caibx(const char *path, chunk_index_t **ret,
+				  char **error);
+// Writes the index in the format above
+extern int chunk_index_save(const chunk_index_t *idx, FILE *fp);
+
+// Location of a chunk in a chunk store, a directory or an URL
+extern int chunk_store_path(const char *store, const chunk_t *chunk,
+			    char **ret);
@@ -0,0 +1,66 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef enum {
+  COMPRESSION_NONE = 0,
+  COMPRESSION_GZIP,
+  COMPRESSION_BZIP2,
+  COMPRESSION_XZ,
+  COMPRESSION_ZSTD,
+  COMPRESSION_LZ4,
+  _COMPRESSION_MAX
+} compression_t;
+
+typedef struct decoder decoder_t;
+
+// Input and output window of one decoder_run() call. Both positions
+// get advanced by the decoder, similar to ZSTD_inBuffer/ZSTD_outBuffer.
+typedef struct {
+  const uint8_t *src;
+  size_t src_size;
+  size_t src_pos;
+  uint8_t *dst;
+  size_t dst_size;
+  size_t dst_pos;
+} decoder_buf_t;
+
+// Bytes compression_from_magic() needs to recognize every format
+#define COMPRESSION_MAGIC_SIZE 10
+
+extern compression_t compression_from_filename(const char *name);
+/* Recognizes the compression by the magic number at the start of the
+   data, COMPRESSION_NONE if none matches. */
+extern compression_t compression_from_magic(const uint8_t *data, size_t size);
+extern const char *compression_to_string(compression_t c);
+
+/* With threads > 1 gzip images, multi-block xz images and zstd images
+   consisting of several frames with known size (pzstd, seekable
+   format) get decoded in parallel, the output stays in order. Other
+   images are decoded by a single thread.
+   memlimit limits the memory of the data the threads work on, 0 means
+   no limit. With a low limit fewer threads are used, down to one. */
+extern int decoder_new(compression_t c, unsigned int threads,
+		       uint64_t memlimit, decoder_t **ret);
+extern decoder_t *decoder_free(decoder_t *d);
+static inline void decoder_freep(decoder_t **d) {
+  if (*d)
+    *d = decoder_free(*d);
+}
+#define _cleanup_decoder_ __attribute__((__cleanup__(decoder_freep)))
+
+/* Decompresses as much of buf->src as fits into buf->dst.
+   Concatenated streams (multiple gzip members, xz streams, zstd and lz4
+   frames) are decoded one after the other.
+   finish must be set once the complete input has been provided.
+   Returns:
+   < 0: -EBADMSG for corrupt or truncated data, other negative errno codes
+   0: more input or more output space is needed
+   1: finish was set and all data got decoded */
+extern int decoder_run(decoder_t *d, decoder_buf_t *buf, bool finish);
+// Description of the last error returned by decoder_run()
+extern const char *decoder_strerror(const decoder_t *d);
@@ -16,7 +16,19 @@ typedef struct {
   int weight;
 } device_t;
 
+// Limits of a block device which matter for writing an image
+typedef struct {
+  uint32_t logical_block_size;  // BLKSSZGET
+  uint32_t physical_block_size; // BLKPBSZGET
+  uint32_t io_min;              // BLKIOMIN, 0 if not reported
+  uint32_t io_opt;              // BLKIOOPT, 0 if not reported
+  uint32_t max_sectors_kb;      // largest request, 0 if unknown
+  bool rotational;
+  char bus[16];                 // see device_t, empty if unknown
+} device_geometry_t;
+
 extern device_t *device_free(device_t *var);
 extern device_t *devices_freep(device_t **var);
 
 extern int get_devices(device_t **ret, int *count);
+extern int get_device_geometry(const char *device, device_geometry_t *ret);
@@ -2,4 +2,18 @@
 
 #pragma once
 
+#include <curl/curl.h>
+
+/* All transfers of the process belong to one curl session: they share
+   the DNS cache and the TLS sessions, and every thread keeps its
+   connections open between its downloads. So the checksum, the
+   signature and the image skip the lookup and most of the handshakes
+   after the first request to a server. */
+
+// Returns the share of the session, NULL if it cannot be created
+extern CURLSH *curl_session(void);
+/* Returns the handle of the calling thread, reset to the defaults of
+   the session. It stays valid until the thread exits. */
+extern CURL *curl_session_handle(void);
+
 extern int curl_download_file(const char *url, const char *output);
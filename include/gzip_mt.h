@@ -0,0 +1,18 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#pragma once
+
+#include "decompress.h"
+
+// Parallel gzip decoder, used by decoder_run() with several threads
+typedef struct gzip_mt gzip_mt_t;
+
+extern int gzip_mt_new(unsigned int threads, gzip_mt_t **ret);
+// Memory one chunk in flight needs at most, a decoder has threads + 2
+extern size_t gzip_mt_job_memory(void);
+extern gzip_mt_t *gzip_mt_free(gzip_mt_t *mt);
+
+/* Same semantics as decoder_run(), error gets set to a static
+   description of the problem on failure. */
+extern int gzip_mt_run(gzip_mt_t *mt, decoder_buf_t *buf, bool finish,
+		       const char **error);
@@ -0,0 +1,35 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#pragma once
+
+#include <stdint.h>
+
+#include "sha256.h"
+
+/* Content-addressed cache of downloaded images, e.g. on a partition
+   with the label "images". Every image is stored under the verified
+   sha256 from its .sha256 file as <dir>/<sha256 in hex>. The
+   modification time of an entry is the time of its last use, the
+   least recently used entries get removed if the cache gets too
+   large. */
+
+/* Looks for the image with the digest in the cache and marks it as
+   used.
+   Returns 1 and the path of the image if it is cached, 0 if not,
+   -errno on failure. */
+extern int image_cache_lookup(const char *dir,
+			      const uint8_t sha256[SHA256_DIGEST_SIZE],
+			      char **ret_path);
+
+/* Creates the cache directory if necessary, but not its parents, so
+   nothing gets written below a missing mount point. Returns the path
+   for a new copy of an image. */
+extern int image_cache_prepare(const char *dir, char **ret_path);
+
+/* Adds the complete and verified copy at path as image with the digest.
+   Least recently used images get removed until all fit into max_size
+   bytes; with max_size 0 the cache may use 80% of the file system.
+   The copy gets removed if it does not fit at all. */
+extern int image_cache_add(const char *dir, const char *path,
+			   const uint8_t sha256[SHA256_DIGEST_SIZE],
+			   uint64_t max_size);
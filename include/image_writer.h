@@ -0,0 +1,189 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <curl/curl.h>
+
+#include "bmap.h"
+#include "chunk_index.h"
+#include "sha256.h"
+
+/* In-process image write pipeline:
+
+   source (libcurl or local file, hashing inline; if the server supports
+           range requests, several ranges get downloaded in parallel and
+           put back in order in front of the decompressor; mcast:// URLs
+           get received from a multicast group, see multicast.h)
+     -> decompress (in-process decoder, multi-frame zstd, multi-block
+                    xz and gzip images with several threads)
+       -> write (aligned O_DIRECT writes, with io_uring several of them
+                 in flight; zero blocks get zeroed with BLKZEROOUT
+                 instead of written; with a block map only the mapped
+                 ranges get written and verified)
+
+   The stages run in their own threads and pass data through a bounded
+   ring of reusable, aligned buffers. The image as read and optionally
+   the decompressed image get hashed by additional threads, which share
+   the buffers with the next stage. With several target devices the
+   write stage runs once per device, all on the same buffers.
+
+   Optionally the image gets read back from the device afterwards by
+   several threads with O_DIRECT and compared with digests of the
+   decompressed image, which were calculated while writing.
+
+   The image as read can be stored in a file, e.g. for a cache, by one
+   more thread sharing the buffers of the source stage.
+
+   With a chunk index the chunks already on the devices get compared
+   with the index by several threads per device first. Then only the
+   differing chunks get fetched with range requests, decompressed and
+   verified one by one by the source stage and written at their
+   offset. With a casync index the url is the chunk store, chunks found
+   in the chunk cache are not downloaded.
+
+   Block devices get discarded behind the end of the image, resp. zeroed
+   where discarded blocks do not read back as zeros, in parallel to the
+   other stages if the size of the image is known in advance, else
+   after writing. */
+
+// The image can be written to several devices at once
+#define IW_MAX_DEVICES 8
+// more decoder threads are rarely faster than the devices
+#define IW_DECOMPRESS_THREADS_MAX 8
+
+typedef enum {
+  IW_STAGE_SOURCE = 0,
+  IW_STAGE_DECOMPRESS,
+  IW_STAGE_WRITE,
+  IW_STAGE_HASH,          // sha256 of the image as read
+  IW_STAGE_HASH_OUTPUT,   // sha256 of the decompressed image
+  IW_STAGE_VERIFY,        // read back from the device
+  IW_STAGE_COPY,          // store the image as read in copy_path
+  IW_STAGE_COMPARE,       // compare the devices with the chunk index
+  IW_STAGE_DISCARD,       // discard the devices behind the image
+  IW_STAGE_CHECK,         // verify the output against the manifest
+  _IW_STAGE_MAX
+} iw_stage_t;
+
+typedef enum {
+  IW_VERIFY_NONE = 0,
+  IW_VERIFY_READBACK,     // read back the complete image
+  IW_VERIFY_SAMPLE,       // read back randomly chosen extents
+} iw_verify_t;
+
+typedef struct {
+  uint64_t bytes;         // bytes produced by the stage
+  uint64_t bytes_in;      // bytes consumed by the stage
+  uint64_t usec;          // runtime of the stage
+  // CPU time of the finished threads of the stage, without the worker
+  // threads of the decoders
+  uint64_t cpu_usec;
+  uint64_t wait_in_usec;  // blocked waiting for data of the previous stage
+  uint64_t wait_out_usec; // blocked waiting for free buffers or the device
+  double mb_per_sec;      // current throughput, at the end the average
+} iw_stage_stats_t;
+
+typedef struct {
+  iw_stage_stats_t stage[_IW_STAGE_MAX];
+  uint64_t source_size;   // size of the image as read, 0 if unknown
+  uint64_t sparse_bytes;  // zeros which got zeroed instead of written
+  uint64_t unmapped_bytes; // bytes skipped because of the block map
+  unsigned int retries;   // resumed downloads
+  uint64_t verify_size;   // bytes to read back
+  uint64_t compare_size;  // bytes to compare with the chunk index
+  uint64_t unchanged_bytes; // already on the device, not written
+  uint64_t usec;          // time since start of the pipeline
+} iw_stats_t;
+
+/* How a device gets written, the defaults fit most devices. The
+   alignment must be a power of two between 512 and 4096 and max_write
+   a multiple of it. */
+typedef struct {
+  unsigned int alignment; // offsets and sizes of O_DIRECT writes
+  size_t max_write;       // size of one io_uring write request
+  unsigned int queue_depth; // io_uring writes in flight, 0 uses pwrite
+  bool direct;            // bypass the page cache with O_DIRECT
+} iw_device_params_t;
+
+typedef void (*iw_progress_fn)(const iw_stats_t *stats, void *userdata);
+
+typedef struct {
+  size_t buffer_size;     // size of one pipeline buffer
+  unsigned int buffers;   // number of buffers per ring
+  unsigned int progress_interval; // in milliseconds
+  unsigned int log_interval; // stage statistics in the log, 0 disables
+  bool sparse;            // zero long runs of zeros instead of writing them
+  bool discard;           // discard block devices behind the image
+  const bmap_t *bmap;     // write only the mapped ranges, optional
+  unsigned int download_streams; // parallel range requests, <= 1 disables
+  size_t download_window; // bytes downloaded ahead of the decompressor
+  unsigned int download_retries; // resume interrupted downloads this often
+  bool hash_output;       // calculate the sha256 of the decompressed image
+  iw_verify_t verify;     // read back the image resp. all chunks
+  unsigned int verify_samples; // extents read back with IW_VERIFY_SAMPLE
+  unsigned int verify_threads; // parallel readers
+  unsigned int write_queue_depth; // io_uring writes in flight, 0 uses pwrite
+  unsigned int decompress_threads; // 0 uses the online CPUs, 1 disables
+  /* Memory for the pipeline buffers and the decoder threads, the
+     reorder window, the rings and the decoder threads shrink to fit
+     into it. 0 means no limit. */
+  size_t memory_limit;
+  const iw_device_params_t *device_params; // one per device, optional
+  const char *copy_path;  // store the image as read there, optional
+  // write only the chunks which differ from the devices, optional
+  const chunk_index_t *chunks;
+  /* Signed chunk index of the image, every chunk of the output gets
+     verified against it before it is written. A broken chunk gets read
+     again on its own. Not used together with chunks. Optional. */
+  const chunk_index_t *manifest;
+  // directory to keep the chunks of a chunk store, optional
+  const char *chunk_cache;
+  // DNS cache and TLS sessions shared with other transfers, optional
+  CURLSH *curl_share;
+  iw_progress_fn progress;
+  /* Called once by the thread running image_write while the download
+     already runs, nothing gets written to the devices before it
+     returned 0. A negative errno cancels the pipeline. Optional. */
+  int (*gate)(void *userdata);
+  void *userdata;
+} iw_options_t;
+
+/* With a chunk index the image is never read completely, have_sha256
+   is not set then. Every written chunk got verified against the index
+   instead, with verify set every chunk on the devices gets read back
+   and compared with it.
+   Chunks which did not match the manifest got read again. Without
+   compression sha256 covers the chunks as read again, else the broken
+   compressed data as read first. */
+typedef struct {
+  bool have_sha256;       // sha256 and output_sha256 are set
+  uint8_t sha256[SHA256_DIGEST_SIZE]; // digest of the image as read
+  uint8_t output_sha256[SHA256_DIGEST_SIZE]; // with hash_output set
+  unsigned int refetched; // chunks read again because of the manifest
+  int device_error[IW_MAX_DEVICES]; // 0 or -errno per device
+  int copy_error;         // 0 if the copy in copy_path is complete
+  iw_stats_t stats;
+} iw_result_t;
+
+extern void iw_options_init(iw_options_t *opts);
+extern void iw_device_params_init(const iw_options_t *opts,
+				  iw_device_params_t *params);
+extern const char *iw_stage_to_string(iw_stage_t stage);
+extern double iw_mb_per_sec(uint64_t bytes, uint64_t usec);
+extern const char *iw_verify_to_string(iw_verify_t verify);
+extern int iw_verify_from_string(const char *s, iw_verify_t *ret);
+
+/* Writes the image url (http(s) URL or local file) to all devices.
+   The image gets read and decompressed only once, every device has its
+   own write stage. A failing device does not stop the others, its
+   error is stored in ret->device_error.
+   For network images curl has to be initialized globally before, e.g.
+   with curl_session().
+   Returns 0 if at least one device got written, -errno on failure. On
+   failure error contains a description of the problem if not NULL. */
+extern int image_write(const char *url, const char *const *devices,
+		       size_t ndevices, const iw_options_t *opts,
+		       iw_result_t *ret, char **error);
@@ -0,0 +1,116 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+
+#include "sha256.h"
+
+/* Multicast distribution of an image to many machines at once:
+   rdii-mcast-send sends the image once to an IPv4 multicast group
+   (mcast://<group>:<port>[%<interface>]) and announces it every second.
+   Every receiver reassembles the image from the packets and sends the
+   numbers of lost packets as NAK to the sender, which sends them again
+   to the whole group. Receivers starting late get the beginning of the
+   image that way, too. A receiver with the complete image reports DONE.
+
+   Every packet starts with a header, all integers are big endian:
+     magic (4) version (1) type (1) reserved (2) session (4) seq (4)
+   The session is chosen randomly by the sender at start, seq is the
+   number of a DATA packet. Packet seq contains the image data at offset
+   seq * MCAST_PAYLOAD, only the last packet is shorter.
+   INFO: size (8) flags (4) sha256 (32) head_len (1) head (16)
+   NAK:  count (4), count times first (4) number (4) */
+
+#define MCAST_MAGIC 0x5244494DU // "RDIM"
+#define MCAST_VERSION 1
+#define MCAST_HEADER_SIZE 16
+// image data per packet, fits into an ethernet frame with IPv4 and UDP
+#define MCAST_PAYLOAD 1400
+#define MCAST_PACKET_MAX (MCAST_HEADER_SIZE + MCAST_PAYLOAD)
+// start of the image in the announcement, to recognize the compression
+#define MCAST_HEAD_SIZE 16
+#define MCAST_NAK_MAX ((MCAST_PAYLOAD - 4) / 8)
+// the sender announces the image this often
+#define MCAST_INFO_INTERVAL_MS 1000
+// receivers give up if nothing of the sender arrives for this long
+#define MCAST_TIMEOUT_SEC 60
+
+typedef enum {
+  MCAST_DATA = 1,         // image data, sender -> group
+  MCAST_INFO = 2,         // announcement of the image, sender -> group
+  MCAST_NAK = 3,          // lost packets, receiver -> sender
+  MCAST_DONE = 4,         // image complete, receiver -> sender
+} mcast_type_t;
+
+#define MCAST_INFO_SHA256 0x1 // sha256 of the image is known
+// the sender calculated sha256 of the image as sent, it is no checksum
+// of the decompressed image
+#define MCAST_INFO_SHA256_AS_SENT 0x2
+
+typedef struct {
+  uint64_t size;          // size of the image as sent
+  bool has_sha256;
+  bool sha256_as_sent;    // calculated by the sender without .sha256 file
+  uint8_t sha256[SHA256_DIGEST_SIZE]; // from the .sha256 file of the image
+  uint8_t head[MCAST_HEAD_SIZE]; // first bytes of the image
+  size_t head_len;
+} mcast_info_t;
+
+// packets first .. first + count - 1
+typedef struct {
+  uint32_t first;
+  uint32_t count;
+} mcast_range_t;
+
+// Number of DATA packets of an image
+static inline uint64_t mcast_packets(uint64_t size) {
+  return (size + MCAST_PAYLOAD - 1) / MCAST_PAYLOAD;
+}
+
+/* Parses mcast://<group>:<port>[%<interface>], ifindex is 0 without
+   interface. Returns -EINVAL for anything else than an IPv4 multicast
+   group. */
+extern int mcast_parse_url(const char *url, struct sockaddr_in *ret_group,
+			   unsigned int *ret_ifindex);
+
+/* Socket which joined the group. NAK and DONE get sent with it, too.
+   Returns the file descriptor or -errno. */
+extern int mcast_open_receiver(const struct sockaddr_in *group,
+			       unsigned int ifindex);
+// Socket sending to the group, which receives NAK and DONE
+extern int mcast_open_sender(unsigned int ifindex, unsigned int ttl);
+
+/* Writes the header in front of the payload, which is already at
+   pkt + MCAST_HEADER_SIZE, returns the size of the packet. */
+extern size_t mcast_build(uint8_t *pkt, mcast_type_t type, uint32_t session,
+			  uint32_t seq, size_t payload_len);
+/* Checks magic and version, returns the type and sets session, seq
+   and payload, -EBADMSG for foreign packets. */
+extern int mcast_parse(const uint8_t *pkt, size_t len, uint32_t *ret_session,
+		       uint32_t *ret_seq, const uint8_t **ret_payload,
+		       size_t *ret_payload_len);
+
+extern size_t mcast_build_info(uint8_t *pkt, uint32_t session,
+			       const mcast_info_t *info);
+extern int mcast_parse_info(const uint8_t *payload, size_t len,
+			    mcast_info_t *ret);
+extern size_t mcast_build_nak(uint8_t *pkt, uint32_t session,
+			      const mcast_range_t *ranges, size_t n);
+/* At most MCAST_NAK_MAX ranges are returned. */
+extern int mcast_parse_nak(const uint8_t *payload, size_t len,
+			   mcast_range_t *ranges, size_t *ret_n);
+
+/* Waits up to timeout_ms for the announcement of an image on the
+   socket. Returns 0 and the session, the address of the sender and
+   the announcement, -ETIMEDOUT if nothing arrived, other -errno on
+   failure. */
+extern int mcast_wait_info(int fd, int timeout_ms, uint32_t *ret_session,
+			   struct sockaddr_in *ret_sender, mcast_info_t *ret);
+
+// Joins the group of url and waits for the announcement of the image
+extern int mcast_query_info(const char *url, int timeout_ms,
+			    mcast_info_t *ret);
@@ -0,0 +1,30 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BLOCK_SIZE 64
+#define SHA256_HEX_SIZE (2 * SHA256_DIGEST_SIZE + 1)
+
+typedef struct {
+  uint32_t state[8];
+  uint64_t length;                  // total number of bytes hashed
+  uint8_t buffer[SHA256_BLOCK_SIZE];
+  size_t buffer_len;
+} sha256_ctx_t;
+
+extern void sha256_init(sha256_ctx_t *ctx);
+extern void sha256_update(sha256_ctx_t *ctx, const void *data, size_t len);
+extern void sha256_final(sha256_ctx_t *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+// Writes the lower case hex representation of digest to hex and returns hex.
+extern char *sha256_to_hex(const uint8_t digest[SHA256_DIGEST_SIZE],
+			   char hex[SHA256_HEX_SIZE]);
+// Parses len hex characters, returns 0 on success, -EINVAL otherwise.
+extern int sha256_from_hex(const char *hex, size_t len,
+			   uint8_t digest[SHA256_DIGEST_SIZE]);
+// Name of the implementation used on this CPU
+extern const char *sha256_implementation(void);
@@ -0,0 +1,365 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include "basics.h"
+#include "logger.h"
+#include "bmap.h"
+
+// bmap files describe the layout, not the data, so they are small
+#define BMAP_MAX_SIZE (64 * 1024 * 1024)
+
+/* The bmap format is a tiny, well defined subset of XML:
+
+   <bmap version="2.0">
+     <ImageSize> 821752 </ImageSize>
+     <BlockSize> 4096 </BlockSize>
+     <BlocksCount> 201 </BlocksCount>
+     <MappedBlocksCount> 117 </MappedBlocksCount>
+     <ChecksumType> sha256 </ChecksumType>
+     <BmapFileChecksum> ... </BmapFileChecksum>
+     <BlockMap>
+       <Range chksum="...">0-1</Range>
+       <Range chksum="...">3</Range>
+     </BlockMap>
+   </bmap>
+
+   so a full XML parser is not needed. */
+
+bmap_t *
+bmap_free(bmap_t *bmap)
+{
+  if (!bmap)
+    return NULL;
+
+  free(bmap->ranges);
+  return mfree(bmap);
+}
+
+uint64_t
+bmap_range_start(const bmap_t *bmap, size_t i)
+{
+  return bmap->ranges[i].first * bmap->block_size;
+}
+
+uint64_t
+bmap_range_end(const bmap_t *bmap, size_t i)
+{
+  uint64_t end = (bmap->ranges[i].last + 1) * bmap->block_size;
+
+  // the last block of the image can be partial
+  return end > bmap->image_size ? bmap->image_size : end;
+}
+
+static int
+bmap_error(char **error, int r, const char *fmt, ...)
+{
+  va_list ap;
+
+  if (error)
+    {
+      va_start(ap, fmt);
+      if (vasprintf(error, fmt, ap) < 0)
+	*error = NULL;
+      va_end(ap);
+    }
+  return r;
+}
+
+static int
+read_file(const char *path, char **ret, size_t *ret_size)
+{
+  _cleanup_close_ int fd = -EBADF;
+  _cleanup_free_ char *buf = NULL;
+  struct stat st;
+  size_t len = 0;
+
+  fd = open(path, O_RDONLY|O_CLOEXEC);
+  if (fd < 0)
+    return -errno;
+  if (fstat(fd, &st) < 0)
+    return -errno;
+  if (st.st_size > BMAP_MAX_SIZE)
+    return -EFBIG;
+
+  buf = malloc(st.st_size + 1);
+  if (!buf)
+    return -ENOMEM;
+
+  while (len < (size_t)st.st_size)
+    {
+      ssize_t n = read(fd, buf + len, st.st_size - len);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -errno;
+	}
+      if (n == 0)
+	break;
+      len += n;
+    }
+  buf[len] = '\0';
+
+  *ret = TAKE_PTR(buf);
+  *ret_size = len;
+  return 0;
+}
+
+// Returns the text between <tag> and </tag>, NULL if not found
+static char *
+tag_content(const char *buf, const char *tag, size_t *ret_len)
+{
+  _cleanup_free_ char *open_tag = NULL;
+  _cleanup_free_ char *close_tag = NULL;
+  char *start, *end;
+
+  if (asprintf(&open_tag, "<%s>", tag) < 0 ||
+      asprintf(&close_tag, "</%s>", tag) < 0)
+    return NULL;
+
+  start = strstr(buf, open_tag);
+  if (!start)
+    return NULL;
+  start += strlen(open_tag);
+  end = strstr(start, close_tag);
+  if (!end)
+    return NULL;
+
+  *ret_len = end - start;
+  return start;
+}
+
+static int
+parse_u64(const char *p, const char **ret_end, uint64_t *ret)
+{
+  char *end;
+  uint64_t v;
+
+  p += strspn(p, WHITESPACE);
+  if (*p < '0' || *p > '9')
+    return -EINVAL;
+
+  errno = 0;
+  v = strtoull(p, &end, 10);
+  if (errno != 0)
+    return -errno;
+
+  if (ret_end)
+    *ret_end = end;
+  *ret = v;
+  return 0;
+}
+
+static int
+tag_u64(const char *buf, const char *tag, uint64_t *ret)
+{
+  const char *p, *end;
+  size_t len;
+  int r;
+
+  p = tag_content(buf, tag, &len);
+  if (!p)
+    return -ENOENT;
+  r = parse_u64(p, &end, ret);
+  if (r < 0)
+    return r;
+  if (strspn(end, WHITESPACE) != (size_t)(p + len - end))
+    return -EINVAL;
+  return 0;
+}
+
+/* The checksum of the bmap file is calculated with the checksum itself
+   replaced by zeros. */
+static int
+verify_file_checksum(char *buf, size_t size)
+{
+  uint8_t expected[SHA256_DIGEST_SIZE], digest[SHA256_DIGEST_SIZE];
+  _cleanup_free_ char *saved = NULL;
+  sha256_ctx_t ctx;
+  char *p;
+  size_t len;
+  int r;
+
+  p = tag_content(buf, "BmapFileChecksum", &len);
+  if (!p)
+    return 0; // optional
+  p += strspn(p, WHITESPACE);
+  len = strcspn(p, WHITESPACE "<");
+
+  r = sha256_from_hex(p, len, expected);
+  if (r < 0)
+    return r;
+
+  saved = strndup(p, len);
+  if (!saved)
+    return -ENOMEM;
+  memset(p, '0', len);
+
+  sha256_init(&ctx);
+  sha256_update(&ctx, buf, size);
+  sha256_final(&ctx, digest);
+
+  memcpy(p, saved, len);
+
+  return memcmp(expected, digest, sizeof(digest)) == 0 ? 0 : -EBADMSG;
+}
+
+static int
+parse_ranges(bmap_t *bmap, const char *buf, bool use_checksums, char **error)
+{
+  const char *p, *end;
+  size_t len;
+  size_t allocated = 0;
+  uint64_t mapped = 0;
+
+  p = tag_content(buf, "BlockMap", &len);
+  if (!p)
+    return bmap_error(error, -EBADMSG, "No BlockMap found");
+  end = p + len;
+
+  while ((p = strstr(p, "<Range")) && p < end)
+    {
+      bmap_range_t range = {};
+      const char *close_bracket, *q;
+      int r;
+
+      close_bracket = strchr(p, '>');
+      if (!close_bracket || close_bracket > end)
+	return bmap_error(error, -EBADMSG, "Invalid Range element");
+
+      if (use_checksums)
+	{
+	  q = strstr(p, "chksum=\"");
+	  if (!q || q > close_bracket)
+	    return bmap_error(error, -EBADMSG, "Range without checksum");
+	  q += strlen("chksum=\"");
+	  if (sha256_from_hex(q, strcspn(q, "\""), range.sha256) < 0)
+	    return bmap_error(error, -EBADMSG, "Invalid range checksum");
+	  range.has_checksum = true;
+	}
+
+      r = parse_u64(close_bracket + 1, &q, &range.first);
+      if (r < 0)
+	return bmap_error(error, -EBADMSG, "Invalid block range");
+      q += strspn(q, WHITESPACE);
+      if (*q == '-')
+	{
+	  r = parse_u64(q + 1, &q, &range.last);
+	  if (r < 0)
+	    return bmap_error(error, -EBADMSG, "Invalid block range");
+	}
+      else
+	range.last = range.first;
+      q += strspn(q, WHITESPACE);
+      if (!startswith(q, "</Range>"))
+	return bmap_error(error, -EBADMSG, "Invalid Range element");
+
+      // the writer walks the ranges in order
+      if (range.last < range.first || range.last >= bmap->blocks_count ||
+	  (bmap->nranges > 0 &&
+	   range.first <= bmap->ranges[bmap->nranges - 1].last))
+	return bmap_error(error, -EBADMSG,
+			  "Block range %" PRIu64 "-%" PRIu64 " is invalid",
+			  range.first, range.last);
+
+      if (bmap->nranges == allocated)
+	{
+	  size_t n = allocated ? allocated * 2 : 64;
+	  bmap_range_t *tmp = reallocarray(bmap->ranges, n, sizeof(bmap_range_t));
+	  if (!tmp)
+	    return -ENOMEM;
+	  bmap->ranges = tmp;
+	  allocated = n;
+	}
+      bmap->ranges[bmap->nranges++] = range;
+      mapped += range.last - range.first + 1;
+
+      p = q + strlen("</Range>");
+    }
+
+  if (mapped != bmap->mapped_blocks)
+    return bmap_error(error, -EBADMSG,
+		      "Block map contains %" PRIu64 " blocks instead of %" PRIu64,
+		      mapped, bmap->mapped_blocks);
+
+  return 0;
+}
+
+int
+bmap_load(const char *path, bmap_t **ret, char **error)
+{
+  _cleanup_bmap_ bmap_t *bmap = NULL;
+  _cleanup_free_ char *buf = NULL;
+  uint64_t major = 0, block_size = 0;
+  bool use_checksums = false;
+  const char *p;
+  size_t size = 0, len;
+  int r;
+
+  MSG_FUNC("path='%s'", path);
+
+  r = read_file(path, &buf, &size);
+  if (r < 0)
+    return bmap_error(error, r, "Cannot read '%s': %s", path, strerror(-r));
+
+  p = strstr(buf, "<bmap version=\"");
+  if (!p || parse_u64(p + strlen("<bmap version=\""), NULL, &major) < 0)
+    return bmap_error(error, -EBADMSG, "'%s' is not a bmap file", path);
+  if (major < 1 || major > 2)
+    return bmap_error(error, -EOPNOTSUPP,
+		      "Unsupported bmap version %" PRIu64, major);
+
+  bmap = calloc(1, sizeof(bmap_t));
+  if (!bmap)
+    return -ENOMEM;
+
+  if (tag_u64(buf, "ImageSize", &bmap->image_size) < 0 ||
+      tag_u64(buf, "BlockSize", &block_size) < 0 ||
+      tag_u64(buf, "BlocksCount", &bmap->blocks_count) < 0 ||
+      tag_u64(buf, "MappedBlocksCount", &bmap->mapped_blocks) < 0)
+    return bmap_error(error, -EBADMSG, "'%s' misses mandatory elements", path);
+
+  if (block_size == 0 || block_size > UINT32_MAX ||
+      bmap->blocks_count != (bmap->image_size + block_size - 1) / block_size)
+    return bmap_error(error, -EBADMSG, "Invalid image geometry in '%s'", path);
+  bmap->block_size = block_size;
+
+  // Older bmap files use SHA1 checksums, which are not checked.
+  p = tag_content(buf, "ChecksumType", &len);
+  if (p)
+    {
+      p += strspn(p, WHITESPACE);
+      if (startswith(p, "sha256"))
+	use_checksums = true;
+    }
+  if (!use_checksums)
+    MSG_WARN("'%s' contains no SHA256 checksums, ranges will not be verified",
+	     path);
+
+  if (use_checksums)
+    {
+      r = verify_file_checksum(buf, size);
+      if (r < 0)
+	return bmap_error(error, r, "Checksum of '%s' does not match", path);
+    }
+
+  r = parse_ranges(bmap, buf, use_checksums, error);
+  if (r < 0)
+    return r;
+
+  MSG_INFO("bmap: image size %" PRIu64 ", %" PRIu64 " of %" PRIu64 " blocks mapped in %zu ranges",
+	   bmap->image_size, bmap->mapped_blocks, bmap->blocks_count,
+	   bmap->nranges);
+
+  *ret = TAKE_PTR(bmap);
+  return 0;
+}
@@ -0,0 +1,383 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <endian.h>
+#include <sys/stat.h>
+
+#include "basics.h"
+#include "logger.h"
+#include "chunk_index.h"
+
+chunk_index_t *
+chunk_index_free(chunk_index_t *idx)
+{
+  if (!idx)
+    return NULL;
+
+  free(idx->chunks);
+  return mfree(idx);
+}
+
+static int
+chunk_index_error(char **error, int r, const char *fmt, ...)
+{
+  va_list ap;
+
+  if (error)
+    {
+      va_start(ap, fmt);
+      if (vasprintf(error, fmt, ap) < 0)
+	*error = NULL;
+      va_end(ap);
+    }
+  return r;
+}
+
+static int
+parse_u64(const char *p, const char **ret_end, uint64_t *ret)
+{
+  char *end;
+
+  p += strspn(p, " \t");
+  if (*p < '0' || *p > '9')
+    return -EINVAL;
+
+  errno = 0;
+  *ret = strtoull(p, &end, 10);
+  if (errno != 0)
+    return -errno;
+
+  *ret_end = end;
+  return 0;
+}
+
+// "<key> <value>" header line
+static int
+header_u64(const char *line, const char *key, uint64_t *ret)
+{
+  const char *p = startswith(line, key), *end;
+
+  if (!p || (*p != ' ' && *p != '\t'))
+    return -ENOENT;
+  if (parse_u64(p, &end, ret) < 0 || end[strspn(end, WHITESPACE)] != '\0')
+    return -EBADMSG;
+  return 0;
+}
+
+static int
+parse_chunk(const char *line, chunk_t *chunk)
+{
+  size_t len = strcspn(line, WHITESPACE);
+  const char *p;
+
+  if (sha256_from_hex(line, len, chunk->sha256) < 0)
+    return -EBADMSG;
+  p = line + len;
+  if (parse_u64(p, &p, &chunk->offset) < 0 ||
+      parse_u64(p, &p, &chunk->length) < 0 ||
+      p[strspn(p, WHITESPACE)] != '\0')
+    return -EBADMSG;
+  return 0;
+}
+
+int
+chunk_index_load(const char *path, chunk_index_t **ret, char **error)
+{
+  _cleanup_chunk_index_ chunk_index_t *idx = NULL;
+  _cleanup_fclose_ FILE *fp = NULL;
+  _cleanup_free_ char *line = NULL;
+  bool have_sha256 = false;
+  uint64_t version = 0, chunk_size = 0, size = 0;
+  size_t allocated = 0, n = 0;
+  unsigned int lineno = 0;
+  ssize_t len;
+
+  MSG_FUNC("path='%s'", path);
+
+  fp = fopen(path, "re");
+  if (!fp)
+    return chunk_index_error(error, -errno, "Cannot read '%s': %s", path,
+			     strerror(errno));
+
+  idx = calloc(1, sizeof(chunk_index_t));
+  if (!idx)
+    return -ENOMEM;
+
+  while ((len = getline(&line, &n, fp)) >= 0)
+    {
+      const char *p;
+      uint64_t v;
+      int r;
+
+      lineno++;
+      line[strcspn(line, "\r\n")] = '\0';
+      if (line[0] == '#' || line[0] == '\0')
+	continue;
+
+      if (version == 0)
+	{
+	  if (header_u64(line, "rdii-chunks", &version) < 0)
+	    return chunk_index_error(error, -EBADMSG,
+				     "'%s' is not a chunk index", path);
+	  if (version != CHUNK_INDEX_VERSION)
+	    return chunk_index_error(error, -EOPNOTSUPP,
+				     "Unsupported chunk index version %" PRIu64,
+				     version);
+	  continue;
+	}
+
+      if ((r = header_u64(line, "size", &v)) != -ENOENT)
+	{
+	  if (r < 0)
+	    goto bad_line;
+	  size = v;
+	}
+      else if ((r = header_u64(line, "chunk-size", &v)) != -ENOENT)
+	{
+	  if (r < 0)
+	    goto bad_line;
+	  chunk_size = v;
+	}
+      else if ((p = startswith(line, "image-sha256 ")))
+	{
+	  p += strspn(p, " \t");
+	  if (sha256_from_hex(p, strcspn(p, WHITESPACE),
+			      idx->image_sha256) < 0)
+	    goto bad_line;
+	  have_sha256 = true;
+	}
+      else
+	{
+	  if (idx->nchunks == allocated)
+	    {
+	      size_t new_allocated = allocated ? allocated * 2 : 256;
+	      chunk_t *c = reallocarray(idx->chunks, new_allocated,
+					sizeof(chunk_t));
+	      if (!c)
+		return -ENOMEM;
+	      idx->chunks = c;
+	      allocated = new_allocated;
+	    }
+	  if (parse_chunk(line, &idx->chunks[idx->nchunks]) < 0)
+	    goto bad_line;
+	  idx->nchunks++;
+	}
+      continue;
+
+    bad_line:
+      return chunk_index_error(error, -EBADMSG, "Invalid line %u in '%s'",
+			       lineno, path);
+    }
+
+  if (version == 0 || size == 0 || chunk_size == 0 || !have_sha256)
+    return chunk_index_error(error, -EBADMSG,
+			     "'%s' misses mandatory entries", path);
+  if (chunk_size % CHUNK_INDEX_ALIGN != 0 ||
+      chunk_size > CHUNK_INDEX_MAX_CHUNK_SIZE)
+    return chunk_index_error(error, -EBADMSG,
+			     "Invalid chunk size %" PRIu64 " in '%s'",
+			     chunk_size, path);
+  if (idx->nchunks != (size + chunk_size - 1) / chunk_size)
+    return chunk_index_error(error, -EBADMSG,
+			     "'%s' contains %zu chunks instead of %" PRIu64,
+			     path, idx->nchunks,
+			     (size + chunk_size - 1) / chunk_size);
+  idx->image_size = size;
+  idx->chunk_size = chunk_size;
+
+  // a compressed chunk is at most slightly larger than the chunk
+  for (size_t i = 0; i < idx->nchunks; i++)
+    {
+      chunk_t *c = &idx->chunks[i];
+
+      c->start = (uint64_t)i * chunk_size;
+      c->size = size - c->start < chunk_size ? size - c->start : chunk_size;
+    }
+  for (size_t i = 0; i < idx->nchunks; i++)
+    if (idx->chunks[i].length == 0 ||
+	idx->chunks[i].length > chunk_size + chunk_size / 8 + 65536 ||
+	idx->chunks[i].offset + idx->chunks[i].length < idx->chunks[i].offset)
+      return chunk_index_error(error, -EBADMSG,
+			       "Invalid location of chunk %zu in '%s'", i, path);
+
+  MSG_INFO("chunk index: image size %" PRIu64 ", %zu chunks of %" PRIu32 " bytes",
+	   idx->image_size, idx->nchunks, idx->chunk_size);
+
+  *ret = TAKE_PTR(idx);
+  return 0;
+}
+
+/*
+ * casync index, all integers are little endian:
+ *   index:  size (8) = 48, type (8), feature flags (8),
+ *           chunk size min (8), avg (8), max (8)
+ *   table:  size (8) = UINT64_MAX, type (8),
+ *           per chunk: end offset in the image (8), chunk id (32)
+ *   tail:   0 (8), 0 (8), offset of the index (8), size of the table (8),
+ *           marker (8)
+ */
+#define CA_FORMAT_INDEX 0x96824d9c7b129ff9ULL
+#define CA_FORMAT_TABLE 0xe75b9e112f17417dULL
+#define CA_FORMAT_TABLE_TAIL_MARKER 0x4b4f050e5549ecd1ULL
+#define CA_FORMAT_SHA512_256 0x2000000000000000ULL
+#define CA_INDEX_SIZE 48
+#define CA_TABLE_HEADER_SIZE 16
+#define CA_ITEM_SIZE 40
+
+static uint64_t
+get_le64(const uint8_t *p)
+{
+  uint64_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return le64toh(v);
+}
+
+static int
+read_file(const char *path, uint8_t **ret, size_t *ret_size)
+{
+  _cleanup_fclose_ FILE *fp = NULL;
+  _cleanup_free_ uint8_t *data = NULL;
+  struct stat st;
+
+  fp = fopen(path, "re");
+  if (!fp)
+    return -errno;
+  if (fstat(fileno(fp), &st) < 0)
+    return -errno;
+  if (!S_ISREG(st.st_mode))
+    return -EBADMSG;
+
+  data = malloc(st.st_size > 0 ? st.st_size : 1);
+  if (!data)
+    return -ENOMEM;
+  if (fread(data, 1, st.st_size, fp) != (size_t)st.st_size)
+    return ferror(fp) ? -EIO : -EBADMSG;
+
+  *ret = TAKE_PTR(data);
+  *ret_size = st.st_size;
+  return 0;
+}
+
+int
+chunk_index_load_caibx(const char *path, chunk_index_t **ret, char **error)
+{
+  _cleanup_chunk_index_ chunk_index_t *idx = NULL;
+  _cleanup_free_ uint8_t *data = NULL;
+  const uint8_t *p;
+  uint64_t flags, max, start = 0;
+  size_t size = 0;
+  sha256_ctx_t sha256;
+  int r;
+
+  MSG_FUNC("path='%s'", path);
+
+  r = read_file(path, &data, &size);
+  if (r < 0)
+    return chunk_index_error(error, r, "Cannot read '%s': %s", path,
+			     strerror(-r));
+
+  if (size < CA_INDEX_SIZE + CA_TABLE_HEADER_SIZE + CA_ITEM_SIZE ||
+      get_le64(data) != CA_INDEX_SIZE ||
+      get_le64(data + 8) != CA_FORMAT_INDEX ||
+      get_le64(data + CA_INDEX_SIZE) != UINT64_MAX ||
+      get_le64(data + CA_INDEX_SIZE + 8) != CA_FORMAT_TABLE ||
+      (size - CA_INDEX_SIZE - CA_TABLE_HEADER_SIZE) % CA_ITEM_SIZE != 0)
+    return chunk_index_error(error, -EBADMSG, "'%s' is not a casync index",
+			     path);
+
+  p = data + size - CA_ITEM_SIZE;
+  if (get_le64(p) != 0 || get_le64(p + 24) != size - CA_INDEX_SIZE ||
+      get_le64(p + 32) != CA_FORMAT_TABLE_TAIL_MARKER)
+    return chunk_index_error(error, -EBADMSG, "'%s' is truncated", path);
+
+  flags = get_le64(data + 16);
+  if (flags & CA_FORMAT_SHA512_256)
+    return chunk_index_error(error, -EOPNOTSUPP,
+			     "'%s' uses SHA512/256 chunk ids, only sha256 is supported",
+			     path);
+  max = get_le64(data + 40);
+  if (max == 0 || max > CHUNK_INDEX_MAX_CHUNK_SIZE)
+    return chunk_index_error(error, -EBADMSG,
+			     "Invalid chunk size %" PRIu64 " in '%s'", max, path);
+
+  idx = calloc(1, sizeof(chunk_index_t));
+  if (!idx)
+    return -ENOMEM;
+  idx->store = true;
+  idx->chunk_size = max;
+  idx->nchunks = (size - CA_INDEX_SIZE - CA_TABLE_HEADER_SIZE) / CA_ITEM_SIZE - 1;
+  idx->chunks = calloc(idx->nchunks ?: 1, sizeof(chunk_t));
+  if (!idx->chunks)
+    return -ENOMEM;
+
+  p = data + CA_INDEX_SIZE + CA_TABLE_HEADER_SIZE;
+  for (size_t i = 0; i < idx->nchunks; i++, p += CA_ITEM_SIZE)
+    {
+      chunk_t *c = &idx->chunks[i];
+      uint64_t end = get_le64(p);
+
+      if (end <= start || end - start > max)
+	return chunk_index_error(error, -EBADMSG,
+				 "Invalid chunk %zu in '%s'", i, path);
+      memcpy(c->sha256, p + 8, SHA256_DIGEST_SIZE);
+      c->start = start;
+      c->size = end - start;
+      start = end;
+    }
+  if (start == 0)
+    return chunk_index_error(error, -EBADMSG, "'%s' contains no chunks",
+			     path);
+  idx->image_size = start;
+
+  // the index gets verified like an image
+  sha256_init(&sha256);
+  sha256_update(&sha256, data, size);
+  sha256_final(&sha256, idx->image_sha256);
+
+  MSG_INFO("casync index: image size %" PRIu64 ", %zu chunks of at most %" PRIu32 " bytes",
+	   idx->image_size, idx->nchunks, idx->chunk_size);
+
+  *ret = TAKE_PTR(idx);
+  return 0;
+}
+
+int
+chunk_store_path(const char *store, const chunk_t *chunk, char **ret)
+{
+  char hex[SHA256_HEX_SIZE];
+  size_t len = strlen(store);
+
+  sha256_to_hex(chunk->sha256, hex);
+  // a trailing slash of the store is optional
+  if (len > 0 && store[len - 1] == '/')
+    len--;
+  if (asprintf(ret, "%.*s/%.4s/%s.cacnk", (int)len, store, hex, hex) < 0)
+    return -ENOMEM;
+  return 0;
+}
+
+int
+chunk_index_save(const chunk_index_t *idx, FILE *fp)
+{
+  char hex[SHA256_HEX_SIZE];
+
+  fprintf(fp, "rdii-chunks %d\n", CHUNK_INDEX_VERSION);
+  fprintf(fp, "size %" PRIu64 "\n", idx->image_size);
+  fprintf(fp, "chunk-size %" PRIu32 "\n", idx->chunk_size);
+  fprintf(fp, "image-sha256 %s\n", sha256_to_hex(idx->image_sha256, hex));
+  for (size_t i = 0; i < idx->nchunks; i++)
+    fprintf(fp, "%s %" PRIu64 " %" PRIu64 "\n",
+	    sha256_to_hex(idx->chunks[i].sha256, hex),
+	    idx->chunks[i].offset, idx->chunks[i].length);
+
+  if (fflush(fp) != 0 || ferror(fp))
+    return -EIO;
+  return 0;
+}
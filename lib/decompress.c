@@ -0,0 +1,1005 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <lzma.h>
+#include <zlib.h>
+#include <bzlib.h>
+#include <zstd.h>
+#if HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "basics.h"
+#include "logger.h"
+#include "decompress.h"
+#include "gzip_mt.h"
+
+// Larger zstd frames get decoded by a single thread, every frame in
+// flight needs its compressed and decompressed size in memory
+#define ZSTD_MT_MAX_FRAME (32 * 1024 * 1024)
+#define ZSTD_MAGIC 0xFD2FB528U
+#define ZSTD_MAGIC_SKIPPABLE 0x184D2A50U
+#define LZ4_MAGIC 0x184D2204U
+
+// one zstd frame, decoded by one of the workers
+typedef struct {
+  uint8_t *src;
+  size_t src_size;
+  uint8_t *dst;
+  size_t dst_size;   // content size from the frame header
+  size_t dst_pos;    // bytes already returned
+  bool done;
+  int error;
+  const char *errmsg;
+} zstd_job_t;
+
+typedef enum {
+  ZS_MAGIC,          // start of the next frame
+  ZS_FRAME_HEADER,
+  ZS_BLOCK_HEADER,
+  ZS_BLOCK,
+  ZS_CHECKSUM,
+  ZS_SKIP_SIZE,      // skippable frame, e.g. the seek table
+  ZS_SKIP,
+} zstd_scan_t;
+
+/* The input gets split into frames by walking the block headers, which
+   needs no decoding. Complete frames get decoded by the workers. */
+typedef struct zstd_mt {
+  pthread_t *threads;
+  ZSTD_DCtx **dctx;
+  unsigned int nthreads;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool stop;
+  unsigned int workers; // started workers, for their context
+  zstd_job_t *jobs;  // ring of frames in flight
+  unsigned int capacity;
+  uint64_t head;     // next frame to return
+  uint64_t next_run; // next frame for a worker
+  uint64_t submitted;
+
+  // frame which gets collected
+  uint8_t *acc;
+  size_t acc_len, acc_size;
+  size_t acc_pos;    // bytes passed on to the sequential decoder
+  zstd_scan_t scan;
+  size_t need;       // acc_len needed for the next step of the scan
+  size_t header_size;
+  uint64_t content_size;
+  bool checksum;
+  bool last_block;
+  bool sequential;   // a frame was too large, single threaded from here
+  size_t max_frame;  // largest frame decoded in parallel
+} zstd_mt_t;
+
+struct decoder {
+  compression_t type;
+  bool in_stream;    // inside of a gzip member/bzip2 stream/zstd frame
+  bool trailing;     // ignore everything after the last gzip member
+  unsigned int streams; // number of completely decoded streams
+  const char *error;
+  union {
+    lzma_stream xz;
+    z_stream gz;
+    bz_stream bz2;
+    ZSTD_DCtx *zstd;
+#if HAVE_LZ4
+    LZ4F_dctx *lz4;
+#endif
+  };
+  zstd_mt_t *zstd_mt;
+  gzip_mt_t *gzip_mt;
+};
+
+static void *zstd_worker(void *arg);
+static void zstd_mt_free(zstd_mt_t *mt);
+
+static uint32_t
+le32(const uint8_t *p)
+{
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+    (uint32_t)p[3] << 24;
+}
+
+static int
+zstd_mt_new(unsigned int threads, uint64_t memlimit, zstd_mt_t **ret)
+{
+  zstd_mt_t *mt;
+
+  mt = calloc(1, sizeof(zstd_mt_t));
+  if (!mt)
+    return -ENOMEM;
+  pthread_mutex_init(&mt->lock, NULL);
+  pthread_cond_init(&mt->cond, NULL);
+  mt->need = 4;
+  // one frame more than workers, so the next one is ready to be returned
+  mt->capacity = threads + 1;
+  // every frame in the ring holds its compressed and decoded data
+  mt->max_frame = ZSTD_MT_MAX_FRAME;
+  if (memlimit > 0 && memlimit / (2 * mt->capacity) < mt->max_frame)
+    mt->max_frame = memlimit / (2 * mt->capacity);
+  mt->jobs = calloc(mt->capacity, sizeof(zstd_job_t));
+  mt->threads = calloc(threads, sizeof(pthread_t));
+  mt->dctx = calloc(threads, sizeof(ZSTD_DCtx *));
+  if (!mt->jobs || !mt->threads || !mt->dctx)
+    {
+      zstd_mt_free(mt);
+      return -ENOMEM;
+    }
+
+  for (unsigned int i = 0; i < threads; i++)
+    {
+      mt->dctx[i] = ZSTD_createDCtx();
+      if (!mt->dctx[i])
+	{
+	  zstd_mt_free(mt);
+	  return -ENOMEM;
+	}
+    }
+  for (unsigned int i = 0; i < threads; i++)
+    {
+      if (pthread_create(&mt->threads[i], NULL, zstd_worker, mt) != 0)
+	{
+	  zstd_mt_free(mt);
+	  return -ENOMEM;
+	}
+      mt->nthreads++;
+    }
+
+  *ret = mt;
+  return 0;
+}
+
+static void
+zstd_mt_free(zstd_mt_t *mt)
+{
+  pthread_mutex_lock(&mt->lock);
+  mt->stop = true;
+  pthread_cond_broadcast(&mt->cond);
+  pthread_mutex_unlock(&mt->lock);
+
+  for (unsigned int i = 0; i < mt->nthreads; i++)
+    pthread_join(mt->threads[i], NULL);
+  if (mt->dctx)
+    for (unsigned int i = 0; i < mt->capacity - 1; i++)
+      ZSTD_freeDCtx(mt->dctx[i]);
+  if (mt->jobs)
+    for (unsigned int i = 0; i < mt->capacity; i++)
+      {
+	free(mt->jobs[i].src);
+	free(mt->jobs[i].dst);
+      }
+
+  pthread_cond_destroy(&mt->cond);
+  pthread_mutex_destroy(&mt->lock);
+  free(mt->jobs);
+  free(mt->threads);
+  free(mt->dctx);
+  free(mt->acc);
+  free(mt);
+}
+
+compression_t
+compression_from_filename(const char *name)
+{
+  if (endswith(name, ".xz"))
+    return COMPRESSION_XZ;
+  if (endswith(name, ".zst"))
+    return COMPRESSION_ZSTD;
+  if (endswith(name, ".gz"))
+    return COMPRESSION_GZIP;
+  if (endswith(name, ".bz2"))
+    return COMPRESSION_BZIP2;
+  if (endswith(name, ".lz4"))
+    return COMPRESSION_LZ4;
+  return COMPRESSION_NONE;
+}
+
+compression_t
+compression_from_magic(const uint8_t *data, size_t size)
+{
+  static const uint8_t xz[] = { 0xFD, '7', 'z', 'X', 'Z', 0x00 };
+  // after "BZh" and the block size: first block or end of stream
+  static const uint8_t bzip2_block[] = { 0x31, 0x41, 0x59, 0x26, 0x53, 0x59 };
+  static const uint8_t bzip2_eos[] = { 0x17, 0x72, 0x45, 0x38, 0x50, 0x90 };
+
+  if (size >= sizeof(xz) && memcmp(data, xz, sizeof(xz)) == 0)
+    return COMPRESSION_XZ;
+  /* Skippable frames are not checked, zstd and lz4 share their magic
+     and the seekable format has its seek table at the end. */
+  if (size >= 4 && le32(data) == ZSTD_MAGIC)
+    return COMPRESSION_ZSTD;
+  // magic and compression method deflate
+  if (size >= 3 && data[0] == 0x1F && data[1] == 0x8B && data[2] == 8)
+    return COMPRESSION_GZIP;
+  if (size >= 10 && memcmp(data, "BZh", 3) == 0 &&
+      data[3] >= '1' && data[3] <= '9' &&
+      (memcmp(data + 4, bzip2_block, sizeof(bzip2_block)) == 0 ||
+       memcmp(data + 4, bzip2_eos, sizeof(bzip2_eos)) == 0))
+    return COMPRESSION_BZIP2;
+  if (size >= 4 && le32(data) == LZ4_MAGIC)
+    return COMPRESSION_LZ4;
+  return COMPRESSION_NONE;
+}
+
+const char *
+compression_to_string(compression_t c)
+{
+  switch (c)
+    {
+    case COMPRESSION_NONE:  return "none";
+    case COMPRESSION_GZIP:  return "gzip";
+    case COMPRESSION_BZIP2: return "bzip2";
+    case COMPRESSION_XZ:    return "xz";
+    case COMPRESSION_ZSTD:  return "zstd";
+    case COMPRESSION_LZ4:   return "lz4";
+    default:                return "unknown";
+    }
+}
+
+int
+decoder_new(compression_t c, unsigned int threads, uint64_t memlimit,
+	    decoder_t **ret)
+{
+  _cleanup_free_ decoder_t *d = NULL;
+
+  d = calloc(1, sizeof(decoder_t));
+  if (!d)
+    return -ENOMEM;
+
+  d->type = c;
+
+  switch (c)
+    {
+    case COMPRESSION_NONE:
+      break;
+    case COMPRESSION_GZIP:
+      // 16 + MAX_WBITS: expect a gzip header
+      if (inflateInit2(&d->gz, 16 + MAX_WBITS) != Z_OK)
+	return -ENOMEM;
+      if (threads > 1 && memlimit > 0)
+	{
+	  uint64_t jobs = memlimit / gzip_mt_job_memory();
+
+	  if (jobs < threads + 2)
+	    {
+	      threads = jobs > 3 ? jobs - 2 : 1;
+	      MSG_DEBUG("gzip: %u threads fit into the memory limit", threads);
+	    }
+	}
+      if (threads > 1 && gzip_mt_new(threads, &d->gzip_mt) < 0)
+	{
+	  inflateEnd(&d->gz);
+	  return -ENOMEM;
+	}
+      break;
+    case COMPRESSION_BZIP2:
+      if (BZ2_bzDecompressInit(&d->bz2, 0, 0) != BZ_OK)
+	return -ENOMEM;
+      break;
+    case COMPRESSION_XZ:
+      d->xz = (lzma_stream)LZMA_STREAM_INIT;
+#if HAVE_LZMA_MT
+      if (threads > 1)
+	{
+	  /* Only blocks with their size in the block header (xz -T)
+	     get decoded in parallel, else liblzma uses one thread. */
+	  lzma_mt mt = {
+	    .flags = LZMA_CONCATENATED,
+	    .threads = threads,
+	    .memlimit_threading = memlimit ?: lzma_physmem() / 4,
+	    .memlimit_stop = UINT64_MAX,
+	  };
+	  if (lzma_stream_decoder_mt(&d->xz, &mt) == LZMA_OK)
+	    break;
+	  MSG_DEBUG("Cannot create multi-threaded xz decoder");
+	}
+#endif
+      if (lzma_stream_decoder(&d->xz, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK)
+	return -ENOMEM;
+      break;
+    case COMPRESSION_ZSTD:
+      d->zstd = ZSTD_createDCtx();
+      if (!d->zstd)
+	return -ENOMEM;
+      if (threads > 1 && zstd_mt_new(threads, memlimit, &d->zstd_mt) < 0)
+	{
+	  ZSTD_freeDCtx(d->zstd);
+	  return -ENOMEM;
+	}
+      break;
+    case COMPRESSION_LZ4:
+#if HAVE_LZ4
+      if (LZ4F_isError(LZ4F_createDecompressionContext(&d->lz4, LZ4F_VERSION)))
+	return -ENOMEM;
+      break;
+#else
+      return -EOPNOTSUPP;
+#endif
+    default:
+      return -EINVAL;
+    }
+
+  *ret = TAKE_PTR(d);
+  return 0;
+}
+
+decoder_t *
+decoder_free(decoder_t *d)
+{
+  if (!d)
+    return NULL;
+
+  switch (d->type)
+    {
+    case COMPRESSION_GZIP:
+      gzip_mt_free(d->gzip_mt);
+      inflateEnd(&d->gz);
+      break;
+    case COMPRESSION_BZIP2:
+      BZ2_bzDecompressEnd(&d->bz2);
+      break;
+    case COMPRESSION_XZ:
+      lzma_end(&d->xz);
+      break;
+    case COMPRESSION_ZSTD:
+      if (d->zstd_mt)
+	zstd_mt_free(d->zstd_mt);
+      ZSTD_freeDCtx(d->zstd);
+      break;
+#if HAVE_LZ4
+    case COMPRESSION_LZ4:
+      LZ4F_freeDecompressionContext(d->lz4);
+      break;
+#endif
+    default:
+      break;
+    }
+
+  return mfree(d);
+}
+
+const char *
+decoder_strerror(const decoder_t *d)
+{
+  return d->error ?: "Unknown error";
+}
+
+static int
+decoder_error(decoder_t *d, int r, const char *msg)
+{
+  d->error = msg;
+  return r;
+}
+
+static int
+truncated(decoder_t *d)
+{
+  return decoder_error(d, -EBADMSG, "Unexpected end of compressed data");
+}
+
+static int
+run_none(decoder_t _unused_ *d, decoder_buf_t *buf, bool finish)
+{
+  size_t n = buf->src_size - buf->src_pos;
+
+  if (n > buf->dst_size - buf->dst_pos)
+    n = buf->dst_size - buf->dst_pos;
+
+  memcpy(buf->dst + buf->dst_pos, buf->src + buf->src_pos, n);
+  buf->src_pos += n;
+  buf->dst_pos += n;
+
+  return (finish && buf->src_pos == buf->src_size) ? 1 : 0;
+}
+
+static int
+run_gzip(decoder_t *d, decoder_buf_t *buf, bool finish)
+{
+  while (1)
+    {
+      if (d->trailing)
+	{
+	  buf->src_pos = buf->src_size;
+	  return finish ? 1 : 0;
+	}
+
+      if (buf->src_pos == buf->src_size)
+	{
+	  if (!finish)
+	    return 0;
+	  // finish with empty input: complete if not inside a member
+	  if (!d->in_stream)
+	    return 1;
+	}
+
+      if (!d->in_stream && buf->src_pos < buf->src_size)
+	{
+	  // Like gzip, ignore trailing garbage (e.g. zero padding)
+	  // after the last member.
+	  if (d->streams > 0 && buf->src[buf->src_pos] != 0x1f)
+	    {
+	      MSG_WARN("Ignoring trailing garbage after gzip data");
+	      d->trailing = true;
+	      continue;
+	    }
+	  if (inflateReset(&d->gz) != Z_OK)
+	    return decoder_error(d, -EIO, "inflateReset() failed");
+	  d->in_stream = true;
+	}
+
+      d->gz.next_in = (Bytef *)(buf->src + buf->src_pos);
+      d->gz.avail_in = buf->src_size - buf->src_pos;
+      d->gz.next_out = buf->dst + buf->dst_pos;
+      d->gz.avail_out = buf->dst_size - buf->dst_pos;
+
+      int r = inflate(&d->gz, Z_NO_FLUSH);
+
+      buf->src_pos = buf->src_size - d->gz.avail_in;
+      buf->dst_pos = buf->dst_size - d->gz.avail_out;
+
+      switch (r)
+	{
+	case Z_STREAM_END:
+	  d->in_stream = false;
+	  d->streams++;
+	  break; // next member or end of data
+	case Z_OK:
+	case Z_BUF_ERROR:
+	  if (buf->dst_pos == buf->dst_size)
+	    return 0;
+	  if (buf->src_pos == buf->src_size)
+	    return finish ? truncated(d) : 0;
+	  break;
+	case Z_MEM_ERROR:
+	  return decoder_error(d, -ENOMEM, "Out of memory");
+	default:
+	  return decoder_error(d, -EBADMSG, d->gz.msg ?: "Corrupt gzip data");
+	}
+    }
+}
+
+static int
+run_bzip2(decoder_t *d, decoder_buf_t *buf, bool finish)
+{
+  while (1)
+    {
+      if (buf->src_pos == buf->src_size)
+	{
+	  if (!finish)
+	    return 0;
+	  if (!d->in_stream)
+	    return 1;
+	}
+
+      if (!d->in_stream && buf->src_pos < buf->src_size)
+	{
+	  // Start the next of several concatenated streams (pbzip2)
+	  if (d->streams > 0)
+	    {
+	      BZ2_bzDecompressEnd(&d->bz2);
+	      memset(&d->bz2, 0, sizeof(d->bz2));
+	      if (BZ2_bzDecompressInit(&d->bz2, 0, 0) != BZ_OK)
+		return decoder_error(d, -ENOMEM, "BZ2_bzDecompressInit() failed");
+	    }
+	  d->in_stream = true;
+	}
+
+      d->bz2.next_in = (char *)(buf->src + buf->src_pos);
+      d->bz2.avail_in = buf->src_size - buf->src_pos;
+      d->bz2.next_out = (char *)(buf->dst + buf->dst_pos);
+      d->bz2.avail_out = buf->dst_size - buf->dst_pos;
+
+      int r = BZ2_bzDecompress(&d->bz2);
+
+      buf->src_pos = buf->src_size - d->bz2.avail_in;
+      buf->dst_pos = buf->dst_size - d->bz2.avail_out;
+
+      switch (r)
+	{
+	case BZ_STREAM_END:
+	  d->in_stream = false;
+	  d->streams++;
+	  break;
+	case BZ_OK:
+	  if (buf->dst_pos == buf->dst_size)
+	    return 0;
+	  if (buf->src_pos == buf->src_size)
+	    return finish ? truncated(d) : 0;
+	  break;
+	case BZ_MEM_ERROR:
+	  return decoder_error(d, -ENOMEM, "Out of memory");
+	default:
+	  return decoder_error(d, -EBADMSG, "Corrupt bzip2 data");
+	}
+    }
+}
+
+static int
+run_xz(decoder_t *d, decoder_buf_t *buf, bool finish)
+{
+  d->xz.next_in = buf->src + buf->src_pos;
+  d->xz.avail_in = buf->src_size - buf->src_pos;
+  d->xz.next_out = buf->dst + buf->dst_pos;
+  d->xz.avail_out = buf->dst_size - buf->dst_pos;
+
+  lzma_ret r = lzma_code(&d->xz, finish ? LZMA_FINISH : LZMA_RUN);
+
+  buf->src_pos = buf->src_size - d->xz.avail_in;
+  buf->dst_pos = buf->dst_size - d->xz.avail_out;
+
+  switch (r)
+    {
+    case LZMA_STREAM_END:
+      return 1;
+    case LZMA_OK:
+      return 0;
+    case LZMA_BUF_ERROR:
+      if (finish && buf->dst_pos < buf->dst_size)
+	return truncated(d);
+      return 0;
+    case LZMA_MEM_ERROR:
+      return decoder_error(d, -ENOMEM, "Out of memory");
+    case LZMA_FORMAT_ERROR:
+      return decoder_error(d, -EBADMSG, "Not in xz format");
+    case LZMA_DATA_ERROR:
+      return decoder_error(d, -EBADMSG, "Corrupt xz data");
+    default:
+      return decoder_error(d, -EIO, "Internal xz decoder error");
+    }
+}
+
+static int
+run_zstd(decoder_t *d, decoder_buf_t *buf, bool finish)
+{
+  ZSTD_inBuffer in = { buf->src, buf->src_size, buf->src_pos };
+  ZSTD_outBuffer out = { buf->dst, buf->dst_size, buf->dst_pos };
+  int r = 0;
+
+  while (1)
+    {
+      if (finish && in.pos == in.size && !d->in_stream)
+	{
+	  r = 1;
+	  break;
+	}
+
+      size_t in_before = in.pos;
+      size_t out_before = out.pos;
+      size_t ret = ZSTD_decompressStream(d->zstd, &out, &in);
+
+      if (ZSTD_isError(ret))
+	{
+	  r = decoder_error(d, -EBADMSG, ZSTD_getErrorName(ret));
+	  break;
+	}
+      // ret == 0: frame completely decoded and flushed,
+      // otherwise it is a hint for the next input size
+      if (ret == 0)
+	d->in_stream = false;
+      else if (in.pos > in_before || out.pos > out_before)
+	d->in_stream = true;
+
+      if (out.pos == out.size)
+	break;
+      if (in.pos == in.size)
+	{
+	  if (!finish)
+	    break;
+	  if (d->in_stream && out.pos == out_before)
+	    {
+	      r = truncated(d);
+	      break;
+	    }
+	}
+    }
+
+  buf->src_pos = in.pos;
+  buf->dst_pos = out.pos;
+
+  return r;
+}
+
+#if HAVE_LZ4
+static int
+run_lz4(decoder_t *d, decoder_buf_t *buf, bool finish)
+{
+  while (1)
+    {
+      if (finish && buf->src_pos == buf->src_size && !d->in_stream)
+	return 1;
+
+      size_t src_size = buf->src_size - buf->src_pos;
+      size_t dst_size = buf->dst_size - buf->dst_pos;
+      size_t ret = LZ4F_decompress(d->lz4, buf->dst + buf->dst_pos, &dst_size,
+				   buf->src + buf->src_pos, &src_size, NULL);
+
+      if (LZ4F_isError(ret))
+	return decoder_error(d, -EBADMSG, LZ4F_getErrorName(ret));
+      buf->src_pos += src_size;
+      buf->dst_pos += dst_size;
+
+      // ret == 0: frame completely decoded and flushed, the context
+      // is ready for the next frame
+      if (ret == 0)
+	d->in_stream = false;
+      else if (src_size > 0 || dst_size > 0)
+	d->in_stream = true;
+
+      if (buf->dst_pos == buf->dst_size)
+	return 0;
+      if (buf->src_pos == buf->src_size)
+	{
+	  if (!finish)
+	    return 0;
+	  if (d->in_stream && dst_size == 0)
+	    return truncated(d);
+	}
+    }
+}
+#endif
+
+static void *
+zstd_worker(void *arg)
+{
+  zstd_mt_t *mt = arg;
+  ZSTD_DCtx *dctx;
+
+  pthread_mutex_lock(&mt->lock);
+  // every worker has its own context
+  dctx = mt->dctx[mt->workers++];
+
+  while (1)
+    {
+      zstd_job_t *job;
+      size_t n;
+
+      while (mt->next_run == mt->submitted && !mt->stop)
+	pthread_cond_wait(&mt->cond, &mt->lock);
+      if (mt->stop)
+	break;
+      job = &mt->jobs[mt->next_run++ % mt->capacity];
+      pthread_mutex_unlock(&mt->lock);
+
+      job->dst = malloc(job->dst_size ?: 1);
+      if (!job->dst)
+	{
+	  job->error = -ENOMEM;
+	  job->errmsg = "Out of memory";
+	}
+      else
+	{
+	  n = ZSTD_decompressDCtx(dctx, job->dst, job->dst_size,
+				  job->src, job->src_size);
+	  if (ZSTD_isError(n))
+	    {
+	      job->error = -EBADMSG;
+	      job->errmsg = ZSTD_getErrorName(n);
+	    }
+	  else if (n != job->dst_size)
+	    {
+	      job->error = -EBADMSG;
+	      job->errmsg = "Frame size does not match frame header";
+	    }
+	}
+      job->src = mfree(job->src);
+
+      pthread_mutex_lock(&mt->lock);
+      job->done = true;
+      pthread_cond_broadcast(&mt->cond);
+    }
+  pthread_mutex_unlock(&mt->lock);
+
+  return NULL;
+}
+
+// Waits until the next frame to return got decoded
+static void
+zstd_mt_wait(zstd_mt_t *mt)
+{
+  pthread_mutex_lock(&mt->lock);
+  while (!mt->jobs[mt->head % mt->capacity].done)
+    pthread_cond_wait(&mt->cond, &mt->lock);
+  pthread_mutex_unlock(&mt->lock);
+}
+
+// Copies decoded frames in order to the output, without waiting
+static int
+zstd_mt_emit(decoder_t *d, decoder_buf_t *buf)
+{
+  zstd_mt_t *mt = d->zstd_mt;
+
+  while (mt->head < mt->submitted && buf->dst_pos < buf->dst_size)
+    {
+      zstd_job_t *job = &mt->jobs[mt->head % mt->capacity];
+      bool done;
+      size_t n;
+
+      pthread_mutex_lock(&mt->lock);
+      done = job->done;
+      pthread_mutex_unlock(&mt->lock);
+      if (!done)
+	break;
+      if (job->error < 0)
+	return decoder_error(d, job->error, job->errmsg);
+
+      n = job->dst_size - job->dst_pos;
+      if (n > buf->dst_size - buf->dst_pos)
+	n = buf->dst_size - buf->dst_pos;
+      memcpy(buf->dst + buf->dst_pos, job->dst + job->dst_pos, n);
+      buf->dst_pos += n;
+      job->dst_pos += n;
+
+      if (job->dst_pos == job->dst_size)
+	{
+	  job->dst = mfree(job->dst);
+	  mt->head++;
+	}
+    }
+
+  return 0;
+}
+
+static int
+zstd_mt_submit(zstd_mt_t *mt)
+{
+  zstd_job_t *job = &mt->jobs[mt->submitted % mt->capacity];
+
+  mt->scan = ZS_MAGIC;
+  mt->need = 4;
+
+  pthread_mutex_lock(&mt->lock);
+  *job = (zstd_job_t){
+    .src = TAKE_PTR(mt->acc),
+    .src_size = mt->acc_len,
+    .dst_size = mt->content_size,
+  };
+  mt->submitted++;
+  pthread_cond_broadcast(&mt->cond);
+  pthread_mutex_unlock(&mt->lock);
+
+  mt->acc_len = mt->acc_size = 0;
+  return 0;
+}
+
+/* Collects the input until the current frame is complete and hands it
+   to the workers. Only as much input as the next step of the scan
+   needs gets consumed, so no data of the next frame ends in acc. */
+static int
+zstd_mt_scan(decoder_t *d, decoder_buf_t *buf)
+{
+  zstd_mt_t *mt = d->zstd_mt;
+
+  while (buf->src_pos < buf->src_size)
+    {
+      size_t n = mt->need - mt->acc_len;
+
+      if (n > buf->src_size - buf->src_pos)
+	n = buf->src_size - buf->src_pos;
+      if (mt->need > mt->acc_size)
+	{
+	  size_t size = mt->acc_size ? mt->acc_size * 2 : 64 * 1024;
+	  uint8_t *tmp;
+
+	  if (size < mt->need)
+	    size = mt->need;
+	  tmp = realloc(mt->acc, size);
+	  if (!tmp)
+	    return decoder_error(d, -ENOMEM, "Out of memory");
+	  mt->acc = tmp;
+	  mt->acc_size = size;
+	}
+      memcpy(mt->acc + mt->acc_len, buf->src + buf->src_pos, n);
+      mt->acc_len += n;
+      buf->src_pos += n;
+      if (mt->acc_len < mt->need)
+	return 0;
+
+      switch (mt->scan)
+	{
+	case ZS_MAGIC:
+	  {
+	    uint32_t magic = le32(mt->acc);
+
+	    if ((magic & 0xFFFFFFF0U) == ZSTD_MAGIC_SKIPPABLE)
+	      {
+		mt->scan = ZS_SKIP_SIZE;
+		mt->need = 8;
+	      }
+	    else if (magic == ZSTD_MAGIC)
+	      {
+		mt->scan = ZS_FRAME_HEADER;
+		mt->need = 5;
+		mt->header_size = 0;
+	      }
+	    else
+	      return decoder_error(d, -EBADMSG, "Unknown frame descriptor");
+	  }
+	  break;
+	case ZS_FRAME_HEADER:
+	  if (mt->header_size == 0)
+	    {
+	      static const uint8_t dict_id_size[] = { 0, 1, 2, 4 };
+	      static const uint8_t content_size_size[] = { 0, 2, 4, 8 };
+	      uint8_t fhd = mt->acc[4];
+	      bool single_segment = (fhd >> 5) & 1;
+
+	      mt->checksum = (fhd >> 2) & 1;
+	      mt->header_size = 5 + (single_segment ? 0 : 1) +
+		dict_id_size[fhd & 3] + content_size_size[fhd >> 6] +
+		(single_segment && (fhd >> 6) == 0 ? 1 : 0);
+	      mt->need = mt->header_size;
+	      break;
+	    }
+	  mt->content_size = ZSTD_getFrameContentSize(mt->acc, mt->acc_len);
+	  if (mt->content_size == ZSTD_CONTENTSIZE_UNKNOWN ||
+	      mt->content_size == ZSTD_CONTENTSIZE_ERROR ||
+	      mt->content_size > mt->max_frame)
+	    {
+	      // e.g. zstd -T0 writes one large frame
+	      if (mt->submitted == 0)
+		MSG_DEBUG("zstd image is not split into small frames, using one thread");
+	      else
+		MSG_DEBUG("Large zstd frame, using one thread for the rest");
+	      mt->sequential = true;
+	      return 0;
+	    }
+	  mt->scan = ZS_BLOCK_HEADER;
+	  mt->need = mt->acc_len + 3;
+	  break;
+	case ZS_BLOCK_HEADER:
+	  {
+	    const uint8_t *p = mt->acc + mt->acc_len - 3;
+	    uint32_t bh = (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+	      (uint32_t)p[2] << 16;
+	    unsigned int type = (bh >> 1) & 3;
+
+	    if (type == 3)
+	      return decoder_error(d, -EBADMSG, "Reserved block type");
+	    mt->last_block = bh & 1;
+	    // RLE blocks contain one byte
+	    mt->need = mt->acc_len + (type == 1 ? 1 : (bh >> 3));
+	    mt->scan = ZS_BLOCK;
+	    if (mt->need - mt->header_size > 2 * mt->max_frame)
+	      return decoder_error(d, -EBADMSG, "Frame larger than its content");
+	  }
+	  break;
+	case ZS_BLOCK:
+	  if (!mt->last_block)
+	    {
+	      mt->scan = ZS_BLOCK_HEADER;
+	      mt->need = mt->acc_len + 3;
+	      break;
+	    }
+	  if (mt->checksum)
+	    {
+	      mt->scan = ZS_CHECKSUM;
+	      mt->need = mt->acc_len + 4;
+	      break;
+	    }
+	  // one frame per call, the ring might be full
+	  return zstd_mt_submit(mt);
+	case ZS_CHECKSUM:
+	  return zstd_mt_submit(mt);
+	case ZS_SKIP_SIZE:
+	  if (le32(mt->acc + 4) > mt->max_frame)
+	    {
+	      // zstd skips it without keeping it in memory
+	      mt->sequential = true;
+	      return 0;
+	    }
+	  mt->need = 8 + (size_t)le32(mt->acc + 4);
+	  mt->scan = ZS_SKIP;
+	  break;
+	case ZS_SKIP:
+	  mt->acc_len = 0;
+	  mt->scan = ZS_MAGIC;
+	  mt->need = 4;
+	  break;
+	}
+    }
+
+  return 0;
+}
+
+static int
+run_zstd_mt(decoder_t *d, decoder_buf_t *buf, bool finish)
+{
+  zstd_mt_t *mt = d->zstd_mt;
+  int r;
+
+  while (1)
+    {
+      r = zstd_mt_emit(d, buf);
+      if (r < 0)
+	return r;
+      if (buf->dst_pos == buf->dst_size)
+	return 0;
+
+      if (mt->sequential)
+	{
+	  if (mt->head < mt->submitted)
+	    {
+	      zstd_mt_wait(mt);
+	      continue;
+	    }
+	  // the frame header in acc was already consumed
+	  if (mt->acc_pos < mt->acc_len)
+	    {
+	      decoder_buf_t tmp = {
+		.src = mt->acc,
+		.src_size = mt->acc_len,
+		.src_pos = mt->acc_pos,
+		.dst = buf->dst,
+		.dst_size = buf->dst_size,
+		.dst_pos = buf->dst_pos,
+	      };
+
+	      r = run_zstd(d, &tmp, false);
+	      mt->acc_pos = tmp.src_pos;
+	      buf->dst_pos = tmp.dst_pos;
+	      if (r < 0)
+		return r;
+	      if (mt->acc_pos < mt->acc_len)
+		return 0;
+	    }
+	  return run_zstd(d, buf, finish);
+	}
+
+      if (buf->src_pos == buf->src_size)
+	{
+	  if (!finish)
+	    return 0;
+	  if (mt->scan != ZS_MAGIC || mt->acc_len > 0)
+	    return truncated(d);
+	  if (mt->head == mt->submitted)
+	    return 1;
+	  zstd_mt_wait(mt);
+	  continue;
+	}
+
+      if (mt->submitted - mt->head == mt->capacity)
+	{
+	  zstd_mt_wait(mt);
+	  continue;
+	}
+
+      r = zstd_mt_scan(d, buf);
+      if (r < 0)
+	return r;
+    }
+}
+
+int
+decoder_run(decoder_t *d, decoder_buf_t *buf, bool finish)
+{
+  switch (d->type)
+    {
+    case COMPRESSION_NONE:
+      return run_none(d, buf, finish);
+    case COMPRESSION_GZIP:
+      if (d->gzip_mt)
+	return gzip_mt_run(d->gzip_mt, buf, finish, &d->error);
+      return run_gzip(d, buf, finish);
+    case COMPRESSION_BZIP2:
+      return run_bzip2(d, buf, finish);
+    case COMPRESSION_XZ:
+      return run_xz(d, buf, finish);
+    case COMPRESSION_ZSTD:
+      if (d->zstd_mt)
+	return run_zstd_mt(d, buf, finish);
+      return run_zstd(d, buf, finish);
+#if HAVE_LZ4
+    case COMPRESSION_LZ4:
+      return run_lz4(d, buf, finish);
+#endif
+    default:
+      return decoder_error(d, -EINVAL, "Unsupported compression format");
+    }
+}
@@ -3,10 +3,15 @@
 #include "config.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <limits.h>
+#include <unistd.h>
 #include <libudev.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
 
 #include "basics.h"
 #include "efivars.h"
@@ -71,6 +76,38 @@ udev_device_unrefp(struct udev_device **p)
     *p = udev_device_unref(*p);
 }
 
+// Returns the bus of the disk, type gets set for disks without ID_TYPE
+static const char *
+get_bus(struct udev_device *dev, const char *device, const char **type)
+{
+  const char *bus = udev_device_get_property_value(dev, "ID_BUS");
+
+  if (isempty(bus))
+    {
+      if (startswith(device, "/dev/vd"))
+	{
+	  bus = "virtio";
+	  if (isempty(*type))
+	    *type = "disk";
+	}
+      else if (startswith(device, "/dev/nvme"))
+	{
+	  bus = "nvme";
+	  if (isempty(*type))
+	    *type = "disk";
+	}
+    }
+  else if (streq(bus, "ata"))
+    {
+      // check if old ata or sata
+      const char *is_sata = udev_device_get_property_value(dev, "ID_ATA_SATA");
+      if (!isempty(is_sata) && streq(is_sata, "1"))
+	bus = "sata";
+    }
+
+  return bus;
+}
+
 device_t *
 device_free(device_t *var)
 {
@@ -163,29 +200,7 @@ get_devices(device_t **ret, int *ret_count)
       const char *is_cdrom = udev_device_get_property_value(dev, "ID_CDROM");
       if (!isempty(is_cdrom) && streq(is_cdrom, "1"))
 	type = "rom";
-      const char *bus = udev_device_get_property_value(dev, "ID_BUS");
-      if (isempty(bus))
-	{
-	  if (startswith(device, "/dev/vd"))
-	    {
-	      bus = "virtio";
-	      if (isempty(type))
-		type = "disk";
-	    }
-	  else if (startswith(device, "/dev/nvme"))
-	    {
-	      bus = "nvme";
-	      if (isempty(type))
-		type = "disk";
-	    }
-	}
-      else if (streq(bus, "ata"))
-	{
-	  // check if old ata or sata
-	  const char *is_sata = udev_device_get_property_value(dev, "ID_ATA_SATA");
-	  if (!isempty(is_sata) && streq(is_sata, "1"))
-	    bus = "sata";
-	}
+      const char *bus = get_bus(dev, device, &type);
       const char *model = udev_device_get_property_value(dev, "ID_MODEL");
       const char *size_str = udev_device_get_sysattr_value(dev, "size");
       uint64_t size = 0;
@@ -243,3 +258,84 @@ get_devices(device_t **ret, int *ret_count)
 
   return 0;
 }
+
+static uint32_t
+sysattr_u32(struct udev_device *dev, const char *attr)
+{
+  const char *value = udev_device_get_sysattr_value(dev, attr);
+  unsigned long v;
+  char *end;
+
+  if (isempty(value))
+    return 0;
+
+  errno = 0;
+  v = strtoul(value, &end, 10);
+  if (errno != 0 || end == value || v > UINT32_MAX)
+    return 0;
+  return v;
+}
+
+int
+get_device_geometry(const char *device, device_geometry_t *ret)
+{
+  _cleanup_close_ int fd = -EBADF;
+  struct stat st;
+  int logical = 0;
+  unsigned int physical = 0, io_min = 0, io_opt = 0;
+
+  MSG_FUNC("device='%s'", device);
+
+  fd = open(device, O_RDONLY|O_CLOEXEC);
+  if (fd < 0)
+    return -errno;
+  if (fstat(fd, &st) < 0)
+    return -errno;
+  if (!S_ISBLK(st.st_mode))
+    return -ENOTBLK;
+
+  if (ioctl(fd, BLKSSZGET, &logical) < 0 ||
+      ioctl(fd, BLKPBSZGET, &physical) < 0 ||
+      ioctl(fd, BLKIOMIN, &io_min) < 0 ||
+      ioctl(fd, BLKIOOPT, &io_opt) < 0)
+    return -errno;
+
+  memset(ret, 0, sizeof(*ret));
+  ret->logical_block_size = logical;
+  ret->physical_block_size = physical;
+  ret->io_min = io_min;
+  ret->io_opt = io_opt;
+
+  _cleanup_(udev_unrefp) struct udev *udev = udev_new();
+  if (!udev)
+    return -ENOMEM;
+
+  _cleanup_(udev_device_unrefp) struct udev_device *dev =
+    udev_device_new_from_devnum(udev, 'b', st.st_rdev);
+  if (!dev)
+    return -errno;
+
+  // the queue limits belong to the disk, not to a partition
+  struct udev_device *disk = dev;
+  if (streq(strempty(udev_device_get_devtype(dev)), "partition"))
+    {
+      disk = udev_device_get_parent_with_subsystem_devtype(dev, "block", "disk");
+      if (!disk)
+	return -ENODEV;
+    }
+
+  ret->max_sectors_kb = sysattr_u32(disk, "queue/max_sectors_kb");
+  ret->rotational = sysattr_u32(disk, "queue/rotational") != 0;
+
+  const char *type = NULL;
+  const char *bus = get_bus(disk, udev_device_get_devnode(disk), &type);
+  if (!isempty(bus))
+    snprintf(ret->bus, sizeof(ret->bus), "%s", bus);
+
+  MSG_DEBUG("%s: bus=%s logical=%u physical=%u io_min=%u io_opt=%u max_sectors_kb=%u rotational=%s",
+	    device, strna(bus), ret->logical_block_size,
+	    ret->physical_block_size, ret->io_min, ret->io_opt,
+	    ret->max_sectors_kb, strbool(ret->rotational));
+
+  return 0;
+}
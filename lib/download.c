@@ -6,11 +6,96 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <curl/curl.h>
 
 #include "basics.h"
 #include "download.h"
 
+static CURLSH *session;
+static pthread_mutex_t session_locks[CURL_LOCK_DATA_LAST];
+static pthread_key_t session_key;
+static pthread_once_t session_once = PTHREAD_ONCE_INIT;
+
+static void
+session_lock(CURL _unused_ *handle, curl_lock_data data,
+	     curl_lock_access _unused_ access, void _unused_ *userptr)
+{
+  pthread_mutex_lock(&session_locks[data]);
+}
+
+static void
+session_unlock(CURL _unused_ *handle, curl_lock_data data,
+	       void _unused_ *userptr)
+{
+  pthread_mutex_unlock(&session_locks[data]);
+}
+
+static void
+session_handle_free(void *curl)
+{
+  curl_easy_cleanup(curl);
+}
+
+/* The session lives as long as the process, so curl_global_init() is
+   only done once. Connections cannot be shared between threads running
+   transfers at the same time, so they stay with the handle of a thread. */
+static void
+session_init(void)
+{
+  if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK)
+    return;
+
+  for (size_t i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    pthread_mutex_init(&session_locks[i], NULL);
+  if (pthread_key_create(&session_key, session_handle_free) != 0)
+    return;
+
+  session = curl_share_init();
+  if (!session)
+    return;
+  curl_share_setopt(session, CURLSHOPT_LOCKFUNC, session_lock);
+  curl_share_setopt(session, CURLSHOPT_UNLOCKFUNC, session_unlock);
+  curl_share_setopt(session, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(session, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+CURLSH *
+curl_session(void)
+{
+  pthread_once(&session_once, session_init);
+  return session;
+}
+
+CURL *
+curl_session_handle(void)
+{
+  CURL *curl;
+
+  if (!curl_session())
+    return NULL;
+
+  curl = pthread_getspecific(session_key);
+  if (curl)
+    curl_easy_reset(curl);
+  else
+    {
+      curl = curl_easy_init();
+      if (!curl)
+	return NULL;
+      if (pthread_setspecific(session_key, curl) != 0)
+	{
+	  curl_easy_cleanup(curl);
+	  return NULL;
+	}
+    }
+
+  curl_easy_setopt(curl, CURLOPT_SHARE, session);
+  curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+
+  return curl;
+}
+
 /* Return value are:
    < 0: negative errno codes
    > 0: CURLcode values
@@ -21,27 +106,17 @@ curl_download_file(const char *url, const char *output)
 {
   _cleanup_fclose_ FILE *fp = NULL;
   CURL *curl;
-  int r;
 
   if (isempty(url) || isempty(output))
     return CURLE_URL_MALFORMAT;
 
-  curl_global_init(CURL_GLOBAL_DEFAULT);
-  curl = curl_easy_init();
+  curl = curl_session_handle();
   if (curl == NULL)
-    {
-      curl_global_cleanup();
-      return CURLE_FAILED_INIT;
-    }
+    return CURLE_FAILED_INIT;
 
   fp = fopen(output, "wb");
   if (!fp)
-    {
-      r = -errno;
-      curl_easy_cleanup(curl);
-      curl_global_cleanup();
-      return r;
-    }
+    return -errno;
 
   // set URL and write callback function
   curl_easy_setopt(curl, CURLOPT_URL, url);
@@ -58,9 +133,5 @@ curl_download_file(const char *url, const char *output)
       remove(output);
     }
 
-  // Cleanup
-  curl_easy_cleanup(curl);
-  curl_global_cleanup();
-
   return res;
 }
@@ -0,0 +1,1510 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include "config.h"
+
+#include <errno.h>
+#include <endian.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "basics.h"
+#include "logger.h"
+#include "gzip_mt.h"
+
+/* Parallel gzip decompression, similar to pugz and rapidgzip:
+
+   The compressed image gets split into chunks of GZ_CHUNK bytes. A
+   worker searches the first position in its chunk where a gzip member
+   or a deflate block starts and decodes from there until the first
+   block boundary behind its chunk. Blocks can refer to up to 32 KiB of
+   data decoded before them, which is not known yet. So the output is
+   stored with 16 bit per symbol, references into the unknown window
+   are stored as markers (GZ_MARKER + offset in the window).
+
+   The chunks get emitted in order, the window is known by then and the
+   markers get replaced with the real data. A chunk gets only used if
+   it starts exactly where the data emitted before ended, so a wrongly
+   guessed block start costs only time. Gaps (no block start found,
+   output of a chunk too large) get decoded by zlib from the exact bit
+   position with the known window, until the next chunk starts. The
+   CRC and length of every member get checked as usual.
+
+   gzip files consisting of several members (pigz -i, concatenated
+   files) and pigz output with its flush points are split cheaply, for
+   other files dynamic Huffman block headers get searched bit by bit. */
+
+#define GZ_WINDOW 32768
+#define GZ_MARKER 0x8000
+#define GZ_CHUNK (1024 * 1024)
+// blocks crossing the end of a chunk get finished with this
+#define GZ_OVERLAP (256 * 1024)
+// symbols per chunk, checked at block boundaries
+#define GZ_MAX_OUTPUT (8 * 1024 * 1024)
+// hard limit inside of a block
+#define GZ_MAX_ALLOC (GZ_WINDOW + 2 * GZ_MAX_OUTPUT)
+#define GZ_HEADER_MAX (64 * 1024)
+
+// internal return value: more input or output space needed
+#define GZ_AGAIN 2
+
+#define LIT_BITS 10
+#define DIST_BITS 8
+#define CL_BITS 7
+#define LIT_TABLE_SIZE ((1 << LIT_BITS) + 288 * (1 << (15 - LIT_BITS)))
+#define DIST_TABLE_SIZE ((1 << DIST_BITS) + 32 * (1 << (15 - DIST_BITS)))
+
+/* Huffman decoding table entries: symbol << 16 | code length. Codes
+   longer than the index bits of the table are found in a sub table,
+   the entry is then: offset of the sub table << 16 | HUFF_SUB | bits
+   of the sub table index. 0 marks an invalid code. */
+#define HUFF_SUB 0x100
+
+typedef struct {
+  uint32_t lit[LIT_TABLE_SIZE];
+  uint32_t dist[DIST_TABLE_SIZE];
+} gz_tables_t;
+
+typedef struct {
+  const uint8_t *data;
+  size_t size;
+  size_t pos;        // next byte to load
+  uint64_t hold;
+  unsigned int bits; // valid bits in hold
+} br_t;
+
+typedef struct {
+  size_t out_pos;    // end of the member in the output of the chunk
+  uint32_t crc;
+  uint32_t isize;
+} gz_member_t;
+
+typedef enum {
+  GZ_FILLING = 0,    // receiving compressed data
+  GZ_QUEUED,
+  GZ_RUNNING,
+  GZ_DONE,
+} gz_state_t;
+
+typedef struct {
+  gz_state_t state;
+  bool cancel;       // not needed anymore, skip it
+  // GZ_CHUNK bytes of compressed data and up to GZ_OVERLAP bytes of
+  // the next chunk
+  uint8_t *data;
+  size_t size;
+  size_t filled;
+  uint64_t offset;   // of data in the compressed stream
+  bool last;         // contains the end of the compressed stream
+
+  // result of the worker, positions are bits in the compressed stream
+  bool ok;
+  bool start_header; // starts with a gzip header
+  uint64_t start, end;
+  bool end_header;   // a gzip header or trailing garbage follows at end
+  bool eos;          // no further gzip data after end
+  uint16_t *out;     // GZ_WINDOW markers followed by the output
+  size_t n;          // symbols in out including the markers
+  size_t alloc;
+  size_t member_start; // references before are invalid
+  gz_member_t *members;
+  size_t nmembers, members_alloc;
+
+  // output after the markers got replaced
+  bool resolved;
+  size_t emit_pos, emit_size;
+} gz_job_t;
+
+typedef enum {
+  GZ_BOUNDARY,       // at the start of a block or member
+  GZ_HEADER,         // gzip header gets parsed
+  GZ_ZLIB,           // sequential decoding
+  GZ_TRAILER,        // CRC and size of a member
+  GZ_EMIT,           // output of a worker
+  GZ_EOS,            // ignore the rest
+} gz_mode_t;
+
+struct gzip_mt {
+  pthread_t *threads;
+  unsigned int nthreads;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool stop;
+  gz_job_t *jobs;    // ring of chunks
+  unsigned int capacity;
+  uint64_t head;     // oldest chunk still needed
+  uint64_t tail;     // next chunk to create
+  uint64_t submitted;
+  uint64_t next_run;
+  uint64_t in_size;  // compressed bytes received
+  bool in_done;      // all compressed data received
+
+  gz_mode_t mode;
+  uint64_t pos;      // bit position in the compressed stream
+  bool pos_header;   // gzip header or end of data expected at pos
+  gz_job_t *emit;
+  z_stream z;
+  bool z_init;
+  uint64_t zin;      // next byte to feed to zlib
+  uint32_t crc, isize; // of the current member
+  uint8_t window[GZ_WINDOW]; // last output of the current member
+  size_t window_len;
+  unsigned int members;
+  uint8_t *header_buf;
+  const char *error;
+
+  uint64_t parallel_bytes, serial_bytes;
+};
+
+static const uint16_t len_base[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t len_extra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t dist_base[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+  8193, 12289, 16385, 24577 };
+static const uint8_t dist_extra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const uint8_t cl_order[19] = {
+  16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+static gz_tables_t fixed_tables;
+static pthread_once_t fixed_once = PTHREAD_ONCE_INIT;
+
+#define JOB(mt, i) (&(mt)->jobs[(i) % (mt)->capacity])
+
+/*
+ * bit reader
+ */
+
+static inline void
+br_refill(br_t *b)
+{
+  if (b->pos + 8 <= b->size)
+    {
+      uint64_t v;
+
+      // the bits above b->bits are the following data anyway
+      memcpy(&v, b->data + b->pos, sizeof(v));
+      b->hold |= le64toh(v) << b->bits;
+      b->pos += (63 - b->bits) >> 3;
+      b->bits |= 56;
+    }
+  else
+    while (b->bits <= 56 && b->pos < b->size)
+      {
+	b->hold |= (uint64_t)b->data[b->pos++] << b->bits;
+	b->bits += 8;
+      }
+}
+
+static inline uint64_t
+br_bitpos(const br_t *b)
+{
+  return (uint64_t)b->pos * 8 - b->bits;
+}
+
+static inline void
+br_drop(br_t *b, unsigned int n)
+{
+  b->hold >>= n;
+  b->bits -= n;
+}
+
+static inline int
+br_get(br_t *b, unsigned int n, uint32_t *ret)
+{
+  if (b->bits < n)
+    {
+      br_refill(b);
+      if (b->bits < n)
+	return -EAGAIN;
+    }
+  *ret = b->hold & ((1ULL << n) - 1);
+  br_drop(b, n);
+  return 0;
+}
+
+static int
+br_init(br_t *b, const uint8_t *data, size_t size, uint64_t bitpos)
+{
+  *b = (br_t){ .data = data, .size = size, .pos = bitpos / 8 };
+  if (b->pos > size)
+    return -EAGAIN;
+  br_refill(b);
+  if (b->bits < bitpos % 8)
+    return -EAGAIN;
+  br_drop(b, bitpos % 8);
+  return 0;
+}
+
+/*
+ * Huffman codes
+ */
+
+static uint32_t
+reverse_bits(uint32_t code, unsigned int len)
+{
+  uint32_t r = 0;
+
+  for (unsigned int i = 0; i < len; i++, code >>= 1)
+    r = r << 1 | (code & 1);
+  return r;
+}
+
+/* Builds the decoding table for the canonical code described by lens.
+   Like zlib, incomplete codes are only accepted with a single code of
+   length 1 (or none at all), which is also a good filter for block
+   starts guessed at a random position. */
+static int
+huff_build(uint32_t *table, unsigned int bits, const uint8_t *lens,
+	   unsigned int n, bool allow_incomplete)
+{
+  unsigned int count[16] = {}, next[16];
+  unsigned int max = 0, code = 0, subbits, used;
+  int left = 1;
+
+  for (unsigned int i = 0; i < n; i++)
+    count[lens[i]]++;
+  count[0] = 0;
+  for (unsigned int len = 1; len <= 15; len++)
+    {
+      left = left * 2 - count[len];
+      if (left < 0)
+	return -EBADMSG;
+      if (count[len])
+	max = len;
+    }
+  if (left > 0 && !(allow_incomplete && max <= 1))
+    return -EBADMSG;
+
+  for (unsigned int len = 1; len <= 15; len++)
+    {
+      code = (code + count[len - 1]) << 1;
+      next[len] = code;
+    }
+
+  memset(table, 0, sizeof(uint32_t) << bits);
+  used = 1U << bits;
+  subbits = max > bits ? max - bits : 0;
+  for (unsigned int sym = 0; sym < n; sym++)
+    {
+      unsigned int len = lens[sym];
+      uint32_t rev, *e, *sub;
+
+      if (len == 0)
+	continue;
+      rev = reverse_bits(next[len]++, len);
+      if (len <= bits)
+	{
+	  for (uint32_t i = rev; i < (1U << bits); i += 1U << len)
+	    table[i] = sym << 16 | len;
+	  continue;
+	}
+
+      e = &table[rev & ((1U << bits) - 1)];
+      if (*e == 0)
+	{
+	  *e = used << 16 | HUFF_SUB | subbits;
+	  memset(table + used, 0, sizeof(uint32_t) << subbits);
+	  used += 1U << subbits;
+	}
+      sub = table + (*e >> 16);
+      for (uint32_t i = rev >> bits; i < (1U << subbits); i += 1U << (len - bits))
+	sub[i] = sym << 16 | len;
+    }
+
+  return 0;
+}
+
+static inline int
+huff_decode(br_t *b, const uint32_t *table, unsigned int bits)
+{
+  uint32_t e = table[b->hold & ((1U << bits) - 1)];
+  unsigned int len;
+
+  if (e & HUFF_SUB)
+    e = table[(e >> 16) + ((b->hold >> bits) & ((1U << (e & 0xff)) - 1))];
+  len = e & 0xff;
+  if (len == 0)
+    return -EBADMSG;
+  if (len > b->bits)
+    return -EAGAIN;
+  br_drop(b, len);
+  return e >> 16;
+}
+
+static void
+init_fixed_tables(void)
+{
+  uint8_t lens[288];
+
+  memset(lens, 8, 144);
+  memset(lens + 144, 9, 112);
+  memset(lens + 256, 7, 24);
+  memset(lens + 280, 8, 8);
+  huff_build(fixed_tables.lit, LIT_BITS, lens, 288, false);
+  memset(lens, 5, 32);
+  huff_build(fixed_tables.dist, DIST_BITS, lens, 32, false);
+}
+
+/*
+ * inflate with markers for the unknown window
+ */
+
+static int
+job_reserve(gz_job_t *job, size_t need)
+{
+  size_t size;
+  uint16_t *p;
+
+  if (job->n + need <= job->alloc)
+    return 0;
+
+  size = job->alloc ? job->alloc * 2 : GZ_WINDOW + 2 * GZ_CHUNK;
+  while (size < job->n + need)
+    size *= 2;
+  if (size > GZ_MAX_ALLOC)
+    {
+      size = GZ_MAX_ALLOC;
+      if (job->n + need > size)
+	return -E2BIG;
+    }
+
+  p = reallocarray(job->out, size, sizeof(uint16_t));
+  if (!p)
+    return -ENOMEM;
+  if (!job->out)
+    for (unsigned int i = 0; i < GZ_WINDOW; i++)
+      p[i] = GZ_MARKER + i;
+  job->out = p;
+  job->alloc = size;
+  return 0;
+}
+
+static int
+inflate_stored(gz_job_t *job, br_t *b)
+{
+  uint32_t len, nlen;
+  int r;
+
+  br_drop(b, b->bits & 7);
+  if ((r = br_get(b, 16, &len)) < 0 || (r = br_get(b, 16, &nlen)) < 0)
+    return r;
+  if (len != (~nlen & 0xffff))
+    return -EBADMSG;
+  r = job_reserve(job, len);
+  if (r < 0)
+    return r;
+
+  // whole bytes left in hold come first
+  for (; len > 0 && b->bits >= 8; len--)
+    {
+      job->out[job->n++] = b->hold & 0xff;
+      br_drop(b, 8);
+    }
+  if (len == 0)
+    return 0;
+  if (b->pos + len > b->size)
+    return -EAGAIN;
+  b->hold = 0;
+  for (uint32_t i = 0; i < len; i++)
+    job->out[job->n++] = b->data[b->pos + i];
+  b->pos += len;
+
+  return 0;
+}
+
+static int
+inflate_codes(gz_job_t *job, br_t *b, const gz_tables_t *t)
+{
+  uint16_t *out = job->out;
+  size_t n = job->n;
+  int r = 0;
+
+  while (1)
+    {
+      uint32_t extra;
+      unsigned int len, dist;
+      int sym;
+
+      if (n + 258 > job->alloc)
+	{
+	  job->n = n;
+	  r = job_reserve(job, 258);
+	  if (r < 0)
+	    return r;
+	  out = job->out;
+	}
+      if (b->bits < 48)
+	br_refill(b);
+
+      sym = huff_decode(b, t->lit, LIT_BITS);
+      if (sym < 256)
+	{
+	  if (sym < 0)
+	    {
+	      r = sym;
+	      break;
+	    }
+	  out[n++] = sym;
+	  continue;
+	}
+      if (sym == 256)
+	break;
+
+      sym -= 257;
+      if (sym >= 29)
+	{
+	  r = -EBADMSG;
+	  break;
+	}
+      len = len_base[sym];
+      if ((r = br_get(b, len_extra[sym], &extra)) < 0)
+	break;
+      len += extra;
+
+      sym = huff_decode(b, t->dist, DIST_BITS);
+      if (sym < 0 || sym >= 30)
+	{
+	  r = sym < 0 ? sym : -EBADMSG;
+	  break;
+	}
+      dist = dist_base[sym];
+      if ((r = br_get(b, dist_extra[sym], &extra)) < 0)
+	break;
+      dist += extra;
+      if (dist > n - job->member_start)
+	{
+	  r = -EBADMSG;
+	  break;
+	}
+
+      if (dist >= len)
+	memcpy(out + n, out + n - dist, len * sizeof(uint16_t));
+      else
+	for (unsigned int i = 0; i < len; i++)
+	  out[n + i] = out[n - dist + i];
+      n += len;
+    }
+
+  job->n = n;
+  return r;
+}
+
+static int
+read_dynamic(br_t *b, gz_tables_t *t)
+{
+  uint8_t cl_lens[19] = {};
+  uint8_t lens[286 + 30];
+  uint32_t cl_table[1 << CL_BITS];
+  uint32_t hlit, hdist, hclen, v;
+  int r;
+
+  if ((r = br_get(b, 5, &hlit)) < 0 || (r = br_get(b, 5, &hdist)) < 0 ||
+      (r = br_get(b, 4, &hclen)) < 0)
+    return r;
+  hlit += 257;
+  hdist += 1;
+  hclen += 4;
+  if (hlit > 286 || hdist > 30)
+    return -EBADMSG;
+
+  for (unsigned int i = 0; i < hclen; i++)
+    {
+      if ((r = br_get(b, 3, &v)) < 0)
+	return r;
+      cl_lens[cl_order[i]] = v;
+    }
+  r = huff_build(cl_table, CL_BITS, cl_lens, 19, false);
+  if (r < 0)
+    return r;
+
+  for (unsigned int i = 0; i < hlit + hdist;)
+    {
+      unsigned int rep, val = 0;
+      int sym;
+
+      if (b->bits < 16)
+	br_refill(b);
+      sym = huff_decode(b, cl_table, CL_BITS);
+      if (sym < 0)
+	return sym;
+      if (sym < 16)
+	{
+	  lens[i++] = sym;
+	  continue;
+	}
+      if (sym == 16)
+	{
+	  if (i == 0)
+	    return -EBADMSG;
+	  val = lens[i - 1];
+	  r = br_get(b, 2, &v);
+	  rep = 3 + v;
+	}
+      else if (sym == 17)
+	{
+	  r = br_get(b, 3, &v);
+	  rep = 3 + v;
+	}
+      else
+	{
+	  r = br_get(b, 7, &v);
+	  rep = 11 + v;
+	}
+      if (r < 0)
+	return r;
+      if (i + rep > hlit + hdist)
+	return -EBADMSG;
+      memset(lens + i, val, rep);
+      i += rep;
+    }
+
+  // the end of block code is mandatory
+  if (lens[256] == 0)
+    return -EBADMSG;
+  r = huff_build(t->lit, LIT_BITS, lens, hlit, true);
+  if (r < 0)
+    return r;
+  return huff_build(t->dist, DIST_BITS, lens + hlit, hdist, true);
+}
+
+static int
+inflate_block(gz_job_t *job, br_t *b, gz_tables_t *t, bool *ret_final)
+{
+  uint32_t v;
+  int r;
+
+  if ((r = br_get(b, 3, &v)) < 0)
+    return r;
+  *ret_final = v & 1;
+
+  switch (v >> 1)
+    {
+    case 0:
+      return inflate_stored(job, b);
+    case 1:
+      return inflate_codes(job, b, &fixed_tables);
+    case 2:
+      r = read_dynamic(b, t);
+      if (r < 0)
+	return r;
+      return inflate_codes(job, b, t);
+    default:
+      return -EBADMSG;
+    }
+}
+
+// Returns the size of the gzip header at p, -EAGAIN if incomplete
+static int
+gz_header_size(const uint8_t *p, size_t avail, size_t *ret)
+{
+  size_t len = 10;
+  uint8_t flags;
+
+  if (avail < 10)
+    return -EAGAIN;
+  flags = p[3];
+  if (p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || (flags & 0xe0))
+    return -EBADMSG;
+
+  if (flags & 0x04)          // FEXTRA
+    {
+      if (avail < 12)
+	return -EAGAIN;
+      len = 12 + (p[10] | p[11] << 8);
+    }
+  for (uint8_t f = 0x08; f <= 0x10; f <<= 1) // FNAME, FCOMMENT
+    if (flags & f)
+      {
+	const uint8_t *z = len < avail ? memchr(p + len, 0, avail - len) : NULL;
+
+	if (!z)
+	  return -EAGAIN;
+	len = z - p + 1;
+      }
+  if (flags & 0x02)          // FHCRC
+    len += 2;
+  if (len > avail)
+    return -EAGAIN;
+
+  *ret = len;
+  return 0;
+}
+
+static int
+job_add_member(gz_job_t *job, uint32_t crc, uint32_t isize)
+{
+  if (job->nmembers == job->members_alloc)
+    {
+      size_t n = job->members_alloc ? job->members_alloc * 2 : 8;
+      gz_member_t *tmp = reallocarray(job->members, n, sizeof(gz_member_t));
+
+      if (!tmp)
+	return -ENOMEM;
+      job->members = tmp;
+      job->members_alloc = n;
+    }
+  job->members[job->nmembers++] = (gz_member_t){
+    .out_pos = job->n - GZ_WINDOW,
+    .crc = crc,
+    .isize = isize,
+  };
+  return 0;
+}
+
+/* Decodes the chunk from the bit position start (relative to the chunk)
+   until the first block boundary behind the chunk. If the input or the
+   output space runs out, the chunk ends at the last block boundary. */
+static int
+job_try(gz_job_t *job, uint64_t start, bool start_header, gz_tables_t *t)
+{
+  uint64_t limit = (uint64_t)job->size * 8;
+  uint64_t pos, last_pos = start;
+  size_t last_n = GZ_WINDOW, last_nmembers = 0;
+  bool header = start_header, last_header = start_header;
+  bool check = false;
+  br_t b;
+  int r;
+
+  job->n = GZ_WINDOW;
+  job->nmembers = 0;
+  job->member_start = start_header ? GZ_WINDOW : 0;
+  job->eos = false;
+  r = job_reserve(job, 0);
+  if (r < 0)
+    return r;
+  r = br_init(&b, job->data, job->filled, start);
+  if (r < 0)
+    return r;
+
+  while (1)
+    {
+      uint32_t crc, isize;
+      bool final;
+
+      pos = br_bitpos(&b);
+      if (check)
+	{
+	  if (pos >= limit || job->n - GZ_WINDOW >= GZ_MAX_OUTPUT)
+	    break;
+	  last_pos = pos;
+	  last_n = job->n;
+	  last_nmembers = job->nmembers;
+	  last_header = header;
+	}
+      check = true;
+
+      if (header)
+	{
+	  size_t len;
+
+	  r = gz_header_size(job->data + pos / 8, job->filled - pos / 8, &len);
+	  if (r < 0)
+	    goto stop;
+	  r = br_init(&b, job->data, job->filled, pos + (uint64_t)len * 8);
+	  if (r < 0)
+	    goto stop;
+	  job->member_start = job->n;
+	  header = false;
+	  // the first block belongs to the header
+	  check = false;
+	  continue;
+	}
+
+      r = inflate_block(job, &b, t, &final);
+      if (r < 0)
+	goto stop;
+      if (!final)
+	continue;
+
+      br_drop(&b, b.bits & 7);
+      if ((r = br_get(&b, 32, &crc)) < 0 || (r = br_get(&b, 32, &isize)) < 0)
+	goto stop;
+      r = job_add_member(job, crc, isize);
+      if (r < 0)
+	return r;
+
+      pos = br_bitpos(&b);
+      if (pos / 8 >= job->filled && job->last)
+	{
+	  job->eos = true;
+	  break;
+	}
+      // like gzip, ignore trailing garbage after the last member
+      if (pos / 8 < job->filled && job->data[pos / 8] != 0x1f)
+	{
+	  job->eos = true;
+	  break;
+	}
+      header = true;
+    }
+
+  job->end = job->offset * 8 + pos;
+  job->end_header = header;
+  return 0;
+
+ stop:
+  if ((r == -EAGAIN || r == -E2BIG) && last_pos != start)
+    {
+      job->end = job->offset * 8 + last_pos;
+      job->end_header = last_header;
+      job->n = last_n;
+      job->nmembers = last_nmembers;
+      return 0;
+    }
+  return r;
+}
+
+static void
+job_found(gz_job_t *job, uint64_t p, bool header)
+{
+  job->ok = true;
+  job->start = job->offset * 8 + p;
+  job->start_header = header;
+}
+
+static void
+job_run(gz_job_t *job, gz_tables_t *t)
+{
+  const uint8_t *d = job->data;
+
+  job->ok = false;
+
+  if (job->offset == 0)
+    {
+      // the stream starts with a gzip header
+      if (job_try(job, 0, true, t) == 0)
+	job_found(job, 0, true);
+      return;
+    }
+
+  for (uint64_t p = 0; p < (uint64_t)job->size * 8; p++)
+    {
+      size_t x = p / 8;
+      unsigned int v;
+
+      if (p % 8 == 0)
+	{
+	  // next gzip member
+	  if (x + 3 < job->filled && d[x] == 0x1f && d[x + 1] == 0x8b &&
+	      d[x + 2] == 8 && (d[x + 3] & 0xe0) == 0 &&
+	      job_try(job, p, true, t) == 0)
+	    {
+	      job_found(job, p, true);
+	      return;
+	    }
+	  // behind a flush point (empty stored block, pigz)
+	  if (x >= 4 && d[x - 4] == 0 && d[x - 3] == 0 && d[x - 2] == 0xff &&
+	      d[x - 1] == 0xff && job_try(job, p, false, t) == 0)
+	    {
+	      job_found(job, p, false);
+	      return;
+	    }
+	}
+
+      // dynamic Huffman block: BTYPE 2
+      v = d[x] | (x + 1 < job->filled ? d[x + 1] << 8 : 0);
+      if (((v >> (p % 8)) & 6) == 4 && job_try(job, p, false, t) == 0)
+	{
+	  job_found(job, p, false);
+	  return;
+	}
+    }
+}
+
+static void *
+gz_worker(void *arg)
+{
+  gzip_mt_t *mt = arg;
+  _cleanup_free_ gz_tables_t *t = malloc(sizeof(gz_tables_t));
+
+  pthread_mutex_lock(&mt->lock);
+  while (1)
+    {
+      gz_job_t *job;
+
+      while (mt->next_run == mt->submitted && !mt->stop)
+	pthread_cond_wait(&mt->cond, &mt->lock);
+      if (mt->stop)
+	break;
+
+      job = JOB(mt, mt->next_run++);
+      if (!job->cancel && t)
+	{
+	  job->state = GZ_RUNNING;
+	  pthread_mutex_unlock(&mt->lock);
+	  job_run(job, t);
+	  if (!job->ok)
+	    {
+	      job->out = mfree(job->out);
+	      job->alloc = 0;
+	    }
+	  pthread_mutex_lock(&mt->lock);
+	}
+      job->state = GZ_DONE;
+      pthread_cond_broadcast(&mt->cond);
+    }
+  pthread_mutex_unlock(&mt->lock);
+
+  return NULL;
+}
+
+/*
+ * chunks
+ */
+
+static void
+job_clear(gz_job_t *job)
+{
+  free(job->data);
+  free(job->out);
+  free(job->members);
+  *job = (gz_job_t){};
+}
+
+// Chunks get submitted in order
+static void
+job_submit(gzip_mt_t *mt, gz_job_t *job)
+{
+  pthread_mutex_lock(&mt->lock);
+  job->state = GZ_QUEUED;
+  mt->submitted++;
+  pthread_cond_broadcast(&mt->cond);
+  pthread_mutex_unlock(&mt->lock);
+}
+
+static void
+job_wait(gzip_mt_t *mt, gz_job_t *job)
+{
+  pthread_mutex_lock(&mt->lock);
+  while (job->state != GZ_DONE)
+    pthread_cond_wait(&mt->cond, &mt->lock);
+  pthread_mutex_unlock(&mt->lock);
+}
+
+// Copies the input into chunks, returns 1 if something got copied
+static int
+gz_fill(gzip_mt_t *mt, decoder_buf_t *buf, bool finish)
+{
+  int progress = 0;
+
+  while (buf->src_pos < buf->src_size)
+    {
+      gz_job_t *cur = mt->tail > mt->head ? JOB(mt, mt->tail - 1) : NULL;
+      gz_job_t *prev;
+      size_t n, want;
+
+      if (!cur || cur->state != GZ_FILLING || cur->size == GZ_CHUNK)
+	{
+	  if (mt->tail - mt->head == mt->capacity)
+	    break;
+	  cur = JOB(mt, mt->tail);
+	  cur->data = malloc(GZ_CHUNK + GZ_OVERLAP);
+	  if (!cur->data)
+	    {
+	      mt->error = "Out of memory";
+	      return -ENOMEM;
+	    }
+	  cur->offset = mt->in_size;
+	  mt->tail++;
+	}
+
+      n = buf->src_size - buf->src_pos;
+      if (n > GZ_CHUNK - cur->size)
+	n = GZ_CHUNK - cur->size;
+      memcpy(cur->data + cur->size, buf->src + buf->src_pos, n);
+      cur->size += n;
+      cur->filled = cur->size;
+      buf->src_pos += n;
+      mt->in_size += n;
+      progress = 1;
+
+      // the start of this chunk is the end of the previous one
+      if (mt->tail - mt->head < 2)
+	continue;
+      prev = JOB(mt, mt->tail - 2);
+      if (prev->state != GZ_FILLING)
+	continue;
+      want = cur->size < GZ_OVERLAP ? cur->size : GZ_OVERLAP;
+      if (prev->filled < prev->size + want)
+	{
+	  memcpy(prev->data + prev->filled, cur->data + (prev->filled - prev->size),
+		 prev->size + want - prev->filled);
+	  prev->filled = prev->size + want;
+	}
+      if (want == GZ_OVERLAP)
+	job_submit(mt, prev);
+    }
+
+  if (finish && buf->src_pos == buf->src_size && !mt->in_done)
+    {
+      mt->in_done = true;
+      for (uint64_t i = mt->head; i < mt->tail; i++)
+	if (JOB(mt, i)->state == GZ_FILLING)
+	  {
+	    JOB(mt, i)->last = (i + 1 == mt->tail);
+	    job_submit(mt, JOB(mt, i));
+	  }
+    }
+
+  return progress;
+}
+
+// Frees the chunks before the byte offset needed
+static void
+gz_release(gzip_mt_t *mt, uint64_t needed)
+{
+  while (mt->head < mt->tail)
+    {
+      gz_job_t *job = JOB(mt, mt->head);
+
+      if (job == mt->emit || job->offset + job->size > needed ||
+	  (job->size < GZ_CHUNK && !mt->in_done))
+	break;
+
+      pthread_mutex_lock(&mt->lock);
+      if (job->state == GZ_FILLING)
+	{
+	  // all chunks before got already processed, skip this one
+	  mt->submitted++;
+	  mt->next_run++;
+	  job->state = GZ_DONE;
+	}
+      job->cancel = true;
+      while (job->state != GZ_DONE)
+	pthread_cond_wait(&mt->cond, &mt->lock);
+      pthread_mutex_unlock(&mt->lock);
+
+      job_clear(job);
+      mt->head++;
+    }
+}
+
+static gz_job_t *
+gz_find(gzip_mt_t *mt, uint64_t offset)
+{
+  for (uint64_t i = mt->head; i < mt->tail; i++)
+    {
+      gz_job_t *job = JOB(mt, i);
+
+      if (offset >= job->offset && offset < job->offset + job->size)
+	return job;
+    }
+  return NULL;
+}
+
+// Copies compressed data, returns the number of bytes available
+static size_t
+gz_read(gzip_mt_t *mt, uint64_t offset, uint8_t *dst, size_t len)
+{
+  size_t done = 0;
+
+  while (done < len)
+    {
+      gz_job_t *job = gz_find(mt, offset + done);
+      size_t n;
+
+      if (!job)
+	break;
+      n = job->offset + job->size - (offset + done);
+      if (n > len - done)
+	n = len - done;
+      memcpy(dst + done, job->data + (offset + done - job->offset), n);
+      done += n;
+    }
+
+  return done;
+}
+
+/* Returns the chunk starting exactly at pos, if there is one. Waits
+   for the worker, the chunk is needed now. */
+static gz_job_t *
+gz_usable_job(gzip_mt_t *mt, uint64_t pos, bool header)
+{
+  gz_job_t *job = gz_find(mt, pos / 8);
+
+  if (!job || job->state == GZ_FILLING)
+    return NULL;
+  job_wait(mt, job);
+  if (job->ok && job->start == pos && job->start_header == header)
+    return job;
+  return NULL;
+}
+
+/*
+ * emitter
+ */
+
+static int
+gz_error(gzip_mt_t *mt, int r, const char *msg)
+{
+  mt->error = msg;
+  return r;
+}
+
+static void
+gz_new_member(gzip_mt_t *mt)
+{
+  mt->crc = crc32(0, NULL, 0);
+  mt->isize = 0;
+  mt->window_len = 0;
+}
+
+// Accounts output of the current member
+static void
+gz_output(gzip_mt_t *mt, const uint8_t *p, size_t len)
+{
+  size_t keep;
+
+  mt->crc = crc32_z(mt->crc, p, len);
+  mt->isize += len;
+
+  if (len >= GZ_WINDOW)
+    {
+      memcpy(mt->window, p + len - GZ_WINDOW, GZ_WINDOW);
+      mt->window_len = GZ_WINDOW;
+      return;
+    }
+  keep = mt->window_len;
+  if (keep > GZ_WINDOW - len)
+    keep = GZ_WINDOW - len;
+  memmove(mt->window, mt->window + mt->window_len - keep, keep);
+  memcpy(mt->window + keep, p, len);
+  mt->window_len = keep + len;
+}
+
+static int
+gz_check_member(gzip_mt_t *mt, uint32_t crc, uint32_t isize)
+{
+  if (crc != mt->crc)
+    return gz_error(mt, -EBADMSG, "incorrect data check");
+  if (isize != mt->isize)
+    return gz_error(mt, -EBADMSG, "incorrect length check");
+  mt->members++;
+  return 0;
+}
+
+static int
+gz_zlib_start(gzip_mt_t *mt)
+{
+  int r;
+
+  if (!mt->z_init)
+    {
+      if (inflateInit2(&mt->z, -MAX_WBITS) != Z_OK)
+	return gz_error(mt, -ENOMEM, "inflateInit2() failed");
+      mt->z_init = true;
+    }
+  else if (inflateReset(&mt->z) != Z_OK)
+    return gz_error(mt, -EIO, "inflateReset() failed");
+
+  // continue at a bit position, like zran.c of zlib
+  mt->zin = mt->pos / 8;
+  if (mt->pos % 8)
+    {
+      uint8_t c;
+
+      if (gz_read(mt, mt->zin, &c, 1) != 1)
+	return gz_error(mt, -EIO, "Compressed data not available");
+      r = inflatePrime(&mt->z, 8 - mt->pos % 8, c >> (mt->pos % 8));
+      if (r != Z_OK)
+	return gz_error(mt, -EIO, "inflatePrime() failed");
+      mt->zin++;
+    }
+  if (mt->window_len > 0 &&
+      inflateSetDictionary(&mt->z, mt->window, mt->window_len) != Z_OK)
+    return gz_error(mt, -EIO, "inflateSetDictionary() failed");
+
+  mt->mode = GZ_ZLIB;
+  return 0;
+}
+
+static int
+gz_boundary(gzip_mt_t *mt, decoder_buf_t *buf)
+{
+  gz_job_t *job;
+
+  gz_release(mt, mt->pos / 8);
+  job = gz_find(mt, mt->pos / 8);
+  if (!job)
+    {
+      if (!mt->in_done)
+	return GZ_AGAIN;
+      if (mt->pos_header && mt->pos / 8 == mt->in_size)
+	{
+	  mt->mode = GZ_EOS;
+	  return 0;
+	}
+      return gz_error(mt, -EBADMSG, "Unexpected end of compressed data");
+    }
+
+  if (job->state == GZ_FILLING && !mt->in_done &&
+      buf->src_pos == buf->src_size)
+    return GZ_AGAIN; // more input completes the chunk
+
+  job = gz_usable_job(mt, mt->pos, mt->pos_header);
+  if (job)
+    {
+      mt->emit = job;
+      mt->mode = GZ_EMIT;
+      return 0;
+    }
+
+  if (mt->pos_header)
+    {
+      mt->mode = GZ_HEADER;
+      return 0;
+    }
+  return gz_zlib_start(mt);
+}
+
+static int
+gz_parse_header(gzip_mt_t *mt)
+{
+  size_t avail, len;
+  int r;
+
+  avail = gz_read(mt, mt->pos / 8, mt->header_buf, GZ_HEADER_MAX);
+  if (avail == 0)
+    {
+      if (!mt->in_done)
+	return GZ_AGAIN;
+      mt->mode = GZ_EOS;
+      return 0;
+    }
+
+  // Like gzip, ignore trailing garbage (e.g. zero padding)
+  // after the last member.
+  if (mt->members > 0 && mt->header_buf[0] != 0x1f)
+    {
+      MSG_WARN("Ignoring trailing garbage after gzip data");
+      mt->mode = GZ_EOS;
+      return 0;
+    }
+
+  r = gz_header_size(mt->header_buf, avail, &len);
+  if (r == -EAGAIN)
+    {
+      if (mt->in_done)
+	return gz_error(mt, -EBADMSG, "Unexpected end of compressed data");
+      if (avail == GZ_HEADER_MAX)
+	return gz_error(mt, -EBADMSG, "gzip header too long");
+      return GZ_AGAIN;
+    }
+  if (r < 0)
+    return gz_error(mt, -EBADMSG, "incorrect header check");
+
+  gz_new_member(mt);
+  mt->pos += (uint64_t)len * 8;
+  mt->pos_header = false;
+  return gz_zlib_start(mt);
+}
+
+static int
+gz_zlib(gzip_mt_t *mt, decoder_buf_t *buf)
+{
+  while (buf->dst_pos < buf->dst_size)
+    {
+      gz_job_t *job;
+      size_t used, produced;
+      int r;
+
+      gz_release(mt, mt->zin);
+      job = gz_find(mt, mt->zin);
+      if (!job)
+	{
+	  if (mt->in_done)
+	    return gz_error(mt, -EBADMSG, "Unexpected end of compressed data");
+	  return GZ_AGAIN;
+	}
+
+      mt->z.next_in = job->data + (mt->zin - job->offset);
+      mt->z.avail_in = job->offset + job->size - mt->zin;
+      mt->z.next_out = buf->dst + buf->dst_pos;
+      mt->z.avail_out = buf->dst_size - buf->dst_pos;
+
+      r = inflate(&mt->z, Z_BLOCK);
+
+      used = job->offset + job->size - mt->zin - mt->z.avail_in;
+      produced = buf->dst_size - buf->dst_pos - mt->z.avail_out;
+      gz_output(mt, buf->dst + buf->dst_pos, produced);
+      buf->dst_pos += produced;
+      mt->zin += used;
+      mt->serial_bytes += produced;
+
+      switch (r)
+	{
+	case Z_STREAM_END:
+	  mt->pos = mt->zin * 8;
+	  mt->mode = GZ_TRAILER;
+	  return 0;
+	case Z_OK:
+	case Z_BUF_ERROR:
+	  break;
+	case Z_MEM_ERROR:
+	  return gz_error(mt, -ENOMEM, "Out of memory");
+	default:
+	  return gz_error(mt, -EBADMSG, mt->z.msg ?: "Corrupt gzip data");
+	}
+      if (used == 0 && produced == 0 && r == Z_BUF_ERROR)
+	return gz_error(mt, -EIO, "Internal gzip decoder error");
+
+      // at the end of a block: continue with a chunk starting here
+      if (mt->z.data_type & 128)
+	{
+	  uint64_t pos = mt->zin * 8 - (mt->z.data_type & 7);
+
+	  job = gz_usable_job(mt, pos, false);
+	  if (job)
+	    {
+	      mt->pos = pos;
+	      mt->pos_header = false;
+	      mt->emit = job;
+	      mt->mode = GZ_EMIT;
+	      return 0;
+	    }
+	}
+    }
+
+  return GZ_AGAIN;
+}
+
+static int
+gz_trailer(gzip_mt_t *mt)
+{
+  uint8_t t[8];
+  int r;
+
+  if (gz_read(mt, mt->pos / 8, t, sizeof(t)) < sizeof(t))
+    {
+      if (mt->in_done)
+	return gz_error(mt, -EBADMSG, "Unexpected end of compressed data");
+      return GZ_AGAIN;
+    }
+
+  r = gz_check_member(mt, t[0] | t[1] << 8 | t[2] << 16 | (uint32_t)t[3] << 24,
+		      t[4] | t[5] << 8 | t[6] << 16 | (uint32_t)t[7] << 24);
+  if (r < 0)
+    return r;
+
+  mt->pos += 64;
+  mt->pos_header = true;
+  mt->mode = GZ_BOUNDARY;
+  return 0;
+}
+
+// Replaces the markers with the data of the window and checks members
+static int
+gz_resolve(gzip_mt_t *mt, gz_job_t *job)
+{
+  uint8_t *bytes = (uint8_t *)job->out;
+  const uint16_t *sym = job->out + GZ_WINDOW;
+  size_t n = job->n - GZ_WINDOW;
+  size_t base, seg = 0;
+  int r;
+
+  if (job->start_header)
+    gz_new_member(mt);
+
+  // in place, every byte gets written before or where its symbol was
+  base = GZ_WINDOW - mt->window_len;
+  for (size_t i = 0; i < n; i++)
+    {
+      unsigned int v = sym[i];
+
+      if (v >= GZ_MARKER)
+	{
+	  if (v - GZ_MARKER < base)
+	    return gz_error(mt, -EBADMSG, "invalid distance too far back");
+	  v = mt->window[v - GZ_MARKER - base];
+	}
+      bytes[i] = v;
+    }
+
+  for (size_t i = 0; i < job->nmembers; i++)
+    {
+      gz_output(mt, bytes + seg, job->members[i].out_pos - seg);
+      r = gz_check_member(mt, job->members[i].crc, job->members[i].isize);
+      if (r < 0)
+	return r;
+      gz_new_member(mt);
+      seg = job->members[i].out_pos;
+    }
+  gz_output(mt, bytes + seg, n - seg);
+
+  job->resolved = true;
+  job->emit_pos = 0;
+  job->emit_size = n;
+  mt->parallel_bytes += n;
+  return 0;
+}
+
+static int
+gz_emit(gzip_mt_t *mt, decoder_buf_t *buf)
+{
+  gz_job_t *job = mt->emit;
+  size_t n;
+  int r;
+
+  if (!job->resolved)
+    {
+      r = gz_resolve(mt, job);
+      if (r < 0)
+	return r;
+    }
+
+  n = job->emit_size - job->emit_pos;
+  if (n > buf->dst_size - buf->dst_pos)
+    n = buf->dst_size - buf->dst_pos;
+  memcpy(buf->dst + buf->dst_pos, (uint8_t *)job->out + job->emit_pos, n);
+  buf->dst_pos += n;
+  job->emit_pos += n;
+  if (job->emit_pos < job->emit_size)
+    return GZ_AGAIN;
+
+  mt->pos = job->end;
+  mt->pos_header = job->end_header;
+  mt->emit = NULL;
+  job->out = mfree(job->out);
+  job->alloc = 0;
+  if (job->eos)
+    {
+      if (job->end / 8 < mt->in_size)
+	MSG_WARN("Ignoring trailing garbage after gzip data");
+      mt->mode = GZ_EOS;
+    }
+  else
+    mt->mode = GZ_BOUNDARY;
+  return 0;
+}
+
+int
+gzip_mt_run(gzip_mt_t *mt, decoder_buf_t *buf, bool finish, const char **error)
+{
+  int r;
+
+  while (1)
+    {
+      r = gz_fill(mt, buf, finish);
+      if (r < 0)
+	break;
+
+      switch (mt->mode)
+	{
+	case GZ_BOUNDARY:
+	  r = gz_boundary(mt, buf);
+	  break;
+	case GZ_HEADER:
+	  r = gz_parse_header(mt);
+	  break;
+	case GZ_ZLIB:
+	  r = gz_zlib(mt, buf);
+	  break;
+	case GZ_TRAILER:
+	  r = gz_trailer(mt);
+	  break;
+	case GZ_EMIT:
+	  r = gz_emit(mt, buf);
+	  break;
+	case GZ_EOS:
+	  buf->src_pos = buf->src_size;
+	  if (!finish)
+	    return 0;
+	  MSG_DEBUG("gzip: %" PRIu64 " bytes decoded in parallel, %" PRIu64 " sequentially",
+		    mt->parallel_bytes, mt->serial_bytes);
+	  return 1;
+	}
+      if (r < 0)
+	break;
+      // with input left the ring of chunks was full, which the
+      // emitter might have changed
+      if (r == GZ_AGAIN &&
+	  (buf->dst_pos == buf->dst_size || buf->src_pos == buf->src_size ||
+	   mt->tail - mt->head == mt->capacity))
+	return 0;
+    }
+
+  *error = mt->error;
+  return r;
+}
+
+size_t
+gzip_mt_job_memory(void)
+{
+  // the input with the overlap and the symbols of the output
+  return GZ_CHUNK + GZ_OVERLAP + GZ_MAX_ALLOC * sizeof(uint16_t);
+}
+
+int
+gzip_mt_new(unsigned int threads, gzip_mt_t **ret)
+{
+  gzip_mt_t *mt;
+
+  pthread_once(&fixed_once, init_fixed_tables);
+
+  mt = calloc(1, sizeof(gzip_mt_t));
+  if (!mt)
+    return -ENOMEM;
+  pthread_mutex_init(&mt->lock, NULL);
+  pthread_cond_init(&mt->cond, NULL);
+  mt->mode = GZ_BOUNDARY;
+  mt->pos_header = true;
+  // one chunk gets filled and one emitted while the workers run
+  mt->capacity = threads + 2;
+  mt->jobs = calloc(mt->capacity, sizeof(gz_job_t));
+  mt->threads = calloc(threads, sizeof(pthread_t));
+  mt->header_buf = malloc(GZ_HEADER_MAX);
+  if (!mt->jobs || !mt->threads || !mt->header_buf)
+    {
+      gzip_mt_free(mt);
+      return -ENOMEM;
+    }
+
+  for (unsigned int i = 0; i < threads; i++)
+    {
+      if (pthread_create(&mt->threads[i], NULL, gz_worker, mt) != 0)
+	{
+	  gzip_mt_free(mt);
+	  return -ENOMEM;
+	}
+      mt->nthreads++;
+    }
+
+  *ret = mt;
+  return 0;
+}
+
+gzip_mt_t *
+gzip_mt_free(gzip_mt_t *mt)
+{
+  if (!mt)
+    return NULL;
+
+  pthread_mutex_lock(&mt->lock);
+  mt->stop = true;
+  pthread_cond_broadcast(&mt->cond);
+  pthread_mutex_unlock(&mt->lock);
+
+  for (unsigned int i = 0; i < mt->nthreads; i++)
+    pthread_join(mt->threads[i], NULL);
+  if (mt->jobs)
+    for (unsigned int i = 0; i < mt->capacity; i++)
+      job_clear(&mt->jobs[i]);
+  if (mt->z_init)
+    inflateEnd(&mt->z);
+
+  pthread_cond_destroy(&mt->cond);
+  pthread_mutex_destroy(&mt->lock);
+  free(mt->jobs);
+  free(mt->threads);
+  free(mt->header_buf);
+  return mfree(mt);
+}
@@ -0,0 +1,233 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "basics.h"
+#include "logger.h"
+#include "image_cache.h"
+
+// name of the copy which gets written during the download
+#define IMAGE_CACHE_INCOMING ".incoming"
+// share of the file system the cache may use by default, in percent
+#define IMAGE_CACHE_DEFAULT_SHARE 80
+
+typedef struct {
+  char name[SHA256_HEX_SIZE];
+  struct timespec mtime;  // last use
+  uint64_t size;
+} cache_entry_t;
+
+static int
+cache_path(const char *dir, const uint8_t sha256[SHA256_DIGEST_SIZE],
+	   char **ret)
+{
+  char hex[SHA256_HEX_SIZE];
+
+  if (asprintf(ret, "%s/%s", dir, sha256_to_hex(sha256, hex)) < 0)
+    return -ENOMEM;
+  return 0;
+}
+
+// Only files named after a digest belong to the cache
+static bool
+is_cache_entry(const char *name)
+{
+  if (strlen(name) != SHA256_HEX_SIZE - 1)
+    return false;
+  return strspn(name, "0123456789abcdef") == SHA256_HEX_SIZE - 1;
+}
+
+int
+image_cache_lookup(const char *dir, const uint8_t sha256[SHA256_DIGEST_SIZE],
+		   char **ret_path)
+{
+  _cleanup_free_ char *path = NULL;
+  struct stat st;
+  int r;
+
+  r = cache_path(dir, sha256, &path);
+  if (r < 0)
+    return r;
+
+  if (stat(path, &st) < 0)
+    return errno == ENOENT ? 0 : -errno;
+  if (!S_ISREG(st.st_mode))
+    return 0;
+
+  // the modification time is the time of the last use
+  if (utimensat(AT_FDCWD, path, NULL, 0) < 0)
+    MSG_WARN("Cannot update the time of last use of '%s': %s", path,
+	     strerror(errno));
+
+  *ret_path = TAKE_PTR(path);
+  return 1;
+}
+
+int
+image_cache_prepare(const char *dir, char **ret_path)
+{
+  if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+    return -errno;
+
+  if (asprintf(ret_path, "%s/" IMAGE_CACHE_INCOMING, dir) < 0)
+    return -ENOMEM;
+  return 0;
+}
+
+static int
+cmp_last_use(const void *a, const void *b)
+{
+  const cache_entry_t *x = a;
+  const cache_entry_t *y = b;
+
+  if (x->mtime.tv_sec != y->mtime.tv_sec)
+    return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+  if (x->mtime.tv_nsec != y->mtime.tv_nsec)
+    return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : 1;
+  return 0;
+}
+
+// All images in the cache, the least recently used first
+static int
+read_entries(const char *dir, cache_entry_t **ret, size_t *ret_n)
+{
+  _cleanup_closedir_ DIR *d = NULL;
+  _cleanup_free_ cache_entry_t *entries = NULL;
+  size_t n = 0, allocated = 0;
+  struct dirent *de;
+
+  d = opendir(dir);
+  if (!d)
+    return -errno;
+
+  while ((de = readdir(d)))
+    {
+      struct stat st;
+
+      if (!is_cache_entry(de->d_name))
+	continue;
+      if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+	  !S_ISREG(st.st_mode))
+	continue;
+
+      if (n == allocated)
+	{
+	  size_t new_allocated = allocated ? allocated * 2 : 16;
+	  cache_entry_t *p = reallocarray(entries, new_allocated,
+					  sizeof(cache_entry_t));
+	  if (!p)
+	    return -ENOMEM;
+	  entries = p;
+	  allocated = new_allocated;
+	}
+      strcpy(entries[n].name, de->d_name);
+      entries[n].mtime = st.st_mtim;
+      entries[n].size = st.st_size;
+      n++;
+    }
+
+  if (n > 0)
+    qsort(entries, n, sizeof(cache_entry_t), cmp_last_use);
+
+  *ret = TAKE_PTR(entries);
+  *ret_n = n;
+  return 0;
+}
+
+int
+image_cache_add(const char *dir, const char *path,
+		const uint8_t sha256[SHA256_DIGEST_SIZE], uint64_t max_size)
+{
+  _cleanup_free_ cache_entry_t *entries = NULL;
+  _cleanup_free_ char *target = NULL;
+  _cleanup_close_ int dfd = -EBADF;
+  char hex[SHA256_HEX_SIZE];
+  uint64_t total = 0;
+  size_t n = 0;
+  struct stat st;
+  int r;
+
+  if (stat(path, &st) < 0)
+    return -errno;
+
+  if (max_size == 0)
+    {
+      struct statvfs sv;
+
+      if (statvfs(dir, &sv) < 0)
+	{
+	  r = -errno;
+	  goto fail;
+	}
+      max_size = (uint64_t)sv.f_blocks * sv.f_frsize *
+	IMAGE_CACHE_DEFAULT_SHARE / 100;
+    }
+
+  if ((uint64_t)st.st_size > max_size)
+    {
+      MSG_INFO("Image with %" PRIu64 " bytes is too large for the cache",
+	       (uint64_t)st.st_size);
+      r = -EFBIG;
+      goto fail;
+    }
+
+  dfd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if (dfd < 0)
+    {
+      r = -errno;
+      goto fail;
+    }
+  r = read_entries(dir, &entries, &n);
+  if (r < 0)
+    goto fail;
+
+  sha256_to_hex(sha256, hex);
+  for (size_t i = 0; i < n; i++)
+    {
+      // an old copy of the same image gets replaced
+      if (streq(entries[i].name, hex))
+	entries[i].size = 0;
+      total += entries[i].size;
+    }
+
+  for (size_t i = 0; i < n && total + st.st_size > max_size; i++)
+    {
+      if (entries[i].size == 0)
+	continue;
+      if (unlinkat(dfd, entries[i].name, 0) < 0)
+	{
+	  MSG_WARN("Cannot remove '%s/%s' from the cache: %s", dir,
+		   entries[i].name, strerror(errno));
+	  continue;
+	}
+      MSG_INFO("Removed least recently used image '%s' from the cache",
+	       entries[i].name);
+      total -= entries[i].size;
+    }
+
+  r = cache_path(dir, sha256, &target);
+  if (r < 0)
+    goto fail;
+  if (rename(path, target) < 0)
+    {
+      r = -errno;
+      goto fail;
+    }
+
+  MSG_INFO("Stored image as '%s' in the cache", target);
+  return 0;
+
+ fail:
+  unlink(path);
+  return r;
+}
@@ -0,0 +1,4696 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <sys/socket.h>
+#include <linux/fs.h>
+#include <curl/curl.h>
+#if HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "basics.h"
+#include "logger.h"
+#include "decompress.h"
+#include "image_writer.h"
+#include "multicast.h"
+
+// O_DIRECT requires aligned buffers, offsets and sizes; the buffers are
+// aligned for every device, the offsets and sizes per device
+#define IW_ALIGN 4096
+// Granularity of the zero block detection
+#define IW_SPARSE_BLOCK (64 * 1024)
+// Shorter runs of zeros are written, longer ones get zeroed by the device
+#define IW_SPARSE_MIN (1024 * 1024)
+// Upper limit for the delay between download retries in seconds
+#define IW_RETRY_MAX_DELAY 30
+// Granularity of the read back verification
+#define IW_VERIFY_EXTENT (1024 * 1024)
+// Default size of one io_uring write request, a buffer is written by several
+#define IW_URING_CHUNK (1024 * 1024)
+// Lost multicast packets get requested again after this many milliseconds
+#define IW_MCAST_NAK_INTERVAL 100
+// Multicast packets received with one system call
+#define IW_MCAST_BATCH 32
+// A failing pipeline stops the discard of a device after this many bytes
+#define IW_DISCARD_STEP (1024ULL * 1024 * 1024)
+// buffer pools of at least this size get backed by huge pages
+#define IW_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+typedef struct {
+  uint8_t *data;
+  size_t len;
+  size_t chunk;           // in the chunk index, only set with one
+  unsigned int refs;      // stages which still need the buffer
+} iw_buf_t;
+
+// write request in flight
+typedef struct {
+  iw_buf_t *buf;
+  const uint8_t *data;
+  size_t len;
+  off_t offset;
+} iw_write_t;
+
+typedef struct iw_ctx iw_ctx_t;
+
+// FIFO of buffers, capacity is the number of buffers in the ring,
+// so push never blocks.
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  iw_buf_t **items;
+  unsigned int capacity;
+  unsigned int head;
+  unsigned int count;
+  bool closed;    // producer is done, no more items will follow
+  bool aborted;   // pipeline failed, consumers should stop
+} bufqueue_t;
+
+// target device with its own write stage
+typedef struct {
+  iw_ctx_t *ctx;
+  const char *path;
+  iw_device_params_t params;
+  int fd;
+  bool direct;
+  bool is_blkdev;
+  bufqueue_t full;        // buffers to write
+  int error;              // first error of this device
+  uint64_t written;       // bytes processed by the write stage
+  uint64_t wait_in;       // usec blocked waiting for buffers
+  uint64_t wait_out;      // usec blocked waiting for the device
+  uint64_t sparse_bytes;
+  uint64_t unmapped_bytes;
+
+  // state of the write stage
+  iw_buf_t *wbuf;         // buffer which gets written
+  off_t zero_start;
+  uint64_t zero_len;      // pending run of zeros
+  size_t range;           // current range of the block map
+  sha256_ctx_t range_sha256;
+  bool warned_unmapped;
+#if HAVE_LIBURING
+  struct io_uring ring;
+  bool uring;             // writes get submitted with io_uring
+  bool fixed;             // the buffers are registered with the ring
+  iw_write_t *writes;     // one per queue entry
+  unsigned int *free_writes;
+  unsigned int nfree;
+  unsigned int inflight;
+#endif
+
+  size_t verify_next;     // next extent to read back
+
+  // with a chunk index: bitmap of the chunks which differ from the device
+  uint64_t *differs;
+  size_t compare_next;    // next chunk to compare
+  uint64_t unchanged_bytes;
+} iw_dev_t;
+
+struct iw_ctx {
+  const char *url;
+  const iw_options_t *opts;
+  compression_t compression;
+
+  int src_fd;     // local image
+  CURL *curl;     // network image
+  int mcast_fd;   // multicast image
+  uint32_t mcast_session;
+  struct sockaddr_in mcast_sender; // NAK and DONE go there
+  mcast_info_t mcast_info;
+  // parallel download with range requests, every request fills one buffer
+  unsigned int streams;   // 0 if the image is downloaded as single stream
+  // number of buffers used for reordering, 0 if the data arrives in order
+  unsigned int window;
+  char *range_url;        // URL after following redirects
+  char *validator;        // ETag or Last-Modified of the image, for If-Range
+  struct curl_slist *validator_headers;
+  // target devices, all get the same data
+  iw_dev_t *devs;
+  unsigned int ndevs;
+  unsigned int failed_devs;
+  uint8_t *zero_buf;     // IW_SPARSE_MIN zeros for short zero runs
+
+  iw_buf_t *bufs;
+  unsigned int nbufs;
+  uint8_t *pool;          // memory of all buffers
+  size_t pool_size;
+  uint64_t decoder_memory; // for the decoder threads, 0 without limit
+  // compressed data: source -> decompress
+  bufqueue_t comp_free, comp_full;
+  // decompressed data: decompress -> write, every device has its own
+  // queue of full buffers
+  bufqueue_t raw_free;
+  // with a manifest the image as written passes the check stage first
+  bufqueue_t check_full;
+  const chunk_index_t *manifest;
+  unsigned int refetched; // chunks which had to be read again
+  // output queues of the source stage, src_full is NULL without decoder
+  bufqueue_t *src_free, *src_full;
+  // buffers to hash, shared with the decompress resp. write stage
+  bufqueue_t hash_full, hash_output_full;
+  bool hash_output;       // decompressed data gets hashed separately
+  // copy of the image as read, shared with the hash stage
+  bufqueue_t copy_full;
+  int copy_fd;            // -EBADF without copy
+  int copy_error;         // the copy is incomplete
+
+  // digests of the written image in IW_VERIFY_EXTENT pieces
+  uint8_t (*extents)[SHA256_DIGEST_SIZE];
+  size_t nextents;
+  size_t extents_allocated;
+  uint64_t output_size;
+  sha256_ctx_t extent_sha256;
+  // extents to read back, NULL if all
+  uint64_t *verify_list;
+  size_t verify_count;
+  size_t verify_next;
+  uint64_t verify_size;
+
+  // chunks of the chunk index which differ on at least one device,
+  // only the first of the chunks with the same content gets fetched
+  uint64_t *fetch;
+  size_t *dup_next;       // next chunk with the same content, or SIZE_MAX
+  uint64_t compare_size;
+  uint64_t cached_bytes;  // found in the chunk cache
+  int cache_error;        // storing chunks in the cache failed
+
+  iw_buf_t *cur;  // buffer curl is currently filling
+  sha256_ctx_t sha256;
+  sha256_ctx_t output_sha256;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  unsigned int running;
+  // the devices may get written, see iw_options_t.gate
+  bool gate_open;
+  pthread_cond_t gate_cond;
+  int error;
+  char *errmsg;
+
+  uint64_t start;
+  uint64_t stage_start[_IW_STAGE_MAX];
+  uint64_t stage_end[_IW_STAGE_MAX];
+  uint64_t stage_bytes[_IW_STAGE_MAX];
+  // only the decompress stage changes the size of the data
+  uint64_t decompress_in;
+  // usec the stages were blocked on their input and output queues
+  uint64_t stage_wait_in[_IW_STAGE_MAX];
+  uint64_t stage_wait_out[_IW_STAGE_MAX];
+  uint64_t stage_cpu[_IW_STAGE_MAX];
+  uint64_t source_size;
+  unsigned int retries;
+  // end of the image if known in advance, the devices get discarded
+  // behind it while writing, else after writing
+  uint64_t discard_start;
+};
+
+// one of the parallel range requests
+typedef struct {
+  iw_ctx_t *ctx;
+  CURL *curl;
+  iw_buf_t *buf;          // NULL if no chunk is assigned
+  uint64_t chunk;         // index of the requested chunk
+  uint64_t start;         // offset of the chunk in the image file
+  size_t expected;        // with url the size of the buffer
+  char *url;              // complete file instead of a range, optional
+  bool active;            // added to the multi handle
+  unsigned int tries;     // retries of this chunk
+  uint64_t retry_at;      // time in usec to resume the chunk
+} iw_segment_t;
+
+static inline bool
+bit_test(const uint64_t *map, uint64_t i)
+{
+  return map[i / 64] & (UINT64_C(1) << (i % 64));
+}
+
+static uint64_t
+now_usec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+iw_options_init(iw_options_t *opts)
+{
+  memset(opts, 0, sizeof(*opts));
+  opts->buffer_size = 4 * 1024 * 1024;
+  opts->buffers = 4;
+  opts->progress_interval = 500;
+  opts->log_interval = 5000;
+  opts->sparse = true;
+  opts->discard = true;
+  opts->download_streams = 4;
+  opts->download_window = 32 * 1024 * 1024;
+  opts->download_retries = 5;
+  opts->verify = IW_VERIFY_NONE;
+  opts->verify_samples = 256;
+  opts->verify_threads = 4;
+  opts->write_queue_depth = 8;
+  opts->decompress_threads = 0;
+}
+
+void
+iw_device_params_init(const iw_options_t *opts, iw_device_params_t *params)
+{
+  params->alignment = IW_ALIGN;
+  params->max_write = IW_URING_CHUNK;
+  params->queue_depth = opts->write_queue_depth;
+  params->direct = true;
+}
+
+static bool
+iw_device_params_valid(const iw_device_params_t *params)
+{
+  unsigned int a = params->alignment;
+
+  return a >= 512 && a <= IW_ALIGN && (a & (a - 1)) == 0 &&
+    params->max_write >= a && params->max_write % a == 0;
+}
+
+const char *
+iw_stage_to_string(iw_stage_t stage)
+{
+  switch (stage)
+    {
+    case IW_STAGE_SOURCE:     return "source";
+    case IW_STAGE_DECOMPRESS: return "decompress";
+    case IW_STAGE_WRITE:      return "write";
+    case IW_STAGE_HASH:       return "hash";
+    case IW_STAGE_HASH_OUTPUT: return "hash-output";
+    case IW_STAGE_VERIFY:     return "verify";
+    case IW_STAGE_COPY:       return "copy";
+    case IW_STAGE_COMPARE:    return "compare";
+    case IW_STAGE_DISCARD:    return "discard";
+    case IW_STAGE_CHECK:      return "check";
+    default:                  return "unknown";
+    }
+}
+
+double
+iw_mb_per_sec(uint64_t bytes, uint64_t usec)
+{
+  if (usec == 0)
+    return 0.0;
+  return (double)bytes / (double)usec; // bytes/usec == MB/s
+}
+
+const char *
+iw_verify_to_string(iw_verify_t verify)
+{
+  switch (verify)
+    {
+    case IW_VERIFY_NONE:      return "none";
+    case IW_VERIFY_READBACK:  return "readback";
+    case IW_VERIFY_SAMPLE:    return "sample";
+    default:                  return "unknown";
+    }
+}
+
+int
+iw_verify_from_string(const char *s, iw_verify_t *ret)
+{
+  for (iw_verify_t v = IW_VERIFY_NONE; v <= IW_VERIFY_SAMPLE; v++)
+    if (streq(s, iw_verify_to_string(v)))
+      {
+	*ret = v;
+	return 0;
+      }
+  return -EINVAL;
+}
+
+/*
+ * buffer queues
+ */
+
+static int
+bufqueue_init(bufqueue_t *q, unsigned int capacity)
+{
+  memset(q, 0, sizeof(*q));
+  q->items = calloc(capacity, sizeof(iw_buf_t *));
+  if (!q->items)
+    return -ENOMEM;
+  q->capacity = capacity;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->cond, NULL);
+  return 0;
+}
+
+static void
+bufqueue_destroy(bufqueue_t *q)
+{
+  if (!q->items)
+    return;
+  pthread_cond_destroy(&q->cond);
+  pthread_mutex_destroy(&q->lock);
+  q->items = mfree(q->items);
+}
+
+static void
+bufqueue_push(bufqueue_t *q, iw_buf_t *b)
+{
+  pthread_mutex_lock(&q->lock);
+  q->items[(q->head + q->count) % q->capacity] = b;
+  q->count++;
+  pthread_cond_signal(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+}
+
+/* Returns NULL if the queue is closed and empty or the pipeline got
+   aborted. The time spent waiting gets added to blocked, which shows
+   which stage is the bottleneck. */
+static iw_buf_t *
+bufqueue_pop(bufqueue_t *q, uint64_t *blocked)
+{
+  iw_buf_t *b = NULL;
+
+  pthread_mutex_lock(&q->lock);
+  if (q->count == 0 && !q->closed && !q->aborted)
+    {
+      uint64_t start = now_usec();
+
+      while (q->count == 0 && !q->closed && !q->aborted)
+	pthread_cond_wait(&q->cond, &q->lock);
+      __atomic_add_fetch(blocked, now_usec() - start, __ATOMIC_RELAXED);
+    }
+  if (q->count > 0 && !q->aborted)
+    {
+      b = q->items[q->head];
+      q->head = (q->head + 1) % q->capacity;
+      q->count--;
+    }
+  pthread_mutex_unlock(&q->lock);
+
+  return b;
+}
+
+// Like bufqueue_pop, but returns NULL instead of waiting
+static iw_buf_t *
+bufqueue_trypop(bufqueue_t *q)
+{
+  iw_buf_t *b = NULL;
+
+  pthread_mutex_lock(&q->lock);
+  if (q->count > 0 && !q->aborted)
+    {
+      b = q->items[q->head];
+      q->head = (q->head + 1) % q->capacity;
+      q->count--;
+    }
+  pthread_mutex_unlock(&q->lock);
+
+  return b;
+}
+
+static void
+bufqueue_close(bufqueue_t *q, bool abort)
+{
+  pthread_mutex_lock(&q->lock);
+  q->closed = true;
+  if (abort)
+    q->aborted = true;
+  pthread_cond_broadcast(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+}
+
+/* A filled buffer is used by the next stage and a hash thread, the last
+   one returns it to the free queue. */
+static void
+iw_buf_put(bufqueue_t *free_q, iw_buf_t *b)
+{
+  if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    bufqueue_push(free_q, b);
+}
+
+/*
+ * error handling
+ */
+
+static void
+iw_abort(iw_ctx_t *ctx)
+{
+  bufqueue_t *queues[] = { &ctx->comp_free, &ctx->comp_full,
+			   &ctx->raw_free, &ctx->check_full,
+			   &ctx->hash_full, &ctx->hash_output_full,
+			   &ctx->copy_full };
+
+  for (size_t i = 0; i < sizeof(queues)/sizeof(queues[0]); i++)
+    if (queues[i]->items)
+      bufqueue_close(queues[i], true);
+  for (unsigned int i = 0; i < ctx->ndevs; i++)
+    if (ctx->devs[i].full.items)
+      bufqueue_close(&ctx->devs[i].full, true);
+}
+
+// Remembers the first error and stops all stages
+static int
+iw_fail(iw_ctx_t *ctx, int r, const char *fmt, ...)
+{
+  va_list ap;
+
+  pthread_mutex_lock(&ctx->lock);
+  if (ctx->error == 0)
+    {
+      ctx->error = r;
+      va_start(ap, fmt);
+      if (vasprintf(&ctx->errmsg, fmt, ap) < 0)
+	ctx->errmsg = NULL;
+      va_end(ap);
+      MSG_ERROR("%s", strna(ctx->errmsg));
+    }
+  pthread_mutex_unlock(&ctx->lock);
+
+  iw_abort(ctx);
+
+  // wakes up the stages waiting for the gate
+  pthread_mutex_lock(&ctx->lock);
+  pthread_cond_broadcast(&ctx->gate_cond);
+  pthread_mutex_unlock(&ctx->lock);
+
+  return r;
+}
+
+// Blocks until the devices may get written, returns 0 or the error
+static int
+iw_gate_wait(iw_ctx_t *ctx)
+{
+  int r;
+
+  pthread_mutex_lock(&ctx->lock);
+  while (!ctx->gate_open && ctx->error == 0)
+    pthread_cond_wait(&ctx->gate_cond, &ctx->lock);
+  r = ctx->error;
+  pthread_mutex_unlock(&ctx->lock);
+
+  return r;
+}
+
+static bool
+iw_failed(iw_ctx_t *ctx)
+{
+  bool failed;
+
+  pthread_mutex_lock(&ctx->lock);
+  failed = ctx->error != 0;
+  pthread_mutex_unlock(&ctx->lock);
+
+  return failed;
+}
+
+static void
+stage_begin(iw_ctx_t *ctx, iw_stage_t stage)
+{
+  __atomic_store_n(&ctx->stage_start[stage], now_usec(), __ATOMIC_RELAXED);
+}
+
+static void
+stage_add(iw_ctx_t *ctx, iw_stage_t stage, uint64_t bytes)
+{
+  __atomic_add_fetch(&ctx->stage_bytes[stage], bytes, __ATOMIC_RELAXED);
+}
+
+static void
+stage_stop(iw_ctx_t *ctx, iw_stage_t stage)
+{
+  __atomic_store_n(&ctx->stage_end[stage], now_usec(), __ATOMIC_RELAXED);
+}
+
+// Every stage thread ends with this
+static void
+stage_end(iw_ctx_t *ctx, iw_stage_t stage)
+{
+  struct timespec ts;
+
+  stage_stop(ctx, stage);
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+    __atomic_add_fetch(&ctx->stage_cpu[stage], (uint64_t)ts.tv_sec * 1000000 +
+		       ts.tv_nsec / 1000, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&ctx->lock);
+  ctx->running--;
+  pthread_cond_signal(&ctx->cond);
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+static void
+iw_get_stats(iw_ctx_t *ctx, iw_stats_t *stats)
+{
+  uint64_t now = now_usec();
+
+  for (int i = 0; i < _IW_STAGE_MAX; i++)
+    {
+      uint64_t start = __atomic_load_n(&ctx->stage_start[i], __ATOMIC_RELAXED);
+      uint64_t end = __atomic_load_n(&ctx->stage_end[i], __ATOMIC_RELAXED);
+
+      stats->stage[i].bytes = __atomic_load_n(&ctx->stage_bytes[i], __ATOMIC_RELAXED);
+      stats->stage[i].bytes_in = stats->stage[i].bytes;
+      if (start == 0)
+	stats->stage[i].usec = 0;
+      else
+	stats->stage[i].usec = (end ? end : now) - start;
+      stats->stage[i].cpu_usec =
+	__atomic_load_n(&ctx->stage_cpu[i], __ATOMIC_RELAXED);
+      stats->stage[i].wait_in_usec =
+	__atomic_load_n(&ctx->stage_wait_in[i], __ATOMIC_RELAXED);
+      stats->stage[i].wait_out_usec =
+	__atomic_load_n(&ctx->stage_wait_out[i], __ATOMIC_RELAXED);
+      stats->stage[i].mb_per_sec = iw_mb_per_sec(stats->stage[i].bytes,
+						 stats->stage[i].usec);
+    }
+  stats->stage[IW_STAGE_DECOMPRESS].bytes_in =
+    __atomic_load_n(&ctx->decompress_in, __ATOMIC_RELAXED);
+  stats->source_size = __atomic_load_n(&ctx->source_size, __ATOMIC_RELAXED);
+  // the devices get the same data, report the slowest one
+  stats->sparse_bytes = 0;
+  stats->unmapped_bytes = 0;
+  stats->unchanged_bytes = 0;
+  stats->stage[IW_STAGE_WRITE].bytes = UINT64_MAX;
+  for (unsigned int i = 0; i < ctx->ndevs; i++)
+    {
+      iw_dev_t *dev = &ctx->devs[i];
+      iw_stage_stats_t *wr = &stats->stage[IW_STAGE_WRITE];
+      uint64_t v;
+
+      if (__atomic_load_n(&dev->error, __ATOMIC_RELAXED) != 0)
+	continue;
+      v = __atomic_load_n(&dev->written, __ATOMIC_RELAXED);
+      if (v < wr->bytes)
+	{
+	  wr->bytes = wr->bytes_in = v;
+	  wr->wait_in_usec = __atomic_load_n(&dev->wait_in, __ATOMIC_RELAXED);
+	  wr->wait_out_usec = __atomic_load_n(&dev->wait_out, __ATOMIC_RELAXED);
+	  wr->mb_per_sec = iw_mb_per_sec(v, wr->usec);
+	}
+      v = __atomic_load_n(&dev->sparse_bytes, __ATOMIC_RELAXED);
+      if (v > stats->sparse_bytes)
+	stats->sparse_bytes = v;
+      v = __atomic_load_n(&dev->unmapped_bytes, __ATOMIC_RELAXED);
+      if (v > stats->unmapped_bytes)
+	stats->unmapped_bytes = v;
+      v = __atomic_load_n(&dev->unchanged_bytes, __ATOMIC_RELAXED);
+      if (v > stats->unchanged_bytes)
+	stats->unchanged_bytes = v;
+    }
+  if (stats->stage[IW_STAGE_WRITE].bytes == UINT64_MAX)
+    stats->stage[IW_STAGE_WRITE].bytes = stats->stage[IW_STAGE_WRITE].bytes_in = 0;
+  stats->retries = __atomic_load_n(&ctx->retries, __ATOMIC_RELAXED);
+  stats->verify_size = __atomic_load_n(&ctx->verify_size, __ATOMIC_RELAXED);
+  stats->compare_size = __atomic_load_n(&ctx->compare_size, __ATOMIC_RELAXED);
+  stats->usec = now - ctx->start;
+}
+
+/*
+ * source stage
+ */
+
+// Passes a buffer of the image as written on to all devices
+static void
+dev_push(iw_ctx_t *ctx, iw_buf_t *b)
+{
+  for (unsigned int i = 0; i < ctx->ndevs; i++)
+    bufqueue_push(&ctx->devs[i].full, b);
+}
+
+static void
+dev_close(iw_ctx_t *ctx)
+{
+  for (unsigned int i = 0; i < ctx->ndevs; i++)
+    bufqueue_close(&ctx->devs[i].full, false);
+}
+
+// Passes a buffer of the image as written on to the output hash and
+// all devices
+static void
+out_push(iw_ctx_t *ctx, iw_buf_t *b)
+{
+  if (ctx->hash_output)
+    bufqueue_push(&ctx->hash_output_full, b);
+  dev_push(ctx, b);
+}
+
+static void
+out_close(iw_ctx_t *ctx)
+{
+  bufqueue_close(&ctx->hash_output_full, false);
+  dev_close(ctx);
+}
+
+// With a manifest the check stage passes the buffer on after verifying it
+static void
+out_emit(iw_ctx_t *ctx, iw_buf_t *b)
+{
+  if (ctx->manifest)
+    bufqueue_push(&ctx->check_full, b);
+  else
+    out_push(ctx, b);
+}
+
+static void
+out_finish(iw_ctx_t *ctx)
+{
+  if (ctx->manifest)
+    bufqueue_close(&ctx->check_full, false);
+  else
+    out_close(ctx);
+}
+
+// Passes a buffer of the image as read on to the hash and the copy
+// thread and to the decoder resp. the output
+static void
+src_push(iw_ctx_t *ctx, iw_buf_t *b)
+{
+  bufqueue_push(&ctx->hash_full, b);
+  if (ctx->copy_fd >= 0)
+    bufqueue_push(&ctx->copy_full, b);
+  if (ctx->src_full)
+    bufqueue_push(ctx->src_full, b);
+  else
+    out_push(ctx, b);
+}
+
+static void
+src_push_close(iw_ctx_t *ctx)
+{
+  bufqueue_close(&ctx->hash_full, false);
+  if (ctx->copy_fd >= 0)
+    bufqueue_close(&ctx->copy_full, false);
+  if (ctx->src_full)
+    bufqueue_close(ctx->src_full, false);
+  else
+    out_close(ctx);
+}
+
+/* Passes a filled buffer on to the next stage(s). Without decoder the
+   check stage gets the image as read first, it replaces broken chunks
+   before the hash and the copy thread see them. */
+static void
+src_emit(iw_ctx_t *ctx, iw_buf_t *b)
+{
+  b->refs = 1 + (ctx->copy_fd >= 0) + (ctx->src_full ? 1 :
+					ctx->ndevs + (ctx->hash_output ? 1 : 0));
+  if (ctx->manifest && !ctx->src_full)
+    bufqueue_push(&ctx->check_full, b);
+  else
+    src_push(ctx, b);
+}
+
+static void
+src_close(iw_ctx_t *ctx)
+{
+  if (ctx->manifest && !ctx->src_full)
+    bufqueue_close(&ctx->check_full, false);
+  else
+    src_push_close(ctx);
+}
+
+static size_t
+curl_write_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+  iw_ctx_t *ctx = userdata;
+  size_t total = size * nmemb;
+  size_t done = 0;
+
+  while (done < total)
+    {
+      if (!ctx->cur)
+	{
+	  ctx->cur = bufqueue_pop(ctx->src_free,
+				  &ctx->stage_wait_out[IW_STAGE_SOURCE]);
+	  if (!ctx->cur)
+	    return 0; // aborted, let curl fail with CURLE_WRITE_ERROR
+	  ctx->cur->len = 0;
+	}
+
+      size_t n = ctx->opts->buffer_size - ctx->cur->len;
+      if (n > total - done)
+	n = total - done;
+      memcpy(ctx->cur->data + ctx->cur->len, ptr + done, n);
+      ctx->cur->len += n;
+      done += n;
+
+      if (ctx->cur->len == ctx->opts->buffer_size)
+	{
+	  src_emit(ctx, ctx->cur);
+	  ctx->cur = NULL;
+	}
+    }
+
+  stage_add(ctx, IW_STAGE_SOURCE, total);
+
+  return total;
+}
+
+static int
+curl_xferinfo_cb(void *userdata, curl_off_t dltotal, curl_off_t _unused_ dlnow,
+		 curl_off_t _unused_ ultotal, curl_off_t _unused_ ulnow)
+{
+  iw_ctx_t *ctx = userdata;
+
+  // with range requests dltotal is the size of the range
+  if (dltotal > 0 && ctx->streams == 0 && ctx->retries == 0)
+    __atomic_store_n(&ctx->source_size, (uint64_t)dltotal, __ATOMIC_RELAXED);
+
+  // non-zero aborts the transfer
+  return iw_failed(ctx) ? 1 : 0;
+}
+
+/* Transfers share the DNS cache and the TLS sessions of the session of
+   the caller, if there is one. HTTP/2 gets used if the server offers it. */
+static void
+iw_curl_defaults(iw_ctx_t *ctx, CURL *curl)
+{
+  if (ctx->opts->curl_share)
+    curl_easy_setopt(curl, CURLOPT_SHARE, ctx->opts->curl_share);
+  curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+}
+
+static CURL *
+iw_curl_new(iw_ctx_t *ctx)
+{
+  CURL *curl = curl_easy_init();
+
+  if (curl)
+    iw_curl_defaults(ctx, curl);
+  return curl;
+}
+
+// The handle keeps its connection open for the next request
+static void
+iw_curl_reset(iw_ctx_t *ctx, CURL *curl)
+{
+  curl_easy_reset(curl);
+  iw_curl_defaults(ctx, curl);
+}
+
+static void
+iw_setup_curl(iw_ctx_t *ctx, CURL *curl, const char *url)
+{
+  curl_easy_setopt(curl, CURLOPT_URL, url);
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(curl, CURLOPT_BUFFERSIZE, 512L * 1024);
+  curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+  curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, curl_xferinfo_cb);
+  curl_easy_setopt(curl, CURLOPT_XFERINFODATA, ctx);
+  // abort stalled transfers instead of hanging forever
+  curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+  curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 60L);
+}
+
+// Network errors and server overload are worth another try
+static bool
+iw_retriable(CURL *curl, CURLcode res)
+{
+  long code = 0;
+
+  switch (res)
+    {
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_SSL_CONNECT_ERROR:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+      return true;
+    case CURLE_HTTP_RETURNED_ERROR:
+      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+      return code >= 500 || code == 408 || code == 429;
+    default:
+      return false;
+    }
+}
+
+// 1, 2, 4, ... seconds
+static uint64_t
+iw_retry_delay(unsigned int attempt)
+{
+  uint64_t delay = attempt < 5 ? 1U << attempt : IW_RETRY_MAX_DELAY;
+
+  if (delay > IW_RETRY_MAX_DELAY)
+    delay = IW_RETRY_MAX_DELAY;
+  return delay * 1000000;
+}
+
+// Returns false if the pipeline failed while waiting
+static bool
+iw_retry_wait(iw_ctx_t *ctx, unsigned int attempt)
+{
+  uint64_t end = now_usec() + iw_retry_delay(attempt);
+
+  while (now_usec() < end)
+    {
+      if (iw_failed(ctx))
+	return false;
+      usleep(100000);
+    }
+  return !iw_failed(ctx);
+}
+
+/* Remembers ETag or Last-Modified of the image, so that a resumed
+   download and the chunks of a parallel download can make sure with
+   If-Range that the image did not change. Header lines are not NUL
+   terminated. */
+static size_t
+curl_validator_cb(char *buffer, size_t size, size_t nitems, void *userdata)
+{
+  iw_ctx_t *ctx = userdata;
+  size_t len = size * nitems;
+  const char *keys[] = { "etag:", "last-modified:" };
+
+  // only the first, complete response is of interest, every response
+  // of a redirect chain starts with a status line
+  if (ctx->retries > 0)
+    return len;
+  if (len >= 5 && strneq(buffer, "HTTP/", 5))
+    {
+      ctx->validator = mfree(ctx->validator);
+      return len;
+    }
+
+  for (size_t i = 0; i < sizeof(keys)/sizeof(keys[0]); i++)
+    {
+      size_t klen = strlen(keys[i]);
+
+      // prefer the ETag
+      if (i > 0 && ctx->validator)
+	break;
+      if (len > klen && strncaseeq(buffer, keys[i], klen))
+	{
+	  const char *v = buffer + klen;
+	  size_t vlen = len - klen;
+
+	  while (vlen > 0 && (*v == ' ' || *v == '\t'))
+	    {
+	      v++;
+	      vlen--;
+	    }
+	  while (vlen > 0 && (v[vlen - 1] == '\r' || v[vlen - 1] == '\n'))
+	    vlen--;
+	  // weak ETags cannot be used for If-Range
+	  if (vlen == 0 || startswith(v, "W/"))
+	    break;
+
+	  free(ctx->validator);
+	  if (asprintf(&ctx->validator, "If-Range: %.*s", (int)vlen, v) < 0)
+	    ctx->validator = NULL;
+	  break;
+	}
+    }
+
+  return len;
+}
+
+// The If-Range header for requests of parts of the image
+static struct curl_slist *
+iw_validator_headers(iw_ctx_t *ctx)
+{
+  if (!ctx->validator_headers)
+    ctx->validator_headers = curl_slist_append(NULL, ctx->validator);
+  return ctx->validator_headers;
+}
+
+/* Prepares the handle to continue the download at offset. The decoder
+   state is still in memory, so the stream is simply continued and nothing
+   already written gets downloaded or written again. */
+static int
+iw_prepare_resume(iw_ctx_t *ctx, CURL *curl, uint64_t offset)
+{
+  char *url = NULL;
+
+  // resume on the same mirror, other mirrors have other ETags
+  if (curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url) == CURLE_OK && url)
+    {
+      _cleanup_free_ char *effective_url = strdup(url);
+      if (!effective_url)
+	return -ENOMEM;
+      curl_easy_setopt(curl, CURLOPT_URL, effective_url);
+    }
+
+  if (!iw_validator_headers(ctx))
+    return -ENOMEM;
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, ctx->validator_headers);
+
+  /* A server not supporting ranges, or an image changed since the first
+     request (If-Range), results in a complete response, which curl
+     reports as CURLE_RANGE_ERROR. */
+  curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE, (curl_off_t)offset);
+
+  return 0;
+}
+
+static void *
+source_net_thread(void *arg)
+{
+  iw_ctx_t *ctx = arg;
+  CURLcode res;
+
+  stage_begin(ctx, IW_STAGE_SOURCE);
+
+  iw_setup_curl(ctx, ctx->curl, ctx->url);
+  curl_easy_setopt(ctx->curl, CURLOPT_WRITEFUNCTION, curl_write_cb);
+  curl_easy_setopt(ctx->curl, CURLOPT_WRITEDATA, ctx);
+  curl_easy_setopt(ctx->curl, CURLOPT_HEADERFUNCTION, curl_validator_cb);
+  curl_easy_setopt(ctx->curl, CURLOPT_HEADERDATA, ctx);
+
+  for (unsigned int attempt = 0; ; attempt++)
+    {
+      uint64_t offset;
+
+      res = curl_easy_perform(ctx->curl);
+      if (res == CURLE_OK || iw_failed(ctx))
+	break;
+
+      // every received byte was passed on, continue behind them
+      offset = __atomic_load_n(&ctx->stage_bytes[IW_STAGE_SOURCE],
+			       __ATOMIC_RELAXED);
+      if (attempt >= ctx->opts->download_retries ||
+	  !iw_retriable(ctx->curl, res))
+	break;
+      /* Without validator a changed image cannot be detected, its new
+	 data would be appended to the old one. */
+      if (!ctx->validator)
+	{
+	  iw_fail(ctx, -EIO, "Download of '%s' interrupted at offset %" PRIu64
+		  " (%s), cannot resume without ETag or Last-Modified",
+		  ctx->url, offset, curl_easy_strerror(res));
+	  break;
+	}
+
+      MSG_WARN("Download of '%s' interrupted at offset %" PRIu64 " (%s), resuming",
+	       ctx->url, offset, curl_easy_strerror(res));
+      __atomic_add_fetch(&ctx->retries, 1, __ATOMIC_RELAXED);
+
+      if (!iw_retry_wait(ctx, attempt))
+	break;
+      if (iw_prepare_resume(ctx, ctx->curl, offset) < 0)
+	{
+	  iw_fail(ctx, -ENOMEM, "Cannot resume download: %s", strerror(ENOMEM));
+	  break;
+	}
+    }
+
+  if (res != CURLE_OK)
+    {
+      if (!iw_failed(ctx))
+	iw_fail(ctx, -EIO, "Downloading '%s' failed: %s", ctx->url,
+		curl_easy_strerror(res));
+    }
+  else if (ctx->cur)
+    {
+      src_emit(ctx, ctx->cur);
+      ctx->cur = NULL;
+    }
+
+  src_close(ctx);
+  stage_end(ctx, IW_STAGE_SOURCE);
+
+  return NULL;
+}
+
+static void *
+source_file_thread(void *arg)
+{
+  iw_ctx_t *ctx = arg;
+  iw_buf_t *b;
+  bool eof = false;
+
+  stage_begin(ctx, IW_STAGE_SOURCE);
+
+  while (!eof && (b = bufqueue_pop(ctx->src_free,
+				    &ctx->stage_wait_out[IW_STAGE_SOURCE])))
+    {
+      b->len = 0;
+      // always fill complete buffers, the write stage depends on it
+      while (b->len < ctx->opts->buffer_size)
+	{
+	  ssize_t n = read(ctx->src_fd, b->data + b->len,
+			   ctx->opts->buffer_size - b->len);
+	  if (n < 0)
+	    {
+	      if (errno == EINTR)
+		continue;
+	      iw_fail(ctx, -errno, "Reading '%s' failed: %s", ctx->url,
+		      strerror(errno));
+	      goto out;
+	    }
+	  if (n == 0)
+	    {
+	      eof = true;
+	      break;
+	    }
+	  b->len += n;
+	}
+
+      stage_add(ctx, IW_STAGE_SOURCE, b->len);
+
+      if (b->len > 0)
+	src_emit(ctx, b);
+      else
+	bufqueue_push(ctx->src_free, b);
+    }
+
+ out:
+  src_close(ctx);
+  stage_end(ctx, IW_STAGE_SOURCE);
+
+  return NULL;
+}
+
+static size_t
+segment_write_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+  iw_segment_t *seg = userdata;
+  size_t total = size * nmemb;
+
+  // more data than requested: the server ignored the range
+  if (seg->buf->len + total > seg->expected)
+    return 0;
+
+  memcpy(seg->buf->data + seg->buf->len, ptr, total);
+  seg->buf->len += total;
+  stage_add(seg->ctx, IW_STAGE_SOURCE, total);
+
+  return total;
+}
+
+// Requests the part of the chunk which is not yet in the buffer
+static int
+segment_request(iw_segment_t *seg, CURLM *multi)
+{
+  char range[64];
+
+  snprintf(range, sizeof(range), "%" PRIu64 "-%" PRIu64,
+	   seg->start + seg->buf->len, seg->start + seg->expected - 1);
+
+  if (seg->url)
+    {
+      // a file gets downloaded again from the start
+      seg->buf->len = 0;
+      curl_easy_setopt(seg->curl, CURLOPT_URL, seg->url);
+    }
+  else
+    curl_easy_setopt(seg->curl, CURLOPT_RANGE, range);
+  if (curl_multi_add_handle(multi, seg->curl) != CURLM_OK)
+    return -EIO;
+  seg->active = true;
+  return 0;
+}
+
+// Requests len bytes at start of the image file into the buffer
+static int
+segment_start(iw_segment_t *seg, CURLM *multi, iw_buf_t *b, uint64_t chunk,
+	      uint64_t start, size_t len)
+{
+  b->len = 0;
+  seg->buf = b;
+  seg->chunk = chunk;
+  seg->start = start;
+  seg->expected = len;
+  seg->tries = 0;
+
+  return segment_request(seg, multi);
+}
+
+/* Returns 1 if the chunk is complete, 0 if the rest of the chunk gets
+   requested again later and < 0 on failure. */
+static int
+segment_done(iw_ctx_t *ctx, iw_segment_t *seg, CURLcode res)
+{
+  long code = 0;
+
+  curl_easy_getinfo(seg->curl, CURLINFO_RESPONSE_CODE, &code);
+  // with If-Range the complete image, which does not fit into the buffer
+  if (code == 200 && !seg->url && ctx->validator)
+    return iw_fail(ctx, -EIO, "'%s' changed during the download", ctx->url);
+
+  if (res != CURLE_OK)
+    {
+      if (seg->tries >= ctx->opts->download_retries ||
+	  !iw_retriable(seg->curl, res))
+	return iw_fail(ctx, -EIO, "Downloading '%s' failed: %s",
+		       seg->url ?: ctx->url, curl_easy_strerror(res));
+
+      MSG_WARN("Download of '%s' interrupted at offset %" PRIu64 " (%s), resuming",
+	       seg->url ?: ctx->url, seg->start + seg->buf->len,
+	       curl_easy_strerror(res));
+      __atomic_add_fetch(&ctx->retries, 1, __ATOMIC_RELAXED);
+      seg->retry_at = now_usec() + iw_retry_delay(seg->tries);
+      seg->tries++;
+      return 0;
+    }
+
+  if (seg->url)
+    {
+      if (code != 200)
+	return iw_fail(ctx, -EIO, "Downloading '%s' failed (HTTP status %ld)",
+		       seg->url, code);
+      return 1;
+    }
+  if (code != 206 || seg->buf->len != seg->expected)
+    return iw_fail(ctx, -EIO,
+		   "Range request for '%s' failed (HTTP status %ld, %zu of %zu bytes)",
+		   ctx->url, code, seg->buf->len, seg->expected);
+  return 1;
+}
+
+/* Downloads buffer sized chunks of the image with several parallel range
+   requests. Completed chunks are kept until all chunks before them are
+   complete, the reorder window is limited to the number of buffers. */
+static void *
+source_ranges_thread(void *arg)
+{
+  iw_ctx_t *ctx = arg;
+  _cleanup_free_ iw_segment_t *segs = NULL;
+  _cleanup_free_ iw_buf_t **done = NULL;  // indexed by chunk % window
+  uint64_t nchunks = (ctx->source_size + ctx->opts->buffer_size - 1) /
+    ctx->opts->buffer_size;
+  uint64_t next = 0;      // next chunk to request
+  uint64_t emit = 0;      // next chunk to pass to the next stage
+  CURLM *multi = NULL;
+
+  stage_begin(ctx, IW_STAGE_SOURCE);
+
+  segs = calloc(ctx->streams, sizeof(iw_segment_t));
+  done = calloc(ctx->window, sizeof(iw_buf_t *));
+  multi = curl_multi_init();
+  if (!segs || !done || !multi)
+    {
+      iw_fail(ctx, -ENOMEM, "Cannot initialize parallel download");
+      goto out;
+    }
+
+  // one connection per stream, multiplexing would share the bandwidth
+  // of a single connection again
+  curl_multi_setopt(multi, CURLMOPT_PIPELINING, (long)CURLPIPE_NOTHING);
+  curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)ctx->streams);
+
+  if (!iw_validator_headers(ctx))
+    {
+      iw_fail(ctx, -ENOMEM, "Cannot initialize parallel download");
+      goto out;
+    }
+
+  for (unsigned int i = 0; i < ctx->streams; i++)
+    {
+      segs[i].ctx = ctx;
+      // the first stream continues on the connection of the probe
+      segs[i].curl = ctx->curl ? TAKE_PTR(ctx->curl) : iw_curl_new(ctx);
+      if (!segs[i].curl)
+	{
+	  iw_fail(ctx, -ENOMEM, "curl_easy_init() failed");
+	  goto out;
+	}
+      iw_setup_curl(ctx, segs[i].curl, ctx->range_url);
+      /* Every chunk and every retry of a chunk is requested with the
+	 validator of the probe, a changed image results in a complete
+	 response instead of a range of the new image. */
+      curl_easy_setopt(segs[i].curl, CURLOPT_HTTPHEADER, ctx->validator_headers);
+      curl_easy_setopt(segs[i].curl, CURLOPT_WRITEFUNCTION, segment_write_cb);
+      curl_easy_setopt(segs[i].curl, CURLOPT_WRITEDATA, &segs[i]);
+      curl_easy_setopt(segs[i].curl, CURLOPT_PRIVATE, &segs[i]);
+    }
+
+  while (emit < nchunks && !iw_failed(ctx))
+    {
+      CURLMsg *msg;
+      int running, left, r;
+
+      // resume interrupted chunks after their delay
+      for (unsigned int i = 0; i < ctx->streams; i++)
+	if (segs[i].buf && !segs[i].active && segs[i].retry_at <= now_usec() &&
+	    segment_request(&segs[i], multi) < 0)
+	  {
+	    iw_fail(ctx, -EIO, "curl_multi_add_handle() failed");
+	    goto out;
+	  }
+
+      // request further chunks as long as the reorder window has room
+      for (unsigned int i = 0; i < ctx->streams; i++)
+	{
+	  uint64_t start = next * ctx->opts->buffer_size;
+	  iw_buf_t *b;
+
+	  if (segs[i].buf)
+	    continue;
+	  if (next >= nchunks || next - emit >= ctx->window)
+	    break;
+	  b = bufqueue_trypop(ctx->src_free);
+	  if (!b)
+	    break;
+	  if (segment_start(&segs[i], multi, b, next, start,
+			    ctx->source_size - start < ctx->opts->buffer_size ?
+			    ctx->source_size - start : ctx->opts->buffer_size) < 0)
+	    {
+	      bufqueue_push(ctx->src_free, b);
+	      segs[i].buf = NULL;
+	      iw_fail(ctx, -EIO, "curl_multi_add_handle() failed");
+	      goto out;
+	    }
+	  next++;
+	}
+
+      curl_multi_perform(multi, &running);
+
+      while ((msg = curl_multi_info_read(multi, &left)))
+	{
+	  iw_segment_t *seg;
+
+	  if (msg->msg != CURLMSG_DONE)
+	    continue;
+
+	  curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&seg);
+	  curl_multi_remove_handle(multi, seg->curl);
+	  seg->active = false;
+	  r = segment_done(ctx, seg, msg->data.result);
+	  if (r < 0)
+	    goto out;
+	  if (r > 0)
+	    done[seg->chunk % ctx->window] = TAKE_PTR(seg->buf);
+	}
+
+      // pass completed chunks on in order
+      while (emit < nchunks && done[emit % ctx->window])
+	{
+	  iw_buf_t *b = TAKE_PTR(done[emit % ctx->window]);
+
+	  src_emit(ctx, b);
+	  emit++;
+	}
+
+      // wakes up early on network activity, the timeout is only needed
+      // to notice buffers freed by the next stage
+      if (emit < nchunks)
+	curl_multi_poll(multi, NULL, 0, 10, NULL);
+    }
+
+ out:
+  if (segs)
+    for (unsigned int i = 0; i < ctx->streams; i++)
+      {
+	if (segs[i].active)
+	  curl_multi_remove_handle(multi, segs[i].curl);
+	if (segs[i].buf)
+	  bufqueue_push(ctx->src_free, segs[i].buf);
+	if (segs[i].curl)
+	  curl_easy_cleanup(segs[i].curl);
+      }
+  if (done)
+    for (unsigned int i = 0; i < ctx->window; i++)
+      if (done[i])
+	bufqueue_push(ctx->src_free, done[i]);
+  if (multi)
+    curl_multi_cleanup(multi);
+
+  src_close(ctx);
+  stage_end(ctx, IW_STAGE_SOURCE);
+
+  return NULL;
+}
+
+/*
+ * multicast source: the packets of a chunk arrive in any order and lost
+ * ones get requested again with NAKs, so like with range requests the
+ * buffers of a reorder window get passed on in order once complete.
+ */
+
+typedef struct {
+  iw_ctx_t *ctx;
+  iw_buf_t **slots;       // indexed by chunk % window
+  size_t *filled;         // bytes received per slot
+  uint64_t *received;     // bitmap of the received packets
+  uint64_t nchunks;
+  uint64_t npackets;
+  uint64_t emit;          // next chunk to pass to the next stage
+  uint64_t highest;       // highest packet number seen plus one
+} iw_mcast_t;
+
+static size_t
+mcast_chunk_len(iw_mcast_t *m, uint64_t chunk)
+{
+  size_t bs = m->ctx->opts->buffer_size;
+  uint64_t left = m->ctx->source_size - chunk * bs;
+
+  return left < bs ? left : bs;
+}
+
+// Buffer for the chunk, NULL if it is outside of the window or no buffer
+// is free
+static iw_buf_t *
+mcast_slot(iw_mcast_t *m, uint64_t chunk)
+{
+  unsigned int i = chunk % m->ctx->window;
+
+  if (chunk < m->emit || chunk >= m->emit + m->ctx->window)
+    return NULL;
+  if (!m->slots[i])
+    {
+      m->slots[i] = bufqueue_trypop(m->ctx->src_free);
+      m->filled[i] = 0;
+    }
+  return m->slots[i];
+}
+
+/* Copies the payload of a DATA packet into the chunks it belongs to,
+   a packet can span two chunks. Returns the number of new bytes, 0 for
+   duplicates and packets which do not fit into the window yet. */
+static size_t
+mcast_store(iw_mcast_t *m, uint32_t seq, const uint8_t *payload, size_t len)
+{
+  size_t bs = m->ctx->opts->buffer_size;
+  uint64_t offset = (uint64_t)seq * MCAST_PAYLOAD;
+  uint64_t first, last;
+
+  if (seq >= m->npackets || bit_test(m->received, seq))
+    return 0;
+  // only the last packet is shorter
+  if (len != (seq + 1 < m->npackets ? MCAST_PAYLOAD :
+	      m->ctx->source_size - offset))
+    return 0;
+
+  first = offset / bs;
+  last = (offset + len - 1) / bs;
+  for (uint64_t c = first; c <= last; c++)
+    if (!mcast_slot(m, c))
+      return 0;
+
+  for (uint64_t c = first; c <= last; c++)
+    {
+      uint64_t start = offset > c * bs ? offset : c * bs;
+      uint64_t end = offset + len < (c + 1) * bs ? offset + len : (c + 1) * bs;
+      unsigned int i = c % m->ctx->window;
+
+      memcpy(m->slots[i]->data + (start - c * bs), payload + (start - offset),
+	     end - start);
+      m->filled[i] += end - start;
+    }
+  m->received[seq / 64] |= UINT64_C(1) << (seq % 64);
+
+  return len;
+}
+
+/* Requests the missing packets of the window again, as far as buffers
+   are free, and below limit. Packets beyond it may still be on the way. */
+static void
+mcast_send_naks(iw_mcast_t *m, int fd, uint64_t limit)
+{
+  iw_ctx_t *ctx = m->ctx;
+  size_t bs = ctx->opts->buffer_size;
+  uint8_t pkt[MCAST_PACKET_MAX];
+  mcast_range_t ranges[MCAST_NAK_MAX];
+  size_t n = 0;
+  uint64_t end_chunk = m->emit, end, seq;
+
+  // only packets which fit completely into the buffers of the window
+  while (end_chunk < m->nchunks && mcast_slot(m, end_chunk))
+    end_chunk++;
+  end = end_chunk * bs >= ctx->source_size ?
+    m->npackets : end_chunk * bs / MCAST_PAYLOAD;
+  if (end > limit)
+    end = limit;
+
+  seq = m->emit * bs / MCAST_PAYLOAD;
+  while (seq < end)
+    {
+      uint64_t first;
+
+      if (bit_test(m->received, seq))
+	{
+	  seq++;
+	  continue;
+	}
+      first = seq;
+      while (seq < end && !bit_test(m->received, seq))
+	seq++;
+      ranges[n].first = first;
+      ranges[n].count = seq - first;
+      if (++n == MCAST_NAK_MAX || seq >= end)
+	{
+	  size_t len = mcast_build_nak(pkt, ctx->mcast_session, ranges, n);
+
+	  sendto(fd, pkt, len, MSG_DONTWAIT,
+		 (const struct sockaddr *)&ctx->mcast_sender,
+		 sizeof(ctx->mcast_sender));
+	  n = 0;
+	}
+    }
+  if (n > 0)
+    {
+      size_t len = mcast_build_nak(pkt, ctx->mcast_session, ranges, n);
+
+      sendto(fd, pkt, len, MSG_DONTWAIT,
+	     (const struct sockaddr *)&ctx->mcast_sender,
+	     sizeof(ctx->mcast_sender));
+    }
+}
+
+static void *
+source_mcast_thread(void *arg)
+{
+  iw_ctx_t *ctx = arg;
+  int fd = ctx->mcast_fd;
+  _cleanup_free_ iw_buf_t **slots = NULL;
+  _cleanup_free_ size_t *filled = NULL;
+  _cleanup_free_ uint64_t *received = NULL;
+  _cleanup_free_ uint8_t *pkts = NULL;
+  struct mmsghdr msgs[IW_MCAST_BATCH];
+  struct iovec iov[IW_MCAST_BATCH];
+  iw_mcast_t m = {
+    .ctx = ctx,
+    .nchunks = (ctx->source_size + ctx->opts->buffer_size - 1) /
+      ctx->opts->buffer_size,
+    .npackets = mcast_packets(ctx->source_size),
+  };
+  uint64_t last_packet = now_usec();
+  uint64_t last_data = last_packet;
+  uint64_t last_nak = last_packet;
+
+  stage_begin(ctx, IW_STAGE_SOURCE);
+
+  slots = calloc(ctx->window, sizeof(iw_buf_t *));
+  filled = calloc(ctx->window, sizeof(size_t));
+  received = calloc((m.npackets + 63) / 64, sizeof(uint64_t));
+  pkts = malloc(IW_MCAST_BATCH * MCAST_PACKET_MAX);
+  if (!slots || !filled || !received || !pkts)
+    {
+      iw_fail(ctx, -ENOMEM, "Cannot initialize multicast receiver");
+      goto out;
+    }
+  m.slots = slots;
+  m.filled = filled;
+  m.received = received;
+
+  for (unsigned int i = 0; i < IW_MCAST_BATCH; i++)
+    {
+      iov[i].iov_base = pkts + i * MCAST_PACKET_MAX;
+      iov[i].iov_len = MCAST_PACKET_MAX;
+      msgs[i].msg_hdr = (struct msghdr) { .msg_iov = &iov[i], .msg_iovlen = 1 };
+    }
+
+  while (m.emit < m.nchunks && !iw_failed(ctx))
+    {
+      struct pollfd pfd = { .fd = fd, .events = POLLIN };
+      uint64_t now;
+      int n;
+
+      // the timeout is only needed to notice buffers freed by the next
+      // stage and to send NAKs
+      poll(&pfd, 1, 10);
+
+      n = recvmmsg(fd, msgs, IW_MCAST_BATCH, MSG_DONTWAIT, NULL);
+      if (n < 0 && errno != EAGAIN && errno != EINTR)
+	{
+	  iw_fail(ctx, -errno, "Cannot receive multicast packets: %s",
+		  strerror(errno));
+	  goto out;
+	}
+
+      now = now_usec();
+      for (int i = 0; i < n; i++)
+	{
+	  const uint8_t *payload;
+	  size_t payload_len, len;
+	  uint32_t session, seq;
+	  int type;
+
+	  // other senders on the same group are ignored
+	  type = mcast_parse(iov[i].iov_base, msgs[i].msg_len, &session, &seq,
+			     &payload, &payload_len);
+	  if (type < 0 || session != ctx->mcast_session)
+	    continue;
+	  last_packet = now;
+	  if (type != MCAST_DATA)
+	    continue;
+
+	  last_data = now;
+	  if (seq >= m.highest)
+	    m.highest = (uint64_t)seq + 1;
+	  len = mcast_store(&m, seq, payload, payload_len);
+	  stage_add(ctx, IW_STAGE_SOURCE, len);
+	}
+
+      // pass completed chunks on in order
+      while (m.emit < m.nchunks)
+	{
+	  unsigned int i = m.emit % ctx->window;
+
+	  if (!slots[i] || filled[i] != mcast_chunk_len(&m, m.emit))
+	    break;
+	  slots[i]->len = filled[i];
+	  src_emit(ctx, TAKE_PTR(slots[i]));
+	  m.emit++;
+	}
+      if (m.emit >= m.nchunks)
+	break;
+
+      // buffers freed by the next stage, to not drop the next packets
+      mcast_slot(&m, m.emit);
+
+      if (now - last_packet > MCAST_TIMEOUT_SEC * 1000000ULL)
+	{
+	  iw_fail(ctx, -ETIMEDOUT, "Multicast sender of '%s' disappeared",
+		  ctx->url);
+	  goto out;
+	}
+
+      /* Packets below the highest one seen are lost. If nothing arrives
+	 anymore, the sender has finished the first round and waits for
+	 NAKs of everything still missing. */
+      if (now - last_nak >= IW_MCAST_NAK_INTERVAL * 1000ULL)
+	{
+	  bool stalled = now - last_data >= IW_MCAST_NAK_INTERVAL * 1000ULL;
+
+	  mcast_send_naks(&m, fd, stalled ? m.npackets : m.highest);
+	  last_nak = now;
+	}
+    }
+
+  if (m.emit >= m.nchunks)
+    {
+      uint8_t pkt[MCAST_HEADER_SIZE];
+      size_t len = mcast_build(pkt, MCAST_DONE, ctx->mcast_session, 0, 0);
+
+      // a lost DONE only keeps the sender running a bit longer
+      for (int i = 0; i < 3; i++)
+	sendto(fd, pkt, len, 0, (const struct sockaddr *)&ctx->mcast_sender,
+	       sizeof(ctx->mcast_sender));
+    }
+
+ out:
+  if (slots)
+    for (unsigned int i = 0; i < ctx->window; i++)
+      if (slots[i])
+	bufqueue_push(ctx->src_free, slots[i]);
+
+  src_close(ctx);
+  stage_end(ctx, IW_STAGE_SOURCE);
+
+  return NULL;
+}
+
+/*
+ * decompress stage
+ */
+
+static void
+raw_emit(iw_ctx_t *ctx, iw_buf_t *b)
+{
+  b->refs = ctx->ndevs + (ctx->hash_output ? 1 : 0);
+  out_emit(ctx, b);
+}
+
+static void *
+decompress_thread(void *arg)
+{
+  iw_ctx_t *ctx = arg;
+  _cleanup_decoder_ decoder_t *d = NULL;
+  iw_buf_t *in;
+  iw_buf_t *out = NULL;
+  decoder_buf_t db = {};
+  int r;
+
+  stage_begin(ctx, IW_STAGE_DECOMPRESS);
+
+  unsigned int threads = ctx->opts->decompress_threads;
+  if (threads == 0)
+    {
+      long n = sysconf(_SC_NPROCESSORS_ONLN);
+      threads = n > 0 ? (unsigned int)n : 1;
+      if (threads > IW_DECOMPRESS_THREADS_MAX)
+	threads = IW_DECOMPRESS_THREADS_MAX;
+    }
+  MSG_DEBUG("decompress: up to %u threads", threads);
+
+  r = decoder_new(ctx->compression, threads, ctx->decoder_memory, &d);
+  if (r < 0)
+    {
+      iw_fail(ctx, r, "Cannot initialize %s decoder: %s",
+	      compression_to_string(ctx->compression), strerror(-r));
+      goto out;
+    }
+
+  // feed compressed buffers, call once more with finish set at the end
+  bool finish = false;
+  in = bufqueue_pop(&ctx->comp_full,
+		    &ctx->stage_wait_in[IW_STAGE_DECOMPRESS]);
+  while (in || !finish)
+    {
+      if (!in)
+	{
+	  if (iw_failed(ctx))
+	    goto out;
+	  finish = true;
+	  db.src = NULL;
+	  db.src_size = db.src_pos = 0;
+	}
+      else
+	{
+	  db.src = in->data;
+	  db.src_size = in->len;
+	  db.src_pos = 0;
+	}
+
+      do
+	{
+	  if (!out)
+	    {
+	      out = bufqueue_pop(&ctx->raw_free,
+				 &ctx->stage_wait_out[IW_STAGE_DECOMPRESS]);
+	      if (!out)
+		goto out;
+	      out->len = 0;
+	    }
+	  db.dst = out->data;
+	  db.dst_size = ctx->opts->buffer_size;
+	  db.dst_pos = out->len;
+
+	  r = decoder_run(d, &db, finish);
+	  if (r < 0)
+	    {
+	      iw_fail(ctx, r, "Decompressing %s image failed: %s",
+		      compression_to_string(ctx->compression),
+		      decoder_strerror(d));
+	      goto out;
+	    }
+
+	  stage_add(ctx, IW_STAGE_DECOMPRESS, db.dst_pos - out->len);
+	  out->len = db.dst_pos;
+	  if (out->len == ctx->opts->buffer_size)
+	    {
+	      raw_emit(ctx, out);
+	      out = NULL;
+	    }
+	}
+      while (finish ? r == 0 : db.src_pos < db.src_size);
+
+      if (in)
+	{
+	  __atomic_add_fetch(&ctx->decompress_in, in->len, __ATOMIC_RELAXED);
+	  iw_buf_put(&ctx->comp_free, in);
+	  in = bufqueue_pop(&ctx->comp_full,
+		    &ctx->stage_wait_in[IW_STAGE_DECOMPRESS]);
+	}
+    }
+
+  if (out && out->len > 0)
+    {
+      raw_emit(ctx, out);
+      out = NULL;
+    }
+
+ out:
+  if (out)
+    bufqueue_push(&ctx->raw_free, out);
+  out_finish(ctx);
+  stage_end(ctx, IW_STAGE_DECOMPRESS);
+
+  return NULL;
+}
+
+/*
+ * hash stages
+ */
+
+typedef struct {
+  iw_ctx_t *ctx;
+  iw_stage_t stage;
+  bufqueue_t *full;
+  bufqueue_t *free;
+  sha256_ctx_t *sha256;   // NULL if only the extents are needed
+  bool extents;           // the data is the image as written
+} iw_hash_t;
+
+// Hashes the written image in IW_VERIFY_EXTENT sized pieces
+static int
+hash_extents(iw_ctx_t *ctx, const uint8_t *data, size_t len)
+{
+  while (len > 0)
+    {
+      size_t fill = ctx->output_size % IW_VERIFY_EXTENT;
+      size_t n = IW_VERIFY_EXTENT - fill;
+
+      if (n > len)
+	n = len;
+
+      if (fill == 0)
+	{
+	  if (ctx->nextents == ctx->extents_allocated)
+	    {
+	      size_t count = ctx->extents_allocated ? ctx->extents_allocated * 2 : 1024;
+	      void *tmp = reallocarray(ctx->extents, count, SHA256_DIGEST_SIZE);
+	      if (!tmp)
+		return -ENOMEM;
+	      ctx->extents = tmp;
+	      ctx->extents_allocated = count;
+	    }
+	  ctx->nextents++;
+	  sha256_init(&ctx->extent_sha256);
+	}
+
+      sha256_update(&ctx->extent_sha256, data, n);
+      ctx->output_size += n;
+      if (ctx->output_size % IW_VERIFY_EXTENT == 0)
+	sha256_final(&ctx->extent_sha256, ctx->extents[ctx->nextents - 1]);
+
+      data += n;
+      len -= n;
+    }
+
+  return 0;
+}
+
+static void *
+hash_thread(void *arg)
+{
+  iw_hash_t *h = arg;
+  iw_buf_t *b;
+
+  stage_begin(h->ctx, h->stage);
+
+  while ((b = bufqueue_pop(h->full, &h->ctx->stage_wait_in[h->stage])))
+    {
+      if (h->sha256)
+	sha256_update(h->sha256, b->data, b->len);
+      if (h->extents && hash_extents(h->ctx, b->data, b->len) < 0)
+	iw_fail(h->ctx, -ENOMEM, "Cannot allocate memory for extent digests");
+      stage_add(h->ctx, h->stage, b->len);
+      iw_buf_put(h->free, b);
+    }
+
+  // the last extent can be partial
+  if (h->extents && h->ctx->output_size % IW_VERIFY_EXTENT != 0)
+    sha256_final(&h->ctx->extent_sha256,
+		 h->ctx->extents[h->ctx->nextents - 1]);
+
+  stage_end(h->ctx, h->stage);
+
+  return NULL;
+}
+
+/*
+ * write stage
+ */
+
+static int
+pwrite_all(int fd, const uint8_t *data, size_t len, off_t offset)
+{
+  while (len > 0)
+    {
+      ssize_t n = pwrite(fd, data, len, offset);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -errno;
+	}
+      if (n == 0)
+	return -ENOSPC;
+      data += n;
+      len -= n;
+      offset += n;
+    }
+  return 0;
+}
+
+/* Remembers the first error of a device. The other devices continue,
+   only if all devices failed the pipeline gets stopped. */
+static int
+dev_fail(iw_dev_t *dev, int r, const char *fmt, ...)
+{
+  iw_ctx_t *ctx = dev->ctx;
+  _cleanup_free_ char *msg = NULL;
+  bool all_failed;
+  va_list ap;
+
+  pthread_mutex_lock(&ctx->lock);
+  if (dev->error != 0)
+    {
+      pthread_mutex_unlock(&ctx->lock);
+      return r;
+    }
+  __atomic_store_n(&dev->error, r, __ATOMIC_RELAXED);
+  all_failed = ++ctx->failed_devs == ctx->ndevs;
+  pthread_mutex_unlock(&ctx->lock);
+
+  va_start(ap, fmt);
+  if (vasprintf(&msg, fmt, ap) < 0)
+    msg = NULL;
+  va_end(ap);
+
+  if (!all_failed)
+    MSG_ERROR("%s: %s", dev->path, strna(msg));
+  else if (ctx->ndevs > 1)
+    iw_fail(ctx, r, "%s: %s", dev->path, strna(msg));
+  else
+    iw_fail(ctx, r, "%s", strna(msg));
+
+  return r;
+}
+
+#if HAVE_LIBURING
+/* Processes completed writes, waits for one if wait is set. Buffers
+   go back to the free queue when their last write completed. */
+static int
+uring_reap(iw_dev_t *dev, bool wait)
+{
+  int ret = 0;
+
+  while (dev->inflight > 0)
+    {
+      struct io_uring_cqe *cqe = NULL;
+      iw_write_t *w;
+      int r, res;
+
+      if (wait)
+	r = io_uring_wait_cqe(&dev->ring, &cqe);
+      else
+	r = io_uring_peek_cqe(&dev->ring, &cqe);
+      if (r == -EINTR)
+	continue;
+      if (r == -EAGAIN)
+	break;
+      if (r < 0)
+	return r;
+
+      w = io_uring_cqe_get_data(cqe);
+      res = cqe->res;
+      io_uring_cqe_seen(&dev->ring, cqe);
+      dev->inflight--;
+      wait = false;
+
+      // short writes are rare enough to finish them synchronously
+      if (res >= 0 && (size_t)res < w->len)
+	res = pwrite_all(dev->fd, w->data + res, w->len - res,
+			 w->offset + res);
+      if (res < 0 && ret == 0)
+	ret = res;
+
+      iw_buf_put(&dev->ctx->raw_free, w->buf);
+      w->buf = NULL;
+      dev->free_writes[dev->nfree++] = w - dev->writes;
+    }
+
+  return ret;
+}
+
+// Waits until all writes are done
+static int
+uring_drain(iw_dev_t *dev)
+{
+  int ret = 0;
+
+  while (dev->inflight > 0)
+    {
+      int r = uring_reap(dev, true);
+      if (r < 0 && ret == 0)
+	ret = r;
+    }
+  return ret;
+}
+
+/* Queues the data in max_write sized requests. Every request holds
+   a reference to the buffer, so the write stage can continue with the
+   next buffer while the device works on the previous ones. */
+static int
+uring_write(iw_dev_t *dev, const uint8_t *data, size_t len, off_t offset)
+{
+  iw_buf_t *b = dev->wbuf;
+  int r;
+
+  while (len > 0)
+    {
+      size_t n = len > dev->params.max_write ? dev->params.max_write : len;
+      struct io_uring_sqe *sqe;
+      iw_write_t *w;
+
+      if (dev->nfree == 0)
+	{
+	  r = io_uring_submit(&dev->ring);
+	  if (r < 0)
+	    return r;
+	  r = uring_reap(dev, true);
+	  if (r < 0)
+	    return r;
+	}
+
+      sqe = io_uring_get_sqe(&dev->ring);
+      if (!sqe)
+	return -EBUSY;
+
+      w = &dev->writes[dev->free_writes[--dev->nfree]];
+      *w = (iw_write_t){ b, data, n, offset };
+      if (dev->fixed)
+	io_uring_prep_write_fixed(sqe, dev->fd, data, n, offset,
+				  b - dev->ctx->bufs);
+      else
+	io_uring_prep_write(sqe, dev->fd, data, n, offset);
+      io_uring_sqe_set_data(sqe, w);
+      __atomic_add_fetch(&b->refs, 1, __ATOMIC_ACQ_REL);
+      dev->inflight++;
+
+      data += n;
+      len -= n;
+      offset += n;
+    }
+
+  r = io_uring_submit(&dev->ring);
+  if (r < 0)
+    return r;
+
+  return uring_reap(dev, false);
+}
+#endif
+
+static int
+dev_write(iw_dev_t *dev, const uint8_t *data, size_t len, off_t offset)
+{
+#if HAVE_LIBURING
+  if (dev->uring)
+    return uring_write(dev, data, len, offset);
+#endif
+  return pwrite_all(dev->fd, data, len, offset);
+}
+
+static int
+disable_direct(iw_dev_t *dev)
+{
+  if (dev->direct)
+    {
+      int flags;
+
+#if HAVE_LIBURING
+      // queued writes must not see the changed flags
+      int r = uring_drain(dev);
+      if (r < 0)
+	return r;
+#endif
+      flags = fcntl(dev->fd, F_GETFL);
+      if (flags < 0 || fcntl(dev->fd, F_SETFL, flags & ~O_DIRECT) < 0)
+	return -errno;
+      dev->direct = false;
+    }
+  return 0;
+}
+
+static int
+write_data(iw_dev_t *dev, const uint8_t *data, size_t len, off_t offset)
+{
+  size_t align = dev->params.alignment;
+  size_t aligned = len & ~(align - 1);
+  int r;
+
+  // block maps with small block sizes can lead to unaligned offsets
+  if (offset % align != 0)
+    {
+      r = disable_direct(dev);
+      if (r < 0)
+	return r;
+      aligned = len;
+    }
+
+  r = dev_write(dev, data, aligned, offset);
+  if (r < 0 || aligned == len)
+    return r;
+
+  // O_DIRECT cannot write the unaligned tail of the image
+  r = disable_direct(dev);
+  if (r < 0)
+    return r;
+
+  return dev_write(dev, data + aligned, len - aligned, offset + aligned);
+}
+
+// Fast check if a block only contains zeros
+static bool
+is_zero(const uint8_t *p, size_t len)
+{
+  static const uint8_t zero[16];
+
+  if (len < sizeof(zero))
+    return memcmp(p, zero, len) == 0;
+  if (memcmp(p, zero, sizeof(zero)) != 0)
+    return false;
+  return memcmp(p, p + sizeof(zero), len - sizeof(zero)) == 0;
+}
+
+/* Makes sure the range reads back as zeros without transferring the
+   zeros: BLKZEROOUT lets the device use WRITE ZEROES/UNMAP, for regular
+   files a hole gets punched. Short ranges and devices not supporting
+   either get the zeros written. */
+static int
+write_zeroes(iw_dev_t *dev, off_t offset, uint64_t len)
+{
+  if (len >= IW_SPARSE_MIN)
+    {
+      int r;
+
+      if (dev->is_blkdev)
+	{
+	  uint64_t range[2] = { offset, len };
+	  r = ioctl(dev->fd, BLKZEROOUT, range);
+	}
+      else
+	r = fallocate(dev->fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+		      offset, len);
+      if (r == 0)
+	{
+	  __atomic_add_fetch(&dev->sparse_bytes, len, __ATOMIC_RELAXED);
+	  return 0;
+	}
+      if (errno != EOPNOTSUPP && errno != ENOTTY && errno != EINVAL)
+	return -errno;
+      MSG_DEBUG("Zeroing range failed (%s), writing zeros", strerror(errno));
+    }
+
+  while (len > 0)
+    {
+      size_t n = len > IW_SPARSE_MIN ? IW_SPARSE_MIN : len;
+      int r = pwrite_all(dev->fd, dev->ctx->zero_buf, n, offset);
+      if (r < 0)
+	return r;
+      offset += n;
+      len -= n;
+    }
+
+  return 0;
+}
+
+static int
+flush_zeroes(iw_dev_t *dev)
+{
+  int r = 0;
+
+  if (dev->zero_len > 0)
+    r = write_zeroes(dev, dev->zero_start, dev->zero_len);
+  dev->zero_len = 0;
+
+  return r;
+}
+
+// Adds a range to the pending run of zeros
+static int
+add_zeroes(iw_dev_t *dev, off_t offset, uint64_t len)
+{
+  if (dev->zero_len > 0 && dev->zero_start + (off_t)dev->zero_len != offset)
+    {
+      int r = flush_zeroes(dev);
+      if (r < 0)
+	return r;
+    }
+  if (dev->zero_len == 0)
+    dev->zero_start = offset;
+  dev->zero_len += len;
+
+  return 0;
+}
+
+// Writes data, with sparse enabled runs of zero blocks get zeroed instead
+static int
+write_region(iw_dev_t *dev, const uint8_t *data, size_t len, off_t offset)
+{
+  size_t data_start = 0;
+  size_t pos = 0;
+  int r = 0;
+
+  while (pos < len)
+    {
+      size_t n = len - pos;
+      if (n > IW_SPARSE_BLOCK)
+	n = IW_SPARSE_BLOCK;
+
+      if (dev->ctx->opts->sparse && n == IW_SPARSE_BLOCK &&
+	  is_zero(data + pos, n))
+	{
+	  if (pos > data_start)
+	    r = write_data(dev, data + data_start, pos - data_start,
+			   offset + data_start);
+	  if (r == 0)
+	    r = add_zeroes(dev, offset + pos, n);
+	  data_start = pos + n;
+	}
+      else if (dev->zero_len > 0)
+	r = flush_zeroes(dev);
+      if (r < 0)
+	return r;
+      pos += n;
+    }
+  if (len > data_start)
+    r = write_data(dev, data + data_start, len - data_start,
+		   offset + data_start);
+
+  return r;
+}
+
+/* Called after the last byte of the current range got written. A
+   mismatch is a problem of the image, not of the device, so it stops
+   the pipeline. */
+static int
+verify_range(iw_dev_t *dev)
+{
+  const bmap_t *bmap = dev->ctx->opts->bmap;
+  const bmap_range_t *range = &bmap->ranges[dev->range];
+  uint8_t digest[SHA256_DIGEST_SIZE];
+
+  dev->range++;
+  if (!range->has_checksum)
+    return 0;
+
+  sha256_final(&dev->range_sha256, digest);
+  sha256_init(&dev->range_sha256);
+
+  if (memcmp(digest, range->sha256, sizeof(digest)) != 0)
+    return iw_fail(dev->ctx, -EBADMSG,
+		   "Checksum of block range %" PRIu64 "-%" PRIu64 " does not match",
+		   range->first, range->last);
+  return 0;
+}
+
+/* Writes only the ranges listed in the block map and verifies them.
+   The block map is not covered by the signature of the image, so the
+   unmapped ranges are only skipped if they really contain zeros. This
+   way the device always ends up with the content of the verified
+   image. */
+static int
+write_bmap(iw_dev_t *dev, const uint8_t *data, size_t len, off_t offset)
+{
+  const bmap_t *bmap = dev->ctx->opts->bmap;
+  size_t pos = 0;
+  int r;
+
+  while (pos < len)
+    {
+      uint64_t cur = offset + pos;
+      uint64_t n = len - pos;
+
+      if (dev->range < bmap->nranges &&
+	  bmap_range_start(bmap, dev->range) <= cur)
+	{
+	  uint64_t end = bmap_range_end(bmap, dev->range);
+
+	  if (n > end - cur)
+	    n = end - cur;
+	  if (bmap->ranges[dev->range].has_checksum)
+	    sha256_update(&dev->range_sha256, data + pos, n);
+	  r = write_region(dev, data + pos, n, cur);
+	  if (r == 0 && cur + n == end)
+	    r = verify_range(dev);
+	}
+      else
+	{
+	  uint64_t next = UINT64_MAX;
+
+	  if (dev->range < bmap->nranges)
+	    next = bmap_range_start(bmap, dev->range);
+	  if (n > next - cur)
+	    n = next - cur;
+
+	  if (is_zero(data + pos, n))
+	    {
+	      r = add_zeroes(dev, cur, n);
+	      __atomic_add_fetch(&dev->unmapped_bytes, n, __ATOMIC_RELAXED);
+	    }
+	  else
+	    {
+	      if (!dev->warned_unmapped)
+		MSG_WARN("Block map does not match image, unmapped data at offset %" PRIu64 " gets written",
+			 cur);
+	      dev->warned_unmapped = true;
+	      r = write_region(dev, data + pos, n, cur);
+	    }
+	}
+      if (r < 0)
+	return r;
+      pos += n;
+    }
+
+  return 0;
+}
+
+/*
+ * discard stage
+ */
+
+/* Reads a number from the queue directory of the block device in
+   sysfs, a partition has none of its own. Returns false if there is no
+   such attribute. */
+static bool
+read_queue_attr(iw_dev_t *dev, const char *name, uint64_t *ret)
+{
+  const char *fmt[] = { "/sys/dev/block/%u:%u/queue/%s",
+			"/sys/dev/block/%u:%u/../queue/%s" };
+  struct stat st;
+
+  if (fstat(dev->fd, &st) < 0)
+    return false;
+
+  for (size_t i = 0; i < sizeof(fmt)/sizeof(fmt[0]); i++)
+    {
+      _cleanup_free_ char *path = NULL;
+      _cleanup_fclose_ FILE *fp = NULL;
+
+      if (asprintf(&path, fmt[i], major(st.st_rdev), minor(st.st_rdev),
+		   name) < 0)
+	return false;
+      fp = fopen(path, "re");
+      if (fp)
+	return fscanf(fp, "%" SCNu64, ret) == 1;
+    }
+
+  return false;
+}
+
+/* Discards the device behind the image, so that the device does not
+   keep the blocks of earlier installations mapped. Inside the image
+   every block gets written or zeroed anyway.
+   Where discarded blocks do not read back as zeros, partitions created
+   there later would show the file systems of earlier installations, so
+   the device gets zeroed with BLKZEROOUT instead, if it can do that
+   without the data getting transferred (WRITE ZEROES). Otherwise it
+   only gets discarded, writing zeros to the whole device would take
+   hours. A device not supporting either is no error. */
+static void
+discard_device(iw_dev_t *dev, uint64_t start)
+{
+  iw_ctx_t *ctx = dev->ctx;
+  uint64_t size, zeroes = 0, write_zeroes = 0;
+  bool zeroout;
+
+  if (ioctl(dev->fd, BLKGETSIZE64, &size) < 0)
+    {
+      MSG_WARN("Cannot get size of '%s': %s", dev->path, strerror(errno));
+      return;
+    }
+
+  read_queue_attr(dev, "discard_zeroes_data", &zeroes);
+  read_queue_attr(dev, "write_zeroes_max_bytes", &write_zeroes);
+  zeroout = zeroes == 0 && write_zeroes > 0;
+  if (zeroes == 0 && write_zeroes == 0)
+    MSG_DEBUG("'%s' keeps the data behind the image, discard does not zero it",
+	      dev->path);
+
+  // the last block of the image gets written
+  start = (start + IW_ALIGN - 1) & ~(uint64_t)(IW_ALIGN - 1);
+  size &= ~(uint64_t)(IW_ALIGN - 1);
+  while (start < size && dev->error == 0 && !iw_failed(ctx))
+    {
+      uint64_t range[2] = { start, size - start };
+
+      if (range[1] > IW_DISCARD_STEP)
+	range[1] = IW_DISCARD_STEP;
+      if (zeroout && ioctl(dev->fd, BLKZEROOUT, range) < 0)
+	{
+	  if (errno != EOPNOTSUPP && errno != EINVAL)
+	    {
+	      MSG_WARN("Zeroing '%s' at offset %" PRIu64 " failed: %s",
+		       dev->path, start, strerror(errno));
+	      return;
+	    }
+	  MSG_DEBUG("Zeroing '%s' failed (%s), discarding", dev->path,
+		    strerror(errno));
+	  zeroout = false;
+	}
+      if (!zeroout && ioctl(dev->fd, BLKDISCARD, range) < 0)
+	{
+	  if (errno == EOPNOTSUPP)
+	    MSG_INFO("'%s' does not support discard", dev->path);
+	  else
+	    MSG_WARN("Discarding '%s' at offset %" PRIu64 " failed: %s",
+		     dev->path, start, strerror(errno));
+	  return;
+	}
+      start += range[1];
+      stage_add(ctx, IW_STAGE_DISCARD, range[1]);
+    }
+}
+
+// Discards behind the image while it gets written
+static void *
+discard_thread(void *arg)
+{
+  iw_dev_t *dev = arg;
+  iw_ctx_t *ctx = dev->ctx;
+
+  stage_begin(ctx, IW_STAGE_DISCARD);
+  if (iw_gate_wait(ctx) == 0)
+    discard_device(dev, ctx->discard_start);
+  stage_end(ctx, IW_STAGE_DISCARD);
+
+  return NULL;
+}
+
+/* Every device has its own write thread. After an error of the device
+   the thread continues to release the buffers, so the other devices
+   are not blocked. */
+static void *
+write_thread(void *arg)
+{
+  iw_dev_t *dev = arg;
+  iw_ctx_t *ctx = dev->ctx;
+  const bmap_t *bmap = ctx->opts->bmap;
+  const chunk_index_t *chunks = ctx->opts->chunks;
+  off_t offset = 0;
+  iw_buf_t *b;
+  int r = 0;
+
+  // the queue of the device fills up meanwhile
+  bool gate_open = iw_gate_wait(ctx) == 0;
+
+  stage_begin(ctx, IW_STAGE_WRITE);
+
+  while ((b = bufqueue_pop(&dev->full, &dev->wait_in)))
+    {
+      // with a chunk index the buffers are chunks in any order, every
+      // device only needs the chunks which differ
+      if (chunks)
+	offset = chunks->chunks[b->chunk].start;
+      if (gate_open && dev->error == 0 &&
+	  (!chunks || bit_test(dev->differs, b->chunk)))
+	{
+	  // with io_uring this only blocks if the queue is full
+	  uint64_t start = now_usec();
+
+	  dev->wbuf = b;
+	  if (bmap)
+	    r = write_bmap(dev, b->data, b->len, offset);
+	  else
+	    r = write_region(dev, b->data, b->len, offset);
+	  __atomic_add_fetch(&dev->wait_out, now_usec() - start,
+			     __ATOMIC_RELAXED);
+	  if (r < 0)
+	    dev_fail(dev, r, "Writing to device at offset %" PRIu64 " failed: %s",
+		     (uint64_t)offset, strerror(-r));
+	  else
+	    __atomic_add_fetch(&dev->written, b->len, __ATOMIC_RELAXED);
+	}
+
+      offset += b->len;
+      iw_buf_put(&ctx->raw_free, b);
+    }
+
+  uint64_t start = now_usec();
+
+  if (dev->error == 0 && !iw_failed(ctx) && dev->zero_len > 0)
+    {
+      off_t zero_start = dev->zero_start;
+
+      r = flush_zeroes(dev);
+      if (r < 0)
+	dev_fail(dev, r, "Zeroing device at offset %" PRIu64 " failed: %s",
+		 (uint64_t)zero_start, strerror(-r));
+    }
+
+#if HAVE_LIBURING
+  // the buffers must not be freed while the kernel still uses them
+  r = uring_drain(dev);
+  if (r < 0)
+    dev_fail(dev, r, "Writing to device failed: %s", strerror(-r));
+#endif
+
+  if (!iw_failed(ctx) && bmap && (uint64_t)offset != bmap->image_size)
+    iw_fail(ctx, -EBADMSG,
+	    "Image size %" PRIu64 " does not match block map image size %" PRIu64,
+	    (uint64_t)offset, bmap->image_size);
+
+  /* Holes punched at the end and unmapped ranges do not extend a
+     regular file, it has to get the size of the image nevertheless. */
+  if (dev->error == 0 && !iw_failed(ctx) && !dev->is_blkdev)
+    {
+      uint64_t end = chunks ? chunks->image_size : (uint64_t)offset;
+      struct stat st;
+
+      if (fstat(dev->fd, &st) < 0)
+	dev_fail(dev, -errno, "Cannot stat device: %s", strerror(errno));
+      else if ((uint64_t)st.st_size < end && ftruncate(dev->fd, end) < 0)
+	dev_fail(dev, -errno, "Cannot extend device to %" PRIu64 " bytes: %s",
+		 end, strerror(errno));
+    }
+
+  // the end of the image is only known now
+  if (ctx->opts->discard && ctx->discard_start == 0 && dev->is_blkdev)
+    {
+      stage_begin(ctx, IW_STAGE_DISCARD);
+      discard_device(dev, offset);
+      stage_stop(ctx, IW_STAGE_DISCARD);
+    }
+
+  if (dev->error == 0 && !iw_failed(ctx) && fsync(dev->fd) < 0)
+    dev_fail(dev, -errno, "Syncing device failed: %s", strerror(errno));
+  __atomic_add_fetch(&dev->wait_out, now_usec() - start, __ATOMIC_RELAXED);
+
+  stage_end(ctx, IW_STAGE_WRITE);
+
+  return NULL;
+}
+
+/*
+ * copy stage
+ */
+
+/* Stores the image as read in a file. A failing copy does not stop the
+   pipeline, the copy is incomplete then. */
+static void *
+copy_thread(void *arg)
+{
+  iw_ctx_t *ctx = arg;
+  uint64_t offset = 0;
+  iw_buf_t *b;
+  int r;
+
+  stage_begin(ctx, IW_STAGE_COPY);
+
+  while ((b = bufqueue_pop(&ctx->copy_full,
+			   &ctx->stage_wait_in[IW_STAGE_COPY])))
+    {
+      if (ctx->copy_error == 0)
+	{
+	  r = pwrite_all(ctx->copy_fd, b->data, b->len, offset);
+	  if (r < 0)
+	    {
+	      MSG_WARN("Writing the copy of the image failed: %s",
+		       strerror(-r));
+	      ctx->copy_error = r;
+	    }
+	  offset += b->len;
+	  stage_add(ctx, IW_STAGE_COPY, b->len);
+	}
+      iw_buf_put(ctx->src_free, b);
+    }
+
+  if (ctx->copy_error == 0 && fdatasync(ctx->copy_fd) < 0)
+    {
+      ctx->copy_error = -errno;
+      MSG_WARN("Writing the copy of the image failed: %s",
+	       strerror(-ctx->copy_error));
+    }
+
+  stage_end(ctx, IW_STAGE_COPY);
+
+  return NULL;
+}
+
+/*
+ * verify stage
+ */
+
+// Reads until len bytes or the end of the device got read
+static ssize_t
+pread_all(int fd, uint8_t *data, size_t len, off_t offset, size_t align)
+{
+  size_t done = 0;
+
+  while (done < len)
+    {
+      ssize_t n = pread(fd, data + done, len - done, offset + done);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -errno;
+	}
+      done += n;
+      // with O_DIRECT only the end of the device leads to short reads
+      if (n == 0 || n % align != 0)
+	break;
+    }
+  return done;
+}
+
+static int
+verify_extent(iw_dev_t *dev, int fd, uint8_t *buf, uint64_t extent)
+{
+  iw_ctx_t *ctx = dev->ctx;
+  uint64_t offset = extent * IW_VERIFY_EXTENT;
+  size_t len = IW_VERIFY_EXTENT;
+  size_t align = dev->params.alignment;
+  uint8_t digest[SHA256_DIGEST_SIZE];
+  sha256_ctx_t sha256;
+  ssize_t n;
+
+  if (len > ctx->output_size - offset)
+    len = ctx->output_size - offset;
+
+  // O_DIRECT needs aligned sizes, the device is at least as large
+  n = pread_all(fd, buf, (len + align - 1) & ~(align - 1), offset, align);
+  if (n < 0)
+    return dev_fail(dev, n, "Reading device at offset %" PRIu64 " failed: %s",
+		    offset, strerror(-n));
+  if ((size_t)n < len)
+    return dev_fail(dev, -EIO, "Short read at offset %" PRIu64, offset);
+
+  sha256_init(&sha256);
+  sha256_update(&sha256, buf, len);
+  sha256_final(&sha256, digest);
+
+  if (memcmp(digest, ctx->extents[extent], sizeof(digest)) != 0)
+    return dev_fail(dev, -EIO,
+		    "Data read back at offset %" PRIu64 " does not match the image",
+		    offset);
+
+  stage_add(ctx, IW_STAGE_VERIFY, len);
+  return 0;
+}
+
+static void *
+verify_thread(void *arg)
+{
+  iw_dev_t *dev = arg;
+  iw_ctx_t *ctx = dev->ctx;
+  _cleanup_close_ int fd = -EBADF;
+  uint8_t *buf = NULL;
+  int r;
+
+  fd = open(dev->path, O_RDONLY|O_DIRECT|O_CLOEXEC);
+  if (fd < 0 && errno == EINVAL)
+    fd = open(dev->path, O_RDONLY|O_CLOEXEC);
+  if (fd < 0)
+    {
+      dev_fail(dev, -errno, "Cannot open '%s': %s", dev->path,
+	       strerror(errno));
+      goto out;
+    }
+
+  r = posix_memalign((void **)&buf, IW_ALIGN, IW_VERIFY_EXTENT);
+  if (r != 0)
+    {
+      buf = NULL;
+      iw_fail(ctx, -r, "Cannot allocate read buffer: %s", strerror(r));
+      goto out;
+    }
+
+  while (__atomic_load_n(&dev->error, __ATOMIC_RELAXED) == 0 &&
+	 !iw_failed(ctx))
+    {
+      size_t i = __atomic_fetch_add(&dev->verify_next, 1, __ATOMIC_RELAXED);
+
+      if (i >= ctx->verify_count)
+	break;
+      if (verify_extent(dev, fd, buf,
+			ctx->verify_list ? ctx->verify_list[i] : i) < 0)
+	break;
+    }
+
+ out:
+  free(buf);
+  stage_end(ctx, IW_STAGE_VERIFY);
+
+  return NULL;
+}
+
+static uint64_t
+splitmix64(uint64_t *state)
+{
+  uint64_t z = (*state += 0x9e3779b97f4a7c15);
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  return z ^ (z >> 31);
+}
+
+/* Selects the extents to read back. Sampling picks one random extent
+   out of every of verify_samples equal parts of the image, so the
+   samples are spread over the whole image. The first and last extent
+   contain the partition tables and are always checked. */
+static int
+iw_verify_plan(iw_ctx_t *ctx)
+{
+  const iw_options_t *opts = ctx->opts;
+  size_t samples = opts->verify_samples < 2 ? 2 : opts->verify_samples;
+  uint64_t seed = now_usec();
+
+  if (opts->verify == IW_VERIFY_READBACK || ctx->nextents <= samples)
+    {
+      ctx->verify_count = ctx->nextents;
+      ctx->verify_size = ctx->output_size;
+      return 0;
+    }
+
+  ctx->verify_list = calloc(samples, sizeof(uint64_t));
+  if (!ctx->verify_list)
+    return -ENOMEM;
+
+  for (size_t i = 0; i < samples; i++)
+    {
+      uint64_t first = ctx->nextents * i / samples;
+      uint64_t end = ctx->nextents * (i + 1) / samples;
+
+      ctx->verify_list[i] = first + splitmix64(&seed) % (end - first);
+    }
+  ctx->verify_list[0] = 0;
+  ctx->verify_list[samples - 1] = ctx->nextents - 1;
+  ctx->verify_count = samples;
+
+  ctx->verify_size = (samples - 1) * (uint64_t)IW_VERIFY_EXTENT +
+    (ctx->output_size - (ctx->nextents - 1) * (uint64_t)IW_VERIFY_EXTENT);
+
+  return 0;
+}
+
+/*
+ * delta installation with a chunk index
+ */
+
+/* Reads chunk c from the device into buf, which holds the largest
+   chunk and two alignments. Returns 1 if it matches its digest, 0 if
+   not and -errno if the device cannot be read. */
+static int
+chunk_on_device(iw_dev_t *dev, int fd, uint8_t *buf, const chunk_t *c)
+{
+  size_t align = dev->params.alignment;
+  uint8_t digest[SHA256_DIGEST_SIZE];
+  sha256_ctx_t sha256;
+  uint64_t first;
+  size_t skip;
+  ssize_t n;
+
+  // O_DIRECT needs aligned reads, a short read means a small device
+  first = c->start & ~(uint64_t)(align - 1);
+  skip = c->start - first;
+  n = pread_all(fd, buf, (skip + c->size + align - 1) & ~(align - 1),
+		first, align);
+  if (n < 0)
+    return n;
+  if ((size_t)n < skip + c->size)
+    return 0;
+
+  sha256_init(&sha256);
+  sha256_update(&sha256, buf + skip, c->size);
+  sha256_final(&sha256, digest);
+  return memcmp(digest, c->sha256, sizeof(digest)) == 0;
+}
+
+/* Hashes the chunks already on the device. The ones which match the
+   chunk index are not written, a device which cannot be read gets all
+   chunks. */
+static void *
+compare_thread(void *arg)
+{
+  iw_dev_t *dev = arg;
+  iw_ctx_t *ctx = dev->ctx;
+  const chunk_index_t *idx = ctx->opts->chunks;
+  size_t align = dev->params.alignment;
+  _cleanup_close_ int fd = -EBADF;
+  uint8_t *buf = NULL;
+  int r;
+
+  fd = open(dev->path, O_RDONLY|O_DIRECT|O_CLOEXEC);
+  if (fd < 0 && errno == EINVAL)
+    fd = open(dev->path, O_RDONLY|O_CLOEXEC);
+  if (fd < 0)
+    {
+      MSG_WARN("Cannot read '%s', writing all chunks: %s", dev->path,
+	       strerror(errno));
+      goto out;
+    }
+
+  // chunks of a casync index start anywhere
+  r = posix_memalign((void **)&buf, IW_ALIGN, idx->chunk_size + 2 * align);
+  if (r != 0)
+    {
+      buf = NULL;
+      iw_fail(ctx, -r, "Cannot allocate read buffer: %s", strerror(r));
+      goto out;
+    }
+
+  while (!iw_failed(ctx))
+    {
+      size_t i = __atomic_fetch_add(&dev->compare_next, 1, __ATOMIC_RELAXED);
+      const chunk_t *c;
+
+      if (i >= idx->nchunks)
+	break;
+      c = &idx->chunks[i];
+
+      r = chunk_on_device(dev, fd, buf, c);
+      if (r < 0)
+	{
+	  MSG_WARN("Reading '%s' at offset %" PRIu64 " failed, writing the rest: %s",
+		   dev->path, c->start, strerror(-r));
+	  break;
+	}
+      stage_add(ctx, IW_STAGE_COMPARE, c->size);
+      if (r == 0)
+	continue;
+
+      __atomic_and_fetch(&dev->differs[i / 64], ~(UINT64_C(1) << (i % 64)),
+			 __ATOMIC_RELAXED);
+      __atomic_add_fetch(&dev->unchanged_bytes, c->size, __ATOMIC_RELAXED);
+    }
+
+ out:
+  free(buf);
+  stage_end(ctx, IW_STAGE_COMPARE);
+
+  return NULL;
+}
+
+/* Reads every chunk back after a delta installation, the ones which
+   were already on the device as well, and compares it with the chunk
+   index. */
+static void *
+delta_verify_thread(void *arg)
+{
+  iw_dev_t *dev = arg;
+  iw_ctx_t *ctx = dev->ctx;
+  const chunk_index_t *idx = ctx->opts->chunks;
+  _cleanup_close_ int fd = -EBADF;
+  uint8_t *buf = NULL;
+  int r;
+
+  fd = open(dev->path, O_RDONLY|O_DIRECT|O_CLOEXEC);
+  if (fd < 0 && errno == EINVAL)
+    fd = open(dev->path, O_RDONLY|O_CLOEXEC);
+  if (fd < 0)
+    {
+      dev_fail(dev, -errno, "Cannot open '%s': %s", dev->path,
+	       strerror(errno));
+      goto out;
+    }
+
+  r = posix_memalign((void **)&buf, IW_ALIGN,
+		     idx->chunk_size + 2 * dev->params.alignment);
+  if (r != 0)
+    {
+      buf = NULL;
+      iw_fail(ctx, -r, "Cannot allocate read buffer: %s", strerror(r));
+      goto out;
+    }
+
+  while (__atomic_load_n(&dev->error, __ATOMIC_RELAXED) == 0 &&
+	 !iw_failed(ctx))
+    {
+      size_t i = __atomic_fetch_add(&dev->verify_next, 1, __ATOMIC_RELAXED);
+      const chunk_t *c;
+
+      if (i >= idx->nchunks)
+	break;
+      c = &idx->chunks[i];
+
+      r = chunk_on_device(dev, fd, buf, c);
+      if (r < 0)
+	{
+	  dev_fail(dev, r, "Reading device at offset %" PRIu64 " failed: %s",
+		   c->start, strerror(-r));
+	  break;
+	}
+      if (r == 0)
+	{
+	  dev_fail(dev, -EIO, "Chunk %zu read back at offset %" PRIu64
+		   " does not match the chunk index", i, c->start);
+	  break;
+	}
+      stage_add(ctx, IW_STAGE_VERIFY, c->size);
+    }
+
+ out:
+  free(buf);
+  stage_end(ctx, IW_STAGE_VERIFY);
+
+  return NULL;
+}
+
+/* Decompresses chunk i of idx as read from the image file resp. the
+   chunk store into dst and verifies it. Returns -EBADMSG if the chunk
+   does not match the index, so it can be fetched again. */
+static int
+chunk_decode(iw_ctx_t *ctx, const chunk_index_t *idx, size_t i,
+	     const uint8_t *data, size_t len, uint8_t *dst, size_t dst_size)
+{
+  const chunk_t *c = &idx->chunks[i];
+  uint8_t digest[SHA256_DIGEST_SIZE];
+  sha256_ctx_t sha256;
+  int r = 0;
+
+  if (ctx->compression == COMPRESSION_NONE)
+    {
+      if (len != c->size)
+	return -EBADMSG;
+      memcpy(dst, data, len);
+    }
+  else
+    {
+      _cleanup_decoder_ decoder_t *d = NULL;
+      decoder_buf_t db = {
+	.src = data,
+	.src_size = len,
+	.dst = dst,
+	.dst_size = dst_size,
+      };
+
+      // every chunk is a complete frame or stream of its own
+      r = decoder_new(ctx->compression, 1, 0, &d);
+      if (r < 0)
+	return iw_fail(ctx, r, "Cannot create %s decoder: %s",
+		       compression_to_string(ctx->compression),
+		       strerror(-r));
+      r = decoder_run(d, &db, true);
+      if (r != 1 || db.dst_pos != c->size)
+	{
+	  MSG_DEBUG("Chunk %zu: %s", i, r < 0 ? decoder_strerror(d) :
+		    "size does not match");
+	  return -EBADMSG;
+	}
+    }
+
+  sha256_init(&sha256);
+  sha256_update(&sha256, dst, c->size);
+  sha256_final(&sha256, digest);
+  if (memcmp(digest, c->sha256, sizeof(digest)) != 0)
+    return -EBADMSG;
+
+  return 0;
+}
+
+static int
+chunk_mismatch(iw_ctx_t *ctx, size_t i, unsigned int tries)
+{
+  if (tries >= ctx->opts->download_retries)
+    return iw_fail(ctx, -EBADMSG,
+		   "Chunk %zu of '%s' does not match the chunk index", i,
+		   ctx->url);
+
+  MSG_WARN("Chunk %zu of '%s' does not match the chunk index, fetching it again",
+	   i, ctx->url);
+  __atomic_add_fetch(&ctx->retries, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/* Decompresses a chunk into a buffer for the write stages and verifies
+   it. The chunks with the same content get a copy. Returns -EBADMSG if
+   the chunk does not match the index. */
+static int
+delta_emit(iw_ctx_t *ctx, size_t i, const uint8_t *data, size_t len)
+{
+  const chunk_index_t *idx = ctx->opts->chunks;
+  const chunk_t *c = &idx->chunks[i];
+  iw_buf_t *b;
+  int r;
+
+  b = bufqueue_pop(&ctx->raw_free, &ctx->stage_wait_out[IW_STAGE_SOURCE]);
+  if (!b)
+    return -ECANCELED;
+
+  r = chunk_decode(ctx, idx, i, data, len, b->data, ctx->opts->buffer_size);
+  if (r < 0)
+    {
+      bufqueue_push(&ctx->raw_free, b);
+      return r;
+    }
+
+  b->len = c->size;
+  b->chunk = i;
+  b->refs = ctx->ndevs;
+  dev_push(ctx, b);
+
+  for (size_t j = ctx->dup_next[i]; j != SIZE_MAX; j = ctx->dup_next[j])
+    {
+      iw_buf_t *copy = bufqueue_pop(&ctx->raw_free,
+				    &ctx->stage_wait_out[IW_STAGE_SOURCE]);
+      if (!copy)
+	return -ECANCELED;
+
+      memcpy(copy->data, b->data, c->size);
+      copy->len = c->size;
+      copy->chunk = j;
+      copy->refs = ctx->ndevs;
+      dev_push(ctx, copy);
+    }
+
+  return 0;
+}
+
+// Reads a chunk of a chunk store, which must fit into the buffer
+static ssize_t
+read_chunk_file(const char *path, iw_buf_t *b, size_t size)
+{
+  _cleanup_close_ int fd = -EBADF;
+  size_t done = 0;
+
+  fd = open(path, O_RDONLY|O_CLOEXEC);
+  if (fd < 0)
+    return -errno;
+
+  while (1)
+    {
+      ssize_t n = read(fd, b->data + done, size - done);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -errno;
+	}
+      if (n == 0)
+	break;
+      done += n;
+      if (done == size)
+	return -EFBIG;
+    }
+
+  b->len = done;
+  return done;
+}
+
+/* The chunk cache is a chunk store itself. Chunks fetched from a remote
+   chunk store are kept there, later installations of images sharing
+   these chunks find them there. */
+static bool
+cache_load(iw_ctx_t *ctx, size_t i, iw_buf_t *b)
+{
+  const chunk_t *c = &ctx->opts->chunks->chunks[i];
+  _cleanup_free_ char *path = NULL;
+  int r;
+
+  if (chunk_store_path(ctx->opts->chunk_cache, c, &path) < 0 ||
+      read_chunk_file(path, b, ctx->opts->buffer_size) < 0)
+    return false;
+
+  r = delta_emit(ctx, i, b->data, b->len);
+  if (r == -EBADMSG)
+    {
+      MSG_WARN("Removing broken chunk '%s' from the chunk cache", path);
+      unlink(path);
+      return false;
+    }
+
+  __atomic_add_fetch(&ctx->cached_bytes, c->size, __ATOMIC_RELAXED);
+  return true;
+}
+
+static void
+cache_store(iw_ctx_t *ctx, size_t i, const uint8_t *data, size_t len)
+{
+  const chunk_t *c = &ctx->opts->chunks->chunks[i];
+  _cleanup_free_ char *path = NULL;
+  _cleanup_free_ char *tmp = NULL;
+  _cleanup_close_ int fd = -EBADF;
+  char *slash;
+  int r;
+
+  if (ctx->cache_error != 0)
+    return;
+
+  r = chunk_store_path(ctx->opts->chunk_cache, c, &path);
+  if (r < 0 || asprintf(&tmp, "%s.XXXXXX", path) < 0)
+    {
+      r = -ENOMEM;
+      goto fail;
+    }
+
+  // the directory of the chunk
+  slash = strrchr(tmp, '/');
+  *slash = '\0';
+  if (mkdir(tmp, 0755) < 0 && errno != EEXIST)
+    {
+      r = -errno;
+      goto fail;
+    }
+  *slash = '/';
+
+  // a partial chunk must never be found
+  fd = mkostemp(tmp, O_CLOEXEC);
+  if (fd < 0)
+    {
+      r = -errno;
+      goto fail;
+    }
+  r = pwrite_all(fd, data, len, 0);
+  if (r == 0 && rename(tmp, path) < 0)
+    r = -errno;
+  if (r < 0)
+    {
+      unlink(tmp);
+      goto fail;
+    }
+  return;
+
+ fail:
+  // the installation does not depend on the cache
+  ctx->cache_error = r;
+  MSG_WARN("Cannot store chunks in '%s': %s", ctx->opts->chunk_cache,
+	   strerror(-r));
+}
+
+/* Reads the differing chunks from a local image file resp. a local
+   chunk store */
+static void
+delta_read_file(iw_ctx_t *ctx)
+{
+  const chunk_index_t *idx = ctx->opts->chunks;
+
+  for (size_t i = 0; i < idx->nchunks && !iw_failed(ctx); i++)
+    {
+      const chunk_t *c = &idx->chunks[i];
+      _cleanup_free_ char *path = NULL;
+      iw_buf_t *b;
+      ssize_t n;
+      int r;
+
+      if (!bit_test(ctx->fetch, i))
+	continue;
+
+      b = bufqueue_pop(ctx->src_free, &ctx->stage_wait_out[IW_STAGE_SOURCE]);
+      if (!b)
+	return;
+      if (idx->store)
+	{
+	  n = chunk_store_path(ctx->url, c, &path);
+	  if (n == 0)
+	    n = read_chunk_file(path, b, ctx->opts->buffer_size);
+	}
+      else
+	{
+	  n = pread_all(ctx->src_fd, b->data, c->length, c->offset, 1);
+	  if (n >= 0 && (size_t)n != c->length)
+	    n = -EIO;
+	}
+      if (n >= 0)
+	{
+	  stage_add(ctx, IW_STAGE_SOURCE, n);
+	  r = delta_emit(ctx, i, b->data, n);
+	  if (r == -EBADMSG)
+	    iw_fail(ctx, r, "Chunk %zu of '%s' does not match the chunk index",
+		    i, ctx->url);
+	}
+      else
+	iw_fail(ctx, n, "Cannot read chunk %zu of '%s': %s", i,
+		path ?: ctx->url, strerror(-n));
+      bufqueue_push(ctx->src_free, b);
+    }
+}
+
+/* Starts the download of chunk i, which is a range of the image file
+   resp. a file of the chunk store */
+static int
+delta_request(iw_ctx_t *ctx, iw_segment_t *seg, CURLM *multi, iw_buf_t *b,
+	      size_t i)
+{
+  const chunk_index_t *idx = ctx->opts->chunks;
+  const chunk_t *c = &idx->chunks[i];
+  int r;
+
+  if (!idx->store)
+    return segment_start(seg, multi, b, i, c->offset, c->length);
+
+  free(seg->url);
+  seg->url = NULL;
+  r = chunk_store_path(ctx->url, c, &seg->url);
+  if (r < 0)
+    return r;
+  // the size of the compressed chunk is unknown
+  return segment_start(seg, multi, b, i, 0, ctx->opts->buffer_size);
+}
+
+/* Downloads the differing chunks with several parallel requests. The
+   chunks are independent of each other, so they get passed on in the
+   order they arrive. */
+static void
+delta_download(iw_ctx_t *ctx)
+{
+  const chunk_index_t *idx = ctx->opts->chunks;
+  _cleanup_free_ iw_segment_t *segs = NULL;
+  bool cache = idx->store && ctx->opts->chunk_cache;
+  size_t next = 0;        // next chunk to check
+  unsigned int active = 0;
+  CURLM *multi = NULL;
+
+  segs = calloc(ctx->streams, sizeof(iw_segment_t));
+  multi = curl_multi_init();
+  if (!segs || !multi)
+    {
+      iw_fail(ctx, -ENOMEM, "Cannot initialize parallel download");
+      goto out;
+    }
+  /* The chunks of a chunk store are small files, with HTTP/2 their
+     requests share one connection instead of waiting for each other. */
+  curl_multi_setopt(multi, CURLMOPT_PIPELINING,
+		    idx->store ? (long)CURLPIPE_MULTIPLEX : (long)CURLPIPE_NOTHING);
+  curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)ctx->streams);
+
+  for (unsigned int i = 0; i < ctx->streams; i++)
+    {
+      segs[i].ctx = ctx;
+      segs[i].curl = iw_curl_new(ctx);
+      if (!segs[i].curl)
+	{
+	  iw_fail(ctx, -ENOMEM, "curl_easy_init() failed");
+	  goto out;
+	}
+      iw_setup_curl(ctx, segs[i].curl, ctx->range_url ?: ctx->url);
+      if (idx->store)
+	curl_easy_setopt(segs[i].curl, CURLOPT_PIPEWAIT, 1L);
+      curl_easy_setopt(segs[i].curl, CURLOPT_WRITEFUNCTION, segment_write_cb);
+      curl_easy_setopt(segs[i].curl, CURLOPT_WRITEDATA, &segs[i]);
+      curl_easy_setopt(segs[i].curl, CURLOPT_PRIVATE, &segs[i]);
+    }
+
+  while (!iw_failed(ctx))
+    {
+      CURLMsg *msg;
+      int running, left, r;
+
+      for (unsigned int i = 0; i < ctx->streams; i++)
+	if (segs[i].buf && !segs[i].active && segs[i].retry_at <= now_usec() &&
+	    segment_request(&segs[i], multi) < 0)
+	  {
+	    iw_fail(ctx, -EIO, "curl_multi_add_handle() failed");
+	    goto out;
+	  }
+
+      for (unsigned int i = 0; i < ctx->streams; i++)
+	{
+	  iw_buf_t *b;
+
+	  if (segs[i].buf)
+	    continue;
+	  b = bufqueue_trypop(ctx->src_free);
+	  if (!b)
+	    break;
+	  // chunks found in the chunk cache need no download
+	  while (next < idx->nchunks &&
+		 (!bit_test(ctx->fetch, next) ||
+		  (cache && cache_load(ctx, next, b))))
+	    next++;
+	  if (next >= idx->nchunks || iw_failed(ctx))
+	    {
+	      bufqueue_push(ctx->src_free, b);
+	      break;
+	    }
+	  if (delta_request(ctx, &segs[i], multi, b, next) < 0)
+	    {
+	      bufqueue_push(ctx->src_free, b);
+	      segs[i].buf = NULL;
+	      iw_fail(ctx, -EIO, "Cannot request chunk %zu", next);
+	      goto out;
+	    }
+	  active++;
+	  next++;
+	}
+      if (active == 0)
+	break;
+
+      curl_multi_perform(multi, &running);
+
+      while ((msg = curl_multi_info_read(multi, &left)))
+	{
+	  iw_segment_t *seg;
+
+	  if (msg->msg != CURLMSG_DONE)
+	    continue;
+
+	  curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&seg);
+	  curl_multi_remove_handle(multi, seg->curl);
+	  seg->active = false;
+	  r = segment_done(ctx, seg, msg->data.result);
+	  if (r < 0)
+	    goto out;
+	  if (r == 0)
+	    continue;
+
+	  r = delta_emit(ctx, seg->chunk, seg->buf->data, seg->buf->len);
+	  if (r == -EBADMSG)
+	    {
+	      // a broken chunk gets fetched again right away
+	      if (chunk_mismatch(ctx, seg->chunk, seg->tries) < 0)
+		goto out;
+	      seg->tries++;
+	      seg->buf->len = 0;
+	      continue;
+	    }
+	  if (r < 0)
+	    goto out;
+	  if (cache)
+	    cache_store(ctx, seg->chunk, seg->buf->data, seg->buf->len);
+	  bufqueue_push(ctx->src_free, TAKE_PTR(seg->buf));
+	  active--;
+	}
+
+      curl_multi_poll(multi, NULL, 0, 10, NULL);
+    }
+
+ out:
+  if (segs)
+    for (unsigned int i = 0; i < ctx->streams; i++)
+      {
+	if (segs[i].active)
+	  curl_multi_remove_handle(multi, segs[i].curl);
+	if (segs[i].buf)
+	  bufqueue_push(ctx->src_free, segs[i].buf);
+	if (segs[i].curl)
+	  curl_easy_cleanup(segs[i].curl);
+	free(segs[i].url);
+      }
+  if (multi)
+    curl_multi_cleanup(multi);
+}
+
+static void *
+source_delta_thread(void *arg)
+{
+  iw_ctx_t *ctx = arg;
+
+  stage_begin(ctx, IW_STAGE_SOURCE);
+
+  if (ctx->streams > 0)
+    delta_download(ctx);
+  else
+    delta_read_file(ctx);
+
+  dev_close(ctx);
+  stage_end(ctx, IW_STAGE_SOURCE);
+
+  return NULL;
+}
+
+/*
+ * check stage
+ */
+
+/* Reads chunk i of the manifest again, from the image file resp. with a
+   range request from the server, and decompresses it into dst. The
+   decoders only report the end of the chunk with space left in dst. */
+static int
+check_refetch(iw_ctx_t *ctx, size_t i, uint8_t *dst, size_t dst_size)
+{
+  const chunk_t *c = &ctx->manifest->chunks[i];
+  _cleanup_free_ uint8_t *data = NULL;
+  iw_buf_t buf = {};
+
+  data = malloc(c->length);
+  if (!data)
+    return -ENOMEM;
+  buf.data = data;
+
+  if (ctx->src_fd >= 0)
+    {
+      ssize_t n = pread_all(ctx->src_fd, data, c->length, c->offset, 1);
+      if (n < 0)
+	return n;
+      buf.len = n;
+    }
+  else
+    {
+      iw_segment_t seg = {
+	.ctx = ctx,
+	.buf = &buf,
+	.expected = c->length,
+      };
+      char range[64];
+      CURLcode res;
+
+      seg.curl = iw_curl_new(ctx);
+      if (!seg.curl)
+	return -ENOMEM;
+      snprintf(range, sizeof(range), "%" PRIu64 "-%" PRIu64,
+	       c->offset, c->offset + c->length - 1);
+      iw_setup_curl(ctx, seg.curl, ctx->range_url ?: ctx->url);
+      curl_easy_setopt(seg.curl, CURLOPT_RANGE, range);
+      curl_easy_setopt(seg.curl, CURLOPT_WRITEFUNCTION, segment_write_cb);
+      curl_easy_setopt(seg.curl, CURLOPT_WRITEDATA, &seg);
+      res = curl_easy_perform(seg.curl);
+      curl_easy_cleanup(seg.curl);
+      if (res != CURLE_OK)
+	{
+	  MSG_DEBUG("Chunk %zu: %s", i, curl_easy_strerror(res));
+	  return -EIO;
+	}
+    }
+
+  return chunk_decode(ctx, ctx->manifest, i, data, buf.len, dst, dst_size);
+}
+
+/* Verifies chunk i of the manifest, the held buffers contain it and
+   the first one starts at offset start. A broken chunk gets read again
+   on its own and copied over the held data, no other stage has the
+   held buffers yet. */
+static int
+check_chunk(iw_ctx_t *ctx, size_t i, sha256_ctx_t *sha256,
+	    iw_buf_t **held, unsigned int nheld, uint64_t start)
+{
+  const chunk_t *c = &ctx->manifest->chunks[i];
+  _cleanup_free_ uint8_t *data = NULL;
+  uint8_t digest[SHA256_DIGEST_SIZE];
+  int r;
+
+  sha256_final(sha256, digest);
+  if (memcmp(digest, c->sha256, sizeof(digest)) == 0)
+    return 0;
+
+  // multicast cannot send a single chunk again
+  if (ctx->mcast_fd >= 0)
+    return iw_fail(ctx, -EBADMSG,
+		   "Chunk %zu of '%s' does not match the chunk index", i,
+		   ctx->url);
+
+  data = malloc(c->size + IW_ALIGN);
+  if (!data)
+    return iw_fail(ctx, -ENOMEM, "Cannot allocate memory for chunk %zu", i);
+
+  for (unsigned int tries = 0;; tries++)
+    {
+      r = chunk_mismatch(ctx, i, tries);
+      if (r < 0)
+	return r;
+      r = check_refetch(ctx, i, data, c->size + IW_ALIGN);
+      if (r == 0)
+	break;
+      if (r != -EBADMSG)
+	return iw_fail(ctx, r, "Cannot read chunk %zu of '%s' again: %s", i,
+		       ctx->url, strerror(-r));
+    }
+  ctx->refetched++;
+
+  for (unsigned int k = 0; k < nheld; k++)
+    {
+      uint64_t end = start + held[k]->len;
+      uint64_t from = start > c->start ? start : c->start;
+      uint64_t to = end < c->start + c->size ? end : c->start + c->size;
+
+      if (from < to)
+	memcpy(held[k]->data + (from - start), data + (from - c->start),
+	       to - from);
+      start = end;
+    }
+
+  return 0;
+}
+
+// Behind the decoder verified data goes to the output, else to the
+// stages reading the image
+static void
+check_push(iw_ctx_t *ctx, iw_buf_t *b)
+{
+  if (ctx->src_full)
+    out_push(ctx, b);
+  else
+    src_push(ctx, b);
+}
+
+/* Holds the output back until every chunk of the manifest in it got
+   verified, so no unverified data reaches the devices. */
+static void *
+check_thread(void *arg)
+{
+  iw_ctx_t *ctx = arg;
+  const chunk_index_t *idx = ctx->manifest;
+  _cleanup_free_ iw_buf_t **held = NULL;
+  unsigned int nheld = 0;
+  uint64_t held_start = 0;  // offset of the first held buffer
+  uint64_t offset = 0;      // end of the data hashed so far
+  size_t i = 0;             // chunk which gets hashed
+  sha256_ctx_t sha256;
+  iw_buf_t *b;
+
+  stage_begin(ctx, IW_STAGE_CHECK);
+
+  held = calloc(ctx->nbufs, sizeof(iw_buf_t *));
+  if (!held)
+    {
+      iw_fail(ctx, -ENOMEM, "Cannot allocate memory for the check stage");
+      goto out;
+    }
+
+  sha256_init(&sha256);
+  while ((b = bufqueue_pop(&ctx->check_full,
+			   &ctx->stage_wait_in[IW_STAGE_CHECK])))
+    {
+      // the buffer may get written and reused before the loop ends
+      size_t len = b->len;
+      size_t pos = 0;
+
+      held[nheld++] = b;
+      while (pos < len)
+	{
+	  const chunk_t *c;
+	  size_t n;
+
+	  if (i >= idx->nchunks)
+	    {
+	      iw_fail(ctx, -EBADMSG,
+		      "Image is larger than the chunk index image size %" PRIu64,
+		      idx->image_size);
+	      goto out;
+	    }
+	  c = &idx->chunks[i];
+	  n = c->start + c->size - offset;
+	  if (n > len - pos)
+	    n = len - pos;
+	  sha256_update(&sha256, b->data + pos, n);
+	  pos += n;
+	  offset += n;
+	  if (offset < c->start + c->size)
+	    continue;
+
+	  if (check_chunk(ctx, i, &sha256, held, nheld, held_start) < 0)
+	    goto out;
+	  i++;
+	  sha256_init(&sha256);
+
+	  // buffers with verified chunks only get passed on
+	  while (nheld > 0 && held_start + held[0]->len <= offset)
+	    {
+	      held_start += held[0]->len;
+	      check_push(ctx, held[0]);
+	      memmove(held, held + 1, --nheld * sizeof(iw_buf_t *));
+	    }
+	}
+      stage_add(ctx, IW_STAGE_CHECK, len);
+    }
+
+  if (iw_failed(ctx))
+    goto out;
+  if (i < idx->nchunks)
+    {
+      iw_fail(ctx, -EBADMSG,
+	      "Image size %" PRIu64 " does not match chunk index image size %" PRIu64,
+	      offset, idx->image_size);
+      goto out;
+    }
+  for (unsigned int k = 0; k < nheld; k++)
+    check_push(ctx, held[k]);
+
+ out:
+  if (ctx->src_full)
+    out_close(ctx);
+  else
+    src_push_close(ctx);
+  stage_end(ctx, IW_STAGE_CHECK);
+
+  return NULL;
+}
+
+/*
+ * setup
+ */
+
+/* All buffers come from one mapping, which gets populated right away:
+   without enough memory the installation fails here and not in the
+   middle of writing the devices. */
+static int
+iw_alloc_buffers(iw_ctx_t *ctx, unsigned int count)
+{
+  size_t size = (size_t)count * ctx->opts->buffer_size;
+  void *pool;
+
+  ctx->bufs = calloc(count, sizeof(iw_buf_t));
+  if (!ctx->bufs)
+    return -ENOMEM;
+  ctx->nbufs = count;
+
+  pool = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS,
+	      -1, 0);
+  if (pool == MAP_FAILED)
+    return -errno;
+  ctx->pool = pool;
+  ctx->pool_size = size;
+
+  // fewer TLB misses while hashing and copying, if the kernel agrees
+  if (size >= IW_HUGEPAGE_SIZE)
+    (void) madvise(pool, size, MADV_HUGEPAGE);
+#ifdef MADV_POPULATE_WRITE
+  // EINVAL: kernel older than 5.14, the pages get allocated on use
+  if (madvise(pool, size, MADV_POPULATE_WRITE) < 0 && errno != EINVAL)
+    return -errno;
+#endif
+
+  // the buffer size is a multiple of IW_ALIGN, the mapping page aligned
+  for (unsigned int i = 0; i < count; i++)
+    ctx->bufs[i].data = ctx->pool + (size_t)i * ctx->opts->buffer_size;
+  return 0;
+}
+
+/* Shrinks the reorder window and the rings until the buffers take at
+   most half of the memory limit, the decoder threads get the rest. The
+   pipeline only gets a bit slower with fewer buffers, a decoder which
+   needs more memory than available would get the installer killed. */
+static void
+iw_fit_memory(iw_ctx_t *ctx, unsigned int *src_bufs, unsigned int *raw_bufs,
+	      unsigned int extra_bufs)
+{
+  const iw_options_t *opts = ctx->opts;
+  unsigned int min_window = ctx->streams > 0 ? ctx->streams : 2;
+  uint64_t used;
+
+  if (opts->memory_limit == 0)
+    return;
+
+  for (;;)
+    {
+      used = (uint64_t)(*src_bufs + *raw_bufs + extra_bufs) * opts->buffer_size;
+      if (used <= opts->memory_limit / 2)
+	break;
+      if (ctx->window > min_window)
+	{
+	  ctx->window--;
+	  (*src_bufs)--;
+	}
+      else if (ctx->window == 0 && *src_bufs > 2)
+	(*src_bufs)--;
+      else if (*raw_bufs > 2)
+	(*raw_bufs)--;
+      else
+	break;
+    }
+
+  // 1: no memory left to decode in parallel
+  ctx->decoder_memory = used < opts->memory_limit ?
+    opts->memory_limit - used : 1;
+  MSG_INFO("Memory limit %zu MiB: %u buffers of %zu KiB, %" PRIu64
+	   " MiB for the decoder", opts->memory_limit / (1024 * 1024),
+	   *src_bufs + *raw_bufs + extra_bufs, opts->buffer_size / 1024,
+	   ctx->decoder_memory / (1024 * 1024));
+}
+
+static void
+iw_ctx_free(iw_ctx_t *ctx)
+{
+  if (ctx->pool)
+    munmap(ctx->pool, ctx->pool_size);
+  free(ctx->bufs);
+  free(ctx->zero_buf);
+  bufqueue_destroy(&ctx->comp_free);
+  bufqueue_destroy(&ctx->comp_full);
+  bufqueue_destroy(&ctx->raw_free);
+  bufqueue_destroy(&ctx->hash_full);
+  bufqueue_destroy(&ctx->hash_output_full);
+  bufqueue_destroy(&ctx->check_full);
+  bufqueue_destroy(&ctx->copy_full);
+  if (ctx->copy_fd >= 0)
+    close(ctx->copy_fd);
+  if (ctx->curl)
+    curl_easy_cleanup(ctx->curl);
+  if (ctx->src_fd >= 0)
+    close(ctx->src_fd);
+  if (ctx->mcast_fd >= 0)
+    close(ctx->mcast_fd);
+  for (unsigned int i = 0; i < ctx->ndevs; i++)
+    {
+      iw_dev_t *dev = &ctx->devs[i];
+
+      bufqueue_destroy(&dev->full);
+      if (dev->fd >= 0)
+	close(dev->fd);
+#if HAVE_LIBURING
+      if (dev->uring)
+	io_uring_queue_exit(&dev->ring);
+      free(dev->writes);
+      free(dev->free_writes);
+#endif
+      free(dev->differs);
+    }
+  free(ctx->devs);
+  free(ctx->range_url);
+  free(ctx->validator);
+  free(ctx->extents);
+  free(ctx->verify_list);
+  free(ctx->fetch);
+  free(ctx->dup_next);
+  curl_slist_free_all(ctx->validator_headers);
+  free(ctx->errmsg);
+  pthread_cond_destroy(&ctx->cond);
+  pthread_cond_destroy(&ctx->gate_cond);
+  pthread_mutex_destroy(&ctx->lock);
+}
+
+typedef struct {
+  iw_ctx_t *ctx;
+  bool accept_ranges;
+} iw_probe_t;
+
+// header lines are not NUL terminated
+static size_t
+curl_header_cb(char *buffer, size_t size, size_t nitems, void *userdata)
+{
+  iw_probe_t *probe = userdata;
+  size_t len = size * nitems;
+  const char *key = "accept-ranges:";
+
+  // the validator for the range requests
+  curl_validator_cb(buffer, size, nitems, probe->ctx);
+
+  // every response of a redirect chain starts with a status line
+  if (len >= 5 && strneq(buffer, "HTTP/", 5))
+    probe->accept_ranges = false;
+  else if (len > strlen(key) && strncaseeq(buffer, key, strlen(key)))
+    {
+      size_t i = strlen(key);
+
+      while (i < len && (buffer[i] == ' ' || buffer[i] == '\t'))
+	i++;
+      if (len - i >= 5 && strncaseeq(buffer + i, "bytes", 5))
+	probe->accept_ranges = true;
+    }
+
+  return len;
+}
+
+/* Checks with a HEAD request if the server supports range requests, the
+   size of the image is known and it has a validator. Any problem here
+   only means that the image gets downloaded as single stream. */
+static void
+iw_probe_ranges(iw_ctx_t *ctx)
+{
+  const iw_options_t *opts = ctx->opts;
+  iw_probe_t probe = { .ctx = ctx };
+  curl_off_t size = -1;
+  char *effective_url = NULL;
+  CURL *curl = ctx->curl;
+  CURLcode res;
+
+  if (opts->download_streams <= 1)
+    return;
+
+  curl_easy_setopt(curl, CURLOPT_URL, ctx->url);
+  curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, curl_header_cb);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, &probe);
+
+  res = curl_easy_perform(curl);
+  if (res == CURLE_OK)
+    {
+      curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &size);
+      curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &effective_url);
+    }
+
+  if (res != CURLE_OK)
+    MSG_INFO("Probing '%s' failed (%s), using single stream", ctx->url,
+	     curl_easy_strerror(res));
+  else if (!probe.accept_ranges || size <= 0)
+    MSG_INFO("Server does not support range requests, using single stream");
+  else if ((uint64_t)size <= opts->buffer_size)
+    MSG_DEBUG("Image too small for parallel download");
+  /* Without validator the chunks could come from different versions of
+     the image, if it gets replaced during the download. */
+  else if (!ctx->validator)
+    MSG_INFO("Server sends neither ETag nor Last-Modified, using single stream");
+  else
+    {
+      ctx->range_url = strdup(effective_url ?: ctx->url);
+      if (ctx->range_url)
+	{
+	  size_t window = opts->download_window / opts->buffer_size;
+
+	  ctx->streams = opts->download_streams;
+	  ctx->window = window > ctx->streams ? window : ctx->streams;
+	  ctx->source_size = size;
+	  MSG_INFO("Downloading with %u streams, reorder window of %u buffers",
+		   ctx->streams, ctx->window);
+	}
+    }
+
+  iw_curl_reset(ctx, curl);
+}
+
+// first bytes of the image, to recognize the compression
+typedef struct {
+  uint8_t data[COMPRESSION_MAGIC_SIZE];
+  size_t len;
+} iw_peek_t;
+
+static size_t
+curl_peek_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+  iw_peek_t *peek = userdata;
+  size_t n = size * nmemb;
+
+  if (n > sizeof(peek->data) - peek->len)
+    n = sizeof(peek->data) - peek->len;
+  memcpy(peek->data + peek->len, ptr, n);
+  peek->len += n;
+
+  // a server ignoring the range sends the complete image, stop it
+  return peek->len == sizeof(peek->data) ? 0 : size * nmemb;
+}
+
+static int
+iw_peek_url(iw_ctx_t *ctx, iw_peek_t *peek)
+{
+  // with a chunk index there is no handle for the whole image
+  CURL *curl = ctx->curl ?: iw_curl_new(ctx);
+  char range[32];
+  CURLcode res;
+
+  if (!curl)
+    return -ENOMEM;
+
+  snprintf(range, sizeof(range), "0-%zu", sizeof(peek->data) - 1);
+  curl_easy_setopt(curl, CURLOPT_URL, ctx->range_url ?: ctx->url);
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(curl, CURLOPT_RANGE, range);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_peek_cb);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, peek);
+  curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+  curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 60L);
+
+  res = curl_easy_perform(curl);
+  if (curl == ctx->curl)
+    iw_curl_reset(ctx, curl);
+  else
+    curl_easy_cleanup(curl);
+
+  if (res == CURLE_WRITE_ERROR && peek->len == sizeof(peek->data))
+    return 0;
+  if (res != CURLE_OK)
+    {
+      MSG_DEBUG("Reading the start of '%s' failed: %s", ctx->url,
+		curl_easy_strerror(res));
+      return -EIO;
+    }
+  return 0;
+}
+
+static int
+iw_peek_file(iw_ctx_t *ctx, iw_peek_t *peek)
+{
+  while (peek->len < sizeof(peek->data))
+    {
+      ssize_t n = pread(ctx->src_fd, peek->data + peek->len,
+			sizeof(peek->data) - peek->len, peek->len);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  // e.g. a pipe, which cannot be read twice
+	  return -errno;
+	}
+      if (n == 0)
+	break;
+      peek->len += n;
+    }
+  return 0;
+}
+
+/* The compression gets recognized by the first bytes of the image, so
+   URLs without suffix, with a query string or a wrong suffix work, too.
+   The suffix is only used if the start of the image cannot be read in
+   advance. */
+static void
+iw_detect_compression(iw_ctx_t *ctx)
+{
+  compression_t by_name = compression_from_filename(ctx->url);
+  iw_peek_t peek = {};
+  int r;
+
+  if (ctx->mcast_fd >= 0)
+    {
+      // the announcement contains the start of the image
+      peek.len = ctx->mcast_info.head_len < sizeof(peek.data) ?
+	ctx->mcast_info.head_len : sizeof(peek.data);
+      memcpy(peek.data, ctx->mcast_info.head, peek.len);
+      r = 0;
+    }
+  else if (ctx->src_fd >= 0)
+    r = iw_peek_file(ctx, &peek);
+  else
+    r = iw_peek_url(ctx, &peek);
+  if (r < 0)
+    {
+      MSG_DEBUG("Cannot read the start of the image (%s), using the suffix",
+		strerror(-r));
+      ctx->compression = by_name;
+      return;
+    }
+
+  ctx->compression = compression_from_magic(peek.data, peek.len);
+  if (by_name != COMPRESSION_NONE && by_name != ctx->compression)
+    MSG_WARN("'%s' is %s compressed, not %s as the name suggests",
+	     ctx->url, compression_to_string(ctx->compression),
+	     compression_to_string(by_name));
+}
+
+/* Joins the multicast group and waits for the announcement of the
+   image, which is needed for the size and the compression. */
+static int
+iw_open_mcast(iw_ctx_t *ctx)
+{
+  struct sockaddr_in group;
+  unsigned int ifindex;
+  size_t window;
+  int r;
+
+  r = mcast_parse_url(ctx->url, &group, &ifindex);
+  if (r < 0)
+    return iw_fail(ctx, r, "Invalid multicast URL '%s'", ctx->url);
+
+  r = mcast_open_receiver(&group, ifindex);
+  if (r < 0)
+    return iw_fail(ctx, r, "Cannot join multicast group of '%s': %s",
+		   ctx->url, strerror(-r));
+  ctx->mcast_fd = r;
+
+  MSG_INFO("Waiting for the multicast sender of '%s'", ctx->url);
+  r = mcast_wait_info(ctx->mcast_fd, MCAST_TIMEOUT_SEC * 1000,
+		      &ctx->mcast_session, &ctx->mcast_sender,
+		      &ctx->mcast_info);
+  if (r < 0)
+    return iw_fail(ctx, r, "No multicast sender for '%s': %s", ctx->url,
+		   strerror(-r));
+  if (ctx->mcast_info.size == 0)
+    return iw_fail(ctx, -EINVAL, "Multicast sender announced an empty image");
+
+  // reordering needs at least the chunk being emitted and the next one
+  window = ctx->opts->download_window / ctx->opts->buffer_size;
+  ctx->window = window > 2 ? window : 2;
+  ctx->source_size = ctx->mcast_info.size;
+  MSG_INFO("Receiving %" PRIu64 " bytes from %s, reorder window of %u buffers",
+	   ctx->source_size, inet_ntoa(ctx->mcast_sender.sin_addr),
+	   ctx->window);
+
+  return 0;
+}
+
+static int
+iw_open_source(iw_ctx_t *ctx)
+{
+  if (startswith(ctx->url, "mcast://"))
+    return iw_open_mcast(ctx);
+
+  if (startswith(ctx->url, "https://") || startswith(ctx->url, "http://"))
+    {
+      /* With a chunk index only range requests for single chunks are
+	 made, with a chunk store the chunks are files below the URL. */
+      if (ctx->opts->chunks)
+	{
+	  if (!ctx->opts->chunks->store)
+	    {
+	      ctx->range_url = strdup(ctx->url);
+	      if (!ctx->range_url)
+		return iw_fail(ctx, -ENOMEM, "Cannot allocate memory for the range URL");
+	    }
+	  ctx->streams = ctx->opts->download_streams > 1 ?
+	    ctx->opts->download_streams : 1;
+	  return 0;
+	}
+
+      /* The probe, the start of the image and the download itself (resp.
+	 its first stream) use the same handle and so one connection. */
+      ctx->curl = iw_curl_new(ctx);
+      if (!ctx->curl)
+	return iw_fail(ctx, -ENOMEM, "curl_easy_init() failed");
+
+      iw_probe_ranges(ctx);
+    }
+  else if (ctx->opts->chunks && ctx->opts->chunks->store)
+    {
+      // local chunk store, the chunks get opened one by one
+      if (access(ctx->url, R_OK|X_OK) < 0)
+	return iw_fail(ctx, -errno, "Cannot access '%s': %s", ctx->url,
+		       strerror(errno));
+    }
+  else
+    {
+      struct stat st;
+
+      ctx->src_fd = open(ctx->url, O_RDONLY|O_CLOEXEC);
+      if (ctx->src_fd < 0)
+	return iw_fail(ctx, -errno, "Cannot open '%s': %s", ctx->url,
+		       strerror(errno));
+      if (fstat(ctx->src_fd, &st) == 0 && S_ISREG(st.st_mode))
+	ctx->source_size = st.st_size;
+      posix_fadvise(ctx->src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+  return 0;
+}
+
+static int
+iw_open_device(iw_dev_t *dev)
+{
+  struct stat st;
+
+  if (!dev->params.direct)
+    dev->fd = open(dev->path, O_WRONLY|O_CLOEXEC);
+  else if ((dev->fd = open(dev->path, O_WRONLY|O_DIRECT|O_CLOEXEC)) < 0 &&
+	   errno == EINVAL)
+    {
+      // e.g. tmpfs does not support O_DIRECT
+      MSG_WARN("Cannot open '%s' with O_DIRECT, using buffered I/O",
+	       dev->path);
+      dev->fd = open(dev->path, O_WRONLY|O_CLOEXEC);
+    }
+  else
+    dev->direct = true;
+
+  if (dev->fd < 0)
+    return dev_fail(dev, -errno, "Cannot open '%s': %s", dev->path,
+		    strerror(errno));
+
+  if (fstat(dev->fd, &st) < 0)
+    return dev_fail(dev, -errno, "Cannot stat '%s': %s", dev->path,
+		    strerror(errno));
+  dev->is_blkdev = S_ISBLK(st.st_mode);
+
+  return 0;
+}
+
+/* Submits the writes with io_uring if the kernel supports it. Registering
+   the buffers saves mapping them for every request, but needs locked
+   memory, so it is optional as well. */
+static void
+iw_setup_uring(iw_dev_t _unused_ *dev)
+{
+#if HAVE_LIBURING
+  iw_ctx_t *ctx = dev->ctx;
+  unsigned int depth = dev->params.queue_depth;
+  _cleanup_free_ struct iovec *iov = NULL;
+  int r;
+
+  if (depth == 0)
+    return;
+
+  r = io_uring_queue_init(depth, &dev->ring, 0);
+  if (r < 0)
+    {
+      MSG_INFO("io_uring not available (%s), using pwrite", strerror(-r));
+      return;
+    }
+  dev->uring = true;
+
+  dev->writes = calloc(depth, sizeof(iw_write_t));
+  dev->free_writes = calloc(depth, sizeof(unsigned int));
+  iov = calloc(ctx->nbufs, sizeof(struct iovec));
+  if (!dev->writes || !dev->free_writes || !iov)
+    {
+      MSG_WARN("Cannot allocate io_uring requests, using pwrite");
+      io_uring_queue_exit(&dev->ring);
+      dev->uring = false;
+      return;
+    }
+  for (unsigned int i = 0; i < depth; i++)
+    dev->free_writes[dev->nfree++] = i;
+
+  for (unsigned int i = 0; i < ctx->nbufs; i++)
+    {
+      iov[i].iov_base = ctx->bufs[i].data;
+      iov[i].iov_len = ctx->opts->buffer_size;
+    }
+  r = io_uring_register_buffers(&dev->ring, iov, ctx->nbufs);
+  if (r < 0)
+    MSG_DEBUG("Cannot register buffers: %s", strerror(-r));
+  dev->fixed = (r == 0);
+
+  MSG_INFO("Writing to '%s' with io_uring, queue depth %u%s", dev->path,
+	   depth, dev->fixed ? ", registered buffers" : "");
+#endif
+}
+
+static int
+iw_start_thread(iw_ctx_t *ctx, pthread_t *thread, void *(*fn)(void *),
+		void *arg)
+{
+  int r;
+
+  pthread_mutex_lock(&ctx->lock);
+  ctx->running++;
+  pthread_mutex_unlock(&ctx->lock);
+
+  r = pthread_create(thread, NULL, fn, arg);
+  if (r != 0)
+    {
+      pthread_mutex_lock(&ctx->lock);
+      ctx->running--;
+      pthread_mutex_unlock(&ctx->lock);
+      return iw_fail(ctx, -r, "Cannot create thread: %s", strerror(r));
+    }
+
+  return 0;
+}
+
+/* Replaces the average throughput of the running stages with the
+   throughput since the last call. */
+static void
+iw_update_rates(iw_stats_t *stats, uint64_t last_bytes[_IW_STAGE_MAX],
+		uint64_t *last_usec)
+{
+  for (int i = 0; i < _IW_STAGE_MAX; i++)
+    {
+      iw_stage_stats_t *st = &stats->stage[i];
+
+      if (*last_usec > 0 && st->usec > 0)
+	st->mb_per_sec = iw_mb_per_sec(st->bytes - last_bytes[i],
+				       stats->usec - *last_usec);
+      last_bytes[i] = st->bytes;
+    }
+  *last_usec = stats->usec;
+}
+
+// One key=value line per stage, so the log can be evaluated by scripts
+static void
+iw_log_stats(const iw_stats_t *stats)
+{
+  for (int i = 0; i < _IW_STAGE_MAX; i++)
+    {
+      const iw_stage_stats_t *st = &stats->stage[i];
+
+      if (st->usec == 0)
+	continue;
+      MSG_INFO("stats elapsed_ms=%" PRIu64 " stage=%s bytes_in=%" PRIu64
+	       " bytes_out=%" PRIu64 " mb_s=%.1f wait_in_ms=%" PRIu64
+	       " wait_out_ms=%" PRIu64 " cpu_ms=%" PRIu64,
+	       stats->usec / 1000, iw_stage_to_string(i), st->bytes_in,
+	       st->bytes, st->mb_per_sec, st->wait_in_usec / 1000,
+	       st->wait_out_usec / 1000, st->cpu_usec / 1000);
+    }
+}
+
+// Reports progress until all threads are done
+static void
+iw_wait(iw_ctx_t *ctx, pthread_t *threads, unsigned int nthreads)
+{
+  const iw_options_t *opts = ctx->opts;
+  uint64_t last_bytes[_IW_STAGE_MAX] = {};
+  uint64_t last_usec = 0, last_log = 0;
+
+  /* The stages in front of the write stage already run while the
+     caller decides whether the devices may get written. */
+  if (!ctx->gate_open)
+    {
+      int r = opts->gate(opts->userdata);
+
+      if (r < 0)
+	iw_fail(ctx, r, "Writing the image was cancelled: %s", strerror(-r));
+      else
+	{
+	  pthread_mutex_lock(&ctx->lock);
+	  ctx->gate_open = true;
+	  pthread_cond_broadcast(&ctx->gate_cond);
+	  pthread_mutex_unlock(&ctx->lock);
+	}
+    }
+
+  pthread_mutex_lock(&ctx->lock);
+  while (ctx->running > 0)
+    {
+      struct timespec ts;
+      iw_stats_t stats;
+
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += opts->progress_interval / 1000;
+      ts.tv_nsec += (long)(opts->progress_interval % 1000) * 1000000;
+      if (ts.tv_nsec >= 1000000000)
+	{
+	  ts.tv_sec++;
+	  ts.tv_nsec -= 1000000000;
+	}
+      pthread_cond_timedwait(&ctx->cond, &ctx->lock, &ts);
+
+      pthread_mutex_unlock(&ctx->lock);
+      iw_get_stats(ctx, &stats);
+      iw_update_rates(&stats, last_bytes, &last_usec);
+      if (opts->progress)
+	opts->progress(&stats, opts->userdata);
+      if (opts->log_interval > 0 &&
+	  stats.usec - last_log >= (uint64_t)opts->log_interval * 1000)
+	{
+	  iw_log_stats(&stats);
+	  last_log = stats.usec;
+	}
+      pthread_mutex_lock(&ctx->lock);
+    }
+  pthread_mutex_unlock(&ctx->lock);
+
+  for (unsigned int i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+}
+
+/* Reads the written image back with several threads per device, so
+   the devices get enough requests in flight, and compares it with the
+   extent digests calculated while writing. After a delta installation
+   all chunks get compared with the chunk index instead. */
+static void
+iw_verify(iw_ctx_t *ctx)
+{
+  const iw_options_t *opts = ctx->opts;
+  unsigned int count = opts->verify_threads ? opts->verify_threads : 1;
+  _cleanup_free_ pthread_t *threads = NULL;
+  unsigned int nthreads = 0;
+  unsigned int ndevs = ctx->ndevs - ctx->failed_devs;
+  void *(*fn)(void *) = verify_thread;
+  int r;
+
+  if (opts->chunks)
+    {
+      fn = delta_verify_thread;
+      ctx->verify_size = opts->chunks->image_size;
+    }
+  else
+    {
+      r = iw_verify_plan(ctx);
+      if (r < 0)
+	{
+	  iw_fail(ctx, r, "Cannot plan verification: %s", strerror(-r));
+	  return;
+	}
+    }
+
+  threads = calloc((size_t)count * ndevs, sizeof(pthread_t));
+  if (!threads)
+    {
+      iw_fail(ctx, -ENOMEM, "Cannot allocate verify threads");
+      return;
+    }
+
+  if (opts->chunks)
+    MSG_INFO("Verifying %zu chunks on %u devices with %u threads each",
+	     opts->chunks->nchunks, ndevs, count);
+  else
+    MSG_INFO("Verifying %zu of %zu extents on %u devices with %u threads each (%s)",
+	     ctx->verify_count, ctx->nextents, ndevs, count,
+	     iw_verify_to_string(opts->verify));
+
+  __atomic_store_n(&ctx->verify_size, ctx->verify_size * ndevs,
+		   __ATOMIC_RELAXED);
+  stage_begin(ctx, IW_STAGE_VERIFY);
+  for (unsigned int d = 0; d < ctx->ndevs; d++)
+    {
+      if (ctx->devs[d].error != 0)
+	continue;
+      for (unsigned int i = 0; i < count; i++)
+	{
+	  if (iw_start_thread(ctx, &threads[nthreads], fn, &ctx->devs[d]) < 0)
+	    goto wait;
+	  nthreads++;
+	}
+    }
+
+ wait:
+  iw_wait(ctx, threads, nthreads);
+}
+
+// Orders the chunks by content, the same content by position
+static int
+chunk_cmp(const void *a, const void *b, void *userdata)
+{
+  const chunk_index_t *idx = userdata;
+  size_t i = *(const size_t *)a, j = *(const size_t *)b;
+  int r;
+
+  r = memcmp(idx->chunks[i].sha256, idx->chunks[j].sha256,
+	     SHA256_DIGEST_SIZE);
+  if (r != 0)
+    return r;
+  return i < j ? -1 : i > j;
+}
+
+/* Chunks with the same content, e.g. zeros, get fetched only once. The
+   first one of them stays in the fetch bitmap, the others get copies
+   of it by the source stage. */
+static int
+iw_dedup_chunks(iw_ctx_t *ctx)
+{
+  const chunk_index_t *idx = ctx->opts->chunks;
+  _cleanup_free_ size_t *order = NULL;
+  size_t n = 0, dups = 0;
+
+  ctx->dup_next = malloc(idx->nchunks * sizeof(size_t));
+  order = malloc(idx->nchunks * sizeof(size_t));
+  if (!ctx->dup_next || !order)
+    return -ENOMEM;
+
+  for (size_t i = 0; i < idx->nchunks; i++)
+    {
+      ctx->dup_next[i] = SIZE_MAX;
+      if (bit_test(ctx->fetch, i))
+	order[n++] = i;
+    }
+  qsort_r(order, n, sizeof(size_t), chunk_cmp, (void *)idx);
+
+  for (size_t k = 1; k < n; k++)
+    {
+      size_t prev = order[k - 1], i = order[k];
+
+      if (memcmp(idx->chunks[prev].sha256, idx->chunks[i].sha256,
+		 SHA256_DIGEST_SIZE) != 0)
+	continue;
+      ctx->dup_next[prev] = i;
+      ctx->fetch[i / 64] &= ~(UINT64_C(1) << (i % 64));
+      dups++;
+    }
+
+  if (dups > 0)
+    MSG_INFO("%zu chunks are duplicates of other chunks", dups);
+  return 0;
+}
+
+/* Compares the chunks of the chunk index with the data already on the
+   devices, with several threads per device like the verification. The
+   chunks differing on any device get fetched, every device writes only
+   its own differing ones. */
+static void
+iw_compare(iw_ctx_t *ctx)
+{
+  const iw_options_t *opts = ctx->opts;
+  const chunk_index_t *idx = opts->chunks;
+  unsigned int count = opts->verify_threads ? opts->verify_threads : 1;
+  size_t words = (idx->nchunks + 63) / 64;
+  _cleanup_free_ pthread_t *threads = NULL;
+  unsigned int nthreads = 0;
+  unsigned int ndevs = ctx->ndevs - ctx->failed_devs;
+  uint64_t fetch_size = 0;
+  size_t nfetch = 0;
+  int r;
+
+  threads = calloc((size_t)count * ndevs, sizeof(pthread_t));
+  ctx->fetch = calloc(words, sizeof(uint64_t));
+  if (!threads || !ctx->fetch)
+    {
+      iw_fail(ctx, -ENOMEM, "Cannot allocate memory for the chunk comparison");
+      return;
+    }
+  for (unsigned int d = 0; d < ctx->ndevs; d++)
+    {
+      iw_dev_t *dev = &ctx->devs[d];
+
+      dev->differs = malloc(words * sizeof(uint64_t));
+      if (!dev->differs)
+	{
+	  iw_fail(ctx, -ENOMEM, "Cannot allocate memory for the chunk comparison");
+	  return;
+	}
+      memset(dev->differs, 0xff, words * sizeof(uint64_t));
+    }
+
+  MSG_INFO("Comparing %zu chunks on %u devices with %u threads each",
+	   idx->nchunks, ndevs, count);
+
+  __atomic_store_n(&ctx->compare_size, idx->image_size * ndevs,
+		   __ATOMIC_RELAXED);
+  stage_begin(ctx, IW_STAGE_COMPARE);
+  for (unsigned int d = 0; d < ctx->ndevs; d++)
+    {
+      if (ctx->devs[d].error != 0)
+	continue;
+      for (unsigned int i = 0; i < count; i++)
+	{
+	  if (iw_start_thread(ctx, &threads[nthreads], compare_thread,
+			      &ctx->devs[d]) < 0)
+	    goto wait;
+	  nthreads++;
+	}
+    }
+
+ wait:
+  iw_wait(ctx, threads, nthreads);
+  if (iw_failed(ctx))
+    return;
+
+  for (unsigned int d = 0; d < ctx->ndevs; d++)
+    {
+      iw_dev_t *dev = &ctx->devs[d];
+
+      if (dev->error != 0)
+	continue;
+      for (size_t w = 0; w < words; w++)
+	ctx->fetch[w] |= dev->differs[w];
+      MSG_INFO("%s: %" PRIu64 " of %" PRIu64 " bytes are unchanged",
+	       dev->path, dev->unchanged_bytes, idx->image_size);
+    }
+  r = iw_dedup_chunks(ctx);
+  if (r < 0)
+    {
+      iw_fail(ctx, r, "Cannot allocate memory for the chunk comparison");
+      return;
+    }
+
+  for (size_t i = 0; i < idx->nchunks; i++)
+    if (bit_test(ctx->fetch, i))
+      {
+	fetch_size += idx->chunks[i].length;
+	nfetch++;
+      }
+
+  // the size of the chunks in a chunk store is unknown
+  ctx->source_size = idx->store ? 0 : fetch_size;
+  if (idx->store)
+    MSG_INFO("Fetching %zu of %zu chunks", nfetch, idx->nchunks);
+  else
+    MSG_INFO("Fetching %zu of %zu chunks, %" PRIu64 " bytes", nfetch,
+	     idx->nchunks, fetch_size);
+}
+
+int
+image_write(const char *url, const char *const *devices, size_t ndevices,
+	    const iw_options_t *opts, iw_result_t *ret, char **error)
+{
+  iw_options_t def_opts, delta_opts;
+  iw_ctx_t ctx = {
+    .url = url,
+    .src_fd = -EBADF,
+    .mcast_fd = -EBADF,
+    .copy_fd = -EBADF,
+  };
+  // source, hash, decompress, check, hash-output, copy and one writer
+  // and discard thread per device
+  pthread_t threads[6 + 2 * IW_MAX_DEVICES];
+  unsigned int nthreads = 0;
+  int r;
+
+  MSG_FUNC("url='%s', device='%s', ndevices=%zu", url,
+	   ndevices > 0 ? devices[0] : "", ndevices);
+
+  if (!opts)
+    {
+      iw_options_init(&def_opts);
+      opts = &def_opts;
+    }
+  if (opts->buffer_size == 0 || opts->buffer_size % IW_ALIGN != 0 ||
+      opts->buffers == 0 || ndevices == 0 || ndevices > IW_MAX_DEVICES)
+    return -EINVAL;
+  // multicast sends the whole image anyway
+  if (opts->chunks && startswith(url, "mcast://"))
+    return -EINVAL;
+  // the chunks of the manifest must be parts of the image file
+  if (opts->manifest && opts->manifest->store)
+    return -EINVAL;
+
+  /* With a chunk index every buffer holds one chunk, which goes to the
+     devices in the order the chunks arrive. Block map, copy and the
+     extent digests need the image in order, the chunks get verified and
+     read back with their own digests instead. */
+  bool delta = opts->chunks != NULL;
+  if (delta)
+    {
+      uint64_t size = opts->chunks->chunk_size;
+
+      // a compressed chunk is at most slightly larger than the chunk
+      if (opts->chunks->store)
+	size += size / 8 + 65536;
+      for (size_t i = 0; i < opts->chunks->nchunks; i++)
+	if (opts->chunks->chunks[i].length > size)
+	  size = opts->chunks->chunks[i].length;
+
+      delta_opts = *opts;
+      delta_opts.buffer_size = (size + IW_ALIGN - 1) & ~(uint64_t)(IW_ALIGN - 1);
+      delta_opts.bmap = NULL;
+      delta_opts.copy_path = NULL;
+      delta_opts.hash_output = false;
+      opts = &delta_opts;
+    }
+
+  ctx.devs = calloc(ndevices, sizeof(iw_dev_t));
+  if (!ctx.devs)
+    return -ENOMEM;
+  ctx.ndevs = ndevices;
+  for (size_t i = 0; i < ndevices; i++)
+    {
+      ctx.devs[i].ctx = &ctx;
+      ctx.devs[i].path = devices[i];
+      ctx.devs[i].fd = -EBADF;
+      if (opts->device_params)
+	ctx.devs[i].params = opts->device_params[i];
+      else
+	iw_device_params_init(opts, &ctx.devs[i].params);
+      if (!iw_device_params_valid(&ctx.devs[i].params))
+	{
+	  free(ctx.devs);
+	  return -EINVAL;
+	}
+      sha256_init(&ctx.devs[i].range_sha256);
+    }
+
+  ctx.opts = opts;
+  // a delta installation verifies every chunk anyway
+  ctx.manifest = delta ? NULL : opts->manifest;
+  pthread_mutex_init(&ctx.lock, NULL);
+  pthread_cond_init(&ctx.cond, NULL);
+  pthread_cond_init(&ctx.gate_cond, NULL);
+  ctx.gate_open = opts->gate == NULL;
+  sha256_init(&ctx.sha256);
+  sha256_init(&ctx.output_sha256);
+
+  if (iw_open_source(&ctx) < 0)
+    goto finish;
+
+  // the chunks of a chunk store are zstd compressed
+  if (delta && opts->chunks->store)
+    {
+      ctx.compression = COMPRESSION_ZSTD;
+      if (opts->chunk_cache && mkdir(opts->chunk_cache, 0755) < 0 &&
+	  errno != EEXIST)
+	{
+	  ctx.cache_error = -errno;
+	  MSG_WARN("Cannot create chunk cache '%s': %s", opts->chunk_cache,
+		   strerror(errno));
+	}
+    }
+  else
+    iw_detect_compression(&ctx);
+  MSG_INFO("decompressor=%s, sha256=%s",
+	   compression_to_string(ctx.compression), sha256_implementation());
+
+  if (opts->copy_path)
+    {
+      ctx.copy_fd = open(opts->copy_path,
+			 O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+      if (ctx.copy_fd < 0)
+	{
+	  ctx.copy_error = -errno;
+	  MSG_WARN("Cannot create '%s': %s", opts->copy_path,
+		   strerror(-ctx.copy_error));
+	}
+    }
+
+  bool use_decoder = !delta && ctx.compression != COMPRESSION_NONE;
+  // parallel downloads and multicast need more buffers for reordering,
+  // the chunks of a delta installation get decompressed by the source
+  unsigned int src_bufs = delta ? (ctx.streams > 0 ? ctx.streams : 1) :
+    ctx.window > 0 ? ctx.window : opts->buffers;
+  unsigned int raw_bufs = use_decoder || delta ? opts->buffers : 0;
+  // the check stage holds the buffers of a chunk until it is complete
+  unsigned int check_bufs = ctx.manifest ?
+    ctx.manifest->chunk_size / opts->buffer_size + 2 : 0;
+
+  iw_fit_memory(&ctx, &src_bufs, &raw_bufs, check_bufs);
+  unsigned int nbufs = src_bufs + raw_bufs + check_bufs;
+
+  r = iw_alloc_buffers(&ctx, nbufs);
+  if (r < 0)
+    {
+      iw_fail(&ctx, r, "Cannot allocate %u buffers: %s", nbufs, strerror(-r));
+      goto finish;
+    }
+
+  if ((r = bufqueue_init(&ctx.raw_free, nbufs)) < 0 ||
+      (r = bufqueue_init(&ctx.check_full, nbufs)) < 0 ||
+      (r = bufqueue_init(&ctx.comp_free, nbufs)) < 0 ||
+      (r = bufqueue_init(&ctx.comp_full, nbufs)) < 0 ||
+      (r = bufqueue_init(&ctx.hash_full, nbufs)) < 0 ||
+      (r = bufqueue_init(&ctx.hash_output_full, nbufs)) < 0 ||
+      (r = bufqueue_init(&ctx.copy_full, nbufs)) < 0)
+    {
+      iw_fail(&ctx, r, "Cannot allocate buffer queues: %s", strerror(-r));
+      goto finish;
+    }
+  for (unsigned int i = 0; i < ctx.ndevs; i++)
+    if ((r = bufqueue_init(&ctx.devs[i].full, nbufs)) < 0)
+      {
+	iw_fail(&ctx, r, "Cannot allocate buffer queues: %s", strerror(-r));
+	goto finish;
+      }
+
+  // with compression the first buffers are used for the compressed data
+  for (unsigned int i = 0; i < nbufs; i++)
+    {
+      if ((use_decoder || delta) && i < src_bufs)
+	bufqueue_push(&ctx.comp_free, &ctx.bufs[i]);
+      else
+	bufqueue_push(&ctx.raw_free, &ctx.bufs[i]);
+    }
+  ctx.src_free = use_decoder || delta ? &ctx.comp_free : &ctx.raw_free;
+  ctx.src_full = use_decoder ? &ctx.comp_full : NULL;
+  /* Without decoder the output is the image as read, unless the check
+     stage replaced broken chunks of it. */
+  ctx.hash_output = (use_decoder || ctx.manifest) &&
+    (opts->hash_output || opts->verify != IW_VERIFY_NONE);
+
+  r = posix_memalign((void **)&ctx.zero_buf, IW_ALIGN, IW_SPARSE_MIN);
+  if (r != 0)
+    {
+      ctx.zero_buf = NULL;
+      iw_fail(&ctx, -r, "Cannot allocate zero buffer: %s", strerror(r));
+      goto finish;
+    }
+  memset(ctx.zero_buf, 0, IW_SPARSE_MIN);
+
+  // a device which cannot be opened only fails itself
+  for (unsigned int i = 0; i < ctx.ndevs; i++)
+    if (iw_open_device(&ctx.devs[i]) == 0)
+      iw_setup_uring(&ctx.devs[i]);
+  if (ctx.error != 0)
+    goto finish;
+
+  ctx.start = now_usec();
+
+  if (delta)
+    {
+      iw_compare(&ctx);
+      if (ctx.error != 0)
+	goto finish;
+    }
+
+  /* With a known image size the devices get discarded behind it in
+     parallel, else the write stage does it at the end. */
+  if (opts->discard)
+    {
+      if (delta)
+	ctx.discard_start = opts->chunks->image_size;
+      else if (opts->bmap)
+	ctx.discard_start = opts->bmap->image_size;
+      else if (!use_decoder)
+	ctx.discard_start = ctx.source_size;
+    }
+
+  bool extents = !delta && opts->verify != IW_VERIFY_NONE;
+  iw_hash_t hash = { &ctx, IW_STAGE_HASH, &ctx.hash_full, ctx.src_free,
+		     &ctx.sha256, extents && !ctx.hash_output };
+  iw_hash_t hash_output = { &ctx, IW_STAGE_HASH_OUTPUT, &ctx.hash_output_full,
+			    &ctx.raw_free,
+			    opts->hash_output ? &ctx.output_sha256 : NULL,
+			    extents };
+  struct {
+    void *(*fn)(void *);
+    void *arg;
+    bool enabled;
+  } stages[] = {
+    { delta ? source_delta_thread :
+      ctx.mcast_fd >= 0 ? source_mcast_thread :
+      ctx.streams > 0 ? source_ranges_thread :
+      ctx.curl ? source_net_thread : source_file_thread, &ctx, true },
+    { hash_thread, &hash, !delta },
+    { decompress_thread, &ctx, use_decoder },
+    { check_thread, &ctx, ctx.manifest != NULL },
+    { hash_thread, &hash_output, ctx.hash_output },
+    { copy_thread, &ctx, ctx.copy_fd >= 0 },
+  };
+
+  for (size_t i = 0; i < sizeof(stages)/sizeof(stages[0]); i++)
+    {
+      if (!stages[i].enabled)
+	continue;
+      if (iw_start_thread(&ctx, &threads[nthreads], stages[i].fn,
+			  stages[i].arg) < 0)
+	goto wait;
+      nthreads++;
+    }
+  // a failed device still needs its thread to release the buffers
+  for (unsigned int i = 0; i < ctx.ndevs; i++)
+    {
+      if (iw_start_thread(&ctx, &threads[nthreads], write_thread,
+			  &ctx.devs[i]) < 0)
+	goto wait;
+      nthreads++;
+    }
+
+  for (unsigned int i = 0; i < ctx.ndevs && ctx.discard_start > 0; i++)
+    {
+      if (!ctx.devs[i].is_blkdev || ctx.devs[i].error != 0)
+	continue;
+      if (iw_start_thread(&ctx, &threads[nthreads], discard_thread,
+			  &ctx.devs[i]) < 0)
+	break;
+      nthreads++;
+    }
+
+ wait:
+
+  iw_wait(&ctx, threads, nthreads);
+
+  if (ctx.error == 0 && opts->verify != IW_VERIFY_NONE)
+    iw_verify(&ctx);
+
+  if (ctx.error == 0)
+    {
+      iw_stats_t stats;
+
+      iw_get_stats(&ctx, &stats);
+      if (opts->progress)
+	opts->progress(&stats, opts->userdata);
+
+      for (int i = 0; i < _IW_STAGE_MAX; i++)
+	if (stats.stage[i].usec > 0)
+	  MSG_INFO("stage %s: %" PRIu64 " bytes in %.2fs (%.1f MB/s)",
+		   iw_stage_to_string(i), stats.stage[i].bytes,
+		   stats.stage[i].usec / 1000000.0,
+		   iw_mb_per_sec(stats.stage[i].bytes, stats.stage[i].usec));
+      if (stats.sparse_bytes > 0)
+	MSG_INFO("%" PRIu64 " bytes of zeros were not written but zeroed",
+		 stats.sparse_bytes);
+      if (stats.retries > 0)
+	MSG_INFO("Download got resumed %u times", stats.retries);
+      if (stats.unmapped_bytes > 0)
+	MSG_INFO("%" PRIu64 " bytes were not mapped in the block map",
+		 stats.unmapped_bytes);
+      if (stats.stage[IW_STAGE_DISCARD].bytes > 0)
+	MSG_INFO("%" PRIu64 " bytes behind the image were discarded or zeroed",
+		 stats.stage[IW_STAGE_DISCARD].bytes);
+      if (delta)
+	MSG_INFO("%" PRIu64 " of %" PRIu64 " bytes were already on the devices",
+		 stats.unchanged_bytes, opts->chunks->image_size);
+      if (ctx.refetched > 0)
+	MSG_INFO("%u chunks did not match the manifest and were read again",
+		 ctx.refetched);
+      if (ctx.cached_bytes > 0)
+	MSG_INFO("%" PRIu64 " bytes were found in the chunk cache",
+		 ctx.cached_bytes);
+      if (ctx.failed_devs > 0)
+	MSG_WARN("%u of %u devices failed", ctx.failed_devs, ctx.ndevs);
+      iw_log_stats(&stats);
+
+      if (ret && delta)
+	{
+	  // only the chunks got verified, the image was never read completely
+	  ret->have_sha256 = false;
+	  ret->stats = stats;
+	}
+      else if (ret)
+	{
+	  ret->have_sha256 = true;
+	  sha256_final(&ctx.sha256, ret->sha256);
+	  ret->refetched = ctx.refetched;
+	  if (ctx.hash_output && opts->hash_output)
+	    sha256_final(&ctx.output_sha256, ret->output_sha256);
+	  else
+	    memcpy(ret->output_sha256, ret->sha256, SHA256_DIGEST_SIZE);
+	  ret->stats = stats;
+	}
+    }
+
+ finish:
+  if (ret)
+    {
+      for (unsigned int i = 0; i < ctx.ndevs; i++)
+	ret->device_error[i] = ctx.error ?: ctx.devs[i].error;
+      ret->copy_error = opts->copy_path ? ctx.error ?: ctx.copy_error : 0;
+    }
+  r = ctx.error;
+  if (r < 0 && error)
+    *error = TAKE_PTR(ctx.errmsg);
+  iw_ctx_free(&ctx);
+
+  return r;
+}
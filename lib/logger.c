@@ -77,16 +77,20 @@ log_write(LogLevel level, const char *file, int line, const char *func,
         return;
       }
 
+      /* args may be needed for the log file, too */
+      va_list aq;
+      va_copy(aq, args);
       if (level == LOG_LEVEL_ERROR || level == LOG_EFIVARS )
         {
-          vfprintf(stderr, fmt, args);
+          vfprintf(stderr, fmt, aq);
 	  fputc('\n', stderr);
 	}
       else
 	{
-          vprintf(fmt, args);
+          vprintf(fmt, aq);
           putchar('\n');
 	}
+      va_end(aq);
     }
 
   if (log_file && level != LOG_EFIVARS)
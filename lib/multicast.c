@@ -0,0 +1,359 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include "config.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <endian.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "basics.h"
+#include "logger.h"
+#include "multicast.h"
+
+// room for bursts of the sender while the receiver is busy
+#define MCAST_RCVBUF (8 * 1024 * 1024)
+
+// offsets in the payload of INFO
+#define INFO_SIZE 0
+#define INFO_FLAGS 8
+#define INFO_SHA256 12
+#define INFO_HEAD_LEN (INFO_SHA256 + SHA256_DIGEST_SIZE)
+#define INFO_HEAD (INFO_HEAD_LEN + 1)
+#define INFO_LEN (INFO_HEAD + MCAST_HEAD_SIZE)
+
+static void
+put_be32(uint8_t *p, uint32_t v)
+{
+  v = htobe32(v);
+  memcpy(p, &v, sizeof(v));
+}
+
+static uint32_t
+get_be32(const uint8_t *p)
+{
+  uint32_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return be32toh(v);
+}
+
+static void
+put_be64(uint8_t *p, uint64_t v)
+{
+  v = htobe64(v);
+  memcpy(p, &v, sizeof(v));
+}
+
+static uint64_t
+get_be64(const uint8_t *p)
+{
+  uint64_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return be64toh(v);
+}
+
+static uint64_t
+now_msec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int
+mcast_parse_url(const char *url, struct sockaddr_in *ret_group,
+		unsigned int *ret_ifindex)
+{
+  _cleanup_free_ char *host = NULL;
+  const char *p, *port, *ifname;
+  unsigned int ifindex = 0;
+  char *end;
+  long n;
+
+  p = startswith(url, "mcast://");
+  if (!p)
+    return -EINVAL;
+
+  port = strrchr(p, ':');
+  if (!port)
+    return -EINVAL;
+  host = strndup(p, port - p);
+  if (!host)
+    return -ENOMEM;
+  port++;
+
+  errno = 0;
+  n = strtol(port, &end, 10);
+  if (errno != 0 || end == port || n <= 0 || n > 65535 ||
+      (*end != '\0' && *end != '%'))
+    return -EINVAL;
+
+  if (*end == '%')
+    {
+      ifname = end + 1;
+      ifindex = if_nametoindex(ifname);
+      if (ifindex == 0)
+	return -ENODEV;
+    }
+
+  memset(ret_group, 0, sizeof(*ret_group));
+  ret_group->sin_family = AF_INET;
+  ret_group->sin_port = htons(n);
+  if (inet_pton(AF_INET, host, &ret_group->sin_addr) != 1 ||
+      !IN_MULTICAST(ntohl(ret_group->sin_addr.s_addr)))
+    return -EINVAL;
+
+  *ret_ifindex = ifindex;
+  return 0;
+}
+
+int
+mcast_open_receiver(const struct sockaddr_in *group, unsigned int ifindex)
+{
+  _cleanup_close_ int fd = -EBADF;
+  struct ip_mreqn mreq = {
+    .imr_multiaddr = group->sin_addr,
+    .imr_ifindex = ifindex,
+  };
+  int one = 1;
+  int size = MCAST_RCVBUF;
+
+  fd = socket(AF_INET, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -errno;
+
+  // several receivers on one machine, e.g. for tests
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0)
+    return -errno;
+  // the limit of the admin does not apply to root
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0)
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+  // bound to the group, other traffic to the port is not received
+  if (bind(fd, (const struct sockaddr *)group, sizeof(*group)) < 0)
+    return -errno;
+  if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+    return -errno;
+
+  return TAKE_FD(fd);
+}
+
+int
+mcast_open_sender(unsigned int ifindex, unsigned int ttl)
+{
+  _cleanup_close_ int fd = -EBADF;
+  struct ip_mreqn mreq = {
+    .imr_ifindex = ifindex,
+  };
+  struct sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_addr.s_addr = htonl(INADDR_ANY),
+  };
+  int v = ttl;
+
+  fd = socket(AF_INET, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -errno;
+
+  if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &v, sizeof(v)) < 0)
+    return -errno;
+  if (ifindex > 0 &&
+      setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq)) < 0)
+    return -errno;
+  // NAK and DONE of the receivers arrive on this port
+  if (bind(fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0)
+    return -errno;
+
+  return TAKE_FD(fd);
+}
+
+size_t
+mcast_build(uint8_t *pkt, mcast_type_t type, uint32_t session, uint32_t seq,
+	    size_t payload_len)
+{
+  put_be32(pkt, MCAST_MAGIC);
+  pkt[4] = MCAST_VERSION;
+  pkt[5] = type;
+  pkt[6] = pkt[7] = 0;
+  put_be32(pkt + 8, session);
+  put_be32(pkt + 12, seq);
+
+  return MCAST_HEADER_SIZE + payload_len;
+}
+
+int
+mcast_parse(const uint8_t *pkt, size_t len, uint32_t *ret_session,
+	    uint32_t *ret_seq, const uint8_t **ret_payload,
+	    size_t *ret_payload_len)
+{
+  if (len < MCAST_HEADER_SIZE || get_be32(pkt) != MCAST_MAGIC ||
+      pkt[4] != MCAST_VERSION)
+    return -EBADMSG;
+
+  *ret_session = get_be32(pkt + 8);
+  *ret_seq = get_be32(pkt + 12);
+  *ret_payload = pkt + MCAST_HEADER_SIZE;
+  *ret_payload_len = len - MCAST_HEADER_SIZE;
+
+  return pkt[5];
+}
+
+size_t
+mcast_build_info(uint8_t *pkt, uint32_t session, const mcast_info_t *info)
+{
+  uint8_t *p = pkt + MCAST_HEADER_SIZE;
+
+  memset(p, 0, INFO_LEN);
+  put_be64(p + INFO_SIZE, info->size);
+  if (info->has_sha256)
+    {
+      put_be32(p + INFO_FLAGS, MCAST_INFO_SHA256 |
+	       (info->sha256_as_sent ? MCAST_INFO_SHA256_AS_SENT : 0));
+      memcpy(p + INFO_SHA256, info->sha256, SHA256_DIGEST_SIZE);
+    }
+  p[INFO_HEAD_LEN] = info->head_len;
+  memcpy(p + INFO_HEAD, info->head, info->head_len);
+
+  return mcast_build(pkt, MCAST_INFO, session, 0, INFO_LEN);
+}
+
+int
+mcast_parse_info(const uint8_t *payload, size_t len, mcast_info_t *ret)
+{
+  if (len < INFO_LEN || payload[INFO_HEAD_LEN] > MCAST_HEAD_SIZE)
+    return -EBADMSG;
+
+  ret->size = get_be64(payload + INFO_SIZE);
+  ret->has_sha256 = get_be32(payload + INFO_FLAGS) & MCAST_INFO_SHA256;
+  ret->sha256_as_sent = get_be32(payload + INFO_FLAGS) & MCAST_INFO_SHA256_AS_SENT;
+  memcpy(ret->sha256, payload + INFO_SHA256, SHA256_DIGEST_SIZE);
+  ret->head_len = payload[INFO_HEAD_LEN];
+  memcpy(ret->head, payload + INFO_HEAD, MCAST_HEAD_SIZE);
+
+  // seq has 32 bit
+  if (mcast_packets(ret->size) > UINT32_MAX)
+    return -EFBIG;
+  return 0;
+}
+
+size_t
+mcast_build_nak(uint8_t *pkt, uint32_t session, const mcast_range_t *ranges,
+		size_t n)
+{
+  uint8_t *p = pkt + MCAST_HEADER_SIZE;
+
+  if (n > MCAST_NAK_MAX)
+    n = MCAST_NAK_MAX;
+  put_be32(p, n);
+  for (size_t i = 0; i < n; i++)
+    {
+      put_be32(p + 4 + i * 8, ranges[i].first);
+      put_be32(p + 8 + i * 8, ranges[i].count);
+    }
+
+  return mcast_build(pkt, MCAST_NAK, session, 0, 4 + n * 8);
+}
+
+int
+mcast_parse_nak(const uint8_t *payload, size_t len, mcast_range_t *ranges,
+		size_t *ret_n)
+{
+  size_t n;
+
+  if (len < 4)
+    return -EBADMSG;
+  n = get_be32(payload);
+  if (n > MCAST_NAK_MAX || len < 4 + n * 8)
+    return -EBADMSG;
+
+  for (size_t i = 0; i < n; i++)
+    {
+      ranges[i].first = get_be32(payload + 4 + i * 8);
+      ranges[i].count = get_be32(payload + 8 + i * 8);
+    }
+  *ret_n = n;
+
+  return 0;
+}
+
+int
+mcast_wait_info(int fd, int timeout_ms, uint32_t *ret_session,
+		struct sockaddr_in *ret_sender, mcast_info_t *ret)
+{
+  uint64_t end = now_msec() + timeout_ms;
+  uint8_t pkt[MCAST_PACKET_MAX];
+
+  while (1)
+    {
+      struct pollfd pfd = { .fd = fd, .events = POLLIN };
+      struct sockaddr_in sender;
+      socklen_t slen = sizeof(sender);
+      const uint8_t *payload;
+      size_t payload_len;
+      uint32_t session, seq;
+      uint64_t now = now_msec();
+      ssize_t n;
+      int r;
+
+      if (now >= end)
+	return -ETIMEDOUT;
+      r = poll(&pfd, 1, end - now);
+      if (r < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -errno;
+	}
+      if (r == 0)
+	return -ETIMEDOUT;
+
+      n = recvfrom(fd, pkt, sizeof(pkt), MSG_DONTWAIT,
+		   (struct sockaddr *)&sender, &slen);
+      if (n < 0)
+	{
+	  if (errno == EINTR || errno == EAGAIN)
+	    continue;
+	  return -errno;
+	}
+
+      // data packets before the announcement get ignored
+      r = mcast_parse(pkt, n, &session, &seq, &payload, &payload_len);
+      if (r != MCAST_INFO)
+	continue;
+      r = mcast_parse_info(payload, payload_len, ret);
+      if (r < 0)
+	return r;
+
+      *ret_session = session;
+      *ret_sender = sender;
+      return 0;
+    }
+}
+
+int
+mcast_query_info(const char *url, int timeout_ms, mcast_info_t *ret)
+{
+  _cleanup_close_ int fd = -EBADF;
+  struct sockaddr_in group, sender;
+  unsigned int ifindex;
+  uint32_t session;
+  int r;
+
+  r = mcast_parse_url(url, &group, &ifindex);
+  if (r < 0)
+    return r;
+
+  fd = mcast_open_receiver(&group, ifindex);
+  if (fd < 0)
+    return fd;
+
+  return mcast_wait_info(fd, timeout_ms, &session, &sender, ret);
+}
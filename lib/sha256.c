@@ -0,0 +1,338 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+// SHA-256 as specified in FIPS 180-4.
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_SHANI 1
+#endif
+
+#include "sha256.h"
+
+typedef void (*sha256_transform_fn)(uint32_t state[8], const uint8_t *data,
+				    size_t nblocks);
+
+static const uint32_t K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+  0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+  0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+  0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+  0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+  0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z) (((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define BSIG0(x) (ROR(x, 2) ^ ROR(x, 13) ^ ROR(x, 22))
+#define BSIG1(x) (ROR(x, 6) ^ ROR(x, 11) ^ ROR(x, 25))
+#define SSIG0(x) (ROR(x, 7) ^ ROR(x, 18) ^ ((x) >> 3))
+#define SSIG1(x) (ROR(x, 17) ^ ROR(x, 19) ^ ((x) >> 10))
+
+static inline uint32_t
+load_be32(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+    ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline void
+store_be32(uint8_t *p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+// Process nblocks consecutive 64 byte blocks
+static void
+sha256_transform_generic(uint32_t state[8], const uint8_t *data, size_t nblocks)
+{
+  uint32_t W[64];
+
+  while (nblocks--)
+    {
+      uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+      uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+      for (int i = 0; i < 16; i++)
+	W[i] = load_be32(data + 4 * i);
+      for (int i = 16; i < 64; i++)
+	W[i] = SSIG1(W[i - 2]) + W[i - 7] + SSIG0(W[i - 15]) + W[i - 16];
+
+      for (int i = 0; i < 64; i++)
+	{
+	  uint32_t t1 = h + BSIG1(e) + CH(e, f, g) + K[i] + W[i];
+	  uint32_t t2 = BSIG0(a) + MAJ(a, b, c);
+	  h = g;
+	  g = f;
+	  f = e;
+	  e = d + t1;
+	  d = c;
+	  c = b;
+	  b = a;
+	  a = t1 + t2;
+	}
+
+      state[0] += a;
+      state[1] += b;
+      state[2] += c;
+      state[3] += d;
+      state[4] += e;
+      state[5] += f;
+      state[6] += g;
+      state[7] += h;
+
+      data += SHA256_BLOCK_SIZE;
+    }
+}
+
+#ifdef HAVE_SHANI
+/* Intel SHA extensions: every sha256rnds2 does two rounds, the message
+   schedule is calculated four words at a time with sha256msg1/2. The
+   state is kept as ABEF/CDGH as required by sha256rnds2. */
+__attribute__((target("sha,sse4.1")))
+static void
+sha256_transform_shani(uint32_t state[8], const uint8_t *data, size_t nblocks)
+{
+  const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+				       0x0405060700010203ULL);
+  __m128i state0, state1, tmp, msg;
+  __m128i w[4];
+
+  tmp = _mm_loadu_si128((const __m128i *)&state[0]);     // DCBA
+  state1 = _mm_loadu_si128((const __m128i *)&state[4]);  // HGFE
+  tmp = _mm_shuffle_epi32(tmp, 0xb1);                    // CDAB
+  state1 = _mm_shuffle_epi32(state1, 0x1b);              // EFGH
+  state0 = _mm_alignr_epi8(tmp, state1, 8);              // ABEF
+  state1 = _mm_blend_epi16(state1, tmp, 0xf0);           // CDGH
+
+  while (nblocks--)
+    {
+      __m128i abef = state0, cdgh = state1;
+
+      for (int i = 0; i < 16; i++)
+	{
+	  __m128i *cur = &w[i % 4];
+
+	  if (i < 4)
+	    *cur = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)),
+				    bswap);
+	  else
+	    {
+	      // W[t] = s1(W[t-2]) + W[t-7] + s0(W[t-15]) + W[t-16]
+	      tmp = _mm_sha256msg1_epu32(*cur, w[(i + 1) % 4]);
+	      tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(w[(i + 3) % 4],
+						       w[(i + 2) % 4], 4));
+	      *cur = _mm_sha256msg2_epu32(tmp, w[(i + 3) % 4]);
+	    }
+
+	  msg = _mm_add_epi32(*cur, _mm_loadu_si128((const __m128i *)&K[4 * i]));
+	  state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+	  msg = _mm_shuffle_epi32(msg, 0x0e);
+	  state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+	}
+
+      state0 = _mm_add_epi32(state0, abef);
+      state1 = _mm_add_epi32(state1, cdgh);
+
+      data += SHA256_BLOCK_SIZE;
+    }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1b);                 // FEBA
+  state1 = _mm_shuffle_epi32(state1, 0xb1);              // DCHG
+  state0 = _mm_blend_epi16(tmp, state1, 0xf0);           // DCBA
+  state1 = _mm_alignr_epi8(state1, tmp, 8);              // HGFE
+
+  _mm_storeu_si128((__m128i *)&state[0], state0);
+  _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+static bool
+cpu_has_shani(void)
+{
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) ||
+      !(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1))
+    return false;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    return false;
+  return (ebx & bit_SHA) != 0;
+}
+#endif
+
+static sha256_transform_fn
+select_transform(void)
+{
+#ifdef HAVE_SHANI
+  if (cpu_has_shani())
+    return sha256_transform_shani;
+#endif
+  return sha256_transform_generic;
+}
+
+static void
+sha256_transform(uint32_t state[8], const uint8_t *data, size_t nblocks)
+{
+  static sha256_transform_fn transform = NULL;
+  sha256_transform_fn fn = __atomic_load_n(&transform, __ATOMIC_RELAXED);
+
+  // every thread selects the same implementation, so racing is harmless
+  if (!fn)
+    {
+      fn = select_transform();
+      __atomic_store_n(&transform, fn, __ATOMIC_RELAXED);
+    }
+
+  fn(state, data, nblocks);
+}
+
+const char *
+sha256_implementation(void)
+{
+#ifdef HAVE_SHANI
+  if (select_transform() == sha256_transform_shani)
+    return "sha-ni";
+#endif
+  return "generic";
+}
+
+void
+sha256_init(sha256_ctx_t *ctx)
+{
+  static const uint32_t H0[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+
+  memcpy(ctx->state, H0, sizeof(H0));
+  ctx->length = 0;
+  ctx->buffer_len = 0;
+}
+
+void
+sha256_update(sha256_ctx_t *ctx, const void *data, size_t len)
+{
+  const uint8_t *p = data;
+
+  ctx->length += len;
+
+  if (ctx->buffer_len > 0)
+    {
+      size_t n = SHA256_BLOCK_SIZE - ctx->buffer_len;
+      if (n > len)
+	n = len;
+      memcpy(ctx->buffer + ctx->buffer_len, p, n);
+      ctx->buffer_len += n;
+      p += n;
+      len -= n;
+
+      if (ctx->buffer_len < SHA256_BLOCK_SIZE)
+	return;
+
+      sha256_transform(ctx->state, ctx->buffer, 1);
+      ctx->buffer_len = 0;
+    }
+
+  if (len >= SHA256_BLOCK_SIZE)
+    {
+      size_t nblocks = len / SHA256_BLOCK_SIZE;
+
+      sha256_transform(ctx->state, p, nblocks);
+      p += nblocks * SHA256_BLOCK_SIZE;
+      len -= nblocks * SHA256_BLOCK_SIZE;
+    }
+
+  if (len > 0)
+    {
+      memcpy(ctx->buffer, p, len);
+      ctx->buffer_len = len;
+    }
+}
+
+void
+sha256_final(sha256_ctx_t *ctx, uint8_t digest[SHA256_DIGEST_SIZE])
+{
+  uint64_t bits = ctx->length * 8;
+
+  ctx->buffer[ctx->buffer_len++] = 0x80;
+  if (ctx->buffer_len > SHA256_BLOCK_SIZE - 8)
+    {
+      memset(ctx->buffer + ctx->buffer_len, 0,
+	     SHA256_BLOCK_SIZE - ctx->buffer_len);
+      sha256_transform(ctx->state, ctx->buffer, 1);
+      ctx->buffer_len = 0;
+    }
+  memset(ctx->buffer + ctx->buffer_len, 0,
+	 SHA256_BLOCK_SIZE - 8 - ctx->buffer_len);
+  store_be32(ctx->buffer + SHA256_BLOCK_SIZE - 8, bits >> 32);
+  store_be32(ctx->buffer + SHA256_BLOCK_SIZE - 4, bits);
+  sha256_transform(ctx->state, ctx->buffer, 1);
+
+  for (int i = 0; i < 8; i++)
+    store_be32(digest + 4 * i, ctx->state[i]);
+}
+
+char *
+sha256_to_hex(const uint8_t digest[SHA256_DIGEST_SIZE],
+	      char hex[SHA256_HEX_SIZE])
+{
+  static const char table[] = "0123456789abcdef";
+
+  for (int i = 0; i < SHA256_DIGEST_SIZE; i++)
+    {
+      hex[2 * i] = table[digest[i] >> 4];
+      hex[2 * i + 1] = table[digest[i] & 0x0f];
+    }
+  hex[2 * SHA256_DIGEST_SIZE] = '\0';
+
+  return hex;
+}
+
+static int
+unhexchar(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -EINVAL;
+}
+
+int
+sha256_from_hex(const char *hex, size_t len, uint8_t digest[SHA256_DIGEST_SIZE])
+{
+  if (len != 2 * SHA256_DIGEST_SIZE)
+    return -EINVAL;
+
+  for (size_t i = 0; i < SHA256_DIGEST_SIZE; i++)
+    {
+      int hi = unhexchar(hex[2 * i]);
+      int lo = unhexchar(hex[2 * i + 1]);
+      if (hi < 0 || lo < 0)
+	return -EINVAL;
+      digest[i] = (hi << 4) | lo;
+    }
+  return 0;
+}
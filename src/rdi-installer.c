@@ -2,6 +2,8 @@
 
 #include "config.h"
 
+#include <errno.h>
+#include <getopt.h>
 #include <string.h>
 #include <libeconf.h>
 
@@ -15,11 +17,32 @@
 const char *rdii_config = "/run/rdi-installer/rdii-config";
 const char *rdii_tmp_dir = NULL;
 const char *rdii_log = "/var/log/rdi-installer.log";
+iw_options_t rdii_iw_options;
+// else the queue depth gets chosen per device
+bool rdii_write_queue_depth_set = false;
+// directory for downloaded images, NULL disables the cache
+const char *rdii_image_cache = NULL;
+uint64_t rdii_image_cache_size = 0;
+// fetch only the chunks which differ from the device, if there is a
+// chunk index of the image
+bool rdii_delta = false;
+// chunk store of a casync index, else default.castr next to the index
+const char *rdii_chunk_store = NULL;
+// directory for the chunks of chunk stores, NULL disables the cache
+const char *rdii_chunk_cache = NULL;
+// public keys the signatures of the images get checked with
+const char *rdii_keyring = "/etc/systemd/import-pubring.gpg";
+// install rdii.url without menu, every question gets answered with no
+bool rdii_batch = false;
 
 static econf_err
 read_config(const char *config, char **ret_device,
 	    char **ret_url, char **ret_url1, char **ret_url2,
-	    char **ret_keymap, bool *ret_preserve_ssh_hostkey)
+	    char **ret_keymap, bool *ret_preserve_ssh_hostkey,
+	    iw_options_t *ret_iw_opts, char **ret_image_cache,
+	    uint64_t *ret_image_cache_size, bool *ret_delta,
+	    char **ret_chunk_store, char **ret_chunk_cache,
+	    char **ret_keyring)
 {
   _cleanup_(econf_freeFilep) econf_file *key_file = NULL;
   _cleanup_free_ char *device = NULL;
@@ -28,6 +51,30 @@ read_config(const char *config, char **ret_device,
   _cleanup_free_ char *url2 = NULL;
   _cleanup_free_ char *keymap = NULL;
   bool preserve_ssh_hostkey = false;
+  bool have_preserve_ssh_hostkey;
+  uint32_t download_streams = 0;
+  uint32_t download_window = 0;
+  bool have_download_streams, have_download_window;
+  bool sha256_uncompressed = false;
+  bool have_sha256_uncompressed;
+  _cleanup_free_ char *verify = NULL;
+  iw_verify_t verify_mode = IW_VERIFY_NONE;
+  uint32_t write_queue_depth = 0;
+  bool have_write_queue_depth;
+  uint32_t decompress_threads = 0;
+  bool have_decompress_threads;
+  uint64_t memory_limit = 0;
+  bool have_memory_limit;
+  bool discard = true;
+  bool have_discard;
+  _cleanup_free_ char *image_cache = NULL;
+  uint64_t image_cache_size = 0;
+  bool have_image_cache_size;
+  bool delta = false;
+  bool have_delta;
+  _cleanup_free_ char *chunk_store = NULL;
+  _cleanup_free_ char *chunk_cache = NULL;
+  _cleanup_free_ char *keyring = NULL;
   econf_err error;
 
   error = econf_readFile(&key_file, config,
@@ -63,10 +110,107 @@ read_config(const char *config, char **ret_device,
   error = econf_getBoolValue(key_file, NULL, "rdii.preserve-ssh-hostkey", &preserve_ssh_hostkey);
   if (error != ECONF_SUCCESS && error != ECONF_NOKEY)
     return error;
-  // if new values get's added later: only do the assignment if a key
-  // was really found, and only after reading the last variable
-  if (error == ECONF_SUCCESS && ret_preserve_ssh_hostkey)
+  have_preserve_ssh_hostkey = (error == ECONF_SUCCESS);
+
+  error = econf_getUIntValue(key_file, NULL, "rdii.download-streams", &download_streams);
+  if (error != ECONF_SUCCESS && error != ECONF_NOKEY)
+    return error;
+  have_download_streams = (error == ECONF_SUCCESS);
+
+  // in MiB
+  error = econf_getUIntValue(key_file, NULL, "rdii.download-window", &download_window);
+  if (error != ECONF_SUCCESS && error != ECONF_NOKEY)
+    return error;
+  have_download_window = (error == ECONF_SUCCESS);
+
+  error = econf_getBoolValue(key_file, NULL, "rdii.sha256-uncompressed", &sha256_uncompressed);
+  if (error != ECONF_SUCCESS && error != ECONF_NOKEY)
+    return error;
+  have_sha256_uncompressed = (error == ECONF_SUCCESS);
+
+  error = econf_getStringValue(key_file, NULL, "rdii.verify", &verify);
+  if (error != ECONF_SUCCESS && error != ECONF_NOKEY)
+    return error;
+  if (verify && iw_verify_from_string(verify, &verify_mode) < 0)
+    {
+      MSG_ERROR("Invalid value for rdii.verify: '%s'", verify);
+      return ECONF_PARSE_ERROR;
+    }
+
+  error = econf_getUIntValue(key_file, NULL, "rdii.write-queue-depth", &write_queue_depth);
+  if (error != ECONF_SUCCESS && error != ECONF_NOKEY)
+    return error;
+  have_write_queue_depth = (error == ECONF_SUCCESS);
+
+  error = econf_getUIntValue(key_file, NULL, "rdii.decompress-threads", &decompress_threads);
+  if (error != ECONF_SUCCESS && error != ECONF_NOKEY)
+    return error;
+  have_decompress_threads = (error == ECONF_SUCCESS);
+
+  // in MiB
+  error = econf_getUInt64Value(key_file, NULL, "rdii.memory-limit", &memory_limit);
+  if (error != ECONF_SUCCESS && error != ECONF_NOKEY)
+    return error;
+  have_memory_limit = (error == ECONF_SUCCESS);
+
+  error = econf_getBoolValue(key_file, NULL, "rdii.discard", &discard);
+  if (error != ECONF_SUCCESS && error != ECONF_NOKEY)
+    return error;
+  have_discard = (error == ECONF_SUCCESS);
+
+  error = econf_getStringValue(key_file, NULL, "rdii.image-cache", &image_cache);
+  if (error != ECONF_SUCCESS && error != ECONF_NOKEY)
+    return error;
+
+  // in MiB
+  error = econf_getUInt64Value(key_file, NULL, "rdii.image-cache-size", &image_cache_size);
+  if (error != ECONF_SUCCESS && error != ECONF_NOKEY)
+    return error;
+  have_image_cache_size = (error == ECONF_SUCCESS);
+
+  error = econf_getBoolValue(key_file, NULL, "rdii.delta", &delta);
+  if (error != ECONF_SUCCESS && error != ECONF_NOKEY)
+    return error;
+  have_delta = (error == ECONF_SUCCESS);
+
+  error = econf_getStringValue(key_file, NULL, "rdii.chunk-store", &chunk_store);
+  if (error != ECONF_SUCCESS && error != ECONF_NOKEY)
+    return error;
+
+  error = econf_getStringValue(key_file, NULL, "rdii.chunk-cache", &chunk_cache);
+  if (error != ECONF_SUCCESS && error != ECONF_NOKEY)
+    return error;
+
+  error = econf_getStringValue(key_file, NULL, "rdii.keyring", &keyring);
+  if (error != ECONF_SUCCESS && error != ECONF_NOKEY)
+    return error;
+
+  // only do the assignment if a key was really found, and only after
+  // reading the last variable
+  if (have_preserve_ssh_hostkey && ret_preserve_ssh_hostkey)
     *ret_preserve_ssh_hostkey = preserve_ssh_hostkey;
+  if (ret_iw_opts)
+    {
+      if (have_download_streams)
+	ret_iw_opts->download_streams = download_streams;
+      if (have_download_window)
+	ret_iw_opts->download_window = (size_t)download_window * 1024 * 1024;
+      if (have_sha256_uncompressed)
+	ret_iw_opts->hash_output = sha256_uncompressed;
+      if (verify)
+	ret_iw_opts->verify = verify_mode;
+      if (have_write_queue_depth)
+	{
+	  ret_iw_opts->write_queue_depth = write_queue_depth;
+	  rdii_write_queue_depth_set = true;
+	}
+      if (have_decompress_threads)
+	ret_iw_opts->decompress_threads = decompress_threads;
+      if (have_memory_limit)
+	ret_iw_opts->memory_limit = (size_t)memory_limit * 1024 * 1024;
+      if (have_discard)
+	ret_iw_opts->discard = discard;
+    }
 
   if (ret_device)
     *ret_device = TAKE_PTR(device);
@@ -78,6 +222,18 @@ read_config(const char *config, char **ret_device,
     *ret_url2 = TAKE_PTR(url2);
   if (ret_keymap)
     *ret_keymap = TAKE_PTR(keymap);
+  if (ret_image_cache && !isempty(image_cache))
+    *ret_image_cache = TAKE_PTR(image_cache);
+  if (have_image_cache_size && ret_image_cache_size)
+    *ret_image_cache_size = image_cache_size * 1024 * 1024;
+  if (have_delta && ret_delta)
+    *ret_delta = delta;
+  if (ret_chunk_store && !isempty(chunk_store))
+    *ret_chunk_store = TAKE_PTR(chunk_store);
+  if (ret_chunk_cache && !isempty(chunk_cache))
+    *ret_chunk_cache = TAKE_PTR(chunk_cache);
+  if (ret_keyring && !isempty(keyring))
+    *ret_keyring = TAKE_PTR(keyring);
 
   return ECONF_SUCCESS;
 }
@@ -102,23 +258,92 @@ rm_rf_and_freep(char **p)
     *p = rm_rf_and_free(*p);
 }
 
+static void
+print_usage(FILE *stream)
+{
+  fprintf(stream, "Usage: rdi-installer [--help]|[--version]|[--batch] [--config <file>]\n");
+}
+
+static void
+print_help(void)
+{
+  fprintf(stdout, "rdi-installer - install a raw disk image\n\n");
+  print_usage(stdout);
+
+  fputs("  -b, --batch          Install rdii.url on rdii.device without asking\n", stdout);
+  fputs("  -c, --config <file>  File with configuration\n", stdout);
+  fputs("  -h, --help           Give this help list\n", stdout);
+  fputs("  -v, --version        Print program version\n", stdout);
+}
+
 int
-main(void)
+main(int argc, char *argv[])
 {
   _cleanup_(rm_rf_and_freep) char *rdii_tmp_dir_cleanup = NULL;
   _cleanup_free_ char *image = NULL;
   _cleanup_free_ char *image1 = NULL;
   _cleanup_free_ char *image2 = NULL;
   _cleanup_free_ char *device = NULL;
+  _cleanup_free_ char *image_cache = NULL;
+  _cleanup_free_ char *chunk_store = NULL;
+  _cleanup_free_ char *chunk_cache = NULL;
+  _cleanup_free_ char *keyring = NULL;
   bool preserve_ssh_hostkey = false;
   int r;
   econf_err conf_err;
+  uint64_t mem_total = 0, mem_free = 0, mem_available = 0;
+
+  while (1)
+    {
+      int c;
+      int option_index = 0;
+      static struct option long_options[] =
+        {
+	  {"batch",     no_argument,       NULL, 'b' },
+	  {"config",    required_argument, NULL, 'c' },
+	  {"help",      no_argument,       NULL, 'h' },
+          {"version",   no_argument,       NULL, 'v' },
+          {NULL,        0,                 NULL, '\0'}
+        };
+
+      c = getopt_long (argc, argv, "bc:hv",
+                       long_options, &option_index);
+      if (c == (-1))
+        break;
+
+      switch (c)
+        {
+	case 'b':
+	  rdii_batch = true;
+	  break;
+	case 'c':
+	  rdii_config = optarg;
+	  break;
+        case 'h':
+          print_help();
+          return 0;
+        case 'v':
+          MSG_INFO("rdi-installer (%s) %s", PACKAGE, VERSION);
+          return 0;
+        default:
+          print_usage(stderr);
+          return EINVAL;
+        }
+    }
+
+  if (optind < argc)
+    {
+      print_usage(stderr);
+      return EINVAL;
+    }
 
-  init_ncurses();
+  // in batch mode the log goes to the console, too
+  if (!rdii_batch)
+    init_ncurses();
 
   if (getuid())
     rdii_log = "rdii.log";
-  r = log_init(NO_CONSOLE_LOG, rdii_log);
+  r = log_init(rdii_batch ? CONSOLE_LOG : NO_CONSOLE_LOG, rdii_log);
   if (r < 0)
     {
       show_error_popup("Cannot initialize log file:", rdii_log, strerror(-r));
@@ -127,12 +352,22 @@ main(void)
 
   MSG_INFO("rdi-installer started");
 
+  iw_options_init(&rdii_iw_options);
+  // the installer runs from RAM, leave half of it to the rest
+  get_meminfo(&mem_total, &mem_free, &mem_available);
+  rdii_iw_options.memory_limit = mem_available / 2 * 1024;
+
   // XXX keymap ignored
-  conf_err = read_config(rdii_config, &device, &image, &image1, &image2, NULL, &preserve_ssh_hostkey);
+  conf_err = read_config(rdii_config, &device, &image, &image1, &image2, NULL,
+			 &preserve_ssh_hostkey, &rdii_iw_options,
+			 &image_cache, &rdii_image_cache_size, &rdii_delta,
+			 &chunk_store, &chunk_cache, &keyring);
   if (conf_err != ECONF_SUCCESS)
     {
       show_error_popup("Failed to read config file:",
                        econf_errString(conf_err), NULL);
+      if (rdii_batch)
+	return EINVAL;
     }
 
   const char *tmpdir_template = "/tmp/rdi-installer-XXXXXX";
@@ -145,6 +380,25 @@ main(void)
     }
   // we cannot make rdii_tmp_dir_cleanup global because of _cleanup_
   rdii_tmp_dir = rdii_tmp_dir_cleanup;
+  rdii_image_cache = image_cache;
+  rdii_chunk_store = chunk_store;
+  rdii_chunk_cache = chunk_cache;
+  if (keyring)
+    rdii_keyring = keyring;
+
+  if (rdii_batch)
+    {
+      if (isempty(image) || isempty(device))
+	{
+	  MSG_ERROR("rdii.url and rdii.device are needed with --batch");
+	  r = -EINVAL;
+	}
+      else
+	r = run_installation(image, device, preserve_ssh_hostkey);
+      MSG_INFO("rdi-installer stopped (retval=%i)", r);
+      log_close();
+      return r < 0 ? -r : 0;
+    }
 
   r = rdii_menu(image, image1, image2, device, preserve_ssh_hostkey);
 
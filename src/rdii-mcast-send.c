@@ -0,0 +1,528 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+
+#include "basics.h"
+#include "logger.h"
+#include "multicast.h"
+
+// default rate in Mbit/s, leaves room for other traffic on gigabit links
+#define DEFAULT_RATE 400
+// packets which may be sent at once after a pause
+#define BURST_PACKETS 64
+// distinct receivers which reported DONE, only used for counting
+#define RECEIVERS_MAX 4096
+
+typedef struct {
+  const uint8_t *image;
+  uint64_t size;
+  uint64_t npackets;
+  uint32_t session;
+  mcast_info_t info;
+  int fd;
+  struct sockaddr_in group;
+  uint64_t next;          // next packet of the first round
+  uint64_t *resend;       // bitmap of packets requested with NAK
+  uint64_t nresend;
+  uint64_t resend_pos;    // continue the search for NAKed packets here
+  uint64_t resent;        // statistics
+  struct sockaddr_in done[RECEIVERS_MAX];
+  unsigned int ndone;
+} sender_t;
+
+static void
+print_usage(FILE *stream)
+{
+  fprintf(stream, "Usage: rdii-mcast-send [--help]|[--version]|[options] mcast://<group>:<port>[%%<interface>] <image>\n");
+}
+
+static void
+print_help(void)
+{
+  fprintf(stdout, "rdii-mcast-send - Send an image to many rdi-installer at once with multicast\n\n");
+  print_usage(stdout);
+
+  fputs("  -r, --rate        Maximum rate in Mbit/s (default: 400)\n", stdout);
+  fputs("  -n, --receivers   Exit after that many receivers got the image\n", stdout);
+  fputs("  -s, --sha256      File with the sha256 of the image (default: <image>.sha256)\n", stdout);
+  fputs("  -t, --ttl         Time to live of the packets (default: 1)\n", stdout);
+  fputs("  -h, --help        Give this help list\n", stdout);
+  fputs("  -v, --version     Print program version\n", stdout);
+}
+
+static void
+print_error(void)
+{
+  MSG_ERROR("Try `rdii-mcast-send --help' for more information.");
+}
+
+static uint64_t
+now_usec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int
+parse_uint(const char *s, unsigned int max, unsigned int *ret)
+{
+  char *end;
+  unsigned long v;
+
+  errno = 0;
+  v = strtoul(s, &end, 10);
+  if (errno != 0 || end == s || *end != '\0' || v > max)
+    return -EINVAL;
+
+  *ret = v;
+  return 0;
+}
+
+/* The receivers verify the image with the sha256 of the announcement.
+   Without .sha256 file it gets calculated, which at least detects
+   transmission errors. The announcement says so, such a digest is of
+   the image as sent also if the receivers expect the one of the
+   decompressed image. */
+static int
+load_sha256(sender_t *s, const char *path, bool required)
+{
+  _cleanup_fclose_ FILE *fp = NULL;
+  _cleanup_free_ char *line = NULL;
+  size_t len = 0;
+
+  fp = fopen(path, "r");
+  if (!fp)
+    {
+      sha256_ctx_t ctx;
+
+      if (errno != ENOENT || required)
+	return -errno;
+
+      MSG_INFO("No '%s', calculating the sha256 of the image", path);
+      sha256_init(&ctx);
+      sha256_update(&ctx, s->image, s->size);
+      sha256_final(&ctx, s->info.sha256);
+      s->info.has_sha256 = true;
+      s->info.sha256_as_sent = true;
+      return 0;
+    }
+
+  if (getline(&line, &len, fp) < 0 ||
+      sha256_from_hex(line, strcspn(line, WHITESPACE), s->info.sha256) < 0)
+    return -EBADMSG;
+  s->info.has_sha256 = true;
+
+  return 0;
+}
+
+static int
+send_packet(sender_t *s, uint8_t *pkt, size_t len)
+{
+  if (sendto(s->fd, pkt, len, 0, (const struct sockaddr *)&s->group,
+	     sizeof(s->group)) < 0)
+    {
+      // the socket buffer is full, the packet gets lost like on the wire
+      if (errno == ENOBUFS || errno == EAGAIN)
+	return 0;
+      return -errno;
+    }
+  return 0;
+}
+
+static int
+send_data(sender_t *s, uint64_t seq)
+{
+  uint8_t pkt[MCAST_PACKET_MAX];
+  uint64_t offset = seq * MCAST_PAYLOAD;
+  size_t len = s->size - offset < MCAST_PAYLOAD ?
+    s->size - offset : MCAST_PAYLOAD;
+
+  memcpy(pkt + MCAST_HEADER_SIZE, s->image + offset, len);
+  return send_packet(s, pkt, mcast_build(pkt, MCAST_DATA, s->session, seq,
+					 len));
+}
+
+static int
+send_info(sender_t *s)
+{
+  uint8_t pkt[MCAST_PACKET_MAX];
+
+  return send_packet(s, pkt, mcast_build_info(pkt, s->session, &s->info));
+}
+
+// Next packet requested with NAK, UINT64_MAX if there is none
+static uint64_t
+next_resend(sender_t *s)
+{
+  if (s->nresend == 0)
+    return UINT64_MAX;
+
+  for (uint64_t i = 0; i < s->npackets; i++)
+    {
+      uint64_t seq = (s->resend_pos + i) % s->npackets;
+
+      // skip empty words quickly
+      if (seq % 64 == 0 && s->resend[seq / 64] == 0 && i + 64 <= s->npackets)
+	{
+	  i += 63;
+	  continue;
+	}
+      if (s->resend[seq / 64] & (UINT64_C(1) << (seq % 64)))
+	{
+	  s->resend[seq / 64] &= ~(UINT64_C(1) << (seq % 64));
+	  s->nresend--;
+	  s->resend_pos = seq + 1;
+	  return seq;
+	}
+    }
+
+  return UINT64_MAX;
+}
+
+static void
+handle_nak(sender_t *s, const uint8_t *payload, size_t len)
+{
+  mcast_range_t ranges[MCAST_NAK_MAX];
+  size_t n;
+
+  if (mcast_parse_nak(payload, len, ranges, &n) < 0)
+    return;
+
+  // requests of several receivers for the same packet are merged
+  for (size_t i = 0; i < n; i++)
+    for (uint64_t seq = ranges[i].first;
+	 seq < (uint64_t)ranges[i].first + ranges[i].count &&
+	   seq < s->next; seq++)
+      if (!(s->resend[seq / 64] & (UINT64_C(1) << (seq % 64))))
+	{
+	  s->resend[seq / 64] |= UINT64_C(1) << (seq % 64);
+	  s->nresend++;
+	}
+}
+
+static void
+handle_done(sender_t *s, const struct sockaddr_in *addr)
+{
+  for (unsigned int i = 0; i < s->ndone; i++)
+    if (s->done[i].sin_addr.s_addr == addr->sin_addr.s_addr &&
+	s->done[i].sin_port == addr->sin_port)
+      return;
+
+  if (s->ndone < RECEIVERS_MAX)
+    s->done[s->ndone] = *addr;
+  s->ndone++;
+  MSG_INFO("%s received the image (%u receivers)", inet_ntoa(addr->sin_addr),
+	   s->ndone);
+}
+
+static int
+receive(sender_t *s, uint64_t timeout_usec)
+{
+  struct pollfd pfd = { .fd = s->fd, .events = POLLIN };
+  struct timespec ts = {
+    .tv_sec = timeout_usec / 1000000,
+    .tv_nsec = (timeout_usec % 1000000) * 1000,
+  };
+  uint8_t pkt[MCAST_PACKET_MAX];
+
+  // poll() would round the pauses between bursts up to milliseconds
+  if (ppoll(&pfd, 1, &ts, NULL) < 0)
+    return errno == EINTR ? 0 : -errno;
+
+  while (1)
+    {
+      struct sockaddr_in addr;
+      socklen_t alen = sizeof(addr);
+      const uint8_t *payload;
+      size_t payload_len;
+      uint32_t session, seq;
+      ssize_t n;
+      int type;
+
+      n = recvfrom(s->fd, pkt, sizeof(pkt), MSG_DONTWAIT,
+		   (struct sockaddr *)&addr, &alen);
+      if (n < 0)
+	return (errno == EAGAIN || errno == EINTR) ? 0 : -errno;
+
+      type = mcast_parse(pkt, n, &session, &seq, &payload, &payload_len);
+      if (type < 0 || session != s->session)
+	continue;
+      if (type == MCAST_NAK)
+	handle_nak(s, payload, payload_len);
+      else if (type == MCAST_DONE)
+	handle_done(s, &addr);
+    }
+}
+
+/* Sends the image once, then only the packets requested with NAK, and
+   announces it every second. Runs until enough receivers are done. */
+static int
+send_image(sender_t *s, unsigned int rate, unsigned int receivers)
+{
+  // bytes per microsecond
+  double bytes_per_usec = rate / 8.0;
+  double burst = BURST_PACKETS * (double)MCAST_PACKET_MAX;
+  double tokens = burst;
+  uint64_t last = now_usec(), last_info = 0;
+  bool first_round = true;
+  int r;
+
+  while (receivers == 0 || s->ndone < receivers)
+    {
+      uint64_t now = now_usec();
+
+      tokens += (now - last) * bytes_per_usec;
+      if (tokens > burst)
+	tokens = burst;
+      last = now;
+
+      if (now - last_info >= MCAST_INFO_INTERVAL_MS * 1000ULL)
+	{
+	  r = send_info(s);
+	  if (r < 0)
+	    return r;
+	  last_info = now;
+	}
+
+      // lost packets first, they stop the receivers
+      while (tokens >= MCAST_PACKET_MAX)
+	{
+	  uint64_t seq = next_resend(s);
+
+	  if (seq != UINT64_MAX)
+	    s->resent++;
+	  else if (s->next < s->npackets)
+	    seq = s->next++;
+	  else
+	    break;
+
+	  r = send_data(s, seq);
+	  if (r < 0)
+	    return r;
+	  tokens -= MCAST_PACKET_MAX;
+	}
+
+      if (first_round && s->next >= s->npackets)
+	{
+	  MSG_INFO("Sent the image once, waiting for NAKs of lost packets");
+	  first_round = false;
+	}
+
+      // wait until the next packet may be sent, with nothing to send
+      // only NAKs and the next announcement are due
+      if (s->nresend > 0 || s->next < s->npackets)
+	r = receive(s, (MCAST_PACKET_MAX - tokens) / bytes_per_usec + 1);
+      else
+	r = receive(s, MCAST_INFO_INTERVAL_MS * 100ULL);
+      if (r < 0)
+	return r;
+    }
+
+  return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+  _cleanup_free_ uint64_t *resend = NULL;
+  _cleanup_free_ char *default_sha256 = NULL;
+  _cleanup_close_ int image_fd = -EBADF;
+  _cleanup_close_ int fd = -EBADF;
+  const char *sha256_file = NULL;
+  unsigned int rate = DEFAULT_RATE;
+  unsigned int receivers = 0;
+  unsigned int ttl = 1;
+  unsigned int ifindex;
+  sender_t *s;
+  struct stat st;
+  void *image;
+  int r;
+
+  while (1)
+    {
+      int c;
+      int option_index = 0;
+      static struct option long_options[] =
+        {
+	  {"rate",       required_argument, NULL, 'r' },
+	  {"receivers",  required_argument, NULL, 'n' },
+	  {"sha256",     required_argument, NULL, 's' },
+	  {"ttl",        required_argument, NULL, 't' },
+          {"help",       no_argument,       NULL, 'h' },
+          {"version",    no_argument,       NULL, 'v' },
+          {NULL,         0,                 NULL, '\0'}
+        };
+
+      c = getopt_long (argc, argv, "r:n:s:t:hv",
+                       long_options, &option_index);
+      if (c == (-1))
+        break;
+
+      switch (c)
+        {
+	case 'r':
+	  if (parse_uint(optarg, 100000, &rate) < 0 || rate == 0)
+	    {
+	      MSG_ERROR("Invalid rate '%s'", optarg);
+	      return EINVAL;
+	    }
+	  break;
+	case 'n':
+	  if (parse_uint(optarg, RECEIVERS_MAX, &receivers) < 0)
+	    {
+	      MSG_ERROR("Invalid number of receivers '%s'", optarg);
+	      return EINVAL;
+	    }
+	  break;
+	case 's':
+	  sha256_file = optarg;
+	  break;
+	case 't':
+	  if (parse_uint(optarg, 255, &ttl) < 0)
+	    {
+	      MSG_ERROR("Invalid time to live '%s'", optarg);
+	      return EINVAL;
+	    }
+	  break;
+	case 'h':
+          print_help();
+          return 0;
+        case 'v':
+	  MSG_INFO("rdii-mcast-send (%s) %s", PACKAGE, VERSION);
+          return 0;
+        default:
+          print_error();
+          return 1;
+        }
+    }
+
+  argc -= optind;
+  argv += optind;
+
+  if (argc != 2)
+    {
+      MSG_ERROR("rdii-mcast-send: %s arguments.", argc < 2 ? "Missing" : "Too many");
+      print_error();
+      return EINVAL;
+    }
+
+  s = calloc(1, sizeof(sender_t));
+  if (!s)
+    {
+      MSG_ERROR("Out of memory!");
+      return ENOMEM;
+    }
+
+  r = mcast_parse_url(argv[0], &s->group, &ifindex);
+  if (r < 0)
+    {
+      MSG_ERROR("Invalid multicast URL '%s': %s", argv[0], strerror(-r));
+      goto out;
+    }
+
+  image_fd = open(argv[1], O_RDONLY|O_CLOEXEC);
+  if (image_fd < 0 || fstat(image_fd, &st) < 0)
+    {
+      r = -errno;
+      MSG_ERROR("Cannot open '%s': %s", argv[1], strerror(-r));
+      goto out;
+    }
+  if (!S_ISREG(st.st_mode) || st.st_size == 0)
+    {
+      r = -EINVAL;
+      MSG_ERROR("'%s' is no image", argv[1]);
+      goto out;
+    }
+  s->size = st.st_size;
+  s->npackets = mcast_packets(s->size);
+  if (s->npackets > UINT32_MAX)
+    {
+      r = -EFBIG;
+      MSG_ERROR("'%s' is too large for multicast", argv[1]);
+      goto out;
+    }
+
+  image = mmap(NULL, s->size, PROT_READ, MAP_SHARED, image_fd, 0);
+  if (image == MAP_FAILED)
+    {
+      r = -errno;
+      MSG_ERROR("Cannot map '%s': %s", argv[1], strerror(-r));
+      goto out;
+    }
+  s->image = image;
+  madvise(image, s->size, MADV_SEQUENTIAL);
+
+  if (!sha256_file)
+    {
+      if (asprintf(&default_sha256, "%s.sha256", argv[1]) < 0)
+	{
+	  r = -ENOMEM;
+	  MSG_ERROR("Out of memory!");
+	  goto out_unmap;
+	}
+      sha256_file = default_sha256;
+    }
+  r = load_sha256(s, sha256_file, default_sha256 == NULL);
+  if (r < 0)
+    {
+      MSG_ERROR("Cannot read sha256 from '%s': %s", sha256_file, strerror(-r));
+      goto out_unmap;
+    }
+
+  s->info.size = s->size;
+  s->info.head_len = s->size < MCAST_HEAD_SIZE ? s->size : MCAST_HEAD_SIZE;
+  memcpy(s->info.head, s->image, s->info.head_len);
+
+  resend = calloc((s->npackets + 63) / 64, sizeof(uint64_t));
+  if (!resend)
+    {
+      r = -ENOMEM;
+      MSG_ERROR("Out of memory!");
+      goto out_unmap;
+    }
+  s->resend = resend;
+
+  if (getrandom(&s->session, sizeof(s->session), 0) != sizeof(s->session))
+    s->session = now_usec() ^ getpid();
+
+  fd = mcast_open_sender(ifindex, ttl);
+  if (fd < 0)
+    {
+      r = fd;
+      MSG_ERROR("Cannot open multicast socket: %s", strerror(-r));
+      goto out_unmap;
+    }
+  s->fd = fd;
+
+  MSG_INFO("Sending '%s' (%" PRIu64 " bytes) to %s with %u Mbit/s",
+	   argv[1], s->size, argv[0], rate);
+  r = send_image(s, rate, receivers);
+  if (r < 0)
+    MSG_ERROR("Sending '%s' failed: %s", argv[1], strerror(-r));
+  else
+    MSG_INFO("%u receivers got the image, %" PRIu64 " packets sent again",
+	     s->ndone, s->resent);
+
+ out_unmap:
+  munmap(image, s->size);
+ out:
+  free(s);
+  return r < 0 ? -r : 0;
+}
@@ -15,6 +15,7 @@
 #include "basics.h"
 #include "logger.h"
 #include "rdii-menu.h"
+#include "download.h"
 
 #define OFFSET 2
 
@@ -32,9 +33,8 @@ url_is_valid(const char *url, const char **error)
   CURLcode res;
   bool is_valid = false;
 
-  curl_global_init(CURL_GLOBAL_DEFAULT); // XXX Don't ignore return code
-
-  curl = curl_easy_init();
+  // the connection stays open for the download of the image
+  curl = curl_session_handle();
   if(curl)
     {
       curl_easy_setopt(curl, CURLOPT_URL, url);
@@ -52,14 +52,10 @@ url_is_valid(const char *url, const char **error)
 	is_valid = true;
       else if (error)
 	*error = curl_easy_strerror(res);
-
-      curl_easy_cleanup(curl);
     }
   else if (error)
     *error = "curl_easy_init() failed";
 
-  curl_global_cleanup();
-
   return is_valid;
 }
 
@@ -190,7 +186,8 @@ is_supported_image(const char *name)
     ".img.gz",  ".raw.gz",
     ".img.bz2", ".raw.bz2",
     ".img.xz",  ".raw.xz",
-    ".img.zst", ".raw.zst"
+    ".img.zst", ".raw.zst",
+    ".img.lz4", ".raw.lz4"
   };
   const size_t num_exts = sizeof(exts) / sizeof(exts[0]);
 
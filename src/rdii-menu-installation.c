@@ -8,8 +8,10 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <spawn.h>
+#include <pthread.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <sys/mount.h>
 #include <curl/curl.h>
 
@@ -21,27 +23,42 @@
 #include "zap_partition_table.h"
 #include "exec_cmd.h"
 #include "rdii-ssh-hostkey.h"
+#include "image_writer.h"
+#include "devices.h"
+#include "bmap.h"
+#include "chunk_index.h"
+#include "image_cache.h"
+#include "multicast.h"
 
 extern char **environ;
 
+/* Returns 0 if the signature matches, the exit status of gpgv if not.
+   Runs while the image gets downloaded, so the output of gpgv must not
+   end up on the screen. */
 // XXX Use exec_cmd, add char **error parameter and change to bool return value
 static int
 verify_signature(const char *file, const char *key)
 {
+  posix_spawn_file_actions_t actions;
   pid_t pid;
   int status;
   int r;
 
   MSG_FUNC("file='%s', key='%s'", file, key);
 
-  char *argv[] = {"gpgv", "--keyring", "/etc/systemd/import-pubring.gpg",
+  char *argv[] = {"gpgv", "--keyring", (char *)rdii_keyring,
 		  (char *)key, (char *)file, NULL};
 
-  print_global_header_footer(NULL);
-  move(2,2);
-  refresh();
-
-  r = posix_spawnp(&pid, "gpgv", NULL, NULL, argv, environ);
+  r = posix_spawn_file_actions_init(&actions);
+  if (r == 0)
+    r = posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+					 O_WRONLY, 0);
+  if (r == 0)
+    r = posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO,
+					 STDERR_FILENO);
+  if (r == 0)
+    r = posix_spawnp(&pid, "gpgv", &actions, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
   if (r != 0)
     {
       MSG_ERROR( "Failed to spawn gpgv: %s", strerror(r));
@@ -58,11 +75,8 @@ verify_signature(const char *file, const char *key)
   if (WIFEXITED(status))
     {
       if (WEXITSTATUS(status)) // Signature doesn't match
-	{
-	  MSG_ERROR("Signature does not match (gpgv failed with %i)",
-		 WEXITSTATUS(status));
-	  keywait(8, 0, NULL, 0);
-	}
+	MSG_ERROR("Signature does not match (gpgv failed with %i)",
+		  WEXITSTATUS(status));
       else
 	MSG_INFO("Signature matches");
       return WEXITSTATUS(status);
@@ -110,495 +124,816 @@ fix_partition_table(const char *device)
   return 0;
 }
 
-// XXX Add cleanup functions for close all_pipes and destroy actions
-static int
-write_net_image(const char *url, const char *device)
+static void
+show_write_progress(const iw_stats_t *stats, void _unused_ *userdata)
 {
-  char **decomp_args;
-  char *decomp_cat_args[] = { "cat", NULL };
-  char *decomp_bz2_args[] = {"pbzip2", "-dc", NULL};
-  char *decomp_gz_args[] = {"pigz", "-dc",  NULL};
-  char *decomp_xz_args[] = {"xz", "-dc",  "-T0", NULL};
-  char *decomp_zst_args[] = {"zstd", "-dc",  "-T0", NULL};
-
-  int p_wget_tee[2], p_tee_sha[2], p_tee_decomp[2], p_decomp_dd[2];
-  int r;
-
-  MSG_FUNC("url='%s', device='%s'", url, device);
-
-  if (endswith(url, ".xz"))
-    decomp_args = decomp_xz_args;
-  else if (endswith(url, ".zst"))
-    decomp_args = decomp_zst_args;
-  else if (endswith(url, ".gz"))
-    decomp_args = decomp_gz_args;
-  else if (endswith(url, ".bz2"))
-    decomp_args = decomp_bz2_args;
+  const iw_stage_stats_t *src = &stats->stage[IW_STAGE_SOURCE];
+  const iw_stage_stats_t *wr = &stats->stage[IW_STAGE_WRITE];
+  const iw_stage_stats_t *vfy = &stats->stage[IW_STAGE_VERIFY];
+  const iw_stage_stats_t *cmp = &stats->stage[IW_STAGE_COMPARE];
+  double gb = 1024.0 * 1024.0 * 1024.0;
+
+  move(4, 0);
+  clrtoeol();
+  if (stats->source_size > 0)
+    mvprintw(4, 2, "Read:    %.2f of %.2f GB (%3.0f%%), %.1f MB/s",
+	     src->bytes / gb, stats->source_size / gb,
+	     100.0 * src->bytes / stats->source_size,
+	     iw_mb_per_sec(src->bytes, src->usec));
   else
-    decomp_args = decomp_cat_args;
-
-  MSG_INFO("decompressor=%s", decomp_args[0]);
-
-  if (pipe(p_wget_tee) != 0 || pipe(p_tee_sha) != 0 ||
-      pipe(p_tee_decomp) != 0 || pipe(p_decomp_dd) != 0)
+    mvprintw(4, 2, "Read:    %.2f GB, %.1f MB/s", src->bytes / gb,
+	     iw_mb_per_sec(src->bytes, src->usec));
+  move(5, 0);
+  clrtoeol();
+  mvprintw(5, 2, "Written: %.2f GB, %.1f MB/s", wr->bytes / gb,
+	   iw_mb_per_sec(wr->bytes, wr->usec));
+  if (stats->verify_size > 0)
     {
-      r = errno;
-      show_error_popup("Cannot start image download.",
-		       "Pipe allocation failed:", strerror(r));
-      return -r;
+      move(6, 0);
+      clrtoeol();
+      mvprintw(6, 2, "Verified: %.2f of %.2f GB (%3.0f%%), %.1f MB/s",
+	       vfy->bytes / gb, stats->verify_size / gb,
+	       100.0 * vfy->bytes / stats->verify_size,
+	       iw_mb_per_sec(vfy->bytes, vfy->usec));
+    }
+  // a delta installation is not verified afterwards
+  else if (stats->compare_size > 0)
+    {
+      move(6, 0);
+      clrtoeol();
+      mvprintw(6, 2, "Compared: %.2f of %.2f GB (%3.0f%%), %.2f GB unchanged",
+	       cmp->bytes / gb, stats->compare_size / gb,
+	       100.0 * cmp->bytes / stats->compare_size,
+	       stats->unchanged_bytes / gb);
     }
 
-  // Array of all pipe ends. We must close unused ends in the child
-  // processes so they receive EOF correctly when a process dies.
-  int all_pipes[] =
-    {
-      p_wget_tee[0], p_wget_tee[1],
-      p_tee_sha[0], p_tee_sha[1],
-      p_tee_decomp[0], p_tee_decomp[1],
-      p_decomp_dd[0], p_decomp_dd[1]
-    };
-
-  pid_t pids[5];
-  posix_spawn_file_actions_t fa[5];
-  for (int i = 0; i < 5; i++)
-    posix_spawn_file_actions_init(&fa[i]);
-
-  // Process 1: wget
-  char *wget_args[] = {"wget", "--tries=5", "-q", "-O", "-", (char *)url, NULL};
-  posix_spawn_file_actions_adddup2(&fa[0], p_wget_tee[1], STDOUT_FILENO);
-  for (int i = 0; i < 8; i++) // XXX calculate 8
-    posix_spawn_file_actions_addclose(&fa[0], all_pipes[i]);
-  if (posix_spawnp(&pids[0], "wget", &fa[0], NULL, wget_args, environ) != 0)
-    {
-      MSG_ERROR("Starting 'wget' failed: %s", strerror(errno));
-      keywait(LINES-3, 0, NULL, 0);
-      for (int i = 0; i < 8; i++)
-	close(all_pipes[i]);
-      for (int i = 0; i < 5; i++)
-	posix_spawn_file_actions_destroy(&fa[i]);
-      return -1;
+  /* A stage waiting for input is faster than the one in front of it,
+     one waiting for output is faster than the one behind it. */
+  int row = 8;
+  mvprintw(row++, 2, "%-12s %10s %10s %9s %9s %9s", "Stage",
+	   "In (MB)", "Out (MB)", "MB/s", "Wait in", "Wait out");
+  for (int i = 0; i < _IW_STAGE_MAX; i++)
+    {
+      const iw_stage_stats_t *st = &stats->stage[i];
+
+      if (st->usec == 0)
+	continue;
+      move(row, 0);
+      clrtoeol();
+      mvprintw(row++, 2, "%-12s %10.1f %10.1f %9.1f %8.1fs %8.1fs",
+	       iw_stage_to_string(i), st->bytes_in / 1000000.0,
+	       st->bytes / 1000000.0, st->mb_per_sec,
+	       st->wait_in_usec / 1000000.0, st->wait_out_usec / 1000000.0);
     }
+  refresh();
+}
 
-  // Process 2: tee
-  _cleanup_free_ char *dev_fd_path = NULL;
-  if (asprintf(&dev_fd_path, "/dev/fd/%d", p_tee_decomp[1]) < 0)
-    return -ENOMEM;
-  char *tee_args[] = {"tee", dev_fd_path, NULL};
+/* Chooses how every device gets written from its queue limits. The
+   buffers are shared by all devices, so the largest buffer size any
+   device prefers is used. */
+static void
+tune_writes(const char *const *devices, size_t ndevices, iw_options_t *opts,
+	    iw_device_params_t *params)
+{
+  size_t buffer_size = opts->buffer_size;
 
-  posix_spawn_file_actions_adddup2(&fa[1], p_wget_tee[0], STDIN_FILENO);
-  posix_spawn_file_actions_adddup2(&fa[1], p_tee_sha[1], STDOUT_FILENO);
-  for (int i = 0; i < 8; i++)
+  for (size_t i = 0; i < ndevices; i++)
     {
-      // Crucial: Leave p_tee_decomp[1] open so tee can write to it via /dev/fd/...
-      if (all_pipes[i] != p_tee_decomp[1])
-	posix_spawn_file_actions_addclose(&fa[1], all_pipes[i]);
+      iw_device_params_t *p = &params[i];
+      device_geometry_t g;
+      unsigned int align, depth;
+      int r;
+
+      iw_device_params_init(opts, p);
+
+      r = get_device_geometry(devices[i], &g);
+      if (r < 0)
+	{
+	  // e.g. an image file, the defaults are fine
+	  MSG_DEBUG("No queue limits for %s: %s", devices[i], strerror(-r));
+	  continue;
+	}
+
+      // 512e disks get written in physical blocks, else every write
+      // at the start or end of a range needs a read-modify-write cycle
+      align = g.physical_block_size > g.logical_block_size ?
+	g.physical_block_size : g.logical_block_size;
+      if (align < 512 || align > 4096 || (align & (align - 1)) != 0)
+	align = g.logical_block_size;
+      if (align >= 512 && align <= 4096 && (align & (align - 1)) == 0)
+	p->alignment = align;
+      else
+	p->direct = false; // the buffers cannot be aligned for O_DIRECT
+
+      // deep queues only help devices with several hardware queues
+      if (streq(g.bus, "nvme"))
+	{
+	  depth = 32;
+	  if (buffer_size < 8 * 1024 * 1024)
+	    buffer_size = 8 * 1024 * 1024;
+	}
+      else if (streq(g.bus, "usb"))
+	depth = 2;
+      else if (g.rotational)
+	depth = 4;
+      else if (streq(g.bus, "virtio") || streq(g.bus, "sata") ||
+	       streq(g.bus, "scsi"))
+	depth = 16;
+      else
+	depth = opts->write_queue_depth;
+      if (!rdii_write_queue_depth_set)
+	p->queue_depth = depth;
+
+      // larger requests get split by the kernel anyway
+      if (g.max_sectors_kb > 0)
+	{
+	  size_t max = (size_t)g.max_sectors_kb * 1024;
+
+	  if (max < 64 * 1024)
+	    max = 64 * 1024;
+	  if (max > 4 * 1024 * 1024)
+	    max = 4 * 1024 * 1024;
+	  p->max_write = max & ~((size_t)p->alignment - 1);
+	}
+
+      // RAID arrays report the stripe width as optimal I/O size
+      if (g.io_opt > 0 && g.io_opt % 4096 == 0 && g.io_opt <= 64 * 1024 * 1024)
+	{
+	  buffer_size = (buffer_size + g.io_opt - 1) / g.io_opt * g.io_opt;
+	  if (p->max_write > g.io_opt)
+	    p->max_write -= p->max_write % g.io_opt;
+	}
+
+      MSG_INFO("%s: bus %s%s, block size %u/%u, max request %u KiB, optimal I/O %u: alignment %u, write size %zu, queue depth %u%s",
+	       devices[i], isempty(g.bus) ? "unknown" : g.bus,
+	       g.rotational ? " (rotational)" : "",
+	       g.logical_block_size, g.physical_block_size, g.max_sectors_kb,
+	       g.io_opt, p->alignment, p->max_write, p->queue_depth,
+	       p->direct ? "" : ", buffered");
     }
-  if (posix_spawnp(&pids[1], "tee", &fa[1], NULL, tee_args, environ) != 0)
+
+  opts->buffer_size = buffer_size;
+}
+
+// Reads the digest from a file in the format of sha256sum
+static int
+read_sha256_file(const char *path, uint8_t sha256[SHA256_DIGEST_SIZE])
+{
+  _cleanup_fclose_ FILE *fp = NULL;
+  _cleanup_free_ char *line = NULL;
+  size_t len = 0;
+
+  MSG_FUNC("path='%s'", path);
+
+  fp = fopen(path, "r");
+  if (!fp)
+    return -errno;
+
+  if (getline(&line, &len, fp) < 0)
+    return feof(fp) ? -EBADMSG : -errno;
+
+  if (sha256_from_hex(line, strcspn(line, WHITESPACE), sha256) < 0)
+    return -EBADMSG;
+
+  return 0;
+}
+
+/* A signature which does not match aborts the installation, one which
+   cannot be checked only if the user wants to. */
+static int
+check_signature_result(int r)
+{
+  if (r > 0)
     {
-      MSG_ERROR("Starting 'tee' failed: %s", strerror(errno));
-      keywait(LINES-3, 0, NULL, 0);
-      for (int i = 0; i < 8; i++)
-	close(all_pipes[i]);
-      for (int i = 0; i < 5; i++)
-	posix_spawn_file_actions_destroy(&fa[i]);
-      return -1;
+      show_error_popup("ERROR: Signature does not match!",
+		       "Aborting installation...", NULL);
+      return -EBADMSG;
     }
+  if (r < 0 && !show_warning_popup("Cannot verify signature.",
+				   "Continue without signature verification?",
+				   NULL))
+    return r;
+  return 0;
+}
 
-  // Process 3: decompressor
-  posix_spawn_file_actions_adddup2(&fa[2], p_tee_decomp[0], STDIN_FILENO);
-  posix_spawn_file_actions_adddup2(&fa[2], p_decomp_dd[1], STDOUT_FILENO);
-  for (int i = 0; i < 8; i++)
-    posix_spawn_file_actions_addclose(&fa[2], all_pipes[i]);
-  if (posix_spawnp(&pids[2], decomp_args[0], &fa[2], NULL, decomp_args, environ) != 0)
+/* Checksum and signature of the image. For network images they get
+   downloaded and checked by a thread while the installation continues,
+   the devices only get written after checksum_finish() accepted them. */
+typedef struct {
+  const char *url;
+  char *sha256_fn;        // NULL without checksum
+  uint8_t expected_sha256[SHA256_DIGEST_SIZE];
+  bool have_sha256;
+  bool as_read;           // of the image as read, also with hash_output
+  pthread_t thread;
+  bool running;
+  bool fetched;           // the results of the thread are pending
+  int sha256_error;       // -errno or CURLcode
+  int asc_error;          // -errno or CURLcode
+  int gpgv_error;         // of verify_signature
+} image_checksum_t;
+
+static void *
+checksum_thread(void *arg)
+{
+  image_checksum_t *cs = arg;
+  _cleanup_free_ char *sha256_url = NULL;
+  _cleanup_free_ char *gpgasc_url = NULL;
+  _cleanup_free_ char *d_gpgasc = NULL;
+
+  if (asprintf(&sha256_url, "%s.sha256", cs->url) < 0 ||
+      asprintf(&gpgasc_url, "%s.sha256.asc", cs->url) < 0 ||
+      asprintf(&d_gpgasc, "%s/image.sha256.asc", rdii_tmp_dir) < 0)
     {
-      MSG_ERROR("Starting '%s' failed: %s", decomp_args[0], strerror(errno));
-      keywait(LINES-3, 0, NULL, 0);
-      for (int i = 0; i < 8; i++)
-	close(all_pipes[i]);
-      for (int i = 0; i < 5; i++)
-	posix_spawn_file_actions_destroy(&fa[i]);
-      return -1;
+      cs->sha256_error = -ENOMEM;
+      return NULL;
     }
 
-  // Process 4: dd
-  _cleanup_free_ char *dd_of_arg = NULL;
-  if (asprintf(&dd_of_arg, "of=%s", device) < 0)
-    return -ENOMEM;
-  char *dd_args[] = {"dd", dd_of_arg, "status=progress", "conv=fsync", "oflag=direct", NULL};
-  posix_spawn_file_actions_adddup2(&fa[3], p_decomp_dd[0], STDIN_FILENO);
-  for (int i = 0; i < 8; i++)
-    posix_spawn_file_actions_addclose(&fa[3], all_pipes[i]);
-  if (posix_spawnp(&pids[3], "dd", &fa[3], NULL, dd_args, environ) != 0)
-    {
-      MSG_ERROR("Starting 'dd' failed: %s", strerror(errno));
-      keywait(LINES-3, 0, NULL, 0);
-      for (int i = 0; i < 8; i++)
-	close(all_pipes[i]);
-      for (int i = 0; i < 5; i++)
-	posix_spawn_file_actions_destroy(&fa[i]);
-      return -1;
-    }
+  cs->sha256_error = curl_download_file(sha256_url, cs->sha256_fn);
+  if (cs->sha256_error != 0)
+    return NULL;
+  cs->asc_error = curl_download_file(gpgasc_url, d_gpgasc);
+  if (cs->asc_error != 0)
+    return NULL;
+  cs->gpgv_error = verify_signature(cs->sha256_fn, d_gpgasc);
+
+  return NULL;
+}
 
-  // Process 5: sha256sum
-  char *sha_args[] = {"sha256sum", NULL};
-  _cleanup_free_ char *written_sha256_fn = NULL;
-  if (asprintf(&written_sha256_fn, "%s/written.sha256", rdii_tmp_dir) < 0)
+static int
+checksum_start(image_checksum_t *cs, const char *url)
+{
+  int r;
+
+  cs->url = url;
+  if (asprintf(&cs->sha256_fn, "%s/image.sha256", rdii_tmp_dir) < 0)
     return -ENOMEM;
-  posix_spawn_file_actions_adddup2(&fa[4], p_tee_sha[0], STDIN_FILENO);
-  posix_spawn_file_actions_addopen(&fa[4], STDOUT_FILENO, written_sha256_fn,
-				   O_WRONLY | O_CREAT | O_TRUNC, 0644);
-  for (int i = 0; i < 8; i++)
-    posix_spawn_file_actions_addclose(&fa[4], all_pipes[i]);
-  if (posix_spawnp(&pids[4], "sha256sum", &fa[4], NULL, sha_args, environ) != 0)
-    {
-      MSG_ERROR("Starting 'sha256sum' failed: %s", strerror(errno));
-      keywait(LINES-3, 0, NULL, 0);
-      for (int i = 0; i < 8; i++)
-	close(all_pipes[i]);
-      for (int i = 0; i < 5; i++)
-	posix_spawn_file_actions_destroy(&fa[i]);
-      return -1;
+  cs->fetched = true;
+
+  /* curl_global_init() is not thread-safe with older libcurl, the
+     session does it once, before the thread starts. */
+  curl_session();
+  r = pthread_create(&cs->thread, NULL, checksum_thread, cs);
+  if (r != 0)
+    {
+      MSG_WARN("Cannot create thread: %s", strerror(r));
+      checksum_thread(cs);
     }
+  else
+    cs->running = true;
 
-  // Close its copies of the pipes so the childs don't hang waiting for EOF
-  for (int i = 0; i < 8; i++)
-    close(all_pipes[i]);
-  for (int i = 0; i < 5; i++)
-    posix_spawn_file_actions_destroy(&fa[i]);
+  return 0;
+}
+
+/* Waits for the checksum thread and asks the user if something is
+   missing. Afterwards expected_sha256 is valid if have_sha256 is set. */
+static int
+checksum_finish(image_checksum_t *cs)
+{
+  int r;
 
-  int first_error = 0;
-  // Wait for all processes to finish
-  for (int i = 0; i < 5; i++)
+  if (cs->running)
     {
-      int status;
+      pthread_join(cs->thread, NULL);
+      cs->running = false;
+    }
 
-      if (waitpid(pids[i], &status, 0) == -1)
-	{
-	  r = errno;
-	  _cleanup_free_ char *err_msg = NULL;
-
-	  if (asprintf(&err_msg, "waitpid(%i) failed: %s\n", i, strerror(r)) < 0)
-            return -ENOMEM;
-          show_error_popup("Cannot finish image download correctl.",
-			   err_msg, NULL);
-	  return -r;
-	}
+  if (cs->fetched)
+    {
+      cs->fetched = false;
 
-      if (WIFEXITED(status))
+      r = cs->sha256_error ?: cs->asc_error;
+      if (cs->sha256_error != 0)
 	{
-	  if (WEXITSTATUS(status) && first_error == 0)
-	    first_error = WEXITSTATUS(status);
+	  if (!show_warning_popup("Error downloading sha256 file:",
+				  r < 0?strerror(-r):curl_easy_strerror(r),
+				  "Continue without image verification?"))
+	    return r < 0 ? r : -EIO;
+	  cs->sha256_fn = mfree(cs->sha256_fn);
 	}
-      else if (WIFSIGNALED(status))
+      else if (cs->asc_error != 0)
 	{
-	  // ignore SIGPIPE, follow up error
-	  if (WTERMSIG(status) != 13)
-	    {
-	      MSG_ERROR("Process %i killed by signal %d", i, WTERMSIG(status));
-	      first_error = 1;
-	    }
+	  if (!show_warning_popup("Error downloading sha256.asc file:",
+				  r < 0?strerror(-r):curl_easy_strerror(r),
+				  "Continue without signature verification?"))
+	    return r < 0 ? r : -EIO;
 	}
       else
 	{
-	  MSG_ERROR("Process %i terminated abnormally", i); // XXX
-	  first_error = 1;
+	  r = check_signature_result(cs->gpgv_error);
+	  if (r < 0)
+	    return r;
 	}
     }
 
-  if (first_error)
-    keywait(LINES-3, 0, NULL, 0);
+  if (cs->sha256_fn)
+    {
+      r = read_sha256_file(cs->sha256_fn, cs->expected_sha256);
+      if (r < 0)
+	{
+	  if (!show_warning_popup("Cannot read sha256 file:", strerror(-r),
+				  "Continue without image verification?"))
+	    return r;
+	}
+      else
+	cs->have_sha256 = true;
+      cs->sha256_fn = mfree(cs->sha256_fn);
+    }
 
-  return -first_error;
+  return 0;
 }
 
-// XXX Add cleanup functions for close all_pipes and destroy actions
+static void
+checksum_done(image_checksum_t *cs)
+{
+  if (cs->running)
+    pthread_join(cs->thread, NULL);
+  free(cs->sha256_fn);
+}
+
+// the image writer waits for it before the first write
 static int
-write_local_image(const char *file, const char *device)
+checksum_gate(void *userdata)
 {
-  // XXX share with write_net_image
-  char **decomp_args;
-  char *decomp_cat_args[] = { "cat", NULL };
-  char *decomp_bz2_args[] = {"pbzip2", "-dc", NULL};
-  char *decomp_gz_args[] = {"pigz", "-dc",  NULL};
-  char *decomp_xz_args[] = {"xz", "-dc",  "-T0", NULL};
-  char *decomp_zst_args[] = {"zstd", "-dc",  "-T0", NULL};
-
-  int p_pv_decomp[2], p_decomp_dd[2];
-  int r;
+  int r = checksum_finish(userdata);
 
-  MSG_FUNC("file='%s', device='%s'", file, device);
+  // restore the progress screen below the popups
+  if (!rdii_batch)
+    {
+      touchwin(stdscr);
+      refresh();
+    }
 
-  if (endswith(file, ".xz"))
-    decomp_args = decomp_xz_args;
-  else if (endswith(file, ".zst"))
-    decomp_args = decomp_zst_args;
-  else if (endswith(file, ".gz"))
-    decomp_args = decomp_gz_args;
-  else if (endswith(file, ".bz2"))
-    decomp_args = decomp_bz2_args;
-  else
-    decomp_args = decomp_cat_args;
+  return r;
+}
 
-  MSG_INFO("decompressor=%s", decomp_args[0]);
+static int
+write_image(const char *url, const char *const *devices, size_t ndevices,
+	    const bmap_t *bmap, const chunk_index_t *chunks,
+	    const chunk_index_t *manifest, const char *copy_path,
+	    image_checksum_t *checksum, iw_result_t *result)
+{
+  _cleanup_free_ char *errmsg = NULL;
+  iw_device_params_t params[IW_MAX_DEVICES];
+  iw_options_t opts;
+  int r;
 
-  if (pipe(p_pv_decomp) != 0 || pipe(p_decomp_dd) != 0)
+  MSG_FUNC("url='%s', device='%s', ndevices=%zu", url, devices[0], ndevices);
+
+  opts = rdii_iw_options;
+  // in batch mode the statistics in the log have to do
+  opts.progress = rdii_batch ? NULL : show_write_progress;
+  opts.bmap = bmap;
+  opts.chunks = chunks;
+  opts.manifest = manifest;
+  opts.chunk_cache = rdii_chunk_cache;
+  opts.curl_share = curl_session();
+  opts.copy_path = copy_path;
+  /* Without the digest of the complete image only reading back every
+     chunk shows that the devices match the signed index. */
+  if (chunks && opts.verify == IW_VERIFY_NONE)
+    opts.verify = IW_VERIFY_READBACK;
+  // the download starts while the checksum is still pending
+  if (checksum->running || checksum->fetched)
     {
-      r = errno;
-      show_error_popup("Cannot start installation process.",
-		       "Pipe allocation failed: %s", strerror(r));
-      return -r;
+      opts.gate = checksum_gate;
+      opts.userdata = checksum;
     }
+  tune_writes(devices, ndevices, &opts, params);
+  opts.device_params = params;
 
-  // Array of all pipe ends. We must close unused ends in the child
-  // processes so they receive EOF correctly when a process dies.
-  int all_pipes[] =
-    {
-      p_pv_decomp[0], p_pv_decomp[1],
-      p_decomp_dd[0], p_decomp_dd[1]
-    };
-
-  pid_t pids[3];
-  posix_spawn_file_actions_t fa[3];
-  for (int i = 0; i < 3; i++)
-    posix_spawn_file_actions_init(&fa[i]);
-
-  // Process 1: pv
-  char *pv_args[] = {"pv", (char *)file, NULL};
-  posix_spawn_file_actions_adddup2(&fa[0], p_pv_decomp[1], STDOUT_FILENO);
-  for (int i = 0; i < 4; i++) // XXX calculate 4
-    posix_spawn_file_actions_addclose(&fa[0], all_pipes[i]);
-  if (posix_spawnp(&pids[0], "pv", &fa[0], NULL, pv_args, environ) != 0)
-    {
-      MSG_ERROR("Starting 'pv' failed: %s", strerror(errno));
-      keywait(LINES-3, 0, NULL, 0);
-      for (int i = 0; i < 4; i++)
-	close(all_pipes[i]);
-      for (int i = 0; i < 3; i++)
-	posix_spawn_file_actions_destroy(&fa[i]);
-      return -1;
+  r = image_write(url, devices, ndevices, &opts, result, &errmsg);
+  if (r < 0)
+    {
+      show_error_popup("Writing image failed:", errmsg ?: strerror(-r), NULL);
+      return r;
     }
 
-  // Process 2: decompressor
-  posix_spawn_file_actions_adddup2(&fa[1], p_pv_decomp[0], STDIN_FILENO);
-  posix_spawn_file_actions_adddup2(&fa[1], p_decomp_dd[1], STDOUT_FILENO);
-  for (int i = 0; i < 4; i++)
-    posix_spawn_file_actions_addclose(&fa[1], all_pipes[i]);
-  if (posix_spawnp(&pids[1], decomp_args[0], &fa[1], NULL, decomp_args, environ) != 0)
+  // the other devices got written, only report the broken ones
+  for (size_t i = 0; i < ndevices; i++)
+    if (result->device_error[i] < 0)
+      {
+	_cleanup_free_ char *msg = NULL;
+
+	if (asprintf(&msg, "%s: %s", devices[i],
+		     strerror(-result->device_error[i])) < 0)
+	  return -ENOMEM;
+	show_error_popup("Writing image failed:", msg, NULL);
+      }
+
+  return 0;
+}
+
+/* Splits the comma separated list of target devices. The strings
+   point into buf. */
+static int
+split_devices(char *buf, const char *devices[IW_MAX_DEVICES],
+	      size_t *ret_ndevices)
+{
+  size_t n = 0;
+  char *token;
+
+  while ((token = strsep(&buf, ",")))
     {
-      MSG_ERROR("Starting '%s' failed: %s", decomp_args[0], strerror(errno));
-      keywait(LINES-3, 0, NULL, 0);
-      for (int i = 0; i < 4; i++)
-	close(all_pipes[i]);
-      for (int i = 0; i < 3; i++)
-	posix_spawn_file_actions_destroy(&fa[i]);
-      return -1;
+      token += strspn(token, WHITESPACE);
+      token[strcspn(token, WHITESPACE)] = '\0';
+      if (isempty(token))
+	continue;
+      if (n == IW_MAX_DEVICES)
+	return -E2BIG;
+      devices[n++] = token;
     }
+  if (n == 0)
+    return -EINVAL;
 
-  // Process 3: dd
-  _cleanup_free_ char *dd_of_arg = NULL;
-  if (asprintf(&dd_of_arg, "of=%s", device) < 0)
-    return -ENOMEM;
-  char *dd_args[] = {"dd", dd_of_arg, "bs=4M", "conv=fsync", "oflag=direct", NULL};
-  posix_spawn_file_actions_adddup2(&fa[2], p_decomp_dd[0], STDIN_FILENO);
-  for (int i = 0; i < 4; i++)
-    posix_spawn_file_actions_addclose(&fa[2], all_pipes[i]);
-  if (posix_spawnp(&pids[2], "dd", &fa[2], NULL, dd_args, environ) != 0)
-    {
-      MSG_ERROR("Starting 'dd' failed: %s", strerror(errno));
-      keywait(LINES-3, 0, NULL, 0);
-      for (int i = 0; i < 4; i++)
-	close(all_pipes[i]);
-      for (int i = 0; i < 3; i++)
-	posix_spawn_file_actions_destroy(&fa[i]);
-      return -1;
-    }
+  *ret_ndevices = n;
+  return 0;
+}
+
+/* Looks for <url>.bmap. The block map is optional, so a missing one
+   is no error and only a broken one is reported. */
+static int
+load_bmap(const char *url, bool is_neturl, bmap_t **ret)
+{
+  _cleanup_free_ char *bmap_url = NULL;
+  _cleanup_free_ char *bmap_fn = NULL;
+  _cleanup_free_ char *errmsg = NULL;
+  int r;
 
-  // Close its copies of the pipes so the childs don't hang waiting for EOF
-  for (int i = 0; i < 4; i++)
-    close(all_pipes[i]);
-  for (int i = 0; i < 3; i++)
-    posix_spawn_file_actions_destroy(&fa[i]);
+  *ret = NULL;
 
-  int first_error = 0;
-  // Wait for all processes to finish
-  for (int i = 0; i < 3; i++)
-    {
-      int status;
+  if (asprintf(&bmap_url, "%s.bmap", url) < 0)
+    return -ENOMEM;
 
-      if (waitpid(pids[i], &status, 0) == -1)
-	{
-	  r = errno;
-	  MSG_ERROR("waitpid(%i) failed: %s", i, strerror(r)); // XXX show_error
-	  return -r;
-	}
+  if (is_neturl)
+    {
+      if (asprintf(&bmap_fn, "%s/image.bmap", rdii_tmp_dir) < 0)
+	return -ENOMEM;
 
-      if (WIFEXITED(status))
-	{
-	  if (WEXITSTATUS(status) && first_error == 0)
-	    first_error = WEXITSTATUS(status);
-	}
-      else if (WIFSIGNALED(status))
+      r = curl_download_file(bmap_url, bmap_fn);
+      if (r != 0)
 	{
-	  // ignore SIGPIPE, follow up error
-	  if (WTERMSIG(status) != 13)
-	    {
-	      MSG_ERROR("Process %i killed by signal %d", i, WTERMSIG(status));
-	      first_error = 1;
-	    }
+	  if (r == CURLE_HTTP_RETURNED_ERROR)
+	    MSG_INFO("No bmap file found, writing complete image");
+	  else
+	    MSG_WARN("Error downloading bmap file: %s",
+		     r < 0?strerror(-r):curl_easy_strerror(r));
+	  return 0;
 	}
-      else
+    }
+  else
+    {
+      if (access(bmap_url, F_OK) < 0)
 	{
-	  MSG_ERROR("Process %i terminated abnormally", i); // XXX
-	  first_error = 1;
+	  MSG_INFO("No bmap file found, writing complete image");
+	  return 0;
 	}
+      bmap_fn = TAKE_PTR(bmap_url);
     }
 
-  if (first_error)
-    keywait(LINES-3, 0, NULL, 0);
+  r = bmap_load(bmap_fn, ret, &errmsg);
+  if (r < 0)
+    {
+      if (!show_warning_popup("Cannot use bmap file:",
+			      errmsg ?: strerror(-r),
+			      "Continue without bmap?"))
+	return r;
+    }
 
-  return -first_error;
+  return 0;
 }
 
-static bool
-sha256_eq(const char *path1, const char *path2)
+/* Network files get downloaded as name into the temporary directory,
+   local ones are used in place. Returns 0, -errno or a CURLcode. */
+static int
+fetch_file(const char *url, bool is_neturl, const char *name, char **ret_fn)
 {
-  _cleanup_fclose_ FILE *fp1 = NULL;
-  _cleanup_fclose_ FILE *fp2 = NULL;
+  _cleanup_free_ char *fn = NULL;
   int r;
 
-  MSG_FUNC("path1='%s', path2='%s'", path1, path2);
+  if (is_neturl)
+    {
+      if (asprintf(&fn, "%s/%s", rdii_tmp_dir, name) < 0)
+	return -ENOMEM;
 
-  fp1 = fopen(path1, "r");
-  if (!fp1)
+      r = curl_download_file(url, fn);
+      if (r != 0)
+	return r;
+    }
+  else
     {
-      r = errno;
-      MSG_ERROR("Cannot open '%s': %s", path1, strerror(r));
-      return false;
+      if (access(url, F_OK) < 0)
+	return -errno;
+      fn = strdup(url);
+      if (!fn)
+	return -ENOMEM;
     }
 
-  fp2 = fopen(path2, "r");
-  if (!fp2)
+  *ret_fn = TAKE_PTR(fn);
+  return 0;
+}
+
+/* Looks for a signed <url>.chunks for a delta installation. The image
+   is never read completely then, so the index is only used if its
+   signature matches and it belongs to the image with the expected
+   digest, else the complete image gets written. A signature which does
+   not match aborts the installation. */
+static int
+load_chunks(const char *url, bool is_neturl,
+	    const uint8_t expected_sha256[SHA256_DIGEST_SIZE],
+	    chunk_index_t **ret)
+{
+  _cleanup_chunk_index_ chunk_index_t *idx = NULL;
+  _cleanup_free_ char *chunks_url = NULL;
+  _cleanup_free_ char *chunks_fn = NULL;
+  _cleanup_free_ char *asc_url = NULL;
+  _cleanup_free_ char *asc_fn = NULL;
+  _cleanup_free_ char *errmsg = NULL;
+  int r;
+
+  *ret = NULL;
+
+  if (asprintf(&chunks_url, "%s.chunks", url) < 0 ||
+      asprintf(&asc_url, "%s.chunks.asc", url) < 0)
+    return -ENOMEM;
+
+  r = fetch_file(chunks_url, is_neturl, "image.chunks", &chunks_fn);
+  if (r == CURLE_HTTP_RETURNED_ERROR || r == -ENOENT)
     {
-      r = errno;
-      MSG_ERROR("Cannot open '%s': %s", path2, strerror(r));
-      return false;
+      MSG_INFO("No chunk index found, writing complete image");
+      return 0;
+    }
+  if (r != 0)
+    {
+      MSG_WARN("Error downloading chunk index: %s",
+	       r < 0?strerror(-r):curl_easy_strerror(r));
+      return 0;
+    }
+  r = fetch_file(asc_url, is_neturl, "image.chunks.asc", &asc_fn);
+  if (r != 0)
+    {
+      MSG_INFO("Chunk index is not signed, writing complete image");
+      return 0;
     }
 
-  _cleanup_free_ char *hash1 = NULL;
-  _cleanup_free_ char *hash2 = NULL;
-  size_t len = 0;
-  ssize_t nread;
+  r = verify_signature(chunks_fn, asc_fn);
+  if (r > 0)
+    return check_signature_result(r);
+  if (r < 0)
+    {
+      MSG_WARN("Cannot verify signature of the chunk index, writing complete image: %s",
+	       strerror(-r));
+      return 0;
+    }
+
+  r = chunk_index_load(chunks_fn, &idx, &errmsg);
+  if (r < 0)
+    {
+      if (!show_warning_popup("Cannot use chunk index:",
+			      errmsg ?: strerror(-r),
+			      "Continue with writing the complete image?"))
+	return r;
+      return 0;
+    }
+
+  if (memcmp(idx->image_sha256, expected_sha256, SHA256_DIGEST_SIZE) != 0)
+    {
+      MSG_WARN("Chunk index does not belong to the image, writing complete image");
+      return 0;
+    }
+
+  *ret = TAKE_PTR(idx);
+  return 0;
+}
+
+/* Looks for a signed <url>.chunks, which is used as manifest: every
+   chunk gets verified before it is written, not only the complete image
+   afterwards. An unsigned chunk index is not used, a signature which
+   does not match aborts the installation. */
+static int
+load_manifest(const char *url, bool is_neturl,
+	      const image_checksum_t *checksum, chunk_index_t **ret)
+{
+  _cleanup_chunk_index_ chunk_index_t *idx = NULL;
+  _cleanup_free_ char *chunks_url = NULL;
+  _cleanup_free_ char *chunks_fn = NULL;
+  _cleanup_free_ char *asc_url = NULL;
+  _cleanup_free_ char *asc_fn = NULL;
+  _cleanup_free_ char *errmsg = NULL;
+  int r;
+
+  *ret = NULL;
+
+  if (asprintf(&chunks_url, "%s.chunks", url) < 0 ||
+      asprintf(&asc_url, "%s.chunks.asc", url) < 0)
+    return -ENOMEM;
 
-  nread = getdelim(&hash1, &len, ' ', fp1);
-  if (nread != 65) // includes trailing space
+  r = fetch_file(chunks_url, is_neturl, "manifest.chunks", &chunks_fn);
+  if (r != 0)
+    {
+      MSG_DEBUG("No manifest: %s", r < 0?strerror(-r):curl_easy_strerror(r));
+      return 0;
+    }
+  r = fetch_file(asc_url, is_neturl, "manifest.chunks.asc", &asc_fn);
+  if (r != 0)
     {
-      MSG_ERROR("Read '%s' failed - nread=%li (%s)", path2, nread, hash1);
-      return false;
+      MSG_INFO("Chunk index is not signed, not using it as manifest");
+      return 0;
     }
 
-  nread = getdelim(&hash2, &len, ' ', fp2);
-  if (nread != 65) // includes trailing space
+  r = verify_signature(chunks_fn, asc_fn);
+  if (r > 0)
+    return check_signature_result(r);
+  if (r < 0)
     {
-      MSG_ERROR("Read '%s' failed - nread=%li (%s)", path2, nread, hash2);
-      return false;
+      MSG_WARN("Cannot verify signature of the manifest: %s", strerror(-r));
+      return 0;
     }
 
-  MSG_INFO("'%s' - '%s' - %i", hash1, hash2, streq(hash1, hash2));
+  r = chunk_index_load(chunks_fn, &idx, &errmsg);
+  if (r < 0)
+    {
+      MSG_WARN("Cannot use manifest: %s", errmsg ?: strerror(-r));
+      return 0;
+    }
+
+  // for network images the checksum is usually not known yet, then the
+  // sha256 of the written image shows a wrong manifest
+  if (checksum->have_sha256 &&
+      memcmp(idx->image_sha256, checksum->expected_sha256,
+	     SHA256_DIGEST_SIZE) != 0)
+    {
+      MSG_WARN("Manifest does not belong to the image, not using it");
+      return 0;
+    }
 
-  return streq(hash1, hash2);
+  MSG_INFO("Every chunk gets verified against the manifest before writing");
+  *ret = TAKE_PTR(idx);
+  return 0;
+}
+
+/* Loads the casync index at url, its chunks get fetched from
+   rdii.chunk-store or else from default.castr next to the index. The
+   image is never read completely, so the index itself has to match
+   the signed checksum. */
+static int
+load_caibx(const char *url, bool is_neturl, const image_checksum_t *checksum,
+	   chunk_index_t **ret, char **ret_store)
+{
+  _cleanup_chunk_index_ chunk_index_t *idx = NULL;
+  _cleanup_free_ char *caibx_fn = NULL;
+  _cleanup_free_ char *errmsg = NULL;
+  _cleanup_free_ char *store = NULL;
+  int r;
+
+  if (is_neturl)
+    {
+      if (asprintf(&caibx_fn, "%s/image.caibx", rdii_tmp_dir) < 0)
+	return -ENOMEM;
+
+      r = curl_download_file(url, caibx_fn);
+      if (r != 0)
+	{
+	  show_error_popup("Error downloading casync index:",
+			   r < 0?strerror(-r):curl_easy_strerror(r), NULL);
+	  return r < 0 ? r : -EIO;
+	}
+    }
+
+  r = chunk_index_load_caibx(caibx_fn ?: url, &idx, &errmsg);
+  if (r < 0)
+    {
+      show_error_popup("Cannot use casync index:", errmsg ?: strerror(-r),
+		       NULL);
+      return r;
+    }
+
+  // image_sha256 of a casync index is the digest of the index file
+  if (checksum->have_sha256 &&
+      memcmp(idx->image_sha256, checksum->expected_sha256,
+	     SHA256_DIGEST_SIZE) != 0)
+    {
+      char hex1[SHA256_HEX_SIZE], hex2[SHA256_HEX_SIZE];
+
+      MSG_ERROR("sha256 of casync index: expected '%s' - got '%s'",
+		sha256_to_hex(checksum->expected_sha256, hex1),
+		sha256_to_hex(idx->image_sha256, hex2));
+      show_error_popup("ERROR: SHA256 verification failed!",
+		       "The casync index does not match its checksum.", NULL);
+      return -EBADMSG;
+    }
+
+  if (rdii_chunk_store)
+    store = strdup(rdii_chunk_store);
+  else
+    {
+      const char *p = strrchr(url, '/');
+      // an index in the current directory has its store there, too
+      if (!p)
+	store = strdup("default.castr");
+      else if (asprintf(&store, "%.*sdefault.castr", (int)(p - url + 1), url) < 0)
+	store = NULL;
+    }
+  if (!store)
+    return -ENOMEM;
+
+  MSG_INFO("Fetching the chunks of '%s' from '%s'", url, store);
+
+  *ret = TAKE_PTR(idx);
+  *ret_store = TAKE_PTR(store);
+  return 0;
 }
 
 int
 run_installation(const char *url, const char *device, bool preserve_ssh_hostkey)
 {
-  _cleanup_free_ char *d_sha256_fn = NULL;
+  _cleanup_(checksum_done) image_checksum_t checksum = {};
   _cleanup_free_ char *ssh_backup_dir = NULL;
+  _cleanup_free_ char *devlist = NULL;
+  _cleanup_bmap_ bmap_t *bmap = NULL;
+  _cleanup_chunk_index_ chunk_index_t *chunks = NULL;
+  _cleanup_chunk_index_ chunk_index_t *manifest = NULL;
+  _cleanup_free_ char *chunk_store = NULL;
+  const char *devices[IW_MAX_DEVICES];
+  size_t ndevices = 0;
   bool is_neturl = startswith(url, "https://") || startswith(url, "http://");
   int r;
 
   MSG_FUNC("url='%s', device='%s', preserve_ssh_hostkey=%s", strna(url), strna(device),
            strbool(preserve_ssh_hostkey));
 
-  if (is_device_mounted(device))
+  // the image can be written to several devices at once
+  devlist = strdup(strempty(device));
+  if (!devlist)
+    return -ENOMEM;
+  r = split_devices(devlist, devices, &ndevices);
+  if (r < 0)
     {
-      _cleanup_free_ char *msg = NULL;
-      if (asprintf(&msg, "The device %s contains mounted partitions.",
-		   device) < 0)
-	return -ENOMEM;
-
-      r = show_warning_popup("!!! CRITICAL WARNING: DRIVE IS CURRENTLY MOUNTED !!!",
-			     msg,
-			     "Proceeding may cause data loss or corruption.");
-      if (r == 0)
-	return -EINTR;
+      show_error_popup("Invalid list of target devices:", strna(device),
+		       r == -E2BIG ? "Too many target devices." : NULL);
+      return r;
     }
 
+  for (size_t i = 0; i < ndevices; i++)
+    if (is_device_mounted(devices[i]))
+      {
+	_cleanup_free_ char *msg = NULL;
+	if (asprintf(&msg, "The device %s contains mounted partitions.",
+		     devices[i]) < 0)
+	  return -ENOMEM;
+
+	r = show_warning_popup("!!! CRITICAL WARNING: DRIVE IS CURRENTLY MOUNTED !!!",
+			       msg,
+			       "Proceeding may cause data loss or corruption.");
+	if (r == 0)
+	  return -EINTR;
+      }
+
   print_global_header_footer(NULL);
-  move(2,0);
+  if (!rdii_batch)
+    move(2,0);
 
   // assume network url style
   if (is_neturl)
     {
-      _cleanup_free_ char *sha256_url = NULL;
-
       MSG_INFO("Is network url");
 
-      if (asprintf(&sha256_url, "%s.sha256", url) < 0)
-	return -ENOMEM;
+      r = checksum_start(&checksum, url);
+      if (r < 0)
+	return r;
+    }
+  // mcast://<group>:<port>, the sender announces the sha256 of the image
+  else if (startswith(url, "mcast://"))
+    {
+      mcast_info_t info;
 
-      if (asprintf(&d_sha256_fn, "%s/image.sha256", rdii_tmp_dir) < 0)
-	return -ENOMEM;
+      MSG_INFO("Is a multicast url");
 
-      r = curl_download_file(sha256_url, d_sha256_fn);
-      if (r != 0)
+      r = mcast_query_info(url, MCAST_TIMEOUT_SEC * 1000, &info);
+      if (r < 0)
 	{
-	  if (!show_warning_popup("Error downloading sha256 file:",
-				  r < 0?strerror(-r):curl_easy_strerror(r),
-				  "Continue without image verification?"))
-	    return r;
+	  show_error_popup("No multicast sender found:", url, strerror(-r));
+	  return r;
 	}
-      else
+      if (info.has_sha256)
 	{
-	  _cleanup_free_ char *gpgasc_url = NULL;
-	  _cleanup_free_ char *d_gpgasc = NULL;
-
-	  if (asprintf(&gpgasc_url, "%s.sha256.asc", url) < 0)
-	    return -ENOMEM;
-
-	  if (asprintf(&d_gpgasc, "%s/image.sha256.asc", rdii_tmp_dir) < 0)
-	    return -ENOMEM;
-
-	  r = curl_download_file(gpgasc_url, d_gpgasc);
-	  if (r != 0)
-	    {
-	      if (!show_warning_popup("Error downloading sha256.asc file:",
-				      r < 0?strerror(-r):curl_easy_strerror(r),
-				      "Continue without signature verification?"))
-		return r;
-	    }
-	  else
-	    {
-	      r = verify_signature(d_sha256_fn, d_gpgasc);
-	      if (r < 0)
-		{
-                  if (!show_warning_popup ("Cannot verify signature.",
-					   "Continue without signature verification?", NULL))
-		    return r;
-		}
-	    }
+	  memcpy(checksum.expected_sha256, info.sha256, SHA256_DIGEST_SIZE);
+	  checksum.have_sha256 = true;
+	  checksum.as_read = info.sha256_as_sent;
 	}
+      else if (!show_warning_popup("The multicast sender announced no sha256.",
+				   "Continue without image verification?", NULL))
+	return -ENOENT;
     }
-  // /path/to/file/*.raw.xz
-  else if (startswith(url, "/"))
+  // /path/to/file/*.raw.xz or a path relative to the current directory
+  else if (!strstr(url, "://"))
     {
-      _cleanup_free_ char *sha256_file = NULL;
-
       MSG_INFO("Is a file url");
 
-      if (asprintf(&sha256_file, "%s.sha256", url) < 0)
+      if (asprintf(&checksum.sha256_fn, "%s.sha256", url) < 0)
 	return -ENOMEM;
 
-      r = access(sha256_file, F_OK);
+      r = access(checksum.sha256_fn, F_OK);
       if (r < 0)
 	{
 	  r = -errno;
@@ -606,6 +941,7 @@ run_installation(const char *url, const char *device, bool preserve_ssh_hostkey)
 				  strerror(-r),
 				  "Continue without image verification?"))
 	    return r;
+	  checksum.sha256_fn = mfree(checksum.sha256_fn);
 	}
       else
 	{
@@ -624,13 +960,10 @@ run_installation(const char *url, const char *device, bool preserve_ssh_hostkey)
 	    }
 	  else
 	    {
-	      r = verify_signature(sha256_file, gpgasc_file);
+	      r = check_signature_result(verify_signature(checksum.sha256_fn,
+							  gpgasc_file));
 	      if (r < 0)
-		{
-                  if (!show_warning_popup ("Cannot verify signature.",
-					   "Continue without signature verification?", NULL))
-		    return r;
-		}
+		return r;
 	    }
 	}
     }
@@ -640,24 +973,87 @@ run_installation(const char *url, const char *device, bool preserve_ssh_hostkey)
       return -EINVAL;
     }
 
+  /* Delta installations, casync indexes and the image cache need the
+     checksum before the download, else only the first write waits for
+     it. */
+  if (!is_neturl || rdii_delta || rdii_image_cache || endswith(url, ".caibx"))
+    {
+      r = checksum_finish(&checksum);
+      if (r < 0)
+	return r;
+    }
+
+  /* A casync index gets verified like an image, the chunks get
+     verified against it. */
+  if (endswith(url, ".caibx"))
+    {
+      r = load_caibx(url, is_neturl, &checksum, &chunks, &chunk_store);
+      if (r < 0)
+	return r;
+    }
+  // multicast always sends the complete image
+  else if (rdii_delta && checksum.have_sha256 && !startswith(url, "mcast://"))
+    {
+      r = load_chunks(url, is_neturl, checksum.expected_sha256, &chunks);
+      if (r < 0)
+	return r;
+    }
+
+  // the block map is not sent with multicast, a delta installation
+  // compares all chunks
+  if (!chunks && !startswith(url, "mcast://"))
+    {
+      r = load_bmap(url, is_neturl, &bmap);
+      if (r < 0)
+	return r;
+      r = load_manifest(url, is_neturl, &checksum, &manifest);
+      if (r < 0)
+	return r;
+    }
+
+  /* Downloaded images get stored in the cache under their expected
+     digest, later installations of the same image read them from
+     there. */
+  _cleanup_free_ char *cached = NULL;
+  _cleanup_free_ char *cache_copy = NULL;
+
+  if (rdii_image_cache && is_neturl && checksum.have_sha256 && !chunks)
+    {
+      r = image_cache_lookup(rdii_image_cache, checksum.expected_sha256, &cached);
+      if (r > 0)
+	MSG_INFO("Using cached image '%s'", cached);
+      else if (r == 0)
+	r = image_cache_prepare(rdii_image_cache, &cache_copy);
+      if (r < 0)
+	MSG_WARN("Cannot use image cache '%s': %s", rdii_image_cache,
+		 strerror(-r));
+    }
+
   _cleanup_free_ char *device_line = NULL;
 
   if (asprintf(&device_line, "will be written to %s", device) < 0)
     return -ENOMEM;
 
-  print_global_header_footer(NULL);
-  refresh();
-  if (!show_warning_popup("WARNING: PERMANENT DATA LOSS - Are you absolutely sure?",
-			  url, device_line))
-    return 1;
+  // --batch is the confirmation
+  if (rdii_batch)
+    MSG_INFO("%s %s", url, device_line);
+  else
+    {
+      print_global_header_footer(NULL);
+      refresh();
+      if (!show_warning_popup("WARNING: PERMANENT DATA LOSS - Are you absolutely sure?",
+			      url, device_line))
+	return 1;
+    }
 
   if (preserve_ssh_hostkey)
     {
       if (asprintf(&ssh_backup_dir, "%s/ssh-backup", rdii_tmp_dir) < 0)
         return -ENOMEM;
 
-      MSG_INFO("Attempting to backup SSH host keys from %s", device);
-      r = rdii_ssh_hostkey_backup(device, ssh_backup_dir);
+      // with several targets the keys of the first one are used
+      MSG_INFO("Attempting to backup SSH host keys from %s", devices[0]);
+      r = rdii_ssh_hostkey_backup(devices[0], ssh_backup_dir);
       if (r < 0)
         {
           MSG_WARN("SSH host key backup failed: %s", strerror(-r));
@@ -668,64 +1064,135 @@ run_installation(const char *url, const char *device, bool preserve_ssh_hostkey)
         }
     }
 
-  print_global_header_footer(NULL);
-  const char *start_installation_str = "Starting installation...";
-  mvprintw(2, (COLS - strlen(start_installation_str)) / 2,
-	   "%s", start_installation_str);
-  move(4,0);
-  refresh();
-
-  if (is_neturl)
+  if (!rdii_batch)
     {
-      _cleanup_free_ char *written_sha256_fn = NULL;
+      print_global_header_footer(NULL);
+      const char *start_installation_str = "Starting installation...";
+      mvprintw(2, (COLS - strlen(start_installation_str)) / 2,
+	       "%s", start_installation_str);
+      move(4,0);
+      refresh();
+    }
 
-      r = write_net_image(url, device);
-      if (r != 0)
-	return r;
+  iw_result_t result;
 
-      if (asprintf(&written_sha256_fn, "%s/written.sha256", rdii_tmp_dir) < 0)
-	return -ENOMEM;
+  r = write_image(chunk_store ?: cached ?: url, devices, ndevices, bmap, chunks,
+		  manifest, cache_copy, &checksum, &result);
+  if (r != 0)
+    {
+      if (cache_copy)
+	unlink(cache_copy);
+      return r;
+    }
 
-      if (!sha256_eq(written_sha256_fn, d_sha256_fn))
+  /* After a delta installation every chunk on the devices got read back
+     and matched the chunk index, which matched the checksum before. */
+  if (checksum.have_sha256 && !result.have_sha256)
+    MSG_INFO("sha256: every chunk matched the verified chunk index");
+  else if (checksum.have_sha256)
+    {
+      /* With hash_output the sha256 file is for the uncompressed image,
+	 a digest calculated by the multicast sender is not. */
+      bool output = rdii_iw_options.hash_output && !checksum.as_read;
+      const uint8_t *sha256 = output ? result.output_sha256 : result.sha256;
+      char hex1[SHA256_HEX_SIZE], hex2[SHA256_HEX_SIZE];
+      bool match;
+
+      MSG_INFO("sha256: expected '%s' - got '%s'",
+	       sha256_to_hex(checksum.expected_sha256, hex1),
+	       sha256_to_hex(sha256, hex2));
+
+      match = memcmp(sha256, checksum.expected_sha256, SHA256_DIGEST_SIZE) == 0;
+      /* The compressed image as read contained broken chunks, which got
+	 read again. Every chunk written matched the signed manifest, so
+	 the manifest has to belong to the image. */
+      if (!match && result.refetched > 0 && !output)
+	{
+	  MSG_INFO("sha256: %u chunks were read again, expected '%s' - manifest '%s'",
+		   result.refetched, hex1,
+		   sha256_to_hex(manifest->image_sha256, hex2));
+	  match = memcmp(manifest->image_sha256, checksum.expected_sha256,
+			 SHA256_DIGEST_SIZE) == 0;
+	}
+
+      if (!match)
 	{
 	  _cleanup_free_ char *errmsg = NULL;
 	  show_error_popup("ERROR: SHA256 verification failed!",
 			   "Wiping invalid data and aborting...", NULL);
-	  if (zap_partition_tables(device, &errmsg) < 0)
-	    show_error_popup("ERROR: wiping invalid data failed!",
-			     errmsg, NULL);
-
+	  // a broken copy must not be used again
+	  if (cache_copy)
+	    unlink(cache_copy);
+	  if (cached)
+	    unlink(cached);
+	  for (size_t i = 0; i < ndevices; i++)
+	    {
+	      if (result.device_error[i] < 0)
+		continue;
+	      if (zap_partition_tables(devices[i], &errmsg) < 0)
+		show_error_popup("ERROR: wiping invalid data failed!",
+				 errmsg, NULL);
+	      errmsg = mfree(errmsg);
+	    }
 
 	  return -EIO;
 	}
     }
-  else
+
+  if (cache_copy)
     {
-      r = write_local_image(url, device);
-      if (r != 0)
-	return r;
+      // the copy contains the broken chunks of a compressed image
+      if (result.copy_error < 0 ||
+	  (result.refetched > 0 &&
+	   memcmp(result.sha256, manifest->image_sha256, SHA256_DIGEST_SIZE) != 0))
+	unlink(cache_copy);
+      else
+	{
+	  // the image got installed, a failure here does not matter
+	  int k = image_cache_add(rdii_image_cache, cache_copy,
+				  checksum.expected_sha256, rdii_image_cache_size);
+	  if (k < 0)
+	    MSG_WARN("Cannot add image to the cache: %s", strerror(-k));
+	}
     }
 
-  fix_partition_table(device);
-  // Re-read partition table to update kernel view on disk
-  _cleanup_close_ int fd = -EBADF;
-  fd = open(device, O_RDWR | O_SYNC);
-  if (fd > 0) // ignore error if we cannot open device
-    ioctl(fd, BLKRRPART);
+  for (size_t i = 0; i < ndevices; i++)
+    {
+      struct stat st;
+
+      if (result.device_error[i] < 0)
+	continue;
+      // an image file has no space behind the backup GPT to move it to
+      if (stat(devices[i], &st) < 0 || !S_ISBLK(st.st_mode))
+	continue;
+
+      fix_partition_table(devices[i]);
+      // Re-read partition table to update kernel view on disk
+      _cleanup_close_ int fd = -EBADF;
+      fd = open(devices[i], O_RDWR | O_SYNC);
+      if (fd > 0) // ignore error if we cannot open device
+	ioctl(fd, BLKRRPART);
+    }
 
   if (preserve_ssh_hostkey && ssh_backup_dir)
     {
-      MSG_INFO("Attempting to restore SSH host keys to %s", device);
       sleep(2);
-      r = rdii_ssh_hostkey_restore(device, ssh_backup_dir);
-      if (r < 0)
-        {
-          MSG_WARN("SSH host key restore failed: %s", strerror(-r));
-        }
-      else if (r > 0)
-        {
-          MSG_INFO("Successfully restored %d SSH host key(s)", r);
-        }
+      for (size_t i = 0; i < ndevices; i++)
+	{
+	  if (result.device_error[i] < 0)
+	    continue;
+
+	  MSG_INFO("Attempting to restore SSH host keys to %s", devices[i]);
+	  r = rdii_ssh_hostkey_restore(devices[i], ssh_backup_dir);
+	  if (r < 0)
+	    {
+	      MSG_WARN("SSH host key restore failed: %s", strerror(-r));
+	    }
+	  else if (r > 0)
+	    {
+	      MSG_INFO("Successfully restored %d SSH host key(s)", r);
+	    }
+	}
     }
 
   keywait(LINES-3, 0, NULL, 60);
@@ -68,7 +68,7 @@ get_cpu_model(char **ret)
     }
 }
 
-static void
+void
 get_meminfo(uint64_t *mem_total, uint64_t *mem_free, uint64_t *mem_available)
 {
   _cleanup_fclose_ FILE *fp = NULL;
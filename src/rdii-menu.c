@@ -54,6 +54,9 @@ keywait(int y, int x, const char *text, int sec)
   if (text)
     msg = text;
 
+  if (rdii_batch)
+    return;
+
   if (sec < 0)
     sec = 5;
 
@@ -122,6 +125,9 @@ show_splash_screen(void)
 void
 print_global_header_footer(const char *addkeys)
 {
+  if (rdii_batch)
+    return;
+
   clear();
   // Draw Header (Green on Blue)
   attron(COLOR_PAIR(CP_HEADER) | A_BOLD);
@@ -183,7 +189,7 @@ truncate_middle(const char *str, size_t max_len)
 }
 
 
-// Returns 1 if YES, 0 if NO
+// Returns 1 if YES, 0 if NO, in batch mode always 0
 int
 show_warning_popup(const char *headline,
 		   const char *descr_line1, const char *descr_line2)
@@ -206,6 +212,13 @@ show_warning_popup(const char *headline,
       height++;
     }
 
+  // nobody there to take the risk
+  if (rdii_batch)
+    {
+      MSG_WARN("Answered with NO in batch mode");
+      return 0;
+    }
+
   width = strlen(headline) + 6;
   if (descr_line1)
     {
@@ -310,6 +323,9 @@ show_error_popup(const char *headline,
 	width = strlen(descr_line2) + 6;
     }
 
+  if (rdii_batch)
+    return;
+
   int start_y = (LINES - height) / 2 - 2;
   int start_x = (COLS - width) / 2;
 
@@ -4,6 +4,8 @@
 
 #include <ncursesw/curses.h>
 
+#include "image_writer.h"
+
 // Color Pair definitions
 #define CP_HEADER 1
 #define CP_SPLASH_BOX 2
@@ -14,6 +16,15 @@
 #define CP_WARNING 7
 
 extern const char *rdii_tmp_dir;
+extern iw_options_t rdii_iw_options;
+extern bool rdii_write_queue_depth_set;
+extern const char *rdii_image_cache;
+extern uint64_t rdii_image_cache_size;
+extern bool rdii_delta;
+extern const char *rdii_chunk_store;
+extern const char *rdii_chunk_cache;
+extern const char *rdii_keyring;
+extern bool rdii_batch;
 
 extern void print_global_header_footer(const char *addkeys);
 extern void print_title(const char *title);
@@ -35,6 +46,9 @@ extern int select_keymap(char **device);
 extern int select_target_device(uint64_t minsize, char **device);
 extern void select_installation_source(const char *prefill, char **ret);
 extern int show_sysinfo(void);
+// in kB, the values stay unchanged if /proc/meminfo cannot be read
+extern void get_meminfo(uint64_t *mem_total, uint64_t *mem_free,
+			uint64_t *mem_available);
 extern int run_installation(const char *url, const char *device, bool preserve_ssh_hostkey);
 extern void init_ncurses(void);
 extern int rdii_menu(const char *image, const char *image1,
@@ -0,0 +1,306 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zstd.h>
+
+#include "basics.h"
+#include "logger.h"
+#include "chunk_index.h"
+
+// default chunk size in MiB
+#define DEFAULT_CHUNK_SIZE 4
+
+static void
+print_usage(FILE *stream)
+{
+  fprintf(stream, "Usage: rdii-mkchunks [--help]|[--version]|[options] <image>\n");
+}
+
+static void
+print_help(void)
+{
+  fprintf(stdout, "rdii-mkchunks - Create the chunk index of an image for delta installations\n\n");
+  print_usage(stdout);
+
+  fputs("  -c, --chunk-size  Size of the chunks in MiB (default: 4)\n", stdout);
+  fputs("  -z, --zstd        Write <image>.zst with one zstd frame per chunk,\n", stdout);
+  fputs("                    compressed with the given level\n", stdout);
+  fputs("  -h, --help        Give this help list\n", stdout);
+  fputs("  -v, --version     Print program version\n", stdout);
+}
+
+static void
+print_error(void)
+{
+  MSG_ERROR("Try `rdii-mkchunks --help' for more information.");
+}
+
+static int
+parse_int(const char *s, int min, int max, int *ret)
+{
+  char *end;
+  long v;
+
+  errno = 0;
+  v = strtol(s, &end, 10);
+  if (errno != 0 || end == s || *end != '\0' || v < min || v > max)
+    return -EINVAL;
+
+  *ret = v;
+  return 0;
+}
+
+static int
+write_all(int fd, const uint8_t *data, size_t len)
+{
+  while (len > 0)
+    {
+      ssize_t n = write(fd, data, len);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -errno;
+	}
+      data += n;
+      len -= n;
+    }
+  return 0;
+}
+
+/* Splits the uncompressed image into chunks. With level > 0 every
+   chunk gets compressed into a zstd frame of its own and appended to
+   out_fd, else the chunks are located in the image itself. */
+static int
+build_index(const uint8_t *image, uint64_t size, uint32_t chunk_size,
+	    int level, int out_fd, chunk_index_t *idx)
+{
+  _cleanup_free_ uint8_t *frame = NULL;
+  size_t frame_size = ZSTD_compressBound(chunk_size);
+  sha256_ctx_t file_sha256;
+  ZSTD_CCtx *cctx = NULL;
+  uint64_t offset = 0;
+  int r = 0;
+
+  idx->image_size = size;
+  idx->chunk_size = chunk_size;
+  idx->nchunks = (size + chunk_size - 1) / chunk_size;
+  idx->chunks = calloc(idx->nchunks, sizeof(chunk_t));
+  if (!idx->chunks)
+    return -ENOMEM;
+
+  if (level > 0)
+    {
+      frame = malloc(frame_size);
+      cctx = ZSTD_createCCtx();
+      if (!frame || !cctx)
+	{
+	  ZSTD_freeCCtx(cctx);
+	  return -ENOMEM;
+	}
+    }
+
+  sha256_init(&file_sha256);
+  for (size_t i = 0; i < idx->nchunks; i++)
+    {
+      chunk_t *c = &idx->chunks[i];
+      const uint8_t *data;
+      size_t len;
+      sha256_ctx_t sha256;
+
+      c->start = (uint64_t)i * chunk_size;
+      c->size = size - c->start < chunk_size ? size - c->start : chunk_size;
+      data = image + c->start;
+      len = c->size;
+
+      sha256_init(&sha256);
+      sha256_update(&sha256, data, len);
+      sha256_final(&sha256, c->sha256);
+
+      if (level == 0)
+	{
+	  c->offset = c->start;
+	  c->length = len;
+	  sha256_update(&file_sha256, data, len);
+	  continue;
+	}
+
+      size_t n = ZSTD_compressCCtx(cctx, frame, frame_size, data, len, level);
+      if (ZSTD_isError(n))
+	{
+	  MSG_ERROR("Compressing chunk %zu failed: %s", i,
+		    ZSTD_getErrorName(n));
+	  r = -EIO;
+	  break;
+	}
+      r = write_all(out_fd, frame, n);
+      if (r < 0)
+	break;
+      sha256_update(&file_sha256, frame, n);
+      c->offset = offset;
+      c->length = n;
+      offset += n;
+    }
+  sha256_final(&file_sha256, idx->image_sha256);
+
+  ZSTD_freeCCtx(cctx);
+  return r;
+}
+
+int
+main(int argc, char **argv)
+{
+  _cleanup_free_ char *zst_path = NULL;
+  _cleanup_free_ char *index_path = NULL;
+  _cleanup_close_ int image_fd = -EBADF;
+  _cleanup_close_ int out_fd = -EBADF;
+  _cleanup_fclose_ FILE *fp = NULL;
+  chunk_index_t idx = {};
+  int chunk_size = DEFAULT_CHUNK_SIZE;
+  int level = 0;
+  struct stat st;
+  void *image;
+  int r;
+
+  while (1)
+    {
+      int c;
+      int option_index = 0;
+      static struct option long_options[] =
+        {
+	  {"chunk-size", required_argument, NULL, 'c' },
+	  {"zstd",       required_argument, NULL, 'z' },
+          {"help",       no_argument,       NULL, 'h' },
+          {"version",    no_argument,       NULL, 'v' },
+          {NULL,         0,                 NULL, '\0'}
+        };
+
+      c = getopt_long (argc, argv, "c:z:hv",
+                       long_options, &option_index);
+      if (c == (-1))
+        break;
+
+      switch (c)
+        {
+	case 'c':
+	  if (parse_int(optarg, 1, CHUNK_INDEX_MAX_CHUNK_SIZE / (1024 * 1024),
+			&chunk_size) < 0)
+	    {
+	      MSG_ERROR("Invalid chunk size '%s'", optarg);
+	      return EINVAL;
+	    }
+	  break;
+	case 'z':
+	  if (parse_int(optarg, 1, ZSTD_maxCLevel(), &level) < 0)
+	    {
+	      MSG_ERROR("Invalid compression level '%s'", optarg);
+	      return EINVAL;
+	    }
+	  break;
+	case 'h':
+          print_help();
+          return 0;
+        case 'v':
+	  MSG_INFO("rdii-mkchunks (%s) %s", PACKAGE, VERSION);
+          return 0;
+        default:
+          print_error();
+          return 1;
+        }
+    }
+
+  argc -= optind;
+  argv += optind;
+
+  if (argc != 1)
+    {
+      MSG_ERROR("rdii-mkchunks: %s arguments.", argc < 1 ? "Missing" : "Too many");
+      print_error();
+      return EINVAL;
+    }
+
+  image_fd = open(argv[0], O_RDONLY|O_CLOEXEC);
+  if (image_fd < 0 || fstat(image_fd, &st) < 0)
+    {
+      MSG_ERROR("Cannot open '%s': %s", argv[0], strerror(errno));
+      return errno;
+    }
+  if (!S_ISREG(st.st_mode) || st.st_size == 0)
+    {
+      MSG_ERROR("'%s' is no image", argv[0]);
+      return EINVAL;
+    }
+
+  // the index describes the file which gets published
+  if (level > 0)
+    {
+      if (asprintf(&zst_path, "%s.zst", argv[0]) < 0 ||
+	  asprintf(&index_path, "%s.chunks", zst_path) < 0)
+	{
+	  MSG_ERROR("Out of memory!");
+	  return ENOMEM;
+	}
+      out_fd = open(zst_path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+      if (out_fd < 0)
+	{
+	  MSG_ERROR("Cannot create '%s': %s", zst_path, strerror(errno));
+	  return errno;
+	}
+    }
+  else if (asprintf(&index_path, "%s.chunks", argv[0]) < 0)
+    {
+      MSG_ERROR("Out of memory!");
+      return ENOMEM;
+    }
+
+  image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, image_fd, 0);
+  if (image == MAP_FAILED)
+    {
+      MSG_ERROR("Cannot map '%s': %s", argv[0], strerror(errno));
+      return errno;
+    }
+  madvise(image, st.st_size, MADV_SEQUENTIAL);
+
+  r = build_index(image, st.st_size, (uint32_t)chunk_size * 1024 * 1024,
+		  level, out_fd, &idx);
+  munmap(image, st.st_size);
+  if (r == 0 && out_fd >= 0 && fsync(out_fd) < 0)
+    r = -errno;
+  if (r < 0)
+    {
+      MSG_ERROR("Cannot create chunks of '%s': %s", argv[0], strerror(-r));
+      goto out;
+    }
+
+  fp = fopen(index_path, "we");
+  if (!fp)
+    {
+      r = -errno;
+      MSG_ERROR("Cannot create '%s': %s", index_path, strerror(-r));
+      goto out;
+    }
+  r = chunk_index_save(&idx, fp);
+  if (r < 0)
+    {
+      MSG_ERROR("Writing '%s' failed: %s", index_path, strerror(-r));
+      goto out;
+    }
+
+  MSG_INFO("Wrote '%s' with %zu chunks%s%s", index_path, idx.nchunks,
+	   zst_path ? " for " : "", zst_path ?: "");
+
+ out:
+  free(idx.chunks);
+  return r < 0 ? -r : 0;
+}
@@ -0,0 +1,224 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/* Benchmark of the image write pipeline, run by bench-image-writer.sh:
+
+     bench-image-writer generate <image> <MiB> <sparse %> <compressible %>
+     bench-image-writer write <image> <target> [<buffer KiB>]
+
+   generate creates a reproducible raw image: the given share of 64 KiB
+   blocks contains only zeros, of the other blocks the given share is
+   text, the rest random data. write installs the image like the
+   installer does and prints one key=value line per stage and one for
+   the complete run. */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/resource.h>
+
+#include "basics.h"
+#include "logger.h"
+#include "download.h"
+#include "image_writer.h"
+
+#define BLOCK_SIZE (64 * 1024)
+
+static void
+print_usage(FILE *stream)
+{
+  fprintf(stream, "Usage: bench-image-writer generate <image> <MiB> <sparse %%> <compressible %%>\n");
+  fprintf(stream, "       bench-image-writer write <image> <target> [<buffer KiB>]\n");
+}
+
+static int
+parse_uint(const char *s, unsigned long max, unsigned long *ret)
+{
+  char *end;
+  unsigned long v;
+
+  errno = 0;
+  v = strtoul(s, &end, 10);
+  if (errno != 0 || end == s || *end != '\0' || v > max)
+    return -EINVAL;
+
+  *ret = v;
+  return 0;
+}
+
+// xorshift64, the images have to be the same in every run
+static uint64_t
+next_random(uint64_t *state)
+{
+  uint64_t x = *state;
+
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+static void
+fill_text(uint8_t *p, size_t len, uint64_t *state)
+{
+  static const char *const words[] = {
+    "usr", "lib", "share", "etc", "systemd", "config", "library", "the",
+    "install", "device", "image", "partition", "kernel", "module", "x86_64",
+    "firmware", "locale", "python3", "site-packages", "__init__.py",
+  };
+  size_t i = 0;
+
+  while (i < len)
+    {
+      size_t k = next_random(state) % (sizeof(words) / sizeof(words[0]));
+      const char *w = words[k];
+      size_t n = strlen(w);
+
+      if (n > len - i)
+	n = len - i;
+      memcpy(p + i, w, n);
+      i += n;
+      if (i < len)
+	p[i++] = next_random(state) % 4 == 0 ? '\n' : '/';
+    }
+}
+
+static void
+fill_random(uint8_t *p, size_t len, uint64_t *state)
+{
+  for (size_t i = 0; i < len; i += sizeof(uint64_t))
+    {
+      uint64_t v = next_random(state);
+      memcpy(p + i, &v, len - i < sizeof(v) ? len - i : sizeof(v));
+    }
+}
+
+static int
+generate(const char *path, unsigned long mib, unsigned long sparse,
+	 unsigned long compressible)
+{
+  _cleanup_fclose_ FILE *fp = NULL;
+  _cleanup_free_ uint8_t *block = NULL;
+  uint64_t nblocks = (uint64_t)mib * 1024 * 1024 / BLOCK_SIZE;
+  size_t text = BLOCK_SIZE / 100 * compressible;
+  uint64_t state = 0x9e3779b97f4a7c15ULL;
+
+  block = malloc(BLOCK_SIZE);
+  if (!block)
+    return -ENOMEM;
+
+  fp = fopen(path, "we");
+  if (!fp)
+    return -errno;
+
+  for (uint64_t i = 0; i < nblocks; i++)
+    {
+      if (next_random(&state) % 100 < sparse)
+	memset(block, 0, BLOCK_SIZE);
+      else
+	{
+	  fill_text(block, text, &state);
+	  fill_random(block + text, BLOCK_SIZE - text, &state);
+	}
+      if (fwrite(block, BLOCK_SIZE, 1, fp) != 1)
+	return -EIO;
+    }
+
+  if (fflush(fp) != 0)
+    return -errno;
+  return 0;
+}
+
+static int
+write_image(const char *image, const char *target, unsigned long buffer_kib)
+{
+  _cleanup_free_ char *error = NULL;
+  const char *devices[] = { target };
+  iw_options_t opts;
+  iw_result_t result;
+  struct rusage ru;
+  uint64_t out;
+  int r;
+
+  iw_options_init(&opts);
+  if (buffer_kib > 0)
+    opts.buffer_size = buffer_kib * 1024;
+  // initializes curl globally, the image may be an URL
+  opts.curl_share = curl_session();
+
+  r = image_write(image, devices, 1, &opts, &result, &error);
+  if (r < 0)
+    {
+      MSG_ERROR("Writing '%s' to '%s' failed: %s", image, target,
+		error ?: strerror(-r));
+      return r;
+    }
+
+  for (int i = 0; i < _IW_STAGE_MAX; i++)
+    {
+      const iw_stage_stats_t *st = &result.stats.stage[i];
+
+      if (st->usec == 0)
+	continue;
+      printf("bench stage=%s bytes_in=%" PRIu64 " bytes_out=%" PRIu64
+	     " mb_s=%.1f cpu_ms=%" PRIu64 " wait_in_ms=%" PRIu64
+	     " wait_out_ms=%" PRIu64 "\n", iw_stage_to_string(i),
+	     st->bytes_in, st->bytes, st->mb_per_sec, st->cpu_usec / 1000,
+	     st->wait_in_usec / 1000, st->wait_out_usec / 1000);
+    }
+
+  // the decoder threads are only included here, like the memory
+  getrusage(RUSAGE_SELF, &ru);
+  out = result.stats.stage[IW_STAGE_WRITE].bytes;
+  printf("bench total elapsed_ms=%" PRIu64 " mb_s=%.1f cpu_ms=%" PRIu64
+	 " max_rss_kib=%ld\n", result.stats.usec / 1000,
+	 iw_mb_per_sec(out, result.stats.usec),
+	 (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000 +
+	 (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000, ru.ru_maxrss);
+
+  return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+  unsigned long mib, sparse, compressible, buffer_kib = 0;
+  int r;
+
+  // the results go to stdout, only errors to the console
+  set_max_log_level(LOG_LEVEL_WARNING);
+
+  if (argc == 6 && streq(argv[1], "generate"))
+    {
+      if (parse_uint(argv[3], 1024 * 1024, &mib) < 0 ||
+	  parse_uint(argv[4], 100, &sparse) < 0 ||
+	  parse_uint(argv[5], 100, &compressible) < 0)
+	{
+	  print_usage(stderr);
+	  return EINVAL;
+	}
+      r = generate(argv[2], mib, sparse, compressible);
+      if (r < 0)
+	MSG_ERROR("Cannot create '%s': %s", argv[2], strerror(-r));
+    }
+  else if ((argc == 4 || argc == 5) && streq(argv[1], "write"))
+    {
+      if (argc == 5 && (parse_uint(argv[4], 64 * 1024, &buffer_kib) < 0 ||
+			buffer_kib % 4 != 0))
+	{
+	  print_usage(stderr);
+	  return EINVAL;
+	}
+      r = write_image(argv[2], argv[3], buffer_kib);
+    }
+  else
+    {
+      print_usage(stderr);
+      return EINVAL;
+    }
+
+  return r < 0 ? -r : 0;
+}
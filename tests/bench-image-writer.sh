@@ -0,0 +1,84 @@
+#!/bin/bash
+
+# Writes synthetic images in every compression format with a compressor
+# installed to a file and, as root, to a loop device. Run with
+# "meson test --benchmark", the results end up in the test log.
+#
+# RDII_BENCH_SIZE          size of the image in MiB (default: 256)
+# RDII_BENCH_SPARSE        percentage of zero blocks (default: 25)
+# RDII_BENCH_COMPRESSIBLE  percentage of text in the other blocks (default: 50)
+# RDII_BENCH_BUFFERS       buffer sizes in KiB (default: "1024 4096")
+
+set -e -o pipefail
+
+BENCH=${1:-./bench-image-writer}
+SIZE=${RDII_BENCH_SIZE:-256}
+SPARSE=${RDII_BENCH_SPARSE:-25}
+COMPRESSIBLE=${RDII_BENCH_COMPRESSIBLE:-50}
+BUFFERS=${RDII_BENCH_BUFFERS:-1024 4096}
+
+cleanup()
+{
+    local exit_code=$?
+
+    if [ -n "$LOOPDEV" ]; then
+        losetup -d "$LOOPDEV"
+    fi
+    if [ -n "$TEMPDIR" ] && [ -d "$TEMPDIR" ]; then
+        rm -rf "$TEMPDIR"
+    fi
+
+    exit $exit_code
+}
+
+trap cleanup EXIT
+
+
+TEMPDIR=$(mktemp -d)
+IMAGE="$TEMPDIR/bench.raw"
+
+"$BENCH" generate "$IMAGE" "$SIZE" "$SPARSE" "$COMPRESSIBLE"
+
+# xz and zstd with several threads create images which can be
+# decompressed in parallel as well
+IMAGES=("$IMAGE")
+compress()
+{
+    local ext=$1
+    shift
+
+    if command -v "$1" > /dev/null; then
+        "$@" < "$IMAGE" > "$IMAGE.$ext"
+        IMAGES+=("$IMAGE.$ext")
+    else
+        echo "# $1 not found, skipping .$ext"
+    fi
+}
+compress gz gzip -c
+compress xz xz -c -T0 --block-size=16MiB
+compress zst zstd -c -q -T0
+compress bz2 bzip2 -c
+compress lz4 lz4 -c -q
+
+TARGETS=("$TEMPDIR/target")
+if [ "$(id -u)" = 0 ] && command -v losetup > /dev/null; then
+    truncate -s "${SIZE}M" "$TEMPDIR/loop"
+    LOOPDEV=$(losetup --find --show --direct-io=on "$TEMPDIR/loop")
+    TARGETS+=("$LOOPDEV")
+else
+    echo "# not root or no losetup, skipping the loop device"
+fi
+
+for target in "${TARGETS[@]}"; do
+    for image in "${IMAGES[@]}"; do
+        for buffer in $BUFFERS; do
+            echo "# image=$(basename "$image") target=$target buffer_kib=$buffer size_mib=$SIZE sparse=$SPARSE compressible=$COMPRESSIBLE"
+            : > "$TEMPDIR/target"
+            "$BENCH" write "$image" "$target" "$buffer" | grep '^bench '
+            if ! cmp -n "$((SIZE * 1024 * 1024))" "$IMAGE" "$target"; then
+                echo "$target differs from $(basename "$image")"
+                exit 1
+            fi
+        done
+    done
+done
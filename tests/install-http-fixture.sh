@@ -0,0 +1,103 @@
+# Sourced by the tst-install-http-* tests.
+#
+# Creates a random image, compresses it with xz and signs its sha256 with
+# a throwaway gpg key, starts a web server on a free local port serving
+# them, and writes an rdii-config installing the image into a sparse
+# file. The tests then run "rdi-installer --batch" with that config.
+#
+# Exits with 77 (skipped) if python3, gpg, gpgv or xz are missing.
+
+RDI_INSTALLER=${RDI_INSTALLER:-./rdi-installer}
+IMAGE_MIB=${RDII_TEST_IMAGE_MIB:-32}
+
+cleanup()
+{
+    local exit_code=$?
+
+    if [ -n "$HTTP_PID" ]; then
+        kill "$HTTP_PID" 2> /dev/null || :
+        wait "$HTTP_PID" 2> /dev/null || :
+    fi
+    if [ -n "$TEMPDIR" ] && [ -d "$TEMPDIR" ]; then
+        rm -rf "$TEMPDIR"
+    fi
+
+    exit $exit_code
+}
+
+trap cleanup EXIT
+
+for tool in python3 gpg gpgv xz; do
+    if ! command -v "$tool" > /dev/null; then
+        echo "$tool not found, skipping"
+        exit 77
+    fi
+done
+
+TEMPDIR=$(mktemp -d)
+SRVDIR="$TEMPDIR/srv"
+IMAGE="$SRVDIR/image.raw.xz"
+TARGET="$TEMPDIR/target"
+CONFIG="$TEMPDIR/rdii-config"
+mkdir "$SRVDIR"
+
+# random data with a hole, so that sparse writing gets used, too
+third=$((IMAGE_MIB / 3))
+{
+    head -c "${third}M" /dev/urandom
+    head -c "${third}M" /dev/zero
+    head -c "$((IMAGE_MIB - 2 * third))M" /dev/urandom
+} > "$TEMPDIR/image.raw"
+xz -T0 -1 -c "$TEMPDIR/image.raw" > "$IMAGE"
+(cd "$SRVDIR" && sha256sum image.raw.xz > image.raw.xz.sha256)
+
+export GNUPGHOME="$TEMPDIR/gnupg"
+mkdir -m 700 "$GNUPGHOME"
+gpg --batch --quiet --pinentry-mode loopback --passphrase '' \
+    --quick-generate-key "rdii test <rdii-test@example.invalid>" \
+    ed25519 sign never
+gpg --batch --quiet --export > "$TEMPDIR/keyring.gpg"
+# sign_sha256 signs the current checksum again, e.g. after a test changed it
+sign_sha256()
+{
+    rm -f "$IMAGE.sha256.asc"
+    gpg --batch --quiet --armor --detach-sign \
+        -o "$IMAGE.sha256.asc" "$IMAGE.sha256"
+}
+sign_sha256
+
+python3 -u -m http.server --bind 127.0.0.1 --directory "$SRVDIR" 0 \
+        > "$TEMPDIR/http.log" 2>&1 &
+HTTP_PID=$!
+for _ in $(seq 50); do
+    PORT=$(sed -n 's/.* port \([0-9]*\) .*/\1/p' "$TEMPDIR/http.log")
+    [ -n "$PORT" ] && break
+    sleep 0.1
+done
+if [ -z "$PORT" ]; then
+    echo "web server did not start"
+    cat "$TEMPDIR/http.log"
+    exit 1
+fi
+
+truncate -s "${IMAGE_MIB}M" "$TARGET"
+
+cat > "$CONFIG" << EOF
+rdii.url=http://127.0.0.1:$PORT/image.raw.xz
+rdii.device=$TARGET
+rdii.keyring=$TEMPDIR/keyring.gpg
+rdii.verify=readback
+EOF
+
+# Runs the installer and stores the runtime in milliseconds in ELAPSED_MS
+run_installer()
+{
+    local start end
+
+    start=$(date +%s%N)
+    "$RDI_INSTALLER" --batch --config "$CONFIG" > "$TEMPDIR/install.log" 2>&1
+    local r=$?
+    end=$(date +%s%N)
+    ELAPSED_MS=$(((end - start) / 1000000))
+    return $r
+}
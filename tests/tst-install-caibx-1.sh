@@ -0,0 +1,70 @@
+#!/bin/bash
+
+# Installs a casync index given relative to the current directory, the
+# chunks have to get fetched from default.castr in that directory.
+
+set -e
+
+. "$(dirname "$0")/install-http-fixture.sh"
+
+if ! command -v zstd > /dev/null; then
+    echo "zstd not found, skipping"
+    exit 77
+fi
+
+# the installer runs inside the directory of the index
+RDI_INSTALLER=$(realpath "$RDI_INSTALLER")
+
+# fixed size chunks of 1 MiB, compressed like casync does
+python3 - "$TEMPDIR/image.raw" "$SRVDIR" << 'EOF'
+import hashlib, os, struct, subprocess, sys
+
+image, srvdir = sys.argv[1:]
+chunk_size = 1024 * 1024
+items = b''
+end = 0
+with open(image, 'rb') as f:
+    while True:
+        data = f.read(chunk_size)
+        if not data:
+            break
+        end += len(data)
+        digest = hashlib.sha256(data).digest()
+        items += struct.pack('<Q', end) + digest
+        hexid = digest.hex()
+        chunk_dir = os.path.join(srvdir, 'default.castr', hexid[:4])
+        os.makedirs(chunk_dir, exist_ok=True)
+        with open(os.path.join(chunk_dir, hexid + '.cacnk'), 'wb') as out:
+            out.write(subprocess.run(['zstd', '-q', '-c'], input=data,
+                                     stdout=subprocess.PIPE,
+                                     check=True).stdout)
+
+index = struct.pack('<6Q', 48, 0x96824d9c7b129ff9, 0,
+                    chunk_size, chunk_size, chunk_size)
+table = struct.pack('<2Q', 0xffffffffffffffff, 0xe75b9e112f17417d) + items
+table_size = len(table) + 40
+table += struct.pack('<5Q', 0, 0, 48, table_size, 0x4b4f050e5549ecd1)
+with open(os.path.join(srvdir, 'image.caibx'), 'wb') as out:
+    out.write(index + table)
+EOF
+
+(cd "$SRVDIR" && sha256sum image.caibx > image.caibx.sha256)
+gpg --batch --quiet --armor --detach-sign \
+    -o "$SRVDIR/image.caibx.sha256.asc" "$SRVDIR/image.caibx.sha256"
+
+sed -i 's|^rdii.url=.*|rdii.url=image.caibx|' "$CONFIG"
+
+if ! (cd "$SRVDIR" && run_installer); then
+    cat "$TEMPDIR/install.log"
+    exit 1
+fi
+
+if ! grep -q "from 'default.castr'" "$TEMPDIR/install.log"; then
+    cat "$TEMPDIR/install.log"
+    exit 1
+fi
+
+if ! cmp "$TEMPDIR/image.raw" "$TARGET"; then
+    cat "$TEMPDIR/install.log"
+    exit 1
+fi
@@ -0,0 +1,92 @@
+#!/bin/bash
+
+# Installs gzip images of every kind the parallel decoder splits
+# differently with rdii.decompress-threads=4, the content has to match:
+# single members at level 0, 1 and 9, pigz style output with flush
+# points and concatenated members.
+
+set -e
+
+. "$(dirname "$0")/install-http-fixture.sh"
+
+if ! command -v gzip > /dev/null; then
+    echo "gzip not found, skipping"
+    exit 77
+fi
+
+# random data alone only gets stored blocks, text gets real Huffman codes
+RAW="$TEMPDIR/gzip.raw"
+python3 - "$TEMPDIR/image.raw" "$RAW" << 'EOF'
+import random, sys
+
+words = [b'usr', b'lib', b'share', b'systemd', b'kernel', b'module',
+         b'firmware', b'x86_64', b'python3', b'locale', b'partition']
+rnd = random.Random(42)
+with open(sys.argv[1], 'rb') as f, open(sys.argv[2], 'wb') as out:
+    out.write(f.read())
+    text = bytearray()
+    while len(text) < 8 * 1024 * 1024:
+        text += rnd.choice(words) + (b'\n' if rnd.random() < 0.25 else b'/')
+    out.write(text)
+EOF
+
+# gzip has no level 0, zlib does. pigz ends every 128 KiB with a sync
+# flush, with -i with a full flush.
+python3 - "$RAW" "$TEMPDIR" << 'EOF'
+import sys, zlib
+
+raw, tempdir = sys.argv[1:]
+with open(raw, 'rb') as f:
+    data = f.read()
+
+def write(name, level, flush=None):
+    c = zlib.compressobj(level, zlib.DEFLATED, 16 + zlib.MAX_WBITS)
+    with open(tempdir + '/' + name, 'wb') as out:
+        step = 128 * 1024 if flush is not None else len(data)
+        for i in range(0, len(data), step):
+            out.write(c.compress(data[i:i + step]))
+            if flush is not None:
+                out.write(c.flush(flush))
+        out.write(c.flush())
+
+write('level0.raw.gz', 0)
+write('sync.raw.gz', 6, zlib.Z_SYNC_FLUSH)
+write('full.raw.gz', 6, zlib.Z_FULL_FLUSH)
+EOF
+
+gzip -1 -c "$RAW" > "$TEMPDIR/level1.raw.gz"
+gzip -9 -c "$RAW" > "$TEMPDIR/level9.raw.gz"
+third=$(($(stat -c %s "$RAW") / 3))
+{
+    head -c "$third" "$RAW" | gzip -1 -c
+    tail -c "+$((third + 1))" "$RAW" | head -c "$third" | gzip -9 -c
+    tail -c "+$((2 * third + 1))" "$RAW" | gzip -6 -c
+} > "$TEMPDIR/members.raw.gz"
+VARIANTS="level0 level1 level9 sync full members"
+if command -v pigz > /dev/null; then
+    pigz -c "$RAW" > "$TEMPDIR/pigz.raw.gz"
+    pigz -i -c "$RAW" > "$TEMPDIR/pigz-i.raw.gz"
+    VARIANTS="$VARIANTS pigz pigz-i"
+fi
+
+echo "rdii.decompress-threads=4" >> "$CONFIG"
+
+for variant in $VARIANTS; do
+    gz="$TEMPDIR/$variant.raw.gz"
+    (cd "$TEMPDIR" && sha256sum "$variant.raw.gz" > "$variant.raw.gz.sha256")
+    gpg --batch --quiet --armor --detach-sign -o "$gz.sha256.asc" "$gz.sha256"
+    sed -i "s|^rdii.url=.*|rdii.url=$gz|" "$CONFIG"
+    : > "$TARGET"
+
+    if ! run_installer; then
+        echo "installation of $variant failed"
+        cat "$TEMPDIR/install.log"
+        exit 1
+    fi
+    if ! cmp "$RAW" "$TARGET"; then
+        echo "$variant differs"
+        cat "$TEMPDIR/install.log"
+        exit 1
+    fi
+    echo "$variant: $(grep -o "gzip: .* sequentially" "$TEMPDIR/install.log" || echo "decoded")"
+done
@@ -0,0 +1,49 @@
+#!/bin/bash
+
+# A truncated gzip image and one with a wrong CRC in the trailer have to
+# fail with rdii.decompress-threads=4, even though their signed checksums
+# match.
+
+set -e
+
+. "$(dirname "$0")/install-http-fixture.sh"
+
+if ! command -v gzip > /dev/null; then
+    echo "gzip not found, skipping"
+    exit 77
+fi
+
+gzip -6 -c "$TEMPDIR/image.raw" > "$TEMPDIR/complete.raw.gz"
+size=$(stat -c %s "$TEMPDIR/complete.raw.gz")
+
+head -c "$((size * 3 / 4))" "$TEMPDIR/complete.raw.gz" > "$TEMPDIR/truncated.raw.gz"
+
+# the trailer is the CRC32 followed by the size, both 4 bytes
+cp "$TEMPDIR/complete.raw.gz" "$TEMPDIR/crc.raw.gz"
+crc=$(od -An -tu1 -j "$((size - 8))" -N1 "$TEMPDIR/crc.raw.gz" | tr -d ' ')
+printf "$(printf '\\%03o' "$((crc ^ 0xff))")" |
+    dd of="$TEMPDIR/crc.raw.gz" bs=1 seek="$((size - 8))" conv=notrunc status=none
+
+echo "rdii.decompress-threads=4" >> "$CONFIG"
+
+for variant in truncated:"Unexpected end of compressed data" \
+               crc:"incorrect data check"; do
+    error=${variant#*:}
+    variant=${variant%%:*}
+    gz="$TEMPDIR/$variant.raw.gz"
+    (cd "$TEMPDIR" && sha256sum "$variant.raw.gz" > "$variant.raw.gz.sha256")
+    gpg --batch --quiet --armor --detach-sign -o "$gz.sha256.asc" "$gz.sha256"
+    sed -i "s|^rdii.url=.*|rdii.url=$gz|" "$CONFIG"
+    : > "$TARGET"
+
+    if run_installer; then
+        echo "installation of $variant succeeded"
+        cat "$TEMPDIR/install.log"
+        exit 1
+    fi
+    if ! grep -q "Decompressing gzip image failed: $error" "$TEMPDIR/install.log"; then
+        echo "$variant did not fail in the decoder"
+        cat "$TEMPDIR/install.log"
+        exit 1
+    fi
+done
@@ -0,0 +1,26 @@
+#!/bin/bash
+
+# Installs a signed image from a web server, the content has to match
+# and the installation has to finish within RDII_TEST_BUDGET_MS.
+
+set -e
+
+. "$(dirname "$0")/install-http-fixture.sh"
+
+BUDGET_MS=${RDII_TEST_BUDGET_MS:-60000}
+
+if ! run_installer; then
+    cat "$TEMPDIR/install.log"
+    exit 1
+fi
+
+if ! cmp "$TEMPDIR/image.raw" "$TARGET"; then
+    cat "$TEMPDIR/install.log"
+    exit 1
+fi
+
+grep "stage=write" "$TEMPDIR/install.log" | tail -n 1
+echo "installation took ${ELAPSED_MS} ms, budget ${BUDGET_MS} ms"
+if [ "$ELAPSED_MS" -gt "$BUDGET_MS" ]; then
+    exit 1
+fi
@@ -0,0 +1,31 @@
+#!/bin/bash
+
+# A checksum whose signature does not match aborts the installation
+# before anything gets written to the device.
+
+set -e
+
+. "$(dirname "$0")/install-http-fixture.sh"
+
+# the signature is still the one of the correct checksum
+if [ "$(head -c 1 "$IMAGE.sha256")" = 0 ]; then
+    sed -i '1s/^./1/' "$IMAGE.sha256"
+else
+    sed -i '1s/^./0/' "$IMAGE.sha256"
+fi
+
+if run_installer; then
+    echo "installation with a wrong signature succeeded"
+    cat "$TEMPDIR/install.log"
+    exit 1
+fi
+
+if ! grep -q "Signature does not match" "$TEMPDIR/install.log"; then
+    cat "$TEMPDIR/install.log"
+    exit 1
+fi
+
+if ! cmp -n "$((IMAGE_MIB * 1024 * 1024))" "$TARGET" /dev/zero; then
+    echo "$TARGET got written"
+    exit 1
+fi